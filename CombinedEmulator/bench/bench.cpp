@@ -0,0 +1,60 @@
+#include "bench.hpp"
+#include <cstdio>
+
+namespace bench {
+
+namespace {
+
+int failure_count = 0;
+
+} // namespace
+
+void report(const char *name, double ns_per_op, Cost cost) {
+  const double factor = (cost == Cost::Float) ? BENCH_M0_FP_FACTOR : BENCH_M0_INT_FACTOR;
+  printf("  %-40s %10.1f ns/op %10.0f M0+ cycles (est)\n", name, ns_per_op, ns_per_op * factor);
+}
+
+void section(const char *title) {
+  printf("\n%s\n", title);
+}
+
+void check(bool condition, const char *what) {
+  if (!condition) {
+    ++failure_count;
+    printf("  FAILED: %s\n", what);
+  }
+}
+
+int failures() {
+  return failure_count;
+}
+
+} // namespace bench
+
+int main() {
+  printf("Emulator microbenchmarks (host ns/op, estimated RP2040 Cortex-M0+ cycles)\n");
+
+  bench::bme_suite();
+  bench::bme_accuracy_suite();
+  bench::bme_mode_suite();
+  bench::bme_noise_suite();
+  bench::sht_suite();
+  bench::sht3x_suite();
+  bench::humidity_correction_suite();
+  bench::shadow_suite();
+  bench::state_suite();
+  bench::core_split_suite();
+  bench::host_command_suite();
+  bench::protocol_suite();
+  bench::gpio_capture_suite();
+  bench::history_suite();
+  bench::trajectory_suite();
+  bench::sim_clock_suite();
+  bench::lockstep_suite();
+
+  if (bench::failures()) {
+    printf("\n%d check(s) failed\n", bench::failures());
+    return 1;
+  }
+  return 0;
+}
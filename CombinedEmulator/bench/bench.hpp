@@ -0,0 +1,85 @@
+#ifndef BENCH_INCLUDED
+#define BENCH_INCLUDED
+
+#include <chrono>
+#include <cstdint>
+
+// Host microbenchmark harness for the emulator sources.
+// Each benchmark reports host ns/op and a coarse Cortex-M0+ cycle estimate
+// for the RP2040. The estimate scales host time by a per-workload factor,
+// because the M0+ retires at most one instruction per cycle and has no FPU,
+// so double precision math costs far more there than on the host.
+// The factors can be tuned with -DBENCH_M0_INT_FACTOR / -DBENCH_M0_FP_FACTOR
+// after calibrating against a board. Treat the estimate as a regression signal,
+// not an absolute number.
+namespace bench {
+
+#ifndef BENCH_M0_INT_FACTOR
+#define BENCH_M0_INT_FACTOR 8.0
+#endif
+
+#ifndef BENCH_M0_FP_FACTOR
+#define BENCH_M0_FP_FACTOR 60.0
+#endif
+
+// Workload class used to choose the M0+ scaling factor
+enum class Cost { Integer, Float };
+
+// Keep the compiler from discarding a value that is only computed for timing
+template <typename T> inline void do_not_optimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void clobber_memory() {
+  asm volatile("" : : : "memory");
+}
+
+void report(const char *name, double ns_per_op, Cost cost);
+
+// Time fn() over iterations calls, after a short warm up, and report ns/op
+template <typename Fn> double run(const char *name, Cost cost, uint32_t iterations, Fn &&fn) {
+  for (uint32_t i = 0; i < iterations / 16 + 1; ++i) {
+    fn(i);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; ++i) {
+    fn(i);
+    clobber_memory();
+  }
+  const auto stop = std::chrono::steady_clock::now();
+
+  const double ns = std::chrono::duration<double, std::nano>(stop - start).count() / iterations;
+  report(name, ns, cost);
+  return ns;
+}
+
+// Print a section heading
+void section(const char *title);
+
+// Record a correctness check. Failed checks make the suite exit non-zero.
+void check(bool condition, const char *what);
+int failures();
+
+// Benchmark suites
+void bme_suite();
+void bme_accuracy_suite();
+void bme_mode_suite();
+void bme_noise_suite();
+void sht_suite();
+void sht3x_suite();
+void humidity_correction_suite();
+void shadow_suite();
+void state_suite();
+void core_split_suite();
+void host_command_suite();
+void protocol_suite();
+void gpio_capture_suite();
+void history_suite();
+void trajectory_suite();
+void sim_clock_suite();
+void lockstep_suite();
+
+} // namespace bench
+
+#endif // BENCH_INCLUDED
@@ -0,0 +1,209 @@
+#include "bench.hpp"
+#include "bme_compensation.hpp"
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// Compares the integer inverse compensation against the floating point
+// quadratic solution it replaced, over the whole operating range of the sensor.
+namespace bench {
+
+namespace {
+
+// The previous implementation, kept as a reference. It solves the floating
+// point formulas of Appendix 8.1 in the BME datasheet for the adc values.
+struct Legacy {
+  double t_a, t_b, t_c;
+  double h1, h2, h3, h4, h5, h6;
+
+  explicit Legacy(const bme::Calibration &cal) {
+    const double T1 = cal.dig_T1;
+    const double T2 = cal.dig_T2;
+    const double T3 = cal.dig_T3;
+    t_a = T3 / pow(131072.0, 2.0);
+    t_b = (T2 / 16384.0) - (2.0 * T1 * T3 / 131072.0 / 8192.0);
+    t_c = (pow(T1 / 8192.0, 2.0) * T3) - (T1 * T2 / 1024.0);
+
+    h1 = cal.dig_H1;
+    h2 = cal.dig_H2;
+    h3 = cal.dig_H3;
+    h4 = cal.dig_H4;
+    h5 = cal.dig_H5;
+    h6 = cal.dig_H6;
+  }
+
+  static double solve_quadratic(double a, double b, double c, bool max_root) {
+    const double discriminant = pow(b, 2.0) - 4.0 * a * c;
+    if (discriminant > 0) {
+      const double square_root = sqrt(discriminant);
+      const double r1 = (-b + square_root) / (2.0 * a);
+      const double r2 = (-b - square_root) / (2.0 * a);
+      return max_root ? fmax(r1, r2) : fmin(r1, r2);
+    }
+    return -b / (2.0 * a);
+  }
+
+  int32_t adc_T(double T) const {
+    return int32_t(solve_quadratic(t_a, t_b, t_c - T * 5120.0, true));
+  }
+
+  int32_t adc_H(double H, int32_t t_fine) const {
+    H = fmin(fmax(H, 0.0), 100.0);
+    const double c1 = t_fine - 76800.0;
+    const double c2 = (h4 * 64.0 + h5 / 16384.0 * c1);
+    const double c3 = (h2 / 65536.0 * (1.0 + h6 / 67108864.0 * c1 * (1.0 + h3 / 67108864.0 * c1)));
+    const double c4 = c2 * c3;
+    const double x = solve_quadratic(-1.0 * h1 / 524288.0, 1.0, -1.0 * H, false);
+    return int32_t((x + c4) / c3);
+  }
+};
+
+struct Error {
+  double max = 0.0;
+  double sum = 0.0;
+  uint32_t count = 0;
+
+  void add(double e) {
+    max = fmax(max, e);
+    sum += e;
+    ++count;
+  }
+};
+
+} // namespace
+
+void bme_accuracy_suite() {
+  section("BME280 inverse compensation, integer search vs floating point quadratic");
+
+  const bme::Coefficients k(bme::DefaultCalibration);
+  const Legacy legacy(bme::DefaultCalibration);
+
+  // Temperature sweep over -40..85 degC in 0.001 degC steps. Error is what a
+  // driver reads back with the datasheet integer formula, in degC.
+  // Requests are exact in both paths: milli degrees for the integer inverse.
+  Error t_legacy, t_integer;
+  uint32_t t_worse = 0;
+  for (int32_t milli = -40000; milli <= 85000; ++milli) {
+    const double T = milli / 1000.0;
+    const double e_legacy = fabs(bme::t_fine_to_centi(bme::compensate_t_fine(k, legacy.adc_T(T))) / 100.0 - T);
+    const double e_integer =
+      fabs(bme::t_fine_to_centi(bme::compensate_t_fine(k, bme::inverse_T(k, milli))) / 100.0 - T);
+    t_legacy.add(e_legacy);
+    t_integer.add(e_integer);
+    t_worse += (e_integer > e_legacy + 1e-9);
+  }
+  printf("  temperature  legacy max %.4f mean %.5f degC, integer max %.4f mean %.5f degC, worse at %u of %u\n",
+         t_legacy.max, t_legacy.sum / t_legacy.count, t_integer.max, t_integer.sum / t_integer.count, t_worse,
+         t_integer.count);
+  check(t_worse == 0, "integer temperature inverse is never less accurate than the quadratic");
+
+  // Humidity sweep over 0..100 %RH in 0.01 %RH steps across the temperature range.
+  // Error is the datasheet integer humidity a driver reads back, in %RH.
+  Error h_legacy, h_integer;
+  uint32_t h_worse = 0;
+  for (int32_t T = -40; T <= 85; T += 5) {
+    const int32_t t_fine = bme::compensate_t_fine(k, bme::inverse_T(k, T * 1000));
+    const bme::HumidityTerms terms = bme::humidity_terms(k, t_fine);
+    for (int32_t centi = 0; centi <= 10000; ++centi) {
+      const double H = centi / 100.0;
+      const double e_legacy = fabs(bme::compensate_H(k, terms, legacy.adc_H(H, t_fine)) / 1024.0 - H);
+      const double e_integer = fabs(bme::compensate_H(k, terms, bme::inverse_H(k, t_fine, centi * 10)) / 1024.0 - H);
+      h_legacy.add(e_legacy);
+      h_integer.add(e_integer);
+      h_worse += (e_integer > e_legacy + 1e-9);
+    }
+  }
+  printf("  humidity     legacy max %.4f mean %.5f %%RH, integer max %.4f mean %.5f %%RH, worse at %u of %u\n",
+         h_legacy.max, h_legacy.sum / h_legacy.count, h_integer.max, h_integer.sum / h_integer.count, h_worse,
+         h_integer.count);
+  check(h_worse == 0, "integer humidity inverse is never less accurate than the quadratic");
+
+  const double legacy_T = run("legacy float adc_T", Cost::Float, 200000, [&](uint32_t i) {
+    do_not_optimize(legacy.adc_T(-40.0 + (i % 12500) * 0.01));
+  });
+  const double integer_T = run("bme::inverse_T", Cost::Integer, 200000, [&](uint32_t i) {
+    do_not_optimize(bme::inverse_T(k, -40000 + int32_t(i % 12500) * 10));
+  });
+  const double legacy_H = run("legacy float adc_H", Cost::Float, 200000, [&](uint32_t i) {
+    do_not_optimize(legacy.adc_H((i % 10000) * 0.01, 112640));
+  });
+  const double integer_H = run("bme::inverse_H", Cost::Integer, 200000, [&](uint32_t i) {
+    do_not_optimize(bme::inverse_H(k, 112640, (i % 10000) * 10));
+  });
+
+  // Pressure has no previous implementation to compare against. Check the
+  // inverse picks the locally closest adc_P over 30..110 kPa across temperature.
+  Error p_integer;
+  uint32_t p_not_nearest = 0;
+  for (int32_t T = -40; T <= 85; T += 25) {
+    const int32_t t_fine = bme::compensate_t_fine(k, bme::inverse_T(k, T * 1000));
+    const bme::PressureTerms terms = bme::pressure_terms(k, t_fine);
+    for (int32_t P = 30000; P <= 110000; P += 3) {
+      const int32_t adc_P = bme::inverse_P(k, t_fine, uint32_t(P) * 1000);
+      const double e = fabs(bme::compensate_P(k, terms, adc_P) / 256.0 - P);
+      const double e_below = fabs(bme::compensate_P(k, terms, adc_P - 1) / 256.0 - P);
+      const double e_above = fabs(bme::compensate_P(k, terms, adc_P + 1) / 256.0 - P);
+      p_integer.add(e);
+      p_not_nearest += (e > e_below || e > e_above);
+    }
+  }
+  printf("  pressure     integer max %.4f mean %.5f Pa, not nearest at %u of %u\n", p_integer.max,
+         p_integer.sum / p_integer.count, p_not_nearest, p_integer.count);
+  check(p_not_nearest == 0, "integer pressure inverse picks the nearest adc_P");
+
+  // Out of range requests read back as the nearest end of the range, within
+  // the 0.2 Pa an adc_P step is worth
+  bool p_clamped = true;
+  for (int32_t T = -40; T <= 85; T += 25) {
+    const int32_t t_fine = bme::compensate_t_fine(k, bme::inverse_T(k, T * 1000));
+    const bme::PressureTerms terms = bme::pressure_terms(k, t_fine);
+    const auto read_back = [&](uint32_t P_milli) {
+      return int64_t(bme::compensate_P(k, terms, bme::inverse_P(k, t_fine, P_milli))) * 1000 / 256;
+    };
+    p_clamped = p_clamped && read_back(0) == read_back(bme::P_MILLI_MIN) &&
+                read_back(1000) == read_back(bme::P_MILLI_MIN) &&
+                read_back(200000000) == read_back(bme::P_MILLI_MAX) &&
+                read_back(UINT32_MAX) == read_back(bme::P_MILLI_MAX) &&
+                std::llabs(read_back(bme::P_MILLI_MIN) - bme::P_MILLI_MIN) < 200 &&
+                std::llabs(read_back(bme::P_MILLI_MAX) - bme::P_MILLI_MAX) < 200;
+  }
+  check(p_clamped, "integer pressure inverse clamps requests outside 30..110 kPa");
+
+  // The compensated pressure never wraps at the ends of the adc range
+  bool p_monotonic = true;
+  {
+    const bme::PressureTerms terms = bme::pressure_terms(k, 112640);
+    uint32_t last = UINT32_MAX;
+    for (int32_t adc_P = 0; adc_P <= bme::ADC_P_MAX; adc_P += 7) {
+      const uint32_t P = bme::compensate_P(k, terms, adc_P);
+      p_monotonic = p_monotonic && P <= last;
+      last = P;
+    }
+  }
+  check(p_monotonic, "compensated pressure falls monotonically over the whole adc range");
+
+  run("bme::inverse_P", Cost::Integer, 100000, [&](uint32_t i) {
+    do_not_optimize(bme::inverse_P(k, 112640, 30000000 + (i % 8000) * 10000));
+  });
+
+  // The integer search is slower than the quadratic on the host, which has an
+  // FPU. Nothing here measures the RP2040, so no speed is claimed for it.
+  printf("  %-40s %10.1fx the float time for temperature, %.1fx for humidity\n", "integer inverse on the host",
+         integer_T / legacy_T, integer_H / legacy_H);
+
+  // A calibration loaded at run time without a linear temperature term, and
+  // requests far outside the operating range
+  {
+    bme::Calibration flat = bme::DefaultCalibration;
+    flat.dig_T2 = 0;
+    const bme::Coefficients k_flat(flat);
+    const int32_t adc_flat = bme::inverse_T(k_flat, 25000);
+    const bool clamped = bme::inverse_T(k, INT32_MAX) == bme::inverse_T(k, 85000) &&
+                         bme::inverse_T(k, INT32_MIN) == bme::inverse_T(k, -40000);
+    check(adc_flat >= 0 && adc_flat <= bme::ADC_T_MAX && clamped,
+          "integer temperature inverse survives dig_T2 = 0 and clamps absurd requests");
+  }
+}
+
+} // namespace bench
@@ -0,0 +1,310 @@
+#include "bench.hpp"
+#include "bme.hpp"
+#include "bme_compensation.hpp"
+#include <Wire.h>
+#include <cstdio>
+#include <cstring>
+
+namespace bench {
+
+namespace {
+
+bool same_calibration(const bme::Calibration &a, const bme::Calibration &b) {
+  return a.dig_T1 == b.dig_T1 && a.dig_T2 == b.dig_T2 && a.dig_T3 == b.dig_T3 &&
+         a.dig_P1 == b.dig_P1 && a.dig_P2 == b.dig_P2 && a.dig_P3 == b.dig_P3 &&
+         a.dig_P4 == b.dig_P4 && a.dig_P5 == b.dig_P5 && a.dig_P6 == b.dig_P6 &&
+         a.dig_P7 == b.dig_P7 && a.dig_P8 == b.dig_P8 && a.dig_P9 == b.dig_P9 &&
+         a.dig_H1 == b.dig_H1 && a.dig_H2 == b.dig_H2 && a.dig_H3 == b.dig_H3 &&
+         a.dig_H4 == b.dig_H4 && a.dig_H5 == b.dig_H5 && a.dig_H6 == b.dig_H6;
+}
+
+// The default calibration as a profile of its own, which an emulator takes
+// as compile time constants
+constexpr bme::Calibration FixedDefaultCalibration = bme::DefaultCalibration;
+
+// A second calibration, as a different part would have
+constexpr bme::Calibration OtherCalibration = {27504, 26435, -1000, 36477, -10685, 3024, 2855, 140, -7, 15500, -14600, 6000, 75, 355, 0, 326, 0, 30};
+
+// Make a forced conversion, with every measurement at x1 oversampling, and run
+// the measurement engine past its end
+void measure(bme::Bme280 &sensor, TwoWire &bus) {
+  const uint8_t forced[] = {bme::BME280_REGISTER_CONTROLHUMID, 0x01, bme::BME280_REGISTER_CONTROL, 0x25};
+  bus.host_receive(forced, sizeof(forced));
+  sensor.update(micros() + 1000000);
+}
+
+// Compensated temperature, in centi degC, of the adc_T a driver reads on bus
+int32_t read_centi(TwoWire &bus, const bme::Coefficients &k) {
+  const uint8_t address = bme::BME280_REGISTER_TEMPDATA;
+  uint8_t data[3];
+  bus.host_receive(&address, 1);
+  bus.host_request(data, 3);
+  const int32_t adc_T = (int32_t(data[0]) << 12) | (int32_t(data[1]) << 4) | (data[2] >> 4);
+  return bme::t_fine_to_centi(bme::compensate_t_fine(k, adc_T));
+}
+
+// The data registers a driver reads on bus after a forced conversion
+void read_data(bme::Bme280 &sensor, TwoWire &bus, uint8_t *data) {
+  measure(sensor, bus);
+  const uint8_t address = bme::BME280_REGISTER_PRESSUREDATA;
+  bus.host_receive(&address, 1);
+  bus.host_request(data, bme::Bme280::DataSize);
+}
+
+} // namespace
+
+void bme_suite() {
+  section("BME280 emulator");
+
+  bme::Bme280Emulator<Wire> sensor(bme::BME280_ADDRESS, 16, 17);
+
+  // The default profile must decode identically from the raw register dump
+  sensor.init_registers();
+  check(same_calibration(sensor.read_calibration(), bme::DefaultCalibration),
+        "bme::DefaultCalibration matches the dumped calibration registers");
+
+  sensor.init();
+  sensor.begin();
+
+  check(same_calibration(sensor.read_calibration(), bme::DefaultCalibration),
+        "bme::load_calibration register encoding round trips");
+
+  // Two sensors, with their own calibration and setpoints, on the two buses
+  {
+    bme::Bme280Emulator<Wire1> other(bme::BME280_ADDRESS_ALTERNATE, 18, 19);
+    other.init();
+    other.load_calibration<OtherCalibration>();
+    other.begin();
+
+    sensor.set_T(20.0);
+    other.set_T(30.0);
+    measure(sensor, Wire);
+    measure(other, Wire1);
+    check(read_centi(Wire, bme::Coefficients(bme::DefaultCalibration)) == 2000 &&
+            read_centi(Wire1, bme::Coefficients(OtherCalibration)) == 3000,
+          "bme instances on Wire and Wire1 keep their own calibration and setpoint");
+    check(Wire.address() == bme::BME280_ADDRESS && Wire1.address() == bme::BME280_ADDRESS_ALTERNATE,
+          "bme instances answer on their own address");
+    other.end();
+  }
+
+  // A profile given to the emulator at compile time stages the same registers
+  // as the profile loaded at run time
+  {
+    bme::Bme280Emulator<Wire1, OtherCalibration> fixed(bme::BME280_ADDRESS_ALTERNATE, 18, 19);
+    bme::Bme280Emulator<Wire1> loaded(bme::BME280_ADDRESS_ALTERNATE, 18, 19);
+    fixed.init();
+    loaded.init();
+    loaded.load_calibration(OtherCalibration);
+    bool same = same_calibration(fixed.read_calibration(), OtherCalibration);
+    for (int32_t T_milli = -40000; T_milli <= 85000; T_milli += 2500) {
+      const uint32_t H_milli = uint32_t(T_milli + 40000) * 4 / 5;
+      uint8_t fixed_data[bme::Bme280::DataSize];
+      uint8_t loaded_data[bme::Bme280::DataSize];
+      fixed.set_state_milli(T_milli, H_milli, 101325000);
+      loaded.set_state_milli(T_milli, H_milli, 101325000);
+      fixed.begin();
+      read_data(fixed, Wire1, fixed_data);
+      loaded.begin();
+      read_data(loaded, Wire1, loaded_data);
+      same = same && memcmp(fixed_data, loaded_data, sizeof(fixed_data)) == 0;
+    }
+    check(same, "bme profile fixed at compile time matches the profile loaded at run time");
+    loaded.end();
+  }
+
+  printf("  %-40s %10zu bytes\n", "sizeof(Bme280Emulator<Wire>)", sizeof(sensor));
+
+  // Writes follow the register descriptors
+  {
+    const uint8_t writes[] = {bme::BME280_REGISTER_CHIPID, 0x12, bme::BME280_REGISTER_DIG_T1, 0x34,
+                              bme::BME280_REGISTER_TEMPDATA, 0x56, bme::BME280_REGISTER_CONTROL, 0x27,
+                              bme::BME280_REGISTER_CONFIG, 0xA0, bme::BME280_REGISTER_SOFTRESET, 0x01};
+    Wire.host_receive(writes, sizeof(writes));
+    check(sensor.read_register(bme::BME280_REGISTER_CHIPID) == 0x60 &&
+            same_calibration(sensor.read_calibration(), bme::DefaultCalibration) &&
+            sensor.read_register(bme::BME280_REGISTER_SOFTRESET) == 0x00,
+          "bme ignores writes to read only registers");
+    check(sensor.read_register(bme::BME280_REGISTER_CONTROL) == 0x27 &&
+            sensor.read_register(bme::BME280_REGISTER_CONFIG) == 0xA0,
+          "bme accepts writes to control registers");
+
+    const uint8_t reset[] = {bme::BME280_REGISTER_SOFTRESET, 0xB6};
+    Wire.host_receive(reset, sizeof(reset));
+    check(sensor.read_register(bme::BME280_REGISTER_CONTROL) == 0x00 &&
+            sensor.read_register(bme::BME280_REGISTER_CONFIG) == 0x00 &&
+            same_calibration(sensor.read_calibration(), bme::DefaultCalibration),
+          "bme soft reset restores the control registers and keeps the calibration");
+  }
+
+  // The data registers read as after power on from a soft reset on, before
+  // and after the main loop resets its bank, until the next conversion
+  {
+    const uint8_t power_on[bme::Bme280::DataSize] = {0x80, 0x00, 0x00, 0x80, 0x00, 0x00, 0x80, 0x00};
+    const uint8_t address = bme::BME280_REGISTER_PRESSUREDATA;
+    const uint8_t reset[] = {bme::BME280_REGISTER_SOFTRESET, 0xB6};
+    uint8_t measured[bme::Bme280::DataSize];
+    uint8_t pending[bme::Bme280::DataSize];
+    uint8_t cleared[bme::Bme280::DataSize];
+    sensor.set_T(25.0);
+    read_data(sensor, Wire, measured);
+    Wire.host_receive(reset, sizeof(reset));
+    Wire.host_receive(&address, 1);
+    Wire.host_request(pending, sizeof(pending));
+    sensor.update(micros());
+    Wire.host_receive(&address, 1);
+    Wire.host_request(cleared, sizeof(cleared));
+    check(memcmp(measured, power_on, sizeof(power_on)) != 0 && memcmp(pending, power_on, sizeof(power_on)) == 0 &&
+            memcmp(cleared, power_on, sizeof(power_on)) == 0,
+          "bme soft reset clears the data registers");
+  }
+
+  // The time a controller first addressed the sensor, for the startup report
+  {
+    bme::Bme280Emulator<Wire1> fresh(bme::BME280_ADDRESS_ALTERNATE, 18, 19);
+    fresh.init();
+    fresh.begin();
+    const bool silent = !fresh.answered();
+    const uint32_t before_us = micros();
+    const uint8_t address = bme::BME280_REGISTER_CHIPID;
+    Wire1.host_receive(&address, 1);
+    check(silent && fresh.answered() && uint32_t(fresh.answered_us() - before_us) <= uint32_t(micros() - before_us),
+          "bme records the first transaction addressed to it");
+    fresh.end();
+  }
+
+  // Boot cost up to the first read a driver makes, the chip id
+  run("bme::init_registers", Cost::Integer, 200000, [&](uint32_t) {
+    sensor.init_registers();
+  });
+
+  run("bme::soft_reset (0xE0 <- 0xB6)", Cost::Integer, 1000000, [](uint32_t) {
+    const uint8_t reset[] = {bme::BME280_REGISTER_SOFTRESET, 0xB6};
+    Wire.host_receive(reset, sizeof(reset));
+  });
+
+  run("bme startup to first ACK (chip id)", Cost::Integer, 20000, [](uint32_t) {
+    bme::Bme280Emulator<Wire> fresh(bme::BME280_ADDRESS, 16, 17);
+    fresh.init();
+    const uint8_t address = bme::BME280_REGISTER_CHIPID;
+    uint8_t chip_id = 0;
+    Wire.host_receive(&address, 1);
+    Wire.host_request(&chip_id, 1);
+    do_not_optimize(chip_id);
+  });
+  sensor.init();
+
+  run("bme::load_calibration (runtime)", Cost::Float, 200000, [&](uint32_t) {
+    sensor.load_calibration(bme::DefaultCalibration);
+  });
+
+  const double runtime_ns = run("bme::set_T_milli (runtime calibration)", Cost::Integer, 200000, [&](uint32_t i) {
+    sensor.set_T_milli(15000 + (i % 200) * 50);
+  });
+  sensor.init();
+
+  // The same calibration fixed at compile time, its terms folded into the search
+  {
+    bme::Bme280Emulator<Wire1, FixedDefaultCalibration> fixed(bme::BME280_ADDRESS_ALTERNATE, 18, 19);
+    fixed.init();
+    const double fixed_ns = run("bme::set_T_milli (fixed profile)", Cost::Integer, 200000, [&](uint32_t i) {
+      fixed.set_T_milli(15000 + (i % 200) * 50);
+    });
+    printf("  %-40s %10.2fx the runtime calibration time\n", "fixed profile", fixed_ns / runtime_ns);
+  }
+
+  // set_T also recomputes the humidity and pressure registers for the new
+  // t_fine, unless the temperature is the one already staged
+  run("bme::set_T_milli", Cost::Integer, 200000, [&](uint32_t i) {
+    sensor.set_T_milli(15000 + (i % 200) * 50);
+  });
+
+  run("bme::set_T_milli (unchanged)", Cost::Integer, 1000000, [&](uint32_t) {
+    sensor.set_T_milli(25000);
+  });
+
+  run("bme::set_P_milli", Cost::Integer, 200000, [&](uint32_t i) {
+    sensor.set_P_milli(95000000 + (i % 1000) * 10000);
+  });
+
+  run("bme::set_H_milli", Cost::Integer, 200000, [&](uint32_t i) {
+    sensor.set_H_milli(20000 + (i % 600) * 100);
+  });
+
+  run("bme::t_fine", Cost::Integer, 1000000, [&](uint32_t) {
+    do_not_optimize(sensor.t_fine());
+  });
+
+  run("bme::on_wire_receive (address write)", Cost::Integer, 1000000, [](uint32_t) {
+    const uint8_t address = bme::BME280_REGISTER_PRESSUREDATA;
+    Wire.host_receive(&address, 1);
+  });
+
+  // Time the reads drivers actually make. The interrupt handler cost that matters
+  // on the RP2040 is spinning on a full TX FIFO: every byte queued past its 16
+  // entries holds the handler until the controller clocks one out, 22.5 us per
+  // byte at 400 kHz, during which the other I2C bus is not serviced.
+  // Before bounded bursts every read queued all of Registers from Address up.
+  constexpr double ByteTimeUs = 9.0 / 400.0e3 * 1e6;
+  const struct {
+    const char *name;
+    uint8_t address;
+    uint8_t length;
+  } reads[] = {
+    {"bme read 0x88 x26 (calib)", bme::BME280_REGISTER_DIG_T1, 26},
+    {"bme read 0xD0 x1 (chip id)", bme::BME280_REGISTER_CHIPID, 1},
+    {"bme read 0xE1 x7 (calib)", bme::BME280_REGISTER_CAL26, 7},
+    {"bme read 0xF3 x1 (status)", bme::BME280_REGISTER_STATUS, 1},
+    {"bme read 0xF7 x8 (data)", bme::BME280_REGISTER_PRESSUREDATA, 8},
+    {"bme read 0xFA x3 (temperature)", bme::BME280_REGISTER_TEMPDATA, 3},
+  };
+
+  for (const auto &read : reads) {
+    const uint8_t address = read.address;
+    const uint8_t length = read.length;
+    run(read.name, Cost::Integer, 1000000, [address, length](uint32_t) {
+      Wire.host_receive(&address, 1);
+      do_not_optimize(Wire.host_request(nullptr, length));
+    });
+
+    Wire.host_receive(&address, 1);
+    check(Wire.host_request(nullptr, length) == length, "bme serves the whole burst");
+
+    const size_t legacy_queued = bme::Bme280::RegisterSize - address;
+    const size_t legacy_spin = legacy_queued > 16 ? legacy_queued - 16 : 0;
+    const size_t queued = Wire.max_queued_per_callback();
+    const size_t spin = queued > 16 ? queued - 16 : 0;
+    printf("    queued per request %3zu -> %2zu bytes in %zu request(s), ISR spin %7.1f -> %.1f us at 400 kHz\n",
+           legacy_queued, queued, Wire.request_callbacks(), legacy_spin * ByteTimeUs, spin * ByteTimeUs);
+  }
+
+  // A read without an address write continues where the last one stopped
+  {
+    sensor.set_state_milli(21000, 40000, 101325000);
+    measure(sensor, Wire);
+    const uint8_t address = bme::BME280_REGISTER_PRESSUREDATA;
+    uint8_t data[bme::Bme280::DataSize];
+    Wire.host_receive(&address, 1);
+    Wire.host_request(data, sizeof(data));
+    const uint8_t temperature = bme::BME280_REGISTER_TEMPDATA;
+    uint8_t T[3];
+    uint8_t H[2];
+    Wire.host_receive(&temperature, 1);
+    Wire.host_request(T, sizeof(T));
+    Wire.host_request(H, sizeof(H));
+    const uint8_t calibration = bme::BME280_REGISTER_DIG_T1;
+    uint8_t T1[2];
+    uint8_t T2[2];
+    Wire.host_receive(&calibration, 1);
+    Wire.host_request(T1, sizeof(T1));
+    Wire.host_request(T2, sizeof(T2));
+    check(memcmp(T, data + 3, 3) == 0 && memcmp(H, data + 6, 2) == 0 &&
+            T2[0] == sensor.read_register(bme::BME280_REGISTER_DIG_T2) &&
+            T2[1] == sensor.read_register(bme::BME280_REGISTER_DIG_T2 + 1),
+          "bme auto increments by the bytes a short read clocks out");
+  }
+
+  sensor.end();
+}
+
+} // namespace bench
@@ -0,0 +1,259 @@
+#include "bench.hpp"
+#include "bme.hpp"
+#include "bme_compensation.hpp"
+#include <Wire.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace bench {
+
+namespace {
+
+void write(uint8_t reg, uint8_t value) {
+  const uint8_t data[] = {reg, value};
+  Wire.host_receive(data, sizeof(data));
+}
+
+uint8_t read(uint8_t reg) {
+  uint8_t value = 0;
+  Wire.host_receive(&reg, 1);
+  Wire.host_request(&value, 1);
+  return value;
+}
+
+void read_data(uint8_t *out) {
+  const uint8_t reg = bme::BME280_REGISTER_PRESSUREDATA;
+  Wire.host_receive(&reg, 1);
+  Wire.host_request(out, 8);
+}
+
+// Count the conversions latched over duration_us, calling update every step_us
+int count_latches(bme::Bme280 &sensor, uint32_t start, uint32_t duration_us, uint32_t step_us) {
+  int latches = 0;
+  for (uint32_t t = 0; t <= duration_us; t += step_us) {
+    latches += sensor.update(start + t) ? 1 : 0;
+  }
+  return latches;
+}
+
+// Compensated temperature in degC, pressure in Pa and humidity in %RH of data
+struct Reading {
+  double T;
+  double P;
+  double H;
+};
+
+Reading compensate(const uint8_t *data) {
+  const bme::Coefficients k(bme::DefaultCalibration);
+  const int32_t adc_P = (int32_t(data[0]) << 12) | (int32_t(data[1]) << 4) | (data[2] >> 4);
+  const int32_t adc_T = (int32_t(data[3]) << 12) | (int32_t(data[4]) << 4) | (data[5] >> 4);
+  const int32_t adc_H = (int32_t(data[6]) << 8) | data[7];
+  const int32_t t_fine = bme::compensate_t_fine(k, adc_T);
+  return Reading{t_fine / 5120.0, bme::compensate_P(k, bme::pressure_terms(k, t_fine), adc_P) / 256.0,
+                 bme::compensate_H(k, bme::humidity_terms(k, t_fine), adc_H) / 1024.0};
+}
+
+// Standard deviation of each measurement over n forced conversions
+Reading noise(bme::Bme280 &sensor, uint8_t ctrl_hum, uint8_t ctrl_meas, int n) {
+  Reading sum = {0, 0, 0};
+  Reading squares = {0, 0, 0};
+  for (int i = 0; i < n; ++i) {
+    write(bme::BME280_REGISTER_CONTROLHUMID, ctrl_hum);
+    write(bme::BME280_REGISTER_CONTROL, ctrl_meas);
+    sensor.update(micros() + 1000000);
+    uint8_t data[8];
+    read_data(data);
+    const Reading r = compensate(data);
+    sum = Reading{sum.T + r.T, sum.P + r.P, sum.H + r.H};
+    squares = Reading{squares.T + r.T * r.T, squares.P + r.P * r.P, squares.H + r.H * r.H};
+  }
+  const auto sd = [n](double total, double total_squares) {
+    return sqrt(fmax(0.0, total_squares / n - (total / n) * (total / n)));
+  };
+  return Reading{sd(sum.T, squares.T), sd(sum.P, squares.P), sd(sum.H, squares.H)};
+}
+
+} // namespace
+
+void bme_mode_suite() {
+  section("BME280 measurement engine");
+
+  bme::Bme280Emulator<Wire> sensor(bme::BME280_ADDRESS, 16, 17);
+  sensor.init();
+  sensor.set_T(25.0);
+  sensor.set_H(40.0);
+  sensor.set_P(100000.0);
+
+  // Power on in sleep mode, with the data registers at their reset values
+  const uint8_t reset_data[] = {0x80, 0x00, 0x00, 0x80, 0x00, 0x00, 0x80, 0x00};
+  uint8_t data[8];
+  read_data(data);
+  check(read(bme::BME280_REGISTER_STATUS) == 0 && memcmp(data, reset_data, 8) == 0,
+        "bme powers on asleep with reset data");
+
+  // A forced conversion at x1 takes 1 + 2 + 2.5 + 2.5 ms
+  write(bme::BME280_REGISTER_CONTROLHUMID, 0x01);
+  const uint32_t start = micros();
+  write(bme::BME280_REGISTER_CONTROL, 0x24 | bme::BME280_MODE_FORCED);
+  check(read(bme::BME280_REGISTER_STATUS) == bme::BME280_STATUS_MEASURING,
+        "bme sets measuring as soon as ctrl_meas is written");
+
+  const bool early = sensor.update(start + 8000 - 1);
+  read_data(data);
+  check(!early && sensor.measurement_us() == 8000 && memcmp(data, reset_data, 8) == 0 &&
+          read(bme::BME280_REGISTER_STATUS) == bme::BME280_STATUS_MEASURING,
+        "bme forced conversion does not complete early");
+
+  const bool done = sensor.update(micros() + 8000);
+  read_data(data);
+  const int32_t adc_T = (int32_t(data[3]) << 16) | (int32_t(data[4]) << 8) | data[5];
+  check(done && adc_T == sensor.adc_T() && read(bme::BME280_REGISTER_STATUS) == 0 &&
+          read(bme::BME280_REGISTER_CONTROL) == 0x24,
+        "bme forced conversion latches, clears measuring and returns to sleep");
+
+  // Humidity skipped, then ctrl_hum changed without a ctrl_meas write, which
+  // must not take effect
+  write(bme::BME280_REGISTER_CONTROLHUMID, 0x00);
+  write(bme::BME280_REGISTER_CONFIG, 0x00);
+  const uint32_t normal = micros();
+  write(bme::BME280_REGISTER_CONTROL, 0x24 | bme::BME280_MODE_NORMAL);
+  write(bme::BME280_REGISTER_CONTROLHUMID, 0x01);
+  sensor.update(normal);
+  check(sensor.measurement_us() == 5500, "bme skips humidity when ctrl_hum is 0");
+
+  // Normal mode runs a conversion every 5.5 ms plus 0.5 ms standby
+  const int latches = count_latches(sensor, normal, 1000000, 100);
+  read_data(data);
+  check(latches >= 166 && latches <= 167 && data[6] == 0x80 && data[7] == 0x00,
+        "bme normal mode converts at 1 / (t_measure + t_sb)");
+
+  // A loop that stalls for seconds latches once, rather than catching up
+  check(count_latches(sensor, normal + 1000000, 10000000, 5000000) <= 3,
+        "bme engine does bounded work per update");
+
+  write(bme::BME280_REGISTER_CONTROL, 0xB7);
+  sensor.update(micros());
+  check(sensor.measurement_us() == 1000 + 32000 + 32500 + 2500, "bme x16 oversampling timing");
+
+  write(bme::BME280_REGISTER_SOFTRESET, 0xB6);
+  sensor.update(micros());
+  check(read(bme::BME280_REGISTER_STATUS) == 0 && read(bme::BME280_REGISTER_CONTROL) == 0 &&
+          !sensor.update(micros() + 10000000),
+        "bme soft reset stops the engine");
+
+  // Humidity follows a temperature change, at the humidity last set, and
+  // setpoints that are already staged recompute nothing
+  {
+    sensor.set_T(35.0);
+    write(bme::BME280_REGISTER_CONTROLHUMID, 0x01);
+    write(bme::BME280_REGISTER_CONTROL, 0x25);
+    sensor.update(micros() + 1000000);
+    read_data(data);
+    const Reading r = compensate(data);
+    check(fabs(r.T - 35.0) < 0.01 && fabs(r.H - 40.0) < 0.01 && fabs(r.P - 100000.0) < 0.5,
+          "bme set_T recomputes humidity and pressure for the new t_fine");
+
+    const bme::Bme280::Recomputes before = sensor.recomputes();
+    sensor.set_T(35.0);
+    sensor.set_H(40.0);
+    sensor.set_P(100000.0);
+    const bme::Bme280::Recomputes after = sensor.recomputes();
+    check(after.adc_T.done == before.adc_T.done && after.adc_H.done == before.adc_H.done &&
+            after.adc_P.done == before.adc_P.done && after.adc_T.avoided == before.adc_T.avoided + 1 &&
+            after.adc_H.avoided == before.adc_H.avoided + 2 && after.adc_P.avoided == before.adc_P.avoided + 2,
+          "bme unchanged setpoints skip their recomputes");
+  }
+
+  // Cost in loop(), when nothing is due, and when every call latches
+  run("bme::update (sleep)", Cost::Integer, 2000000, [&](uint32_t i) {
+    do_not_optimize(sensor.update(i));
+  });
+
+  write(bme::BME280_REGISTER_CONTROLHUMID, 0x01);
+  write(bme::BME280_REGISTER_CONTROL, 0x24 | bme::BME280_MODE_NORMAL);
+  const uint32_t now = micros();
+  sensor.update(now);
+
+  run("bme::update (normal, nothing due)", Cost::Integer, 2000000, [&](uint32_t) {
+    do_not_optimize(sensor.update(now));
+  });
+
+  uint32_t t = now;
+  run("bme::update (normal, latch every call)", Cost::Integer, 2000000, [&](uint32_t) {
+    t += 8500;
+    do_not_optimize(sensor.update(t));
+  });
+
+  sensor.end();
+}
+
+void bme_noise_suite() {
+  section("BME280 noise and IIR filter");
+
+  bme::Bme280Emulator<Wire> sensor(bme::BME280_ADDRESS, 16, 17);
+  sensor.init();
+  sensor.set_T(25.0);
+  sensor.set_H(50.0);
+  sensor.set_P(101325.0);
+  sensor.set_noise(true);
+
+  // RMS noise against the datasheet, 0.005 degC, 3.3 Pa and 0.02 %RH at x1
+  const Reading x1 = noise(sensor, 0x01, 0x25, 20000);
+  const Reading x16 = noise(sensor, 0x05, 0xB5, 20000);
+  printf("  RMS noise x1  %.4f degC %.2f Pa %.4f %%RH\n", x1.T, x1.P, x1.H);
+  printf("  RMS noise x16 %.4f degC %.2f Pa %.4f %%RH\n", x16.T, x16.P, x16.H);
+  check(fabs(x1.T - 0.005) < 0.001 && fabs(x1.P - 3.3) < 0.4 && fabs(x1.H - 0.02) < 0.004,
+        "bme noise at x1 matches the datasheet RMS");
+  check(x16.T < x1.T && x16.P < 0.45 * x1.P && x16.H < 0.3 * x1.H, "bme noise falls with oversampling");
+
+  // The same seed gives the same readings
+  uint8_t first[8];
+  uint8_t second[8];
+  sensor.seed_noise(1234);
+  noise(sensor, 0x01, 0x25, 10);
+  read_data(first);
+  sensor.seed_noise(1234);
+  noise(sensor, 0x01, 0x25, 10);
+  read_data(second);
+  check(memcmp(first, second, 8) == 0, "bme noise is deterministic for a seed");
+
+  // Step response of the x16 filter, without noise. Each conversion closes
+  // 1/16 of the remaining gap, see section 3.4.4 of the datasheet.
+  sensor.set_noise(false);
+  write(bme::BME280_REGISTER_CONFIG, 0x04 << 2);
+  noise(sensor, 0x01, 0x25, 1);
+  sensor.set_T(30.0);
+  double T = 0;
+  for (int i = 0; i < 16; ++i) {
+    uint8_t data[8];
+    noise(sensor, 0x01, 0x25, 1);
+    read_data(data);
+    T = compensate(data).T;
+  }
+  const double expected = 30.0 - 5.0 * pow(15.0 / 16.0, 16);
+  printf("  x16 filter after 16 conversions %.3f degC, expected %.3f\n", T, expected);
+  check(fabs(T - expected) < 0.01, "bme IIR filter step response");
+
+  write(bme::BME280_REGISTER_CONFIG, 0x00);
+  noise(sensor, 0x01, 0x25, 1);
+  uint8_t data[8];
+  read_data(data);
+  check(fabs(compensate(data).T - 30.0) < 0.01, "bme filter off passes the setpoint through");
+
+  sensor.set_noise(true);
+  uint32_t t = micros();
+  write(bme::BME280_REGISTER_CONFIG, 0x04 << 2);
+  write(bme::BME280_REGISTER_CONTROLHUMID, 0x05);
+  write(bme::BME280_REGISTER_CONTROL, 0xB7);
+  sensor.update(t);
+  const uint32_t period = sensor.measurement_us() + sensor.standby_us();
+  run("bme::update (latch with noise and filter)", Cost::Integer, 1000000, [&](uint32_t) {
+    t += period;
+    do_not_optimize(sensor.update(t));
+  });
+
+  sensor.end();
+}
+
+} // namespace bench
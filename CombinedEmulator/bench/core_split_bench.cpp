@@ -0,0 +1,159 @@
+#include "bench.hpp"
+#include "bme.hpp"
+#include "core_link.hpp"
+#include "isr_stats.hpp"
+#include "sht.hpp"
+#include <Wire.h>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+// The split of sensor emulation and networking across the two cores, with
+// host threads standing in for the cores. HTTP requests are modelled as
+// LoadUs of busy work on core0; the sensor loop either shares that thread,
+// as before the split, or runs on its own and takes setpoints from the queue.
+// The threads yield when they spin, so on a host with one CPU the gaps
+// measure the scheduler's time slice rather than the split.
+namespace bench {
+
+namespace {
+
+constexpr uint32_t LoadUs = 2000;
+constexpr int Requests = 150;
+
+// Busy, but letting the other thread run where the host has a single CPU
+void busy_wait(uint32_t us) {
+  const uint32_t start = micros();
+  while (micros() - start < us) {
+    std::this_thread::yield();
+  }
+}
+
+SetpointCommand command_for(int i) {
+  const double T = 18.0 + (i % 100) * 0.1;
+  return SetpointCommand{T, 45.0, int32_t(T * 1000), 45000, 101325000, uint32_t(micros()), 0};
+}
+
+} // namespace
+
+void core_split_suite() {
+  section("Core split and SPSC queues");
+
+  // Order, full and empty, on one thread
+  {
+    SpscQueue<int, 4> queue;
+    bool pushed = true;
+    for (int i = 0; i < 4; ++i) {
+      pushed = queue.push(i) && pushed;
+    }
+    const bool full = !queue.push(4);
+    int out = -1;
+    bool in_order = true;
+    for (int i = 0; i < 4; ++i) {
+      in_order = queue.pop(out) && out == i && in_order;
+    }
+    check(pushed && full && in_order && !queue.pop(out) && queue.size() == 0,
+          "SpscQueue keeps order and refuses to overrun");
+  }
+
+  // A producer and a consumer thread, every message arriving once and in order
+  {
+    SpscQueue<uint32_t, 16> queue;
+    constexpr uint32_t Messages = 1000000;
+    std::atomic<bool> ordered{true};
+    std::thread consumer([&]() {
+      uint32_t expected = 0;
+      uint32_t message;
+      while (expected < Messages) {
+        if (queue.pop(message)) {
+          if (message != expected) {
+            ordered = false;
+          }
+          ++expected;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+    for (uint32_t i = 0; i < Messages;) {
+      if (queue.push(i)) {
+        ++i;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    consumer.join();
+    check(ordered, "SpscQueue passes every message across threads in order");
+  }
+
+  sht::Sht4xEmulator<Wire1> sht4x(sht::SHT4x_DEFAULT_ADDR, 18, 19);
+  bme::Bme280Emulator<Wire> bme280(bme::BME280_ADDRESS, 16, 17);
+  sht4x.init();
+  bme280.init();
+
+  // One loop: the sensors wait for each request to be served
+  {
+    IsrStats loop_stats;
+    uint32_t last = micros();
+    for (int i = 0; i < Requests; ++i) {
+      busy_wait(LoadUs);
+      apply_setpoints(command_for(i), sht4x, bme280);
+      const uint32_t now = micros();
+      bme280.update(now);
+      sht4x.update(now);
+      loop_stats.record(now - last);
+      last = now;
+    }
+    printf("  %-40s %10lu us worst sensor loop gap\n", "single loop, 2 ms requests",
+           (unsigned long)loop_stats.max_us);
+  }
+
+  // Two cores: the sensor loop runs on, and setpoints cross the queue
+  {
+    SetpointQueue setpoints;
+    IsrStats latency;
+    IsrStats loop_stats;
+    std::atomic<bool> running{true};
+    std::thread core1([&]() {
+      uint32_t last = micros();
+      SetpointCommand command;
+      while (running.load(std::memory_order_relaxed) || setpoints.size() != 0) {
+        const uint32_t now = micros();
+        loop_stats.record(now - last);
+        last = now;
+        bme280.update(now);
+        while (setpoints.pop(command)) {
+          apply_setpoints(command, sht4x, bme280);
+          latency.record(uint32_t(micros()) - command.sent_us);
+        }
+        sht4x.update(micros());
+        std::this_thread::yield();
+      }
+    });
+    uint32_t drops = 0;
+    for (int i = 0; i < Requests; ++i) {
+      busy_wait(LoadUs);
+      drops += setpoints.push(command_for(i)) ? 0 : 1;
+    }
+    running = false;
+    core1.join();
+
+    printf("  %-40s %10lu us worst sensor loop gap\n", "two cores, 2 ms requests", (unsigned long)loop_stats.max_us);
+    printf("  %-40s %10lu us worst, %.1f us mean\n", "setpoint to registers", (unsigned long)latency.max_us,
+           latency.count ? double(latency.total_us) / latency.count : 0.0);
+    const double last_T = 18.0 + ((Requests - 1) % 100) * 0.1;
+    check(drops == 0 && latency.count == Requests && fabs(sht4x.get_T() - last_T) < 0.01,
+          "core1 applies every queued setpoint");
+  }
+
+  // The cost each side pays per message
+  SetpointQueue queue;
+  SetpointCommand command = command_for(0);
+  run("SpscQueue push + pop (SetpointCommand)", Cost::Integer, 2000000, [&](uint32_t) {
+    queue.push(command);
+    queue.pop(command);
+    do_not_optimize(command.sent_us);
+  });
+}
+
+} // namespace bench
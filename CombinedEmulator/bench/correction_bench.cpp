@@ -0,0 +1,80 @@
+#include "bench.hpp"
+#include "humidity_correction.hpp"
+#include <cmath>
+#include <cstdio>
+
+namespace bench {
+
+namespace {
+
+// The fit set_H evaluated in double precision before the grid
+double fit(double T, double H) {
+  return HumidityFitGrid::A * H + HumidityFitGrid::B * T + HumidityFitGrid::C * H * T + HumidityFitGrid::D;
+}
+
+} // namespace
+
+void humidity_correction_suite() {
+  section("Humidity correction grid");
+
+  HumidityCorrection correction;
+  check(correction.apply(23456, 45678) == 45678 && correction.apply(-5000, 0) == 0,
+        "humidity correction starts as the identity");
+
+  check(correction.load(HumidityFitGrid::T, HumidityFitGrid::H, HumidityFit.values),
+        "humidity correction loads the fit grid");
+
+  // The fit is bilinear, so the grid reproduces it to the rounding of its
+  // thousandths, which extrapolating past the edges magnifies
+  double inside = 0;
+  double outside = 0;
+  for (int T = -50000; T <= 90000; T += 250) {
+    for (int H = 0; H <= 100000; H += 250) {
+      const double error = fabs(correction.apply(T, H) / 1000.0 - fit(T / 1000.0, H / 1000.0));
+      if (T >= -40000 && T <= 80000) {
+        inside = fmax(inside, error);
+      } else {
+        outside = fmax(outside, error);
+      }
+    }
+  }
+  printf("  worst error against the fit %.4f %%RH, %.4f %%RH extrapolated\n", inside, outside);
+  check(inside <= 0.0015 && outside <= 0.003, "humidity correction grid reproduces the fit");
+
+  // A surface that is not bilinear: nodes are exact, cell centres average the corners
+  const HumidityCorrection::Axis T = {0, 20000, 3};
+  const HumidityCorrection::Axis H = {20000, 30000, 3};
+  const int32_t surface[] = {
+    20000, 50000, 80000,
+    21000, 52000, 83000,
+    23000, 55000, 87000,
+  };
+  HumidityCorrection custom;
+  custom.load(T, H, surface);
+  check(custom.apply(20000, 50000) == 52000 && custom.apply(40000, 80000) == 87000 &&
+          custom.apply(10000, 35000) == (20000 + 50000 + 21000 + 52000) / 4 &&
+          custom.apply(30000, 65000) == (52000 + 83000 + 55000 + 87000 + 2) / 4,
+        "humidity correction interpolates a custom surface");
+
+  const HumidityCorrection::Axis single = {0, 10000, 1};
+  const HumidityCorrection::Axis large = {0, 10000, HumidityCorrection::MaxPoints + 1};
+  const HumidityCorrection::Axis flat = {0, 0, 3};
+  check(!custom.load(single, H, surface) && !custom.load(T, large, surface) && !custom.load(flat, H, surface) &&
+          custom.apply(20000, 50000) == 52000,
+        "humidity correction rejects bad axes and keeps its grid");
+
+  // Per setpoint cost, against the double precision fit it replaces
+  run("humidity fit (double)", Cost::Float, 2000000, [](uint32_t i) {
+    const double T = 15.0 + (i % 200) * 0.05;
+    const double H = 20.0 + (i % 600) * 0.1;
+    do_not_optimize(fit(T, H));
+  });
+
+  run("HumidityCorrection::apply", Cost::Integer, 2000000, [&](uint32_t i) {
+    const int32_t T = 15000 + int32_t(i % 200) * 50;
+    const int32_t H = 20000 + int32_t(i % 600) * 100;
+    do_not_optimize(correction.apply(T, H));
+  });
+}
+
+} // namespace bench
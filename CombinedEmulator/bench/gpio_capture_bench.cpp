@@ -0,0 +1,144 @@
+#include "bench.hpp"
+#include "gpio_capture.hpp"
+#include <cstdio>
+
+// Capture of the thermostat outputs. The edge interrupt is called directly,
+// with the time stamps a port read at that time would carry.
+namespace bench {
+
+namespace {
+
+// The events poll reported, oldest first
+int drain(GpioQueue &queue, GpioEvent *events, int max) {
+  return int(queue.pop_batch(events, size_t(max)));
+}
+
+} // namespace
+
+void gpio_capture_suite() {
+  section("Thermostat output capture");
+
+  GpioEvent events[GpioQueue::Capacity];
+
+  // One clean edge, reported once it has held for the debounce time
+  {
+    EdgeCapture capture;
+    GpioQueue queue;
+    capture.reset(0);
+    capture.on_edge(0x2, 10000);
+    capture.poll(10999, queue);
+    const int early = drain(queue, events, 8);
+    capture.poll(11000, queue);
+    const int count = drain(queue, events, 8);
+    check(early == 0 && count == 1 && events[0].inputs == 0x2 && events[0].time_us == 10000 &&
+            capture.inputs() == 0x2,
+          "edge is reported after the debounce time, stamped with its own time");
+  }
+
+  // Contact bounce settles to one change at the first edge
+  {
+    EdgeCapture capture;
+    GpioQueue queue;
+    capture.reset(0);
+    const uint32_t bounce[] = {0, 50, 120, 200, 260};
+    for (int i = 0; i < 5; ++i) {
+      capture.on_edge(i % 2 == 0 ? 0x1 : 0x0, 5000 + bounce[i]);
+    }
+    capture.poll(5300, queue);
+    capture.poll(7000, queue);
+    const int count = drain(queue, events, 8);
+    check(count == 1 && events[0].inputs == 0x1 && events[0].time_us == 5000 && capture.glitches() == 0,
+          "bouncing edge is one change at its first edge");
+  }
+
+  // A pulse shorter than the debounce time is a glitch
+  {
+    EdgeCapture capture;
+    GpioQueue queue;
+    capture.reset(0x4);
+    capture.on_edge(0x0, 100);
+    capture.on_edge(0x4, 400);
+    capture.poll(5000, queue);
+    check(drain(queue, events, 8) == 0 && capture.glitches() == 1 && capture.inputs() == 0x4,
+          "pulse shorter than the debounce time is dropped");
+  }
+
+  // Changes further apart than the debounce time are each reported, in
+  // order, even when one poll sees them all; with no debounce, so is every
+  // edge
+  {
+    EdgeCapture capture;
+    GpioQueue queue;
+    capture.reset(0);
+    capture.on_edge(0x1, 1000);
+    capture.on_edge(0x3, 3000);
+    capture.on_edge(0x2, 5000);
+    capture.poll(9000, queue);
+    const int count = drain(queue, events, 8);
+    const bool ordered = count == 3 && events[0].time_us == 1000 && events[1].inputs == 0x3 &&
+                         events[2].inputs == 0x2 && events[2].time_us == 5000;
+
+    capture.set_debounce_us(0);
+    capture.on_edge(0x0, 9001);
+    capture.on_edge(0x2, 9002);
+    capture.poll(9002, queue);
+    check(ordered && drain(queue, events, 8) == 2 && events[1].time_us == 9002,
+          "separate changes are reported in order, and every edge without debounce");
+  }
+
+  // An edge stamped after the time the loop read is not yet settled
+  {
+    EdgeCapture capture;
+    GpioQueue queue;
+    capture.reset(0);
+    capture.on_edge(0x1, 20000);
+    capture.poll(19990, queue);
+    check(drain(queue, events, 8) == 0, "edge stamped after the poll time waits for its debounce");
+  }
+
+  // A full ring drops samples rather than overwriting unread ones
+  {
+    EdgeCapture capture;
+    GpioQueue queue;
+    capture.reset(0);
+    for (uint32_t i = 0; i < 65; ++i) {
+      capture.on_edge(uint8_t(i & 1), i);
+    }
+    check(capture.overruns() == 1, "full edge ring counts the sample it drops");
+  }
+
+  // The cost of the interrupt, and of loop1 settling one change
+  {
+    EdgeCapture capture;
+    GpioQueue queue;
+    capture.reset(0);
+    capture.set_debounce_us(0);
+    run("EdgeCapture::on_edge + poll", Cost::Integer, 200000, [&](uint32_t i) {
+      capture.on_edge(uint8_t(i & 1), i);
+      capture.poll(i, queue);
+      GpioEvent event;
+      do_not_optimize(queue.pop(event));
+    });
+  }
+
+  // Time stamp error against reading the pins once per loop(), for edges at
+  // arbitrary times and a loop held up LoadUs by an HTTP request. Capture is
+  // off by the interrupt latency only, a few us on the M0+.
+  {
+    constexpr uint32_t LoadUs = 2000;
+    uint32_t seed = 12345;
+    double total = 0;
+    uint32_t worst = 0;
+    constexpr int Edges = 10000;
+    for (int i = 0; i < Edges; ++i) {
+      seed = seed * 1664525 + 1013904223;
+      const uint32_t error = LoadUs - (seed >> 8) % LoadUs;
+      total += error;
+      worst = error > worst ? error : worst;
+    }
+    printf("  %-40s %10.0f us mean, %lu us worst when polled\n", "output edge time error (model)", total / Edges,
+           (unsigned long)worst);
+  }
+}
+
+} // namespace bench
@@ -0,0 +1,183 @@
+#include "bench.hpp"
+#include "history.hpp"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// The compressed history on a trace like the Executive's: a new zone
+// temperature every 2 s with a few ms of jitter, humidity and pressure left
+// alone, and the heating cycling every few minutes.
+namespace bench {
+
+namespace {
+
+constexpr uint32_t StepMs = 2000;
+
+std::vector<HistorySample> trace(int count) {
+  std::vector<HistorySample> samples;
+  uint32_t seed = 2024;
+  uint32_t time_ms = 5000;
+  double T = 20.0;
+  uint8_t inputs = 0;
+  for (int i = 0; i < count; ++i) {
+    seed = seed * 1664525 + 1013904223;
+    time_ms += StepMs - 4 + (seed >> 24) % 9;
+    if (i % 90 == 0) {
+      inputs ^= 0x3;
+    }
+    T += (inputs & 0x2 ? 0.011 : -0.007) + ((seed >> 8) % 5 - 2) * 0.001;
+    samples.push_back(HistorySample{time_ms, int32_t(T * 1000), 50000, 101325000, inputs});
+  }
+  return samples;
+}
+
+bool same(const HistorySample &a, const HistorySample &b) {
+  return a.time_ms == b.time_ms && a.T_milli == b.T_milli && a.H_milli == b.H_milli && a.P_milli == b.P_milli &&
+         a.inputs == b.inputs;
+}
+
+std::vector<HistorySample> held(const HistoryLog &log, uint32_t from_ms = 0, uint32_t to_ms = UINT32_MAX) {
+  std::vector<HistorySample> samples;
+  log.for_each(from_ms, to_ms, [&](const HistorySample &sample) { samples.push_back(sample); });
+  return samples;
+}
+
+// Decode an export as the host does, block header then bits
+std::vector<HistorySample> decode_export(const std::vector<uint8_t> &bytes) {
+  std::vector<HistorySample> samples;
+  size_t at = 0;
+  while (at + HistoryLog::ExportHeaderSize <= bytes.size()) {
+    const uint8_t *header = bytes.data() + at;
+    const uint16_t count = uint16_t(header[8] | (header[9] << 8));
+    const uint16_t bits = uint16_t(header[10] | (header[11] << 8));
+    at += HistoryLog::ExportHeaderSize;
+    HistoryReader reader(bytes.data() + at, bits, count);
+    HistorySample sample;
+    while (reader.next(sample)) {
+      samples.push_back(sample);
+    }
+    at += (bits + 7) / 8;
+  }
+  return samples;
+}
+
+std::vector<uint8_t> export_all(const HistoryLog &log, HistoryLog::Export &position, size_t chunk) {
+  std::vector<uint8_t> bytes;
+  std::vector<uint8_t> buffer(chunk);
+  size_t length;
+  while ((length = log.read(position, buffer.data(), chunk)) > 0) {
+    bytes.insert(bytes.end(), buffer.begin(), buffer.begin() + length);
+  }
+  return bytes;
+}
+
+} // namespace
+
+void history_suite() {
+  section("Compressed history");
+
+  static HistoryLog log;
+  const std::vector<HistorySample> samples = trace(3000);
+  for (const HistorySample &sample : samples) {
+    log.append(sample);
+  }
+  {
+    const std::vector<HistorySample> read = held(log);
+    bool equal = read.size() == samples.size();
+    for (size_t i = 0; equal && i < read.size(); ++i) {
+      equal = same(read[i], samples[i]);
+    }
+    check(equal && log.dropped() == 0, "history gives back every sample of a trace");
+  }
+
+  // Jumps in every field, negative setpoints, long gaps and a sample out of
+  // order, which is logged at the time of the one before
+  {
+    static HistoryLog extremes;
+    const HistorySample input[] = {
+      {0, -40000, 0, 0, 0},
+      {1, 85000, 100000, 110000000, 0xFF},
+      {100000, INT32_MIN, INT32_MAX, -1, 0x00},
+      {100001, INT32_MAX, INT32_MIN, 1, 0x01},
+      {2000000000u, 0, 0, 0, 0x01},
+      {1999999000u, 5, 5, 5, 0x02},
+      {2000000010u, 5, 5, 5, 0x02},
+    };
+    for (const HistorySample &sample : input) {
+      extremes.append(sample);
+    }
+    const std::vector<HistorySample> read = held(extremes);
+    bool equal = read.size() == 7;
+    for (size_t i = 0; equal && i < 7; ++i) {
+      HistorySample expected = input[i];
+      if (i == 5) {
+        expected.time_ms = input[4].time_ms;
+      }
+      equal = same(read[i], expected);
+    }
+    check(equal, "history keeps extreme values and clamps a sample out of order");
+  }
+
+  // A range, straight and through an export in chunks no bigger than a frame
+  {
+    const uint32_t from = samples[1000].time_ms;
+    const uint32_t to = samples[1999].time_ms;
+    const std::vector<HistorySample> range = held(log, from, to);
+
+    HistoryLog::Export position = log.start_export(from, to);
+    const std::vector<HistorySample> exported = decode_export(export_all(log, position, 64));
+    std::vector<HistorySample> in_range;
+    for (const HistorySample &sample : exported) {
+      if (sample.time_ms >= from && sample.time_ms <= to) {
+        in_range.push_back(sample);
+      }
+    }
+    bool equal = range.size() == 1000 && in_range.size() == range.size() && !position.cut;
+    for (size_t i = 0; equal && i < range.size(); ++i) {
+      equal = same(range[i], samples[1000 + i]) && same(in_range[i], range[i]);
+    }
+    check(equal && exported.size() < samples.size(), "history range reads back, and exports only its blocks");
+  }
+
+  // The oldest block goes when the ring is full, and an export that it
+  // overtakes ends
+  {
+    static HistoryLog full;
+    const std::vector<HistorySample> many = trace(60000);
+    for (size_t i = 0; i < 20000; ++i) {
+      full.append(many[i]);
+    }
+    HistoryLog::Export position = full.start_export(0, UINT32_MAX);
+    uint8_t chunk[64];
+    full.read(position, chunk, sizeof(chunk));
+    for (size_t i = 20000; i < many.size(); ++i) {
+      full.append(many[i]);
+    }
+    const std::vector<HistorySample> read = held(full);
+    const bool kept = full.dropped() > 0 && read.size() + full.dropped() == many.size() &&
+                      same(read.back(), many.back()) && full.block_count() == HistoryLog::Blocks;
+    check(kept && full.read(position, chunk, sizeof(chunk)) == 0 && position.cut,
+          "full history drops its oldest block, ending an export it overtakes");
+  }
+
+  const double bytes_per_sample = double(log.bytes()) / log.samples();
+  const double encode_ns = run("HistoryLog::append (trace)", Cost::Integer, 60000, [&](uint32_t i) {
+    static HistoryLog timed;
+    // Each pass over the trace later than the last
+    HistorySample sample = samples[i % samples.size()];
+    sample.time_ms += uint32_t(i / samples.size()) * 10000000u;
+    timed.append(sample);
+  });
+  const double decode_ns = run("HistoryLog::for_each (3000 samples)", Cost::Integer, 200, [&](uint32_t) {
+    uint32_t sum = 0;
+    log.for_each(0, UINT32_MAX, [&](const HistorySample &sample) { sum += sample.inputs; });
+    do_not_optimize(sum);
+  }) / log.samples();
+  const size_t capacity = HistoryLog::Blocks * HistoryLog::BlockBytes;
+  printf("  %-40s %10.2f bytes/sample vs %zu raw, %.0f ns encode, %.0f ns decode\n", "history compression",
+         bytes_per_sample, sizeof(uint32_t) * 4 + 1, encode_ns, decode_ns);
+  printf("  %-40s %10.1f hours at one sample per %.0f s in %zu KB\n", "history held", capacity / bytes_per_sample *
+         StepMs / 3.6e6, StepMs / 1000.0, capacity / 1024);
+}
+
+} // namespace bench
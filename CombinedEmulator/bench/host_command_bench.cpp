@@ -0,0 +1,148 @@
+#include "bench.hpp"
+#include "host_command.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace bench {
+
+namespace {
+
+// Bytes in, as a serial port or a file would give them
+class TextStream : public Stream {
+public:
+  explicit TextStream(const std::string &text) : text_(text) {}
+
+  int available() override { return int(text_.size() - position_); }
+  int read() override { return position_ < text_.size() ? uint8_t(text_[position_++]) : -1; }
+  size_t write(uint8_t c) override {
+    text_.push_back(char(c));
+    return 1;
+  }
+  using Print::write;
+
+  const std::string &text() const { return text_; }
+
+private:
+  std::string text_;
+  size_t position_ = 0;
+};
+
+// Feed text, counting the messages it completes, with the last one in last
+int feed(HostCommandReader &reader, const char *text, HostCommand *last = nullptr) {
+  int messages = 0;
+  for (const char *c = text; *c; ++c) {
+    if (reader.feed(*c)) {
+      ++messages;
+      if (last) {
+        *last = reader.command();
+      }
+    }
+  }
+  return messages;
+}
+
+} // namespace
+
+void host_command_suite() {
+  section("Serial control channel parser");
+
+  static HostCommand command;
+  {
+    HostCommandReader reader;
+    const int messages = feed(reader, "{\"temperature\": 21.5, \"humidity\": 45, \"pressure\": 1.01325e5}\n", &command);
+    check(messages == 1 && command.has_T && command.has_H && command.has_P && command.T == 21.5 &&
+            command.H == 45.0 && command.P == 101325.0 && !command.has_correction,
+          "host command reads temperature, humidity and pressure");
+  }
+
+  // Split at every byte, as a slow serial port delivers it
+  {
+    HostCommandReader reader;
+    const char *message = "{\"humidity\": 38.25}";
+    bool early = false;
+    for (size_t i = 0; i + 1 < strlen(message); ++i) {
+      early = reader.feed(message[i]) || early;
+    }
+    const bool complete = reader.feed(message[strlen(message) - 1]);
+    check(!early && complete && reader.command().has_H && !reader.command().has_T &&
+            reader.command().H == 38.25,
+          "host command waits for the rest of a partial message");
+  }
+
+  // Back to back, with and without separators, as a burst from the host
+  {
+    HostCommandReader reader;
+    const int messages =
+      feed(reader, "{\"temperature\": 20}{\"temperature\": 21}\r\n{\"temperature\": 22, \"unknown\": [1, {\"a\": null}]}",
+           &command);
+    check(messages == 3 && command.T == 22.0, "host command takes every message in a burst");
+  }
+
+  // Garbage is dropped up to the next message, with what it had set
+  {
+    HostCommandReader reader;
+    const int messages = feed(reader, "{\"temperature\": 2x1, \"humidity\": 10}\nnoise{\"humidity\": 40}", &command);
+    check(messages == 1 && reader.errors() == 2 && command.has_H && !command.has_T && command.H == 40.0,
+          "host command resynchronises after a malformed message");
+  }
+
+  // Nothing nested in a malformed message is taken for a message of its own
+  {
+    HostCommandReader reader;
+    const int messages = feed(reader,
+                              "{\"bad\": !, \"x\": {\"temperature\": 99}, \"s\": \"}{\\\"\"}"
+                              "{\"a\": [{\"b\": [[1, !]]}], \"temperature\": 98}{\"humidity\": 41}",
+                              &command);
+    check(messages == 1 && reader.errors() == 2 && !command.has_T && command.H == 41.0,
+          "host command skips all of a malformed message");
+  }
+
+  // A correction grid, loaded, written out and read back as from flash
+  {
+    HostCommandReader reader;
+    const int messages = feed(reader,
+                              "{\"humidity_correction\": {\"sensor\": \"sht\", \"save\": true, "
+                              "\"T\": {\"origin\": 0, \"step\": 20, \"count\": 2}, "
+                              "\"H\": {\"origin\": 0, \"step\": 100, \"count\": 2}, "
+                              "\"values\": [0.5, 99.5, 1.5, 98.25]}}",
+                              &command);
+    HumidityCorrection correction;
+    const bool loaded = command.correction.load_into(correction);
+
+    TextStream file("");
+    command.correction.print(file);
+    TextStream stored(file.text());
+    static CorrectionGrid grid;
+    const bool read = read_grid(stored, grid);
+    HumidityCorrection reloaded;
+    check(messages == 1 && command.has_correction && strcmp(command.correction_sensor, "sht") == 0 &&
+            command.save_correction && loaded && correction.apply(20000, 100000) == 98250 && read &&
+            grid.load_into(reloaded) && reloaded.apply(10000, 50000) == correction.apply(10000, 50000),
+          "host command reads a correction grid, which round trips through a file");
+
+    command.correction.count = 3;
+    check(!command.correction.load_into(correction) && correction.apply(20000, 100000) == 98250,
+          "correction grid with the wrong number of values is refused");
+  }
+
+  // Messages per second the parser sustains, and what the per loop byte
+  // budget in main.cpp costs at most. ArduinoJson's deserializeJson, which
+  // this replaces, cannot be built on the host; it allocated a document per
+  // message and waited out the stream timeout, 1 s by default, for the rest
+  // of a partial one.
+  HostCommandReader reader;
+  const char *message = "{\"temperature\": 21.375, \"humidity\": 45.5}";
+  const size_t length = strlen(message);
+  const double ns = run("HostCommandReader (T and H message)", Cost::Float, 200000, [&](uint32_t) {
+    for (size_t i = 0; i < length; ++i) {
+      do_not_optimize(reader.feed(message[i]));
+    }
+  });
+  const double per_byte = ns / length;
+  printf("  %-40s %10.0f messages/s, %.2f us for 512 bytes\n", "host command parse rate", 1e9 / ns,
+         per_byte * 512 / 1000);
+}
+
+} // namespace bench
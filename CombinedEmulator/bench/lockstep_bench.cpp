@@ -0,0 +1,174 @@
+#include "bench.hpp"
+#include "core_link.hpp"
+#include "host_command.hpp"
+#include "host_protocol.hpp"
+#include "lockstep.hpp"
+#include <cstdio>
+
+// Lockstep steps through the whole path on one thread: the host's Step frame
+// read byte by byte, the setpoints queued for core1 and applied, and the
+// acknowledgement framed and read back by the host.
+namespace bench {
+
+namespace {
+
+constexpr double BitsPerByte = 10;
+constexpr double Baud = 115200;
+constexpr double StepS = 30;
+constexpr double YearSteps = 365 * 86400 / StepS;
+
+struct Device {
+  protocol::FrameReader reader;
+  SetpointQueue setpoints;
+  StepQueue applied;
+  Lockstep lockstep;
+  uint8_t inputs = 0;
+};
+
+// The host's Step in, the acknowledgement out if the step was applied or
+// resent. Returns the bytes of the acknowledgement, 0 if there was none.
+size_t step_through(Device &device, const uint8_t *wire, size_t length, uint8_t *ack_wire) {
+  bool resend = false;
+  for (size_t i = 0; i < length; ++i) {
+    if (device.reader.feed(wire[i]) != protocol::FrameReader::Result::Frame) {
+      continue;
+    }
+    protocol::StepPayload step;
+    if (device.reader.frame().type != protocol::Step || !step.get(device.reader.frame())) {
+      continue;
+    }
+    switch (device.lockstep.receive(step.step, step.T_milli, step.H_milli, step.P_milli)) {
+    case Lockstep::Action::Apply:
+      device.setpoints.push(
+          SetpointCommand{step.T_milli / 1000.0, step.H_milli / 1000.0, step.T_milli, 0, 0, 0, step.step});
+      break;
+    case Lockstep::Action::Resend:
+      resend = true;
+      break;
+    default:
+      break;
+    }
+  }
+
+  // Core1 applies the setpoints and reports the step
+  SetpointCommand command;
+  while (device.setpoints.pop(command)) {
+    if (command.step != 0) {
+      device.applied.push(StepApplied{command.step, device.inputs, command.step * 7});
+    }
+  }
+
+  // Core0 acknowledges it
+  StepApplied applied;
+  bool acknowledge = resend;
+  while (device.applied.pop(applied)) {
+    acknowledge = device.lockstep.applied(applied.step, applied.inputs, applied.time_us) || acknowledge;
+  }
+  if (!acknowledge) {
+    return 0;
+  }
+  protocol::Frame frame = {};
+  frame.version = protocol::Version;
+  frame.type = protocol::StepAck;
+  protocol::StepAckPayload{device.lockstep.ack()}.put(frame);
+  return protocol::encode_frame(frame, ack_wire);
+}
+
+size_t step_frame(uint32_t number, int32_t T_milli, uint8_t *wire) {
+  protocol::Frame frame = {};
+  frame.version = protocol::Version;
+  frame.type = protocol::Step;
+  frame.sequence = uint16_t(number);
+  protocol::StepPayload{number, protocol::StatePayload::HasT | protocol::StepPayload::HasSimTime, T_milli, 0, 0,
+                        uint64_t(number) * 30000000}
+      .put(frame);
+  return protocol::encode_frame(frame, wire);
+}
+
+bool read_ack(const uint8_t *wire, size_t length, StepAck &ack) {
+  protocol::FrameReader reader;
+  for (size_t i = 0; i < length; ++i) {
+    protocol::StepAckPayload payload;
+    if (reader.feed(wire[i]) == protocol::FrameReader::Result::Frame && reader.frame().type == protocol::StepAck &&
+        payload.get(reader.frame())) {
+      ack = payload.ack;
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+void lockstep_suite() {
+  section("Lockstep steps");
+
+  // Applied once, acknowledged again when sent again, applied again while
+  // core1 has not taken it, old steps ignored, and step 1 restarting
+  {
+    Lockstep lockstep;
+    using Action = Lockstep::Action;
+    const bool first = lockstep.receive(1, 21000, 0, 0) == Action::Apply && lockstep.pending();
+    const bool pending = lockstep.receive(1, 21000, 0, 0) == Action::Apply;
+    const bool done = lockstep.applied(1, 0x2, 500) && !lockstep.applied(1, 0x2, 600) &&
+                      lockstep.ack().inputs == 0x2 && lockstep.ack().time_us == 500;
+    const bool resend = lockstep.receive(1, 21000, 0, 0) == Action::Resend;
+    const bool next = lockstep.receive(2, 21500, 0, 0) == Action::Apply && !lockstep.applied(1, 0, 0) &&
+                      lockstep.applied(2, 0x4, 700) && lockstep.ack().T_milli == 21500;
+    const bool stale = lockstep.receive(1, 0, 0, 0) == Action::Apply && lockstep.receive(5, 0, 0, 0) == Action::Apply &&
+                       lockstep.receive(3, 0, 0, 0) == Action::Ignore && lockstep.receive(0, 0, 0, 0) == Action::Ignore;
+    check(first && pending && done && resend && next && stale && lockstep.stale() == 1,
+          "lockstep applies each step once and acknowledges it again on request");
+  }
+
+  // Through the frames, each step acknowledged with its setpoint and the
+  // outputs, and a lost acknowledgement recovered by sending the step again
+  uint8_t wire[protocol::MaxEncoded];
+  uint8_t ack_wire[protocol::MaxEncoded];
+  size_t step_length = 0;
+  size_t ack_length = 0;
+  {
+    Device device;
+    bool all = true;
+    for (uint32_t number = 1; number <= 100; ++number) {
+      device.inputs = uint8_t(number % 8);
+      step_length = step_frame(number, 20000 + int32_t(number), wire);
+      ack_length = step_through(device, wire, step_length, ack_wire);
+      StepAck ack;
+      all = all && read_ack(ack_wire, ack_length, ack) && ack.step == number &&
+            ack.T_milli == 20000 + int32_t(number) && ack.inputs == number % 8;
+    }
+    StepAck again;
+    const bool resent = read_ack(ack_wire, step_through(device, wire, step_length, ack_wire), again) &&
+                        again.step == 100 && device.lockstep.steps() == 100;
+    check(all && resent, "lockstep steps are acknowledged through the frames");
+  }
+
+  // From JSON
+  {
+    HostCommandReader reader;
+    bool complete = false;
+    for (const char *c = "{\"step\": 12, \"temperature\": 21.5}"; *c; ++c) {
+      complete = reader.feed(*c);
+    }
+    check(complete && reader.command().has_step && reader.command().step == 12 && reader.command().has_T,
+          "lockstep steps are read from JSON");
+  }
+
+  Device device;
+  const double device_ns = run("step, Step frame in to StepAck out", Cost::Integer, 100000, [&](uint32_t i) {
+    const size_t length = step_frame(i + 1, 21000, wire);
+    do_not_optimize(step_through(device, wire, length, ack_wire));
+  });
+
+  // The round trip is the two frames on the wire and the device's work; the
+  // host's own time, BOPTEST's above all, comes on top
+  const double wire_us = (step_length + ack_length) * BitsPerByte / Baud * 1e6;
+  const double step_us = wire_us + device_ns * 8 / 1000;
+  printf("  %-40s %10.0f us on the wire for %zu + %zu bytes at 115200 baud\n", "step round trip", wire_us,
+         step_length, ack_length);
+  printf("  %-40s %10.1f h for a year of 30 s steps, vs %.1f days at a time scale of 15\n", "lockstep bound",
+         YearSteps * step_us / 3.6e9, 365 / 15.0);
+}
+
+} // namespace bench
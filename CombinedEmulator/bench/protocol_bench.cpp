@@ -0,0 +1,248 @@
+#include "bench.hpp"
+#include "host_command.hpp"
+#include "host_protocol.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// The binary frames of the serial link against the JSON messages they stand
+// in for. Latency on the wire is the time the bytes take at the link's
+// 115200 baud, 10 bits a byte, which dwarfs either parser.
+namespace bench {
+
+namespace {
+
+constexpr double BaudRate = 115200;
+
+double wire_us(size_t bytes) {
+  return bytes * 10 / BaudRate * 1e6;
+}
+
+// Feed bytes, returning the frames they complete in order, and counting the
+// bytes passed on as text and the invalid frames
+struct Split {
+  std::vector<protocol::Frame> frames;
+  std::string text;
+  int invalid = 0;
+};
+
+Split split(protocol::FrameReader &reader, const std::vector<uint8_t> &bytes) {
+  Split result;
+  for (const uint8_t byte : bytes) {
+    switch (reader.feed(byte)) {
+    case protocol::FrameReader::Result::Text:
+      result.text.push_back(char(byte));
+      break;
+    case protocol::FrameReader::Result::Frame:
+      result.frames.push_back(reader.frame());
+      break;
+    case protocol::FrameReader::Result::Invalid:
+      ++result.invalid;
+      break;
+    case protocol::FrameReader::Result::None:
+      break;
+    }
+  }
+  return result;
+}
+
+void append_frame(std::vector<uint8_t> &bytes, uint8_t type, uint16_t sequence, const protocol::StatePayload &state) {
+  protocol::Frame frame;
+  frame.version = protocol::Version;
+  frame.type = type;
+  frame.sequence = sequence;
+  state.put(frame);
+  uint8_t wire[protocol::MaxEncoded];
+  bytes.insert(bytes.end(), wire, wire + protocol::encode_frame(frame, wire));
+}
+
+bool cobs_round_trip(const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> encoded(data.size() + data.size() / 254 + 1);
+  const size_t length = protocol::cobs_encode(data.data(), data.size(), encoded.data());
+  if (length > encoded.size() || std::memchr(encoded.data(), 0, length) != nullptr) {
+    return false;
+  }
+  std::vector<uint8_t> decoded(length);
+  const size_t decoded_length = protocol::cobs_decode(encoded.data(), length, decoded.data());
+  return decoded_length == data.size() && std::equal(data.begin(), data.end(), decoded.begin());
+}
+
+} // namespace
+
+void protocol_suite() {
+  section("Binary host protocol");
+
+  // Zeros at either end, together, and runs across the 254 byte block
+  {
+    bool round_trips = cobs_round_trip({0}) && cobs_round_trip({0, 0}) && cobs_round_trip({1, 0, 2, 0}) &&
+                       cobs_round_trip({0, 1, 2, 3, 0});
+    for (const size_t run : {253, 254, 255, 508, 600}) {
+      std::vector<uint8_t> data(run);
+      for (size_t i = 0; i < run; ++i) {
+        data[i] = uint8_t(i % 255 + 1);
+      }
+      round_trips = cobs_round_trip(data) && round_trips;
+      data.push_back(0);
+      round_trips = cobs_round_trip(data) && round_trips;
+    }
+    uint8_t out[4];
+    const uint8_t overrun[] = {5, 1, 2};
+    check(round_trips && protocol::cobs_decode(overrun, sizeof(overrun), out) == 0,
+          "COBS round trips zeros and long runs, and refuses an overrun");
+  }
+
+  const protocol::StatePayload state = {protocol::StatePayload::HasT | protocol::StatePayload::HasH, 21375, 45500,
+                                        0, 0x12345678};
+
+  // A frame through the reader, every field intact
+  {
+    protocol::FrameReader reader;
+    std::vector<uint8_t> bytes;
+    append_frame(bytes, protocol::SetState, 0xBEEF, state);
+    const Split result = split(reader, bytes);
+    protocol::StatePayload read = {};
+    const bool got = result.frames.size() == 1 && read.get(result.frames[0]);
+    check(got && result.frames[0].type == protocol::SetState && result.frames[0].sequence == 0xBEEF &&
+            read.fields == state.fields && read.T_milli == 21375 && read.H_milli == 45500 &&
+            read.host_ms == 0x12345678 && result.text.empty(),
+          "frame round trips its header and payload");
+  }
+
+  // Negative setpoints and every output bit
+  {
+    protocol::Frame frame = {};
+    protocol::StatePayload cold = {protocol::StatePayload::HasT, -40000, 0, 0, 0};
+    cold.put(frame);
+    protocol::StatePayload read = {};
+    protocol::OutputsPayload outputs = {0x07, 0xFFFFFFF0};
+    protocol::Frame outputs_frame = {};
+    outputs.put(outputs_frame);
+    protocol::OutputsPayload outputs_read = {};
+    check(read.get(frame) && read.T_milli == -40000 && outputs_read.get(outputs_frame) &&
+            outputs_read.inputs == 0x07 && outputs_read.time_us == 0xFFFFFFF0,
+          "payloads keep signed setpoints and output time stamps");
+  }
+
+  // A full batch of output changes, and a count longer than the frame
+  {
+    protocol::OutputEventsPayload batch = {};
+    batch.count = protocol::OutputEventsPayload::MaxEvents;
+    for (int i = 0; i < batch.count; ++i) {
+      batch.events[i] = protocol::OutputsPayload{uint8_t(i & 7), uint32_t(i) * 1000003u};
+    }
+    protocol::Frame frame = {};
+    batch.put(frame);
+    protocol::OutputEventsPayload read = {};
+    bool same = read.get(frame) && read.count == batch.count;
+    for (int i = 0; same && i < batch.count; ++i) {
+      same = read.events[i].inputs == batch.events[i].inputs && read.events[i].time_us == batch.events[i].time_us;
+    }
+    frame.length = uint8_t(frame.length - 1);
+    check(same && !read.get(frame), "output event batches round trip, and a short one is refused");
+  }
+
+  // Every single bit error is caught by the CRC
+  {
+    std::vector<uint8_t> bytes;
+    append_frame(bytes, protocol::SetState, 1, state);
+    bool caught = true;
+    for (size_t i = 1; i + 1 < bytes.size(); ++i) {
+      for (int bit = 0; bit < 8; ++bit) {
+        std::vector<uint8_t> corrupt = bytes;
+        corrupt[i] ^= uint8_t(1 << bit);
+        protocol::FrameReader reader;
+        const Split result = split(reader, corrupt);
+        caught = result.frames.empty() && caught;
+      }
+    }
+    check(caught, "frame with any bit flipped is rejected");
+  }
+
+  // A frame cut short loses itself and, at most, the frame after it
+  {
+    std::vector<uint8_t> bytes;
+    append_frame(bytes, protocol::SetState, 1, state);
+    bytes.pop_back();
+    bytes.resize(bytes.size() - 3);
+    for (uint16_t sequence = 2; sequence <= 4; ++sequence) {
+      append_frame(bytes, protocol::SetState, sequence, state);
+    }
+    protocol::FrameReader reader;
+    const Split result = split(reader, bytes);
+    check(result.frames.size() == 2 && result.frames[0].sequence == 3 && result.frames[1].sequence == 4 &&
+            result.invalid == 1,
+          "frame reader falls back in step after a lost delimiter");
+  }
+
+  // JSON messages either side of a frame reach the JSON parser untouched
+  {
+    const char *json = "{\"temperature\": 21}\n";
+    std::vector<uint8_t> bytes(json, json + strlen(json));
+    append_frame(bytes, protocol::SetState, 7, state);
+    bytes.insert(bytes.end(), json, json + strlen(json));
+    protocol::FrameReader reader;
+    const Split result = split(reader, bytes);
+    HostCommandReader commands;
+    int messages = 0;
+    for (const char c : result.text) {
+      messages += commands.feed(c) ? 1 : 0;
+    }
+    check(result.frames.size() == 1 && result.frames[0].sequence == 7 && messages == 2 && commands.errors() == 0,
+          "JSON text and frames share the link");
+  }
+
+  // Encode and decode cost of the same setpoints in both encodings, and the
+  // time their bytes take on the wire, which bounds the messages per second
+  protocol::Frame frame = {};
+  frame.version = protocol::Version;
+  frame.type = protocol::SetState;
+  state.put(frame);
+  uint8_t wire[protocol::MaxEncoded];
+  const size_t frame_bytes = protocol::encode_frame(frame, wire);
+  const double encode_ns = run("protocol::encode_frame (SetState)", Cost::Integer, 200000, [&](uint32_t i) {
+    frame.sequence = uint16_t(i);
+    do_not_optimize(protocol::encode_frame(frame, wire));
+  });
+
+  protocol::FrameReader reader;
+  const double decode_ns = run("protocol::FrameReader (SetState)", Cost::Integer, 200000, [&](uint32_t) {
+    for (size_t i = 0; i < frame_bytes; ++i) {
+      do_not_optimize(reader.feed(wire[i]));
+    }
+  });
+
+  char json[96];
+  const double json_encode_ns = run("snprintf JSON (T and H message)", Cost::Float, 200000, [&](uint32_t i) {
+    do_not_optimize(snprintf(json, sizeof(json), "{\"temperature\": %.3f, \"humidity\": %.3f}\n",
+                             21.375 + (i & 7) * 0.001, 45.5));
+  });
+  const size_t json_bytes = strlen(json);
+
+  HostCommandReader commands;
+  const double json_decode_ns = run("HostCommandReader (T and H message)", Cost::Float, 200000, [&](uint32_t) {
+    for (size_t i = 0; i < json_bytes; ++i) {
+      do_not_optimize(commands.feed(json[i]));
+    }
+  });
+
+  printf("  %-40s %10.0f frames/s, %zu bytes, %.0f us on the wire\n", "binary SetState",
+         1e9 / (encode_ns + decode_ns), frame_bytes, wire_us(frame_bytes));
+  printf("  %-40s %10.0f frames/s, %zu bytes, %.0f us on the wire\n", "JSON setpoints",
+         1e9 / (json_encode_ns + json_decode_ns), json_bytes, wire_us(json_bytes));
+  printf("  %-40s %10.0f frames/s binary, %.0f frames/s JSON\n", "at 115200 baud", 1e6 / wire_us(frame_bytes),
+         1e6 / wire_us(json_bytes));
+
+  // The outputs report, one way
+  protocol::Frame outputs = {};
+  outputs.version = protocol::Version;
+  outputs.type = protocol::Outputs;
+  protocol::OutputsPayload{0x05, 123456}.put(outputs);
+  const size_t outputs_bytes = protocol::encode_frame(outputs, wire);
+  const size_t outputs_json = strlen("{\"input0\": 1, \"input1\": 0, \"input2\": 1}\r\n");
+  printf("  %-40s %10zu bytes binary, %zu bytes JSON, %.0f vs %.0f us on the wire\n", "outputs report",
+         outputs_bytes, outputs_json, wire_us(outputs_bytes), wire_us(outputs_json));
+}
+
+} // namespace bench
@@ -0,0 +1,179 @@
+#include "bench.hpp"
+#include "bme.hpp"
+#include "shadow_bank.hpp"
+#include "sht.hpp"
+#include <Wire.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+// Stress tests for the shadowed data registers. A writer thread publishes
+// samples as fast as it can while reader threads, standing in for the I2C
+// interrupt handlers, check every read is one whole published sample.
+// On the device the reader is an interrupt on the writer's core, or with
+// two cores a truly concurrent reader, and host threads cover both.
+namespace bench {
+
+namespace {
+
+constexpr auto StressDuration = std::chrono::milliseconds(300);
+
+struct StressResult {
+  uint64_t writes = 0;
+  uint64_t reads = 0;
+  uint64_t torn = 0;
+};
+
+// Run writer() in a loop on one thread and reader() on readers threads for
+// StressDuration. reader returns false for a torn read.
+template <typename Writer, typename Reader>
+StressResult stress(int readers, Writer &&writer, Reader &&reader) {
+  std::atomic<bool> running{true};
+  std::atomic<uint64_t> reads{0};
+  std::atomic<uint64_t> torn{0};
+  uint64_t writes = 0;
+
+  std::vector<std::thread> threads;
+  for (int r = 0; r < readers; ++r) {
+    threads.emplace_back([&]() {
+      uint64_t local_reads = 0;
+      uint64_t local_torn = 0;
+      while (running.load(std::memory_order_relaxed)) {
+        local_torn += reader() ? 0 : 1;
+        ++local_reads;
+      }
+      reads += local_reads;
+      torn += local_torn;
+    });
+  }
+
+  const auto stop = std::chrono::steady_clock::now() + StressDuration;
+  while (std::chrono::steady_clock::now() < stop) {
+    for (int i = 0; i < 64; ++i) {
+      writer(writes++);
+    }
+  }
+  running = false;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  return StressResult{writes, reads.load(), torn.load()};
+}
+
+void print(const char *name, const StressResult &result) {
+  printf("  %-40s %9llu writes %9llu reads %llu torn\n", name, (unsigned long long)result.writes,
+         (unsigned long long)result.reads, (unsigned long long)result.torn);
+}
+
+} // namespace
+
+void shadow_suite() {
+  section("Shadowed data registers, concurrent writer and readers");
+
+  // Every byte of a sample is the same, so any mix of two samples shows
+  {
+    ShadowBank<8> bank;
+    const uint8_t zero[8] = {};
+    bank.reset(zero);
+
+    const StressResult result = stress(
+      3,
+      [&bank](uint64_t n) {
+        uint8_t *sample = bank.stage();
+        memset(sample, uint8_t(n), 8);
+        bank.publish();
+      },
+      [&bank]() {
+        uint8_t sample[8];
+        bank.read(sample);
+        for (int i = 1; i < 8; ++i) {
+          if (sample[i] != sample[0]) {
+            return false;
+          }
+        }
+        return true;
+      });
+    print("ShadowBank<8>", result);
+    check(result.torn == 0, "ShadowBank never returns a torn sample");
+  }
+
+  // BME280 burst read of 0xF7..0xFE in normal mode, while the temperature,
+  // and with it the pressure registers, alternates between two values and
+  // every update latches a conversion
+  {
+    bme::Bme280Emulator<Wire> sensor(bme::BME280_ADDRESS, 16, 17);
+    sensor.init();
+    sensor.set_H_milli(45000);
+    sensor.set_P_milli(98000000);
+
+    const uint8_t normal[] = {bme::BME280_REGISTER_CONTROLHUMID, 0x01, bme::BME280_REGISTER_CONFIG, 0x00,
+                              bme::BME280_REGISTER_CONTROL, 0x27};
+    Wire.host_receive(normal, sizeof(normal));
+    uint32_t now = micros();
+    sensor.update(now);
+    const uint32_t period = sensor.measurement_us() + sensor.standby_us();
+
+    const uint8_t address = bme::BME280_REGISTER_PRESSUREDATA;
+    uint8_t cold[8];
+    uint8_t hot[8];
+    sensor.set_T_milli(-10000);
+    sensor.update(now += period);
+    Wire.host_receive(&address, 1);
+    Wire.host_request(cold, 8);
+    sensor.set_T_milli(40000);
+    sensor.update(now += period);
+    Wire.host_receive(&address, 1);
+    Wire.host_request(hot, 8);
+
+    const StressResult result = stress(
+      1,
+      [&](uint64_t n) {
+        sensor.set_T_milli((n & 1) ? 40000 : -10000);
+        sensor.update(now += period);
+      },
+      [&]() {
+        uint8_t sample[8];
+        Wire.host_receive(&address, 1);
+        Wire.host_request(sample, 8);
+        return memcmp(sample, cold, 8) == 0 || memcmp(sample, hot, 8) == 0;
+      });
+    print("bme 0xF7 x8 during set_T", result);
+    check(result.torn == 0 && memcmp(cold, hot, 8) != 0, "bme data burst never mixes two samples");
+    sensor.end();
+  }
+
+  // SHT4x measurement read while the temperature alternates
+  {
+    sht::Sht4xEmulator<Wire1> sensor(sht::SHT4x_DEFAULT_ADDR, 18, 19);
+    sensor.init();
+
+    const uint8_t command = sht::SHT4x_NOHEAT_HIGHPRECISION;
+    uint8_t cold[6];
+    uint8_t hot[6];
+    sensor.set_T(-10.0);
+    Wire1.host_receive(&command, 1);
+    Wire1.host_request(cold, 6);
+    sensor.set_T(60.0);
+    Wire1.host_receive(&command, 1);
+    Wire1.host_request(hot, 6);
+
+    const StressResult result = stress(
+      1,
+      [&](uint64_t n) { sensor.set_T((n & 1) ? 60.0 : -10.0); },
+      [&]() {
+        uint8_t frame[6];
+        Wire1.host_receive(&command, 1);
+        Wire1.host_request(frame, 6);
+        return memcmp(frame, cold, 6) == 0 || memcmp(frame, hot, 6) == 0;
+      });
+    print("sht measurement during set_T", result);
+    check(result.torn == 0, "sht measurement never mixes two samples");
+    sensor.end();
+  }
+}
+
+} // namespace bench
@@ -0,0 +1,165 @@
+#include "bench.hpp"
+#include "sht3x.hpp"
+#include <Wire.h>
+#include <cmath>
+#include <cstdio>
+
+namespace bench {
+
+namespace {
+
+void send(uint16_t command) {
+  const uint8_t data[] = {uint8_t(command >> 8), uint8_t(command)};
+  Wire1.host_receive(data, sizeof(data));
+}
+
+bool busy(const uint8_t *frame) {
+  return frame[0] == 0xFF && frame[1] == 0xFF && frame[2] == 0xFF;
+}
+
+bool valid(const uint8_t *frame) {
+  return frame[2] == sht::crc8(frame, 2) && frame[5] == sht::crc8(frame + 3, 2);
+}
+
+uint16_t read_status() {
+  uint8_t frame[3];
+  send(sht::SHT3x_READ_STATUS);
+  Wire1.host_request(frame, 3);
+  return frame[2] == sht::crc8(frame, 2) ? (frame[0] << 8) | frame[1] : 0xFFFF;
+}
+
+void wait_until(uint32_t start, uint32_t us) {
+  while (micros() - start < us) {
+  }
+}
+
+} // namespace
+
+void sht3x_suite() {
+  section("SHT3x emulator");
+
+  sht::Sht3xEmulator<Wire1> sensor(sht::SHT3x_DEFAULT_ADDR, 18, 19);
+  sensor.init();
+  sensor.begin();
+  sensor.set_T(25.0);
+  sensor.set_H(40.0);
+
+  printf("  %-40s %10zu bytes\n", "sizeof(Sht3xEmulator<Wire1>)", sizeof(sensor));
+
+  uint8_t frame[6];
+  send(sht::SHT3x_READ_SERIAL);
+  Wire1.host_request(frame, 6);
+  check(valid(frame) && frame[0] == 0x0E && frame[1] == 0xFE && frame[3] == 0x7F && frame[4] == 0xBF,
+        "sht3x reports its serial number");
+
+  // Status after power on, and what clear status, the heater and a bad command do to it
+  const uint16_t power_on = read_status();
+  send(sht::SHT3x_CLEAR_STATUS);
+  const uint16_t cleared = read_status();
+  send(sht::SHT3x_HEATER_ENABLE);
+  const uint16_t heater = read_status();
+  send(sht::SHT3x_HEATER_DISABLE);
+  send(0x1234);
+  const uint16_t failed = sensor.status();
+  check(power_on == sht::SHT3x_STATUS_POWER_ON && cleared == 0 && heater == sht::SHT3x_STATUS_HEATER &&
+          failed == sht::SHT3x_STATUS_COMMAND_FAILED && read_status() == 0,
+        "sht3x status register, clear status and heater bit");
+
+  send(sht::SHT3x_SINGLE_STRETCH_HIGH);
+  Wire1.host_request(frame, 6);
+  const double T = -45.0 + 175.0 * ((frame[0] << 8) | frame[1]) / 65535.0;
+  const double H = 100.0 * ((frame[3] << 8) | frame[4]) / 65535.0;
+  check(valid(frame) && fabs(T - 25.0) < 0.01 && fabs(H - 40.0) < 0.01, "sht3x single shot reads the setpoints");
+
+  // Fetch Data before any periodic command has nothing to fetch, and no
+  // period to count measurements by
+  send(sht::SHT3x_FETCH_DATA);
+  Wire1.host_request(frame, 6);
+  check(busy(frame), "sht3x Fetch Data outside periodic mode answers busy");
+
+  // Setpoints past the measurement range read as its ends
+  sensor.set_state(-100.0, 150.0);
+  send(sht::SHT3x_SINGLE_STRETCH_HIGH);
+  Wire1.host_request(frame, 6);
+  const bool high = valid(frame) && frame[0] == 0x00 && frame[1] == 0x00 && frame[3] == 0xFF && frame[4] == 0xFF;
+  sensor.set_T(200.0);
+  sensor.set_H(-10.0);
+  send(sht::SHT3x_SINGLE_STRETCH_HIGH);
+  Wire1.host_request(frame, 6);
+  check(high && valid(frame) && frame[0] == 0xFF && frame[1] == 0xFF && frame[3] == 0x00 && frame[4] == 0x00,
+        "sht3x setpoints are held to the measurement range");
+  sensor.set_T(25.0);
+  sensor.set_H(40.0);
+
+  // Without clock stretching a single shot is busy for its duration
+  sensor.set_timing(true);
+  {
+    const uint32_t start = micros();
+    send(sht::SHT3x_SINGLE_LOW);
+    const uint32_t sent = micros();
+    Wire1.host_request(frame, 6);
+    const bool early = busy(frame);
+    const bool late = micros() - start >= sht::Sht3x::measurement_us(sht::SHT3x_SINGLE_LOW);
+    wait_until(sent, sht::Sht3x::measurement_us(sht::SHT3x_SINGLE_LOW));
+    Wire1.host_request(frame, 6);
+    check((early || late) && valid(frame), "sht3x single shot is busy until the measurement is done");
+
+    send(sht::SHT3x_SINGLE_STRETCH_LOW);
+    Wire1.host_request(frame, 6);
+    check(valid(frame), "sht3x clock stretching single shot answers at once");
+  }
+
+  // 10 measurements per second: each one can be fetched once, after its duration
+  {
+    const uint32_t period = sht::Sht3x::period_us(sht::SHT3x_PERIODIC_10_HIGH);
+    const uint32_t duration = sht::Sht3x::measurement_us(sht::SHT3x_PERIODIC_10_HIGH);
+    const uint32_t start = micros();
+    send(sht::SHT3x_PERIODIC_10_HIGH);
+    const uint32_t sent = micros();
+    send(sht::SHT3x_FETCH_DATA);
+    Wire1.host_request(frame, 6);
+    const bool early = busy(frame) || micros() - start >= duration;
+    wait_until(sent, duration);
+    send(sht::SHT3x_FETCH_DATA);
+    Wire1.host_request(frame, 6);
+    const bool first = valid(frame);
+    send(sht::SHT3x_FETCH_DATA);
+    Wire1.host_request(frame, 6);
+    const bool again = busy(frame) || micros() - start >= duration + period;
+    wait_until(sent, duration + period);
+    send(sht::SHT3x_FETCH_DATA);
+    Wire1.host_request(frame, 6);
+    const bool second = valid(frame);
+    check(period == 100000 && early && first && again && second,
+          "sht3x periodic mode serves each measurement to one Fetch Data");
+
+    send(sht::SHT3x_SINGLE_HIGH);
+    const uint16_t refused = sensor.status();
+    send(sht::SHT3x_BREAK);
+    send(sht::SHT3x_FETCH_DATA);
+    Wire1.host_request(frame, 6);
+    check((refused & sht::SHT3x_STATUS_COMMAND_FAILED) && busy(frame),
+          "sht3x periodic mode refuses single shots until Break");
+  }
+  sensor.set_timing(false);
+
+  check(sht::Sht3x::period_us(sht::SHT3x_ART) == 250000 && sht::Sht3x::period_us(sht::SHT3x_PERIODIC_05_LOW) == 2000000,
+        "sht3x ART and 0.5 mps periods");
+
+  send(sht::SHT3x_SOFTRESET);
+  check(sensor.status() == sht::SHT3x_STATUS_POWER_ON, "sht3x soft reset restores the power on status");
+
+  send(sht::SHT3x_PERIODIC_4_HIGH);
+  run("sht3x::on_wire_receive (Fetch Data)", Cost::Integer, 1000000, [](uint32_t) {
+    send(sht::SHT3x_FETCH_DATA);
+  });
+
+  run("sht3x::on_wire_request (Fetch Data)", Cost::Integer, 1000000, [](uint32_t) {
+    do_not_optimize(Wire1.host_request(nullptr, 6));
+  });
+  send(sht::SHT3x_BREAK);
+
+  sensor.end();
+}
+
+} // namespace bench
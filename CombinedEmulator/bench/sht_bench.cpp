@@ -0,0 +1,221 @@
+#include "bench.hpp"
+#include "sht.hpp"
+#include <Wire.h>
+#include <cmath>
+#include <cstdio>
+
+namespace bench {
+
+void sht_suite() {
+  section("SHT4x emulator");
+
+  sht::Sht4xEmulator<Wire1> sensor(sht::SHT4x_DEFAULT_ADDR, 18, 19);
+  sensor.init();
+  sensor.begin();
+
+  // Each instance reports its own serial number
+  {
+    sht::Sht4xEmulator<Wire> other(sht::SHT4x_ADDR_B, 16, 17, 0x12345678);
+    other.init();
+    other.begin();
+
+    const uint8_t command = sht::SHT4x_READSERIAL;
+    uint8_t first[6];
+    uint8_t second[6];
+    Wire1.host_receive(&command, 1);
+    Wire1.host_request(first, 6);
+    Wire.host_receive(&command, 1);
+    Wire.host_request(second, 6);
+    check(first[0] == 0x0E && first[1] == 0xFE && first[3] == 0x7F && first[4] == 0xBF &&
+            second[0] == 0x12 && second[1] == 0x34 && second[3] == 0x56 && second[4] == 0x78 &&
+            second[2] == sht::crc8(second, 2) && second[5] == sht::crc8(second + 3, 2),
+          "sht instances on Wire and Wire1 report their own serial number");
+    other.end();
+  }
+
+  printf("  %-40s %10zu bytes\n", "sizeof(Sht4xEmulator<Wire1>)", sizeof(sensor));
+
+  // Setpoints past the range of the ticks read as its ends
+  {
+    uint8_t low[6];
+    uint8_t high[6];
+    sensor.set_state(-100.0, -50.0);
+    Wire1.host_receive(&sht::SHT4x_NOHEAT_HIGHPRECISION, 1);
+    Wire1.host_request(low, 6);
+    sensor.set_state(200.0, 150.0);
+    Wire1.host_receive(&sht::SHT4x_NOHEAT_HIGHPRECISION, 1);
+    Wire1.host_request(high, 6);
+    check(low[0] == 0x00 && low[1] == 0x00 && low[3] == 0x00 && low[4] == 0x00 && high[0] == 0xFF &&
+            high[1] == 0xFF && high[3] == 0xFF && high[4] == 0xFF,
+          "sht setpoints are held to the range of the ticks");
+  }
+
+  // Repeatability noise of each precision, 3 sigma in the datasheet
+  sensor.set_T(25.0);
+  sensor.set_H(50.0);
+  sensor.set_noise(true);
+  const struct {
+    uint8_t command;
+    double T;
+    double H;
+  } precisions[] = {
+    {sht::SHT4x_NOHEAT_HIGHPRECISION, 0.04, 0.08},
+    {sht::SHT4x_NOHEAT_MEDPRECISION, 0.07, 0.15},
+    {sht::SHT4x_NOHEAT_LOWPRECISION, 0.10, 0.25},
+  };
+  for (const auto &precision : precisions) {
+    constexpr int N = 20000;
+    double sum_T = 0, squares_T = 0, sum_H = 0, squares_H = 0;
+    for (int i = 0; i < N; ++i) {
+      uint8_t frame[6];
+      Wire1.host_receive(&precision.command, 1);
+      Wire1.host_request(frame, 6);
+      sensor.update(micros());
+      const double T = ((frame[0] << 8) | frame[1]) * 175.0 / 65535.0 - 45.0;
+      const double H = ((frame[3] << 8) | frame[4]) * 125.0 / 65535.0 - 6.0;
+      sum_T += T;
+      squares_T += T * T;
+      sum_H += H;
+      squares_H += H * H;
+    }
+    const double sd_T = sqrt(squares_T / N - (sum_T / N) * (sum_T / N));
+    const double sd_H = sqrt(squares_H / N - (sum_H / N) * (sum_H / N));
+    printf("  command 0x%02X repeatability (3 sigma) %.3f degC %.3f %%RH\n", precision.command, 3 * sd_T, 3 * sd_H);
+    check(fabs(3 * sd_T - precision.T) < 0.15 * precision.T && fabs(3 * sd_H - precision.H) < 0.15 * precision.H,
+          "sht noise matches the datasheet repeatability");
+  }
+  const uint8_t measure = sht::SHT4x_NOHEAT_HIGHPRECISION;
+  const bool idle = sensor.update(micros());
+  Wire1.host_receive(&measure, 1);
+  Wire1.host_request(nullptr, 6);
+  check(!idle && sensor.update(micros()) && !sensor.update(micros()), "sht noise is redrawn once per measurement");
+  sensor.set_noise(false);
+
+  // Measurement duration, with reads answered busy until it has passed
+  check(sht::Sht4x::measurement_us(sht::SHT4x_NOHEAT_HIGHPRECISION) == 8300 &&
+          sht::Sht4x::measurement_us(sht::SHT4x_NOHEAT_MEDPRECISION) == 4500 &&
+          sht::Sht4x::measurement_us(sht::SHT4x_NOHEAT_LOWPRECISION) == 1600 &&
+          sht::Sht4x::measurement_us(sht::SHT4x_HIGHHEAT_1S) == 1100000 &&
+          sht::Sht4x::measurement_us(sht::SHT4x_LOWHEAT_100MS) == 110000 &&
+          sht::Sht4x::measurement_us(sht::SHT4x_READSERIAL) == 0,
+        "sht measurement durations from the datasheet");
+
+  sensor.set_timing(true);
+  {
+    const uint8_t command = sht::SHT4x_NOHEAT_LOWPRECISION;
+    uint8_t early[6];
+    uint8_t ready[6];
+    const uint32_t busy = sensor.busy_reads();
+    const uint32_t start = micros();
+    Wire1.host_receive(&command, 1);
+    const uint32_t sent = micros();
+    Wire1.host_request(early, 6);
+    const bool answered_early = micros() - start >= 1600;
+    while (micros() - sent < 1600) {
+    }
+    Wire1.host_request(ready, 6);
+    check(answered_early || (early[0] == 0xFF && early[2] != sht::crc8(early, 2) && sensor.busy_reads() == busy + 1 &&
+                             ready[2] == sht::crc8(ready, 2) && ready[5] == sht::crc8(ready + 3, 2)),
+          "sht reads are busy until the measurement is done");
+  }
+  sensor.set_timing(false);
+
+  // A 1 s pulse at 200 mW heats the die, which then cools back to the setpoint
+  {
+    const uint8_t command = sht::SHT4x_HIGHHEAT_1S;
+    uint8_t frame[6];
+    Wire1.host_receive(&command, 1);
+    Wire1.host_request(frame, 6);
+    const bool busy = frame[0] == 0xFF && frame[1] == 0xFF;
+    const uint32_t start = micros();
+    sensor.update(start);
+    Wire1.host_request(frame, 6);
+    const double T = ((frame[0] << 8) | frame[1]) * 175.0 / 65535.0 - 45.0;
+    const double H = ((frame[3] << 8) | frame[4]) * 125.0 / 65535.0 - 6.0;
+    const double pulse = sensor.heater_excess();
+    sensor.update(start + 1000000 + 3000000);
+    const double cooled = sensor.heater_excess();
+    sensor.update(start + 1000000 + 20000000);
+    printf("  after SHT4x_HIGHHEAT_1S %.2f degC %.2f %%RH, +%.2f K 3 s later\n", T, H, cooled);
+    check(busy && fabs(T - 25.0 - 50.0 * (1 - exp(-1.0))) < 0.1 && H < 50.0 * 0.2 && pulse > 30.0 &&
+            fabs(cooled - pulse * exp(-3.0)) < 0.1 && sensor.heater_excess() == 0,
+          "sht heater raises the temperature and the die cools afterwards");
+  }
+
+  // A setpoint within the resolution of the ticks already published leaves the frames as they are
+  {
+    sensor.set_T(25.0);
+    sensor.set_H(40.0);
+    const RecomputeStats before = sensor.frame_recomputes();
+    sensor.set_T(25.0001);
+    sensor.set_H(40.0);
+    const RecomputeStats after = sensor.frame_recomputes();
+    sensor.set_T(26.0);
+    check(after.done == before.done && after.avoided == before.avoided + 2 &&
+            sensor.frame_recomputes().done == before.done + 1,
+          "sht publishes frames only when the ticks change");
+  }
+
+  const uint8_t vector[] = {0xBE, 0xEF};
+  check(sht::crc8(vector, 2) == 0x92, "sht::crc8 datasheet vector 0xBE 0xEF -> 0x92");
+
+  // The table against the bit by bit formula of the datasheet, every pair of bytes
+  bool same = true;
+  for (uint32_t i = 0; i < 0x10000; ++i) {
+    const uint8_t data[] = {uint8_t(i >> 8), uint8_t(i)};
+    uint8_t crc = 0xFF;
+    for (uint8_t byte : data) {
+      crc ^= byte;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : (crc << 1);
+      }
+    }
+    same = same && sht::crc8(data, 2) == crc;
+  }
+  check(same, "sht::crc8 table matches the bitwise CRC for all 2 byte inputs");
+
+  run("sht::crc8 (2 bytes)", Cost::Integer, 2000000, [](uint32_t i) {
+    const uint8_t data[] = {uint8_t(i >> 8), uint8_t(i)};
+    do_not_optimize(sht::crc8(data, 2));
+  });
+
+  run("sht::is_measure_command (every byte)", Cost::Integer, 2000000, [](uint32_t i) {
+    do_not_optimize(sht::is_measure_command(int16_t(i & 0xFF)));
+  });
+
+  run("sht::set_T", Cost::Float, 1000000, [&](uint32_t i) {
+    sensor.set_T(15.0 + (i % 200) * 0.05);
+  });
+
+  run("sht::set_H", Cost::Float, 1000000, [&](uint32_t i) {
+    sensor.set_H(20.0 + (i % 600) * 0.1);
+  });
+
+  run("sht::set_H (unchanged)", Cost::Float, 1000000, [&](uint32_t) {
+    sensor.set_H(40.0);
+  });
+
+  run("sht::on_wire_receive (command)", Cost::Integer, 1000000, [](uint32_t) {
+    const uint8_t command = sht::SHT4x_NOHEAT_HIGHPRECISION;
+    Wire1.host_receive(&command, 1);
+  });
+
+  run("sht::on_wire_request (measurement)", Cost::Integer, 1000000, [](uint32_t) {
+    do_not_optimize(Wire1.host_request(nullptr, 6));
+  });
+
+  run("sht::measure command and read", Cost::Integer, 1000000, [&](uint32_t) {
+    const uint8_t command = sht::SHT4x_NOHEAT_HIGHPRECISION;
+    Wire1.host_receive(&command, 1);
+    do_not_optimize(Wire1.host_request(nullptr, 6));
+  });
+
+  uint32_t t = micros();
+  run("sht::update (nothing due)", Cost::Integer, 2000000, [&](uint32_t) {
+    do_not_optimize(sensor.update(t));
+  });
+
+  sensor.end();
+}
+
+} // namespace bench
@@ -0,0 +1,157 @@
+#include "bench.hpp"
+#include "host_command.hpp"
+#include "host_protocol.hpp"
+#include "sim_clock.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// The simulation clock against a host syncing it every 2 s at a time scale of
+// 15, the device's crystal off by drift_ppm and the host's latency spread
+// over jitter_us.
+namespace bench {
+
+namespace {
+
+constexpr uint32_t Scale = 15000;
+constexpr uint64_t SyncEveryUs = 2000000;
+constexpr uint32_t LatencyUs = 2000;
+// Where micros() was at the host's time 0, so the runs cross its wrap
+constexpr uint32_t DeviceStartUs = 0xF0000000u;
+
+struct Run {
+  // Stamp errors in simulation us once the drift is measured
+  double worst_us = 0;
+  double rms_us = 0;
+  // Error of a clock set once and never corrected, at the end
+  double uncorrected_us = 0;
+  bool monotonic = true;
+  double drift_ppm = 0;
+};
+
+uint32_t device_us(double host_us, double drift_ppm) {
+  return DeviceStartUs + uint32_t(uint64_t(host_us * (1 + drift_ppm * 1e-6)));
+}
+
+Run simulate(double drift_ppm, uint32_t jitter_us, uint32_t minutes) {
+  Run run;
+  SimClock clock;
+  uint32_t seed = 12345;
+  const auto random = [&seed](uint32_t range) {
+    seed = seed * 1664525 + 1013904223;
+    return range ? (seed >> 8) % range : 0;
+  };
+  // The host adds the latency it expects to the time it sends
+  const double expected_us = LatencyUs + jitter_us / 2.0;
+  const uint64_t end_us = uint64_t(minutes) * 60000000;
+  uint64_t last_stamp = 0;
+  double squares = 0;
+  uint32_t samples = 0;
+  for (uint64_t sent = 0; sent < end_us; sent += SyncEveryUs) {
+    const double arrived = double(sent) + LatencyUs + random(jitter_us);
+    clock.sync(uint64_t((sent + expected_us) * Scale / 1000), Scale, device_us(arrived, drift_ppm));
+
+    // Edges and reads until the next sync, in order
+    double at = arrived;
+    for (int i = 0; i < 20; ++i) {
+      at += random(SyncEveryUs / 20);
+      const uint64_t stamp = clock.to_sim_us(device_us(at, drift_ppm));
+      run.monotonic = run.monotonic && stamp >= last_stamp;
+      last_stamp = stamp;
+      if (sent < 60000000) {
+        continue;
+      }
+      const double error = double(stamp) - at * Scale / 1000;
+      run.worst_us = std::max(run.worst_us, std::fabs(error));
+      squares += error * error;
+      ++samples;
+    }
+  }
+  run.rms_us = std::sqrt(squares / samples);
+  run.uncorrected_us = double(end_us) * drift_ppm * 1e-6 * Scale / 1000;
+  run.drift_ppm = clock.drift_ppm();
+  return run;
+}
+
+} // namespace
+
+void sim_clock_suite() {
+  section("Simulation clock");
+
+  // Exact at the scale between syncs, and across the wrap of micros()
+  {
+    SimClock clock;
+    clock.sync(3600000000ull, Scale, 0xFFFFF000u);
+    const bool exact = clock.to_sim_us(0xFFFFF000u + 1000000) == 3600000000ull + 15000000 &&
+                       clock.to_sim_us(0xFFFFF000u) == 3600000000ull;
+    check(exact && clock.synced() && clock.steps() == 1, "sim clock runs at the scale from a sync");
+  }
+
+  // A small offset is slewed out without running backwards, a large one or a
+  // new scale is stepped to, and a held clock stays put
+  {
+    SimClock clock;
+    clock.sync(0, Scale, 0);
+    const uint64_t before = clock.to_sim_us(2000000);
+    clock.sync(30000000 - 60000, Scale, 2000000);
+    const uint64_t after = clock.to_sim_us(2000000);
+    const uint64_t slewed = clock.to_sim_us(2000000 + SimClock::SlewUs);
+    // To the us, the slew rate being fixed point
+    const bool slew = after == before && slewed + 1 >= 30000000 - 30000 + 15000000 &&
+                      slewed <= 30000000 - 30000 + 15000000 && clock.steps() == 1;
+    clock.sync(7200000000ull, Scale, 3000000);
+    const bool stepped = clock.to_sim_us(3000000) == 7200000000ull && clock.steps() == 2;
+    clock.sync(7300000000ull, 0, 4000000);
+    const bool held = clock.to_sim_us(9000000) == 7300000000ull && clock.steps() == 3;
+    check(slew && stepped && held, "sim clock slews small offsets, steps to large ones and holds at scale 0");
+  }
+
+  // Drift is measured and taken out, stamps never run backwards
+  const Run drifting = simulate(40, 3000, 60);
+  check(drifting.monotonic && std::fabs(drifting.drift_ppm - 40) < 2 && drifting.worst_us < 60000,
+        "sim clock takes out a 40 ppm crystal and never runs backwards");
+  const Run still = simulate(0, 0, 10);
+  check(still.worst_us < 1000, "sim clock stays within 1 ms of a steady host");
+
+  // The wire forms
+  {
+    protocol::Frame frame;
+    protocol::ClockSyncPayload{0x0000123456789ABCull, 15000}.put(frame);
+    protocol::ClockSyncPayload sync;
+    const bool clock_frame = sync.get(frame) && sync.sim_us == 0x0000123456789ABCull && sync.scale_milli == 15000;
+    protocol::SimEventsPayload events = {};
+    events.count = protocol::SimEventsPayload::MaxEvents;
+    for (int i = 0; i < events.count; ++i) {
+      events.events[i] = {uint8_t(i), 31536000000000ull + i};
+    }
+    events.put(frame);
+    protocol::SimEventsPayload read;
+    const bool events_frame = frame.length <= protocol::MaxPayload && read.get(frame) && read.count == 7 &&
+                              read.events[6].value == 6 && read.events[6].sim_us == 31536000000006ull;
+
+    HostCommandReader reader;
+    bool complete = false;
+    for (const char *c = "{\"sim_time\": 86400.25, \"sim_scale\": 15}"; *c; ++c) {
+      complete = reader.feed(*c);
+    }
+    const HostCommand &command = reader.command();
+    const bool json = complete && command.has_sim_time && command.sim_time == 86400.25 && command.has_sim_scale &&
+                      command.sim_scale == 15;
+    check(clock_frame && events_frame && json, "clock syncs and sim time events round trip");
+  }
+
+  {
+    SimClock clock;
+    clock.sync(0, Scale, 0);
+    run("SimClock::to_sim_us", Cost::Integer, 1000000, [&](uint32_t i) { do_not_optimize(clock.to_sim_us(i * 97)); });
+  }
+
+  printf("  %-40s %10.1f ms worst, %.1f ms rms, in simulation time, 3 ms jitter\n", "edge stamp error",
+         drifting.worst_us / 1000, drifting.rms_us / 1000);
+  printf("  %-40s %10.1f ms after an hour uncorrected at 40 ppm, %.0f ms placed by 30 s step\n", "",
+         drifting.uncorrected_us / 1000, 30000.0);
+  printf("  %-40s %10.1f ppm measured of 40\n", "crystal drift", drifting.drift_ppm);
+}
+
+} // namespace bench
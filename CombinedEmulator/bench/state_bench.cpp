@@ -0,0 +1,103 @@
+#include "bench.hpp"
+#include "bme.hpp"
+#include "humidity_correction.hpp"
+#include "sht.hpp"
+#include <Wire.h>
+#include <cmath>
+#include <cstring>
+
+namespace bench {
+
+namespace {
+
+// The data registers after a forced conversion at x1
+void convert(bme::Bme280 &sensor, uint8_t *data) {
+  const uint8_t forced[] = {bme::BME280_REGISTER_CONTROLHUMID, 0x01, bme::BME280_REGISTER_CONTROL, 0x25};
+  Wire.host_receive(forced, sizeof(forced));
+  sensor.update(micros() + 1000000);
+  const uint8_t reg = bme::BME280_REGISTER_PRESSUREDATA;
+  Wire.host_receive(&reg, 1);
+  Wire.host_request(data, 8);
+}
+
+} // namespace
+
+void state_suite() {
+  section("Batched state updates");
+
+  bme::Bme280Emulator<Wire> bme280(bme::BME280_ADDRESS, 16, 17);
+  sht::Sht4xEmulator<Wire1> sht4x(sht::SHT4x_DEFAULT_ADDR, 18, 19);
+  bme280.init();
+  sht4x.init();
+  bme280.begin();
+  sht4x.begin();
+
+  HumidityCorrection correction;
+  correction.load(HumidityFitGrid::T, HumidityFitGrid::H, HumidityFit.values);
+
+  // The SHT4x publishes one set of frames for both setpoints, rather than one
+  // with the new temperature and the old humidity first
+  {
+    const uint32_t before = sht4x.frame_recomputes().done;
+    sht4x.set_T(30.0);
+    sht4x.set_H(60.0);
+    const uint32_t separate = sht4x.frame_recomputes().done - before;
+    sht4x.set_state(25.0, 45.0);
+    check(separate == 2 && sht4x.frame_recomputes().done - before == 3 && fabs(sht4x.get_T() - 25.0) < 0.01 &&
+            fabs(sht4x.get_H() - 45.0) < 0.01,
+          "sht set_state publishes both setpoints at once");
+  }
+
+  // The BME280 reads the same registers either way, computing adc_H once
+  {
+    uint8_t separate[8];
+    uint8_t batched[8];
+    bme280.set_state_milli(20000, 30000, 100000000);
+    bme280.set_T_milli(27500);
+    const uint32_t before = bme280.recomputes().adc_H.done;
+    bme280.set_H_milli(55000);
+    bme280.set_P_milli(98000000);
+    const uint32_t after_H = bme280.recomputes().adc_H.done;
+    convert(bme280, separate);
+
+    bme280.set_state_milli(20000, 30000, 100000000);
+    const uint32_t start = bme280.recomputes().adc_H.done;
+    bme280.set_state_milli(27500, 55000, 98000000);
+    const uint32_t batched_H = bme280.recomputes().adc_H.done - start;
+    convert(bme280, batched);
+    check(memcmp(separate, batched, 8) == 0 && after_H - before == 1 && batched_H == 1,
+          "bme set_state matches the separate setters with one adc_H recompute");
+  }
+
+  // What a host update costs for both sensors, the way main fans it out:
+  // set_T and then set_H, each reapplying the humidity correction, against
+  // one set_state
+  const auto adjusted = [](double T) { return (T + 4.3766) / 0.9861; };
+  run("set_T then set_H (both sensors)", Cost::Float, 500000, [&](uint32_t i) {
+    const double T = 15.0 + (i % 200) * 0.05;
+    const double H = 20.0 + (i % 600) * 0.1;
+    const int32_t T_milli = lround(T * 1000);
+    const int32_t old_H = correction.apply(T_milli, 45000);
+    sht4x.set_T(adjusted(T));
+    bme280.set_T(adjusted(T));
+    sht4x.set_H(old_H / 1000.0);
+    bme280.set_H_milli(old_H);
+    const int32_t new_H = correction.apply(T_milli, lround(H * 1000));
+    sht4x.set_H(new_H / 1000.0);
+    bme280.set_H_milli(new_H);
+  });
+
+  run("set_state (both sensors)", Cost::Float, 500000, [&](uint32_t i) {
+    const double T = 15.0 + (i % 200) * 0.05;
+    const double H = 20.0 + (i % 600) * 0.1;
+    const int32_t T_milli = lround(T * 1000);
+    const int32_t new_H = correction.apply(T_milli, lround(H * 1000));
+    sht4x.set_state(adjusted(T), new_H / 1000.0);
+    bme280.set_state_milli(lround(adjusted(T) * 1000), new_H, 101325000);
+  });
+
+  sht4x.end();
+  bme280.end();
+}
+
+} // namespace bench
@@ -0,0 +1,197 @@
+#include "bench.hpp"
+#include "host_command.hpp"
+#include "host_protocol.hpp"
+#include "trajectory.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Trajectory playback, from memory as the device plays it from flash, with
+// the ticks' times given rather than read from the clock.
+namespace bench {
+
+namespace {
+
+class MemoryTrajectory : public TrajectorySource {
+public:
+  std::vector<TrajectoryPoint> points;
+
+  uint32_t size() const override { return uint32_t(points.size()); }
+  bool read(uint32_t index, TrajectoryPoint &point) override {
+    if (index >= points.size()) {
+      return false;
+    }
+    point = points[index];
+    return true;
+  }
+};
+
+constexpr uint8_t AllFields = TrajectoryPoint::HasT | TrajectoryPoint::HasH | TrajectoryPoint::HasP;
+
+TrajectoryControl command(uint8_t flags, uint32_t seek_s = 0, uint32_t scale_milli = 0) {
+  return TrajectoryControl{flags, seek_s, scale_milli, 0, 0, 0};
+}
+
+// A day of 30 s steps, the temperature swinging 4 degC, as BOPTEST gives it
+MemoryTrajectory day() {
+  MemoryTrajectory trajectory;
+  for (uint32_t i = 0; i <= 2880; ++i) {
+    const int32_t T = 20000 + int32_t(2000 * ((i % 480) < 240 ? (i % 240) / 240.0 : 1 - (i % 240) / 240.0));
+    trajectory.points.push_back(TrajectoryPoint{i * 30, T, 45000, 101325000});
+  }
+  return trajectory;
+}
+
+} // namespace
+
+void trajectory_suite() {
+  section("Trajectory playback");
+
+  TrajectoryPoint out;
+
+  // Interpolation at real time, and at a time scale of 15
+  {
+    MemoryTrajectory source;
+    source.points = {{0, 20000, 40000, 100000000}, {100, 21000, 50000, 100000000}};
+    TrajectoryPlayer player;
+    player.load(source, AllFields, 1000);
+    player.control(command(TrajectoryControl::Play), 1000);
+    const bool half = player.tick(51000, out) && out.T_milli == 20500 && out.H_milli == 45000;
+    player.control(command(TrajectoryControl::Scale, 0, 15000), 51000);
+    const bool scaled = player.tick(53000, out) && player.position_ms() == 80000 && out.T_milli == 20800;
+    check(half && scaled, "trajectory interpolates at real time and at a time scale");
+  }
+
+  // Ticks of 3 ms at a third of real time lose no time to rounding
+  {
+    MemoryTrajectory source;
+    source.points = {{0, 0, 0, 0}, {3600, 3600000, 0, 0}};
+    TrajectoryPlayer player;
+    player.load(source, AllFields, 0);
+    player.control(TrajectoryControl{TrajectoryControl::Play | TrajectoryControl::Scale, 0, 333, 0, 0, 0}, 0);
+    for (uint32_t now = 3; now <= 30000; now += 3) {
+      player.tick(now, out);
+    }
+    check(player.position_ms() == 9990, "trajectory carries the fraction of a ms between ticks");
+  }
+
+  // Pause holds, seek goes back, and offsets are added
+  {
+    MemoryTrajectory source = day();
+    TrajectoryPlayer player;
+    player.load(source, AllFields, 0);
+    player.control(command(TrajectoryControl::Play | TrajectoryControl::Scale, 0, 1000000), 0);
+    player.tick(60, out);
+    player.control(command(TrajectoryControl::Pause), 60);
+    const uint64_t paused = player.position_ms();
+    const bool held = !player.tick(5000, out) && player.position_ms() == paused && paused == 60000;
+    player.control(TrajectoryControl{TrajectoryControl::Seek | TrajectoryControl::Offsets, 7215, 0, 500, -1000, 0},
+                   5000);
+    // Half way from point 240 to 241
+    const int32_t from = source.points[240].T_milli;
+    const int32_t halfway = from + (source.points[241].T_milli - from) / 2;
+    const bool sought = player.tick(5000, out) && out.T_milli == halfway + 500 && out.H_milli == 44000;
+    check(held && player.state() == TrajectoryPlayer::State::Paused && sought,
+          "trajectory pauses, seeks back and adds offsets");
+  }
+
+  // Held at the first point before the start, and at the last at the end
+  {
+    MemoryTrajectory source;
+    source.points = {{60, 18000, 0, 0}, {120, 19000, 0, 0}};
+    TrajectoryPlayer player;
+    player.load(source, AllFields, 0);
+    player.control(command(TrajectoryControl::Play), 0);
+    const bool before = player.tick(30000, out) && out.T_milli == 18000;
+    player.tick(200000, out);
+    const bool after = out.T_milli == 19000 && player.state() == TrajectoryPlayer::State::Finished &&
+                       player.position_ms() == 120000;
+    player.control(command(TrajectoryControl::Seek | TrajectoryControl::Play, 90), 200000);
+    check(before && after && player.tick(200000, out) && out.T_milli == 18500 &&
+            player.state() == TrajectoryPlayer::State::Playing,
+          "trajectory holds its ends, and plays again after a seek");
+  }
+
+  // Playing through reads each point about once, however the ticks fall
+  {
+    MemoryTrajectory source = day();
+    TrajectoryPlayer player;
+    player.load(source, AllFields, 0);
+    player.control(command(TrajectoryControl::Play | TrajectoryControl::Scale, 0, 15000), 0);
+    uint32_t now = 0;
+    uint32_t seed = 99;
+    while (player.state() == TrajectoryPlayer::State::Playing) {
+      seed = seed * 1664525 + 1013904223;
+      now += 150 + (seed >> 24) % 100;
+      player.tick(now, out);
+    }
+    check(player.reads() < source.size() + 16 && out.T_milli == source.points.back().T_milli,
+          "trajectory reads each point about once playing through");
+  }
+
+  // Control from the JSON channel
+  {
+    HostCommandReader reader;
+    const char *message = "{\"trajectory\": {\"play\": true, \"scale\": 15, \"seek\": 3600, \"offset_T\": -0.25}}";
+    bool complete = false;
+    for (const char *c = message; *c; ++c) {
+      complete = reader.feed(*c);
+    }
+    const TrajectoryControl &control = reader.command().trajectory;
+    check(complete && reader.command().has_trajectory &&
+            control.flags == (TrajectoryControl::Play | TrajectoryControl::Scale | TrajectoryControl::Seek |
+                              TrajectoryControl::Offsets) &&
+            control.scale_milli == 15000 && control.seek_s == 3600 && control.offset_T_milli == -250,
+          "trajectory commands are read from JSON");
+  }
+
+  // The sensor signal, against the host pushing each 30 s step at a time
+  // scale of 15 with its latency spread over 0 to 500 ms: the host's
+  // staircase is off by a step's change plus the latency, where the
+  // trajectory is off by its tick.
+  {
+    MemoryTrajectory source = day();
+    TrajectoryPlayer player;
+    player.load(source, AllFields, 0);
+    player.control(command(TrajectoryControl::Play | TrajectoryControl::Scale, 0, 15000), 0);
+    uint32_t seed = 7;
+    int32_t trajectory_worst = 0;
+    int32_t pushed_worst = 0;
+    for (uint32_t now = 200; now < 2000 * 2880; now += 200) {
+      player.tick(now, out);
+      const uint64_t position = uint64_t(now) * 15;
+      const uint32_t step = uint32_t(position / 30000);
+      const int32_t ideal = source.points[step].T_milli +
+                            int32_t((int64_t(source.points[step + 1].T_milli) - source.points[step].T_milli) *
+                                    int64_t(position - step * 30000ull) / 30000);
+      seed = seed * 1664525 + 1013904223;
+      const uint32_t latency = (seed >> 8) % 500;
+      const uint32_t pushed_step = uint32_t((position > latency * 15 ? position - latency * 15 : 0) / 30000);
+      trajectory_worst = std::max(trajectory_worst, std::abs(out.T_milli - ideal));
+      pushed_worst = std::max(pushed_worst, std::abs(source.points[pushed_step].T_milli - ideal));
+    }
+    printf("  %-40s %10.3f degC worst from the trajectory, %.3f pushed per step\n", "sensor signal error",
+           trajectory_worst / 1000.0, pushed_worst / 1000.0);
+  }
+
+  {
+    MemoryTrajectory source = day();
+    TrajectoryPlayer player;
+    player.load(source, AllFields, 0);
+    player.control(command(TrajectoryControl::Play | TrajectoryControl::Scale, 0, 15000), 0);
+    run("TrajectoryPlayer::tick (200 ms, x15)", Cost::Integer, 200000, [&](uint32_t i) {
+      if (player.state() != TrajectoryPlayer::State::Playing) {
+        player.control(command(TrajectoryControl::Seek | TrajectoryControl::Play, 0), i * 200);
+      }
+      do_not_optimize(player.tick(i * 200, out));
+    });
+  }
+
+  // The upload framing, points per frame and the frames a day takes
+  constexpr int PerFrame = protocol::TrajectoryPointsPerFrame;
+  printf("  %-40s %10d points/frame, %d frames for a day of 30 s steps\n", "trajectory upload", PerFrame,
+         (2881 + PerFrame - 1) / PerFrame);
+}
+
+} // namespace bench
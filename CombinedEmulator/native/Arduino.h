@@ -0,0 +1,67 @@
+#ifndef NATIVE_ARDUINO_INCLUDED
+#define NATIVE_ARDUINO_INCLUDED
+
+// Minimal host stand-in for the Arduino core.
+// Only what the emulator sources use is provided, so the sensor code can be
+// built and benchmarked on Linux with the PlatformIO "native" environment.
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+typedef uint8_t byte;
+
+#define HEX 16
+#define DEC 10
+#define F(string_literal) (string_literal)
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+class Print {
+public:
+  virtual ~Print() = default;
+
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+
+  size_t print(const char *str);
+  size_t print(char c);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(int n, int base = DEC) { return print(long(n), base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(double n, int digits = 2);
+
+  size_t println(void);
+  template <typename T> size_t println(const T &value) { return print(value) + println(); }
+  template <typename T> size_t println(const T &value, int format) { return print(value, format) + println(); }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+};
+
+// Serial writes to stdout on the host. Nothing is ever available to read.
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long baud) { (void)baud; }
+  void setTX(int pin) { (void)pin; }
+  void setRX(int pin) { (void)pin; }
+
+  int available() override { return 0; }
+  int read() override { return -1; }
+  size_t write(uint8_t c) override;
+  using Print::write;
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+#endif // NATIVE_ARDUINO_INCLUDED
@@ -0,0 +1,72 @@
+#ifndef NATIVE_WIRE_INCLUDED
+#define NATIVE_WIRE_INCLUDED
+
+#include <Arduino.h>
+
+// Host stand-in for the Arduino TwoWire peripheral API, in target (slave) mode only.
+// The controller side of a transaction is driven from the host with
+// host_receive() and host_request(), which invoke the registered callbacks
+// the same way the Pico I2C interrupt handler would.
+class TwoWire : public Stream {
+public:
+  // The earlephilhower Pico core buffers 256 bytes per transaction
+  constexpr static size_t BufferSize = 256;
+
+  void setSDA(int pin) { (void)pin; }
+  void setSCL(int pin) { (void)pin; }
+  void begin() { address_ = 0; }
+  void begin(uint8_t address) { address_ = address; }
+  void end() { address_ = 0; }
+
+  void onReceive(void (*handler)(int)) { on_receive_ = handler; }
+  void onRequest(void (*handler)(void)) { on_request_ = handler; }
+
+  int available() override;
+  int read() override;
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+
+  // Host side of the bus, not part of the Arduino API
+
+  // Controller writes len bytes to this target
+  void host_receive(const uint8_t *data, size_t len);
+
+  // Controller reads len bytes from this target into out, which may be null.
+  // As on the RP2040, the request callback runs whenever the controller needs
+  // a byte and none is queued, so a target can serve a long read in chunks.
+  // Bytes left queued when the read ends are flushed, as a NACK does.
+  // Returns the number of bytes the target supplied, at most len.
+  size_t host_request(uint8_t *out, size_t len);
+
+  uint8_t address() const { return address_; }
+
+  // Request callbacks run, and bytes they queued, during the last host_request
+  size_t request_callbacks() const { return request_callbacks_; }
+  size_t bytes_queued() const { return bytes_queued_; }
+
+  // Most bytes queued by a single request callback during the last host_request.
+  // On the RP2040 anything past the 16 byte TX FIFO makes the callback spin
+  // until the controller clocks bytes out.
+  size_t max_queued_per_callback() const { return max_queued_per_callback_; }
+
+private:
+  uint8_t address_ = 0;
+  void (*on_receive_)(int) = nullptr;
+  void (*on_request_)(void) = nullptr;
+
+  uint8_t rx_[BufferSize];
+  size_t rx_length_ = 0;
+  size_t rx_index_ = 0;
+
+  uint8_t tx_[BufferSize];
+  size_t tx_length_ = 0;
+
+  size_t request_callbacks_ = 0;
+  size_t bytes_queued_ = 0;
+  size_t max_queued_per_callback_ = 0;
+};
+
+extern TwoWire Wire;
+extern TwoWire Wire1;
+
+#endif // NATIVE_WIRE_INCLUDED
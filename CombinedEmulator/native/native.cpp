@@ -0,0 +1,153 @@
+#include <Arduino.h>
+#include <Wire.h>
+#include <chrono>
+#include <thread>
+
+// Host implementations of the Arduino core stand-ins declared in Arduino.h and Wire.h
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+TwoWire Wire;
+TwoWire Wire1;
+
+namespace {
+
+const auto Epoch = std::chrono::steady_clock::now();
+
+} // namespace
+
+unsigned long millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - Epoch).count();
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - Epoch).count();
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size--) {
+    n += write(*buffer++);
+  }
+  return n;
+}
+
+size_t Print::print(const char *str) {
+  return write(reinterpret_cast<const uint8_t *>(str), strlen(str));
+}
+
+size_t Print::print(char c) {
+  return write(uint8_t(c));
+}
+
+size_t Print::print(long n, int base) {
+  if (base == 0) {
+    return write(uint8_t(n));
+  }
+  if (base == DEC) {
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "%ld", n);
+    return print(buffer);
+  }
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  if (base == 0) {
+    return write(uint8_t(n));
+  }
+  char buffer[24];
+  snprintf(buffer, sizeof(buffer), base == HEX ? "%lX" : "%lu", n);
+  return print(buffer);
+}
+
+size_t Print::print(double n, int digits) {
+  char buffer[48];
+  snprintf(buffer, sizeof(buffer), "%.*f", digits, n);
+  return print(buffer);
+}
+
+size_t Print::println(void) {
+  return print("\r\n");
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  return fputc(c, stdout) == EOF ? 0 : 1;
+}
+
+int TwoWire::available() {
+  return int(rx_length_ - rx_index_);
+}
+
+int TwoWire::read() {
+  if (rx_index_ >= rx_length_) {
+    return -1;
+  }
+  return rx_[rx_index_++];
+}
+
+size_t TwoWire::write(uint8_t c) {
+  if (tx_length_ >= BufferSize) {
+    return 0;
+  }
+  tx_[tx_length_++] = c;
+  return 1;
+}
+
+size_t TwoWire::write(const uint8_t *buffer, size_t size) {
+  const size_t n = size < BufferSize - tx_length_ ? size : BufferSize - tx_length_;
+  memcpy(tx_ + tx_length_, buffer, n);
+  tx_length_ += n;
+  return n;
+}
+
+void TwoWire::host_receive(const uint8_t *data, size_t len) {
+  rx_length_ = len < BufferSize ? len : BufferSize;
+  rx_index_ = 0;
+  memcpy(rx_, data, rx_length_);
+
+  if (on_receive_) {
+    on_receive_(int(rx_length_));
+  }
+}
+
+size_t TwoWire::host_request(uint8_t *out, size_t len) {
+  request_callbacks_ = 0;
+  bytes_queued_ = 0;
+  max_queued_per_callback_ = 0;
+
+  size_t supplied = 0;
+  size_t tx_index = 0;
+  tx_length_ = 0;
+
+  while (supplied < len) {
+    if (tx_index == tx_length_) {
+      tx_index = 0;
+      tx_length_ = 0;
+      if (on_request_) {
+        on_request_();
+      }
+      ++request_callbacks_;
+      bytes_queued_ += tx_length_;
+      if (tx_length_ > max_queued_per_callback_) {
+        max_queued_per_callback_ = tx_length_;
+      }
+      if (tx_length_ == 0) {
+        break;
+      }
+    }
+
+    const uint8_t c = tx_[tx_index++];
+    if (out) {
+      out[supplied] = c;
+    }
+    ++supplied;
+  }
+
+  tx_length_ = 0;
+  return supplied;
+}
@@ -1,160 +1,466 @@
 #include "bme.hpp"
-#include <Wire.h>
+#include "bme_compensation.hpp"
+#include "bme_registers.hpp"
 
 namespace bme {
 
-void init() {
+namespace {
+
+// What a skipped measurement reads as, see section 4.2.2 of the BME datasheet
+constexpr int32_t SkippedAdc20 = 0x80000;
+constexpr int32_t SkippedAdc16 = 0x8000;
+
+// Oversampling of each osrs_* setting, 0 when the measurement is skipped
+constexpr uint8_t Oversampling[8] = {0, 1, 2, 4, 8, 16, 16, 16};
+
+// Standby time of each config t_sb setting in normal mode, see table 27
+constexpr uint32_t StandbyUs[8] = {500, 62500, 125000, 250000, 500000, 1000000, 10000, 20000};
+
+byte osrs_t(byte ctrl_meas) {
+  return Oversampling[ctrl_meas >> 5];
+}
+
+byte osrs_p(byte ctrl_meas) {
+  return Oversampling[(ctrl_meas >> 2) & 0x7];
+}
+
+byte osrs_h(byte ctrl_hum) {
+  return Oversampling[ctrl_hum & 0x7];
+}
+
+// RMS noise relative to x1 for each osrs_* setting, in 1/256ths.
+// Temperature and pressure follow the datasheet noise tables, humidity
+// falls as the square root of the oversampling.
+constexpr uint16_t NoiseRatioT[8] = {0, 256, 205, 154, 128, 102, 102, 102};
+constexpr uint16_t NoiseRatioP[8] = {0, 256, 202, 163, 124, 101, 101, 101};
+constexpr uint16_t NoiseRatioH[8] = {0, 256, 181, 128, 91, 64, 64, 64};
+
+// RMS noise at x1, in 0.001 degC, 0.001 Pa and 0.001 %RH
+constexpr int32_t NoiseT_milli = 5;
+constexpr int32_t NoiseP_milli = 3300;
+constexpr int32_t NoiseH_milli = 20;
+
+// IIR filter coefficient of each config filter setting, as a power of two
+constexpr uint8_t FilterShift[8] = {0, 1, 2, 3, 4, 4, 4, 4};
+
+// True if the uint32 micros() timestamp now is at or past deadline, across wraps
+bool reached(uint32_t now, uint32_t deadline) {
+  return int32_t(now - deadline) >= 0;
+}
+
+// The last register of the shortest read a driver makes starting at each
+// address. The Wire API does not say how many bytes the controller clocks
+// out, so a request queues no more than every driver reads, and the auto
+// increment stays where the controller stopped. A longer read drains the
+// queue and fires the request again from there. The Bosch driver reads the
+// calibration as 26 bytes from 0x88 and 7 from 0xE1, and the measurement as
+// 8 bytes from 0xF7; the Adafruit one reads the calibration a word or a byte
+// at a time, and each measurement on its own, 3 bytes from 0xF7 and 0xFA
+// and 2 from 0xFD. Anything else is a single byte.
+struct BurstTable {
+  byte end[Bme280::RegisterSize];
+
+  constexpr BurstTable() : end() {
+    for (int reg = 0; reg < Bme280::RegisterSize; ++reg) {
+      end[reg] = reg;
+    }
+    for (int reg = BME280_REGISTER_DIG_T1; reg <= BME280_REGISTER_DIG_P9; reg += 2) {
+      fill(reg, reg + 1);
+    }
+    fill(BME280_REGISTER_DIG_H2, BME280_REGISTER_DIG_H2 + 1);
+    fill(BME280_REGISTER_PRESSUREDATA, BME280_REGISTER_PRESSUREDATA + 2);
+    fill(BME280_REGISTER_TEMPDATA, BME280_REGISTER_TEMPDATA + 2);
+    fill(BME280_REGISTER_HUMIDDATA, BME280_REGISTER_HUMIDDATA + 1);
+  }
+
+  constexpr void fill(int first, int last) {
+    for (int reg = first; reg <= last; ++reg) {
+      end[reg] = last;
+    }
+  }
+
+  constexpr byte operator[](byte reg) const { return end[reg]; }
+};
+
+constexpr BurstTable BurstEnd;
+
+static_assert(BurstEnd[BME280_REGISTER_DIG_T1] - BME280_REGISTER_DIG_T1 + 1 == 2, "calibration words are 2 bytes");
+static_assert(BurstEnd[BME280_REGISTER_DIG_H1] == BME280_REGISTER_DIG_H1, "dig_H1 is a single byte");
+static_assert(BurstEnd[BME280_REGISTER_TEMPDATA] - BME280_REGISTER_TEMPDATA + 1 == 3, "adc_T is 3 bytes");
+static_assert(BurstEnd[BME280_REGISTER_HUMIDDATA] - BME280_REGISTER_HUMIDDATA + 1 == 2, "adc_H is 2 bytes");
+static_assert(BurstEnd[BME280_REGISTER_CONTROL] == BME280_REGISTER_CONTROL, "ctrl_meas is a single byte");
+static_assert(BurstEnd[BME280_REGISTER_CHIPID] == BME280_REGISTER_CHIPID, "chip id is a single byte");
+
+} // namespace
+
+// Setpoints in thousandths of a degC, clamped to -40..85, of a %RH, clamped
+// to 0..100, and of a Pa
+int32_t Bme280::T_to_milli(double T) {
+  if (T > T_MILLI_MAX / 1000.0)
+     T = T_MILLI_MAX / 1000.0;
+  else if (T < T_MILLI_MIN / 1000.0)
+     T = T_MILLI_MIN / 1000.0;
+
+  return int32_t(lround(T * 1000.0));
+}
+
+uint32_t Bme280::H_to_milli(double H) {
+  if (H > 100.0)
+     H = 100.0;
+  else if (H < 0.0)
+     H = 0.0;
+
+  return uint32_t(lround(H * 1000.0));
+}
+
+uint32_t Bme280::P_to_milli(double P) {
+  return P > 0.0 ? uint32_t(lround(P * 1000.0)) : 0;
+}
+
+Bme280::Bme280(byte i2c_address)
+  : i2c_address_(i2c_address), registers_(), noise_(i2c_address), coefficients_(DefaultCalibration) {}
+
+void Bme280::init() {
   init_registers();
+  data_.reset(registers_ + BME280_REGISTER_PRESSUREDATA);
+  memcpy(sample_, registers_ + BME280_REGISTER_PRESSUREDATA, DataSize);
+
+  // Power on in sleep mode, as after a soft reset
+  latched_ctrl_hum_ = 0;
+  seen_triggers_.store(triggers_.load());
+  seen_resets_.store(resets_.load());
+  answered_.store(false);
+  measuring_.store(false);
+  sleeping_.store(true);
+  mode_ = Mode::Sleep;
+
+  // Loading the calibration stages these into the sample
+  temperature_setpoint_ = 22000;
+  humidity_setpoint_ = 50000;
+  load_calibration<DefaultCalibration>();
+}
+
+void Bme280::write_u16(byte reg, uint16_t value) {
+  registers_[reg] = value;
+  registers_[reg + 1] = value >> 8;
+}
+
+void Bme280::load_calibration(const Calibration &calibration) {
+  load_calibration(calibration, Coefficients(calibration));
+}
+
+void Bme280::load_calibration(const Calibration &calibration, const Coefficients &coefficients) {
+  coefficients_ = coefficients;
+  set_noise_scales();
+  stage_setpoints(coefficients_);
+
+  write_u16(BME280_REGISTER_DIG_T1, calibration.dig_T1);
+  write_u16(BME280_REGISTER_DIG_T2, calibration.dig_T2);
+  write_u16(BME280_REGISTER_DIG_T3, calibration.dig_T3);
+  write_u16(BME280_REGISTER_DIG_P1, calibration.dig_P1);
+  write_u16(BME280_REGISTER_DIG_P2, calibration.dig_P2);
+  write_u16(BME280_REGISTER_DIG_P3, calibration.dig_P3);
+  write_u16(BME280_REGISTER_DIG_P4, calibration.dig_P4);
+  write_u16(BME280_REGISTER_DIG_P5, calibration.dig_P5);
+  write_u16(BME280_REGISTER_DIG_P6, calibration.dig_P6);
+  write_u16(BME280_REGISTER_DIG_P7, calibration.dig_P7);
+  write_u16(BME280_REGISTER_DIG_P8, calibration.dig_P8);
+  write_u16(BME280_REGISTER_DIG_P9, calibration.dig_P9);
+  registers_[BME280_REGISTER_DIG_H1] = calibration.dig_H1;
+  write_u16(BME280_REGISTER_DIG_H2, calibration.dig_H2);
+  registers_[BME280_REGISTER_DIG_H3] = calibration.dig_H3;
+
+  // dig_H4 and dig_H5 are 12 bit values sharing the nibbles of 0xE5
+  registers_[BME280_REGISTER_DIG_H4] = calibration.dig_H4 >> 4;
+  registers_[BME280_REGISTER_DIG_H4 + 1] = (calibration.dig_H5 << 4) | (calibration.dig_H4 & 0xF);
+  registers_[BME280_REGISTER_DIG_H5 + 1] = calibration.dig_H5 >> 4;
+  registers_[BME280_REGISTER_DIG_H6] = calibration.dig_H6;
+}
+
+Calibration Bme280::read_calibration() const {
+  return Calibration{
+    dig_T1(), dig_T2(), dig_T3(),
+    uint16_t((registers_[BME280_REGISTER_DIG_P1 + 1] << 8) | registers_[BME280_REGISTER_DIG_P1]),
+    int16_t((registers_[BME280_REGISTER_DIG_P2 + 1] << 8) | registers_[BME280_REGISTER_DIG_P2]),
+    int16_t((registers_[BME280_REGISTER_DIG_P3 + 1] << 8) | registers_[BME280_REGISTER_DIG_P3]),
+    int16_t((registers_[BME280_REGISTER_DIG_P4 + 1] << 8) | registers_[BME280_REGISTER_DIG_P4]),
+    int16_t((registers_[BME280_REGISTER_DIG_P5 + 1] << 8) | registers_[BME280_REGISTER_DIG_P5]),
+    int16_t((registers_[BME280_REGISTER_DIG_P6 + 1] << 8) | registers_[BME280_REGISTER_DIG_P6]),
+    int16_t((registers_[BME280_REGISTER_DIG_P7 + 1] << 8) | registers_[BME280_REGISTER_DIG_P7]),
+    int16_t((registers_[BME280_REGISTER_DIG_P8 + 1] << 8) | registers_[BME280_REGISTER_DIG_P8]),
+    int16_t((registers_[BME280_REGISTER_DIG_P9 + 1] << 8) | registers_[BME280_REGISTER_DIG_P9]),
+    dig_H1(), dig_H2(), dig_H3(), dig_H4(), dig_H5(), int8_t(dig_H6())
+  };
+}
+
+uint16_t Bme280::dig_T1() const {
+   return uint16_t((registers_[BME280_REGISTER_DIG_T1 + 1]) << 8) | uint16_t((registers_[BME280_REGISTER_DIG_T1]));
+}
+
+int16_t Bme280::dig_T2() const {
+   return int16_t((registers_[BME280_REGISTER_DIG_T2 + 1]) << 8) | int16_t((registers_[BME280_REGISTER_DIG_T2]));
+}
+
+int16_t Bme280::dig_T3() const {
+   return int16_t((registers_[BME280_REGISTER_DIG_T3 + 1]) << 8) | int16_t((registers_[BME280_REGISTER_DIG_T3]));
+}
+
+uint8_t Bme280::dig_H1() const {
+  return registers_[BME280_REGISTER_DIG_H1];
+}
+
+int16_t Bme280::dig_H2() const {
+  return int16_t((registers_[BME280_REGISTER_DIG_H2 + 1]) << 8) | int16_t((registers_[BME280_REGISTER_DIG_H2]));
+}
+
+uint8_t Bme280::dig_H3() const {
+  return registers_[BME280_REGISTER_DIG_H3];
+}
 
-  set_T(22.0);
-  set_H(50.0);
+int16_t Bme280::dig_H4() const {
+  return ((int8_t)registers_[BME280_REGISTER_DIG_H4] << 4) | (registers_[BME280_REGISTER_DIG_H4 + 1] & 0xF);
+}
 
-  Wire.setSDA(16);
-  Wire.setSCL(17);
+int16_t Bme280::dig_H5() const {
+  return ((int8_t)registers_[BME280_REGISTER_DIG_H5 + 1] << 4) | (registers_[BME280_REGISTER_DIG_H5] >> 4);
+}
 
-  Wire.onReceive(on_wire_receive);
-  Wire.onRequest(on_wire_request);
+uint8_t Bme280::dig_H6() const {
+  return registers_[BME280_REGISTER_DIG_H6];
 }
 
-void begin() {
-  Wire.begin(0x76); // This is the I2C address of a BME280
-  Serial.println("BME emulator started with I2C address 0x76 on Wire");
+// Set the raw sensor reading (adc_T) given temperature T in degC
+void Bme280::set_T(const double &T) {
+  set_T_milli(T_to_milli(T));
 }
 
-uint16_t dig_T1() {
-   return uint16_t((Registers[BME280_REGISTER_DIG_T1 + 1]) << 8) | uint16_t((Registers[BME280_REGISTER_DIG_T1]));
+void Bme280::set_T_milli(int32_t T_milli) {
+  set_T_milli(coefficients_, T_milli);
 }
 
-int16_t dig_T2() {
-   return int16_t((Registers[BME280_REGISTER_DIG_T2 + 1]) << 8) | int16_t((Registers[BME280_REGISTER_DIG_T2]));
+// The adc_T the next conversion reads, in the 24 bit register layout
+int32_t Bme280::adc_T() const {
+  return get_adc20(sample_ + TemperatureOffset) << 4;
 }
 
-int16_t dig_T3() {
-   return int16_t((Registers[BME280_REGISTER_DIG_T3 + 1]) << 8) | int16_t((Registers[BME280_REGISTER_DIG_T3]));
+int32_t Bme280::t_fine() const {
+  return t_fine_;
 }
 
-uint8_t dig_H1() {
-  return Registers[BME280_REGISTER_DIG_H1];
+void Bme280::set_H(double H) {
+  set_H_milli(H_to_milli(H));
 }
 
-int16_t dig_H2() {
-  return int16_t((Registers[BME280_REGISTER_DIG_H2 + 1]) << 8) | int16_t((Registers[BME280_REGISTER_DIG_H2]));
+void Bme280::set_H_milli(uint32_t H_milli) {
+  set_H_milli(coefficients_, H_milli);
 }
 
-uint8_t dig_H3() {
-  return Registers[BME280_REGISTER_DIG_H3];
+// Set the raw sensor reading (adc_P) given pressure P in Pa
+void Bme280::set_P(const double &P) {
+  set_P_milli(P_to_milli(P));
 }
 
-int16_t dig_H4() {
-  return ((int8_t)Registers[BME280_REGISTER_DIG_H4] << 4) | (Registers[BME280_REGISTER_DIG_H4 + 1] & 0xF);
+void Bme280::set_P_milli(uint32_t P_milli) {
+  set_P_milli(coefficients_, P_milli);
 }
 
-int16_t dig_H5() {
-  return ((int8_t)Registers[BME280_REGISTER_DIG_H5 + 1] << 4) | (Registers[BME280_REGISTER_DIG_H5] >> 4);
+void Bme280::set_state(const double &T, double H, const double &P) {
+  set_state_milli(T_to_milli(T), H_to_milli(H), P_to_milli(P));
 }
 
-uint8_t dig_H6() {
-  return Registers[BME280_REGISTER_DIG_H6];
+void Bme280::set_state_milli(int32_t T_milli, uint32_t H_milli, uint32_t P_milli) {
+  set_state_milli(coefficients_, T_milli, H_milli, P_milli);
 }
 
-double solve_quadratic(const double &a, const double &b, const double &c, Root root) {
-  // a * x ** 2 + b * x + c = 0, return max x
-  const double discriminant = pow(b, 2.0) - 4.0 * a * c;
+// Measurement timing, see section 9.1 of the BME datasheet. This uses the
+// typical rather than the maximum times, so a driver waiting the maximum
+// always finds the conversion done.
+uint32_t Bme280::measurement_us() const {
+  const uint32_t t = osrs_t(ctrl_meas_);
+  const uint32_t p = osrs_p(ctrl_meas_);
+  const uint32_t h = osrs_h(ctrl_hum_);
+  return 1000 + 2000 * t + (p ? 2000 * p + 500 : 0) + (h ? 2000 * h + 500 : 0);
+}
 
-  if ( discriminant > 0) {
-    const double square_root = sqrt(discriminant);
-    if (root == Root::Min) {
-      return fmin((-b + square_root) / (2.0 * a), (-b - square_root) / (2.0 * a));
+uint32_t Bme280::standby_us() const {
+  return StandbyUs[registers_[BME280_REGISTER_CONFIG] >> 5];
+}
+
+bool Bme280::update(uint32_t now_us) {
+  IsrTimer timer(update_stats_);
+
+  // A soft reset clears the data registers and the filter. The reset image is
+  // published from here, the bank's only writer; until then the interrupt
+  // serves it itself.
+  const uint32_t resets = resets_.load(std::memory_order_acquire);
+  if (resets != seen_resets_.load(std::memory_order_relaxed)) {
+    memcpy(data_.stage(), Registers.reset + BME280_REGISTER_PRESSUREDATA, DataSize);
+    data_.publish();
+    filter_T_ = -1;
+    filter_P_ = -1;
+    seen_resets_.store(resets, std::memory_order_release);
+  }
+
+  // A ctrl_meas write, or a soft reset, restarts the engine in the new mode
+  const uint32_t triggers = triggers_.load(std::memory_order_acquire);
+  if (triggers != seen_triggers_.load(std::memory_order_relaxed)) {
+    ctrl_meas_ = registers_[BME280_REGISTER_CONTROL];
+    ctrl_hum_ = latched_ctrl_hum_;
+
+    switch (ctrl_meas_ & BME280_MODE_MASK) {
+    case BME280_MODE_SLEEP:
+      mode_ = Mode::Sleep;
+      break;
+    case BME280_MODE_NORMAL:
+      mode_ = Mode::Normal;
+      break;
+    default:
+      mode_ = Mode::Forced;
+      break;
+    }
+
+    if (mode_ == Mode::Sleep) {
+      measuring_.store(false, std::memory_order_relaxed);
+      sleeping_.store(true, std::memory_order_relaxed);
     } else {
-      return fmax((-b + square_root) / (2.0 * a), (-b - square_root) / (2.0 * a));
+      // The conversion started when the controller wrote ctrl_meas
+      deadline_us_ = trigger_us_ + measurement_us();
+      measuring_.store(true, std::memory_order_relaxed);
+      sleeping_.store(false, std::memory_order_relaxed);
     }
-  } else {
-    return -b / (2.0 * a);
+    // Release, so an interrupt that sees this trigger acted on also sees the
+    // measuring bit it implies
+    seen_triggers_.store(triggers, std::memory_order_release);
   }
+
+  // At most a completion and the start of the next conversion, or a start and
+  // its completion, are due in one call
+  bool latched = false;
+  for (int step = 0; step < 2 && mode_ != Mode::Sleep && reached(now_us, deadline_us_); ++step) {
+    if (measuring_.load(std::memory_order_relaxed)) {
+      latch();
+      latched = true;
+
+      if (mode_ == Mode::Forced) {
+        mode_ = Mode::Sleep;
+        measuring_.store(false, std::memory_order_release);
+        sleeping_.store(true, std::memory_order_release);
+      } else {
+        deadline_us_ += standby_us();
+        measuring_.store(false, std::memory_order_release);
+      }
+    } else {
+      // Normal mode standby is over. If the loop fell a whole conversion
+      // behind, start from now rather than catching up.
+      const uint32_t duration = measurement_us();
+      if (reached(now_us, deadline_us_ + duration)) {
+        deadline_us_ = now_us;
+      }
+      deadline_us_ += duration;
+      measuring_.store(true, std::memory_order_release);
+    }
+  }
+  return latched;
 }
 
-// Set the raw sensor reading (adc_T) given temperature T in degC
-// This solves the quadratic equation given in Appendix 8.1 in the BME datasheet
-void set_T(const double &T) {
-  const double T1 = dig_T1();
-  const double T2 = dig_T2();
-  const double T3 = dig_T3();
+// Publish the setpoints as the result of the conversion that just completed,
+// with noise and the IIR filter applied. The filter only acts on temperature
+// and pressure. Skipped measurements read as 0x80000, or 0x8000 for humidity.
+void Bme280::latch() {
+  // The filter restarts from the next sample whenever its coefficient changes
+  const byte shift = FilterShift[(registers_[BME280_REGISTER_CONFIG] >> 2) & 0x7];
+  if (shift != filter_shift_) {
+    filter_shift_ = shift;
+    filter_T_ = -1;
+    filter_P_ = -1;
+  }
 
-  const double a = T3 / pow(131072.0, 2.0);
-  const double b = (T2 / 16384.0) - (2.0 * T1 * T3 / 131072.0 / 8192.0);
-  const double c = (pow(T1 / 8192.0, 2.0) * T3) - (T1 * T2 / 1024.0) - (T * 5120.0);
+  const byte setting_P = (ctrl_meas_ >> 2) & 0x7;
+  const byte setting_T = ctrl_meas_ >> 5;
+  const byte setting_H = ctrl_hum_ & 0x7;
 
-  const double result = solve_quadratic(a, b, c, Root::Max);
+  byte *sample = data_.stage();
+  if (setting_P) {
+    const int32_t adc = measure(get_adc20(sample_ + PressureOffset), noise_P_, NoiseRatioP, setting_P, ADC_P_MAX);
+    put_adc20(sample + PressureOffset, filter(filter_P_, adc, shift));
+  } else {
+    put_adc20(sample + PressureOffset, SkippedAdc20);
+  }
+  if (setting_T) {
+    const int32_t adc = measure(get_adc20(sample_ + TemperatureOffset), noise_T_, NoiseRatioT, setting_T, ADC_T_MAX);
+    put_adc20(sample + TemperatureOffset, filter(filter_T_, adc, shift));
+  } else {
+    put_adc20(sample + TemperatureOffset, SkippedAdc20);
+  }
+  const int32_t adc_H = setting_H ? measure((int32_t(sample_[HumidityOffset]) << 8) | sample_[HumidityOffset + 1],
+                                            noise_H_, NoiseRatioH, setting_H, ADC_H_MAX)
+                                  : SkippedAdc16;
+  sample[HumidityOffset] = adc_H >> 8;
+  sample[HumidityOffset + 1] = adc_H & 0xFF;
+  data_.publish();
+}
 
-  // The four least significant digits are not used by the TEMPDATA register
-  // so shift 4 digits to the left
-  //return (int32_t)result << 4;
-  int32_t adc_T_value = (int32_t)result << 4;
-  Registers[BME280_REGISTER_TEMPDATA] = adc_T_value >> 16;
-  Registers[BME280_REGISTER_TEMPDATA + 1] = adc_T_value >> 8;
-  Registers[BME280_REGISTER_TEMPDATA + 2] = adc_T_value;
+// adc plus noise for an osrs_* setting, kept in 0..max
+int32_t Bme280::measure(int32_t adc, int32_t scale, const uint16_t *ratio, byte setting, int32_t max) {
+  if (!noise_enabled_) {
+    return adc;
+  }
+  adc += noise_.gaussian((scale * ratio[setting]) >> 8);
+  return adc < 0 ? 0 : (adc > max ? max : adc);
 }
 
-int32_t adc_T() {
-  return 
-    int32_t(Registers[BME280_REGISTER_TEMPDATA]) << 16 |
-    int32_t(Registers[BME280_REGISTER_TEMPDATA + 1]) << 8 |
-    int32_t(Registers[BME280_REGISTER_TEMPDATA + 2]);
+// One step of the IIR filter in section 3.4.4 of the BME datasheet,
+// state = (state * (c - 1) + adc) / c with c = 2^shift
+int32_t Bme280::filter(int32_t &state, int32_t adc, byte shift) {
+  if (state < 0 || shift == 0) {
+    state = adc << 8;
+  } else {
+    state += ((adc << 8) - state) >> shift;
+  }
+  return (state + 128) >> 8;
 }
 
-int32_t t_fine() {
-  const int32_t t_adc_T = adc_T() >> 4;
-  const int32_t t1 = dig_T1();
-  const int32_t t2 = dig_T2();
-  const int32_t t3 = dig_T3();
+void Bme280::set_noise(bool enabled) {
+  noise_enabled_ = enabled;
+}
 
-  const int32_t var1 = ((((t_adc_T >> 3) - (t1 << 1))) * t2) >> 11;
-  const int32_t var2 = (((((t_adc_T >> 4) - t1) * ((t_adc_T >> 4) - t1)) >> 12) * t3) >> 14;
+void Bme280::seed_noise(uint32_t seed) {
+  noise_.seed(seed);
+}
 
-  return var1 + var2;
+// Convert the x1 RMS noise to adc counts, from the slope of the compensation
+// formulas at 25 degC, 50 %RH and 101325 Pa. The slope barely changes across
+// the operating range, so one point per calibration is enough.
+void Bme280::set_noise_scales() {
+  const Coefficients &k = coefficients_;
+  constexpr int32_t Step = 256;
+
+  const int32_t adc_T = inverse_T(k, 25000);
+  const int32_t t_fine = compensate_t_fine(k, adc_T);
+  const int32_t dt_fine = compensate_t_fine(k, adc_T + Step) - t_fine;
+  // t_fine is 1/5120 degC
+  noise_T_ = Noise::scale(NoiseT_milli * 5.12 * Step / dt_fine);
+
+  const PressureTerms p_terms = pressure_terms(k, t_fine);
+  const int32_t adc_P = inverse_P(k, t_fine, 101325000);
+  const int32_t dP = int32_t(compensate_P(k, p_terms, adc_P)) - int32_t(compensate_P(k, p_terms, adc_P + Step));
+  // Pressure is Q24.8 Pa
+  noise_P_ = Noise::scale(NoiseP_milli * 0.256 * Step / dP);
+
+  const HumidityTerms h_terms = humidity_terms(k, t_fine);
+  const int32_t adc_H = inverse_H(k, t_fine, 50000);
+  const int32_t dH = int32_t(compensate_H(k, h_terms, adc_H + Step)) - int32_t(compensate_H(k, h_terms, adc_H));
+  // Humidity is Q22.10 %RH
+  noise_H_ = Noise::scale(NoiseH_milli * 1.024 * Step / dH);
 }
 
-void set_H(double H) {
-  if (H > 100.0)
-     H = 100.0;
-  else if (H < 0.0)
-     H = 0.0;
-  
-  const double t_fine_double = t_fine();
-  const double h1 = dig_H1();
-  const double h2 = dig_H2();
-  const double h3 = dig_H3();
-  const double h4 = dig_H4();
-  const double h5 = dig_H5();
-  const double h6 = dig_H6();
-
-  const double c1 = t_fine_double - 76800.0;
-  const double c2 = (h4 * 64.0 + h5 / 16384.0 * c1);
-  const double c3 = (h2 / 65536.0 * (1.0 + h6 / 67108864.0 * c1 * (1.0 + h3 / 67108864.0 * c1)));
-  const double c4 = c2 * c3;
-  
-  // H = x - dig_H1 / 524288.0 * pow(x, 2)
-  // Where x = ((adcH * c3) - c4)
-  // Therefore
-  // -1 * dig_H1 / 524288.0 * pow(x, 2) + x - H = 0;
-  
-  const double a = -1.0 * h1 / 524288.0;
-  const double b = 1.0;
-  const double c = -1.0 * H;
-  const double x = solve_quadratic(a, b, c, Root::Min);
-  
-  const int32_t adc_H = (x + c4) / c3;
-
-  Registers[BME280_REGISTER_HUMIDDATA] = adc_H >> 8;
-  Registers[BME280_REGISTER_HUMIDDATA + 1] = adc_H;
-}
-
-void on_wire_receive(int numBytes) {
+void Bme280::on_wire_receive(TwoWire &bus, int /* numBytes */) {
+  answer();
   //Serial.println("onRequestHandler received data");
   int byteCount = 0;
 
-  while (Wire.available()) {
-    byte rxByte = Wire.read();
+  while (bus.available()) {
+    byte rxByte = bus.read();
 
     // By convention, (see BME280 datasheet) the first bit of a pair (of bits) recieved by the BME280 from a controller
     // is the address of the register to write. The "second" bit of a pair is the 
@@ -163,304 +469,130 @@ void on_wire_receive(int numBytes) {
     if((byteCount % 2) == 0) {
       //Serial.print("Setting Address ");
       //Serial.println(rxByte, HEX);
-      Address = rxByte;
+      address_ = rxByte;
+      data_burst_ = false;
     } else {
-      // TODO Protect read only registers
       //Serial.print("Setting Register at Address ");
       //Serial.print(Address, HEX);
       //Serial.print(" to ");
       //Serial.println(rxByte, HEX);
-      Registers[Address] = rxByte;
+      write_register(address_, rxByte);
     }
 
     byteCount++;
   }
 }
 
-void on_wire_request(void) {
+// A controller write. As on the real part, writes to read only and data
+// registers are ignored, and the reset register only acts on the reset command.
+void Bme280::write_register(byte reg, byte value) {
+  switch (Registers.access[reg]) {
+  case Access::ReadWrite:
+    registers_[reg] = value;
+    if (reg == BME280_REGISTER_CONTROL) {
+      trigger();
+    }
+    break;
+  case Access::WriteOnly:
+    if (reg == BME280_REGISTER_SOFTRESET && value == BME280_SOFTRESET_COMMAND) {
+      soft_reset();
+    }
+    break;
+  case Access::ReadOnly:
+  case Access::Volatile:
+    break;
+  }
+}
+
+void Bme280::soft_reset() {
+  memcpy(registers_ + ResetFirst, Registers.reset + ResetFirst, ResetLast - ResetFirst + 1);
+  resets_.store(resets_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  trigger();
+}
+
+// The first transaction addressed to the sensor since init, in the interrupt
+void Bme280::answer() {
+  if (!answered_.load(std::memory_order_relaxed)) {
+    answered_us_ = micros();
+    answered_.store(true, std::memory_order_release);
+  }
+}
+
+// ctrl_meas was written, in the interrupt. Changes to ctrl_hum only take
+// effect now, so latch it for the main loop along with the time.
+void Bme280::trigger() {
+  latched_ctrl_hum_ = registers_[BME280_REGISTER_CONTROLHUMID];
+  trigger_us_ = micros();
+  triggers_.store(triggers_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Bring status and the mode bits of ctrl_meas up to date, in the interrupt.
+// A conversion counts as running from the ctrl_meas write until the main loop
+// latches its result, and a forced conversion reports sleep mode once done.
+void Bme280::refresh_status() {
+  const bool pending = triggers_.load(std::memory_order_relaxed) != seen_triggers_.load(std::memory_order_acquire);
+  byte &ctrl_meas = registers_[BME280_REGISTER_CONTROL];
+
+  if (pending) {
+    const bool starting = (ctrl_meas & BME280_MODE_MASK) != BME280_MODE_SLEEP;
+    registers_[BME280_REGISTER_STATUS] = starting ? BME280_STATUS_MEASURING : 0;
+    return;
+  }
+
+  registers_[BME280_REGISTER_STATUS] = measuring_.load(std::memory_order_acquire) ? BME280_STATUS_MEASURING : 0;
+  if (sleeping_.load(std::memory_order_acquire)) {
+    ctrl_meas &= ~BME280_MODE_MASK;
+  }
+}
+
+void Bme280::on_wire_request(TwoWire &bus) {
+  IsrTimer timer(request_stats_);
+  answer();
+
   //Serial.print("onReceiveHandler got a request and the Address is currently ");
   //Serial.print(Address, HEX);
   //Serial.println(".");
 
-  // The Wire API does not tell us how many bytes were requested
-  // so the fastest and safest thing to do is to fill the buffer with the entire register
-  // Careful, an ESP32 I2C buffer is 32 bytes,
-  // but a Raspberry Pi Pico is 1024. In other words a Pico can easily buffer the entire Register
-  // If this is running on an ESP32 then adjust code to buffer only 32 bytes
-  if(Address < RegisterSize) {
-    Wire.write(Registers + Address, RegisterSize - Address);
+  // The Wire API does not tell us how many bytes were requested, so serve the
+  // shortest read a driver makes from this address, see BurstTable, and no
+  // more than fits in the TX FIFO. Writing past the FIFO would spin in this
+  // interrupt until the controller clocks the bytes out. If the controller
+  // keeps reading, the request fires again and the auto incremented Address
+  // continues the burst.
+  const int burst = BurstEnd[address_] - address_ + 1;
+  const int length = burst < ReadChunk ? burst : ReadChunk;
+
+  if (address_ >= BME280_REGISTER_CONTROLHUMID && address_ <= BME280_REGISTER_CONFIG) {
+    refresh_status();
   }
+
+  const int data_offset = address_ - BME280_REGISTER_PRESSUREDATA;
+  if (data_offset >= 0 && data_offset < DataSize) {
+    // A burst over several measurements is served from the sample its first
+    // request read, so it never mixes two conversions
+    if (!data_burst_) {
+      if (resets_.load(std::memory_order_relaxed) != seen_resets_.load(std::memory_order_acquire)) {
+        memcpy(data_sample_, Registers.reset + BME280_REGISTER_PRESSUREDATA, DataSize);
+      } else {
+        data_.read(data_sample_);
+      }
+      data_burst_ = true;
+      data_read_us_ = micros();
+      data_reads_.store(data_reads_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    bus.write(data_sample_ + data_offset, length);
+    data_burst_ = data_offset + length < DataSize;
+  } else {
+    bus.write(registers_ + address_, length);
+  }
+
+  // Auto increment, wrapping from 0xFF to 0x00
+  address_ += length;
 }
 
-// This is a raw dump of data from a real BME280
-// According to the datasheet the first register address is actually 0x88,
-// but this emulator is using a byte array of size 256, so initRegisters will
-// initialize the entire byte array.
-void init_registers() {
-  Registers[0x00] = 0x0;
-  Registers[0x01] = 0x0;
-  Registers[0x02] = 0x0;
-  Registers[0x03] = 0x0;
-  Registers[0x04] = 0x0;
-  Registers[0x05] = 0x0;
-  Registers[0x06] = 0x0;
-  Registers[0x07] = 0x0;
-  Registers[0x08] = 0x0;
-  Registers[0x09] = 0x0;
-  Registers[0x0A] = 0x0;
-  Registers[0x0B] = 0x0;
-  Registers[0x0C] = 0x0;
-  Registers[0x0D] = 0x0;
-  Registers[0x0E] = 0x0;
-  Registers[0x0F] = 0x0;
-  Registers[0x10] = 0x0;
-  Registers[0x11] = 0x0;
-  Registers[0x12] = 0x0;
-  Registers[0x13] = 0x0;
-  Registers[0x14] = 0x0;
-  Registers[0x15] = 0x0;
-  Registers[0x16] = 0x0;
-  Registers[0x17] = 0x0;
-  Registers[0x18] = 0x0;
-  Registers[0x19] = 0x0;
-  Registers[0x1A] = 0x0;
-  Registers[0x1B] = 0x0;
-  Registers[0x1C] = 0x0;
-  Registers[0x1D] = 0x0;
-  Registers[0x1E] = 0x0;
-  Registers[0x1F] = 0x0;
-  Registers[0x20] = 0x0;
-  Registers[0x21] = 0x0;
-  Registers[0x22] = 0x0;
-  Registers[0x23] = 0x0;
-  Registers[0x24] = 0x0;
-  Registers[0x25] = 0x0;
-  Registers[0x26] = 0x0;
-  Registers[0x27] = 0x0;
-  Registers[0x28] = 0x0;
-  Registers[0x29] = 0x0;
-  Registers[0x2A] = 0x0;
-  Registers[0x2B] = 0x0;
-  Registers[0x2C] = 0x0;
-  Registers[0x2D] = 0x0;
-  Registers[0x2E] = 0x0;
-  Registers[0x2F] = 0x0;
-  Registers[0x30] = 0x0;
-  Registers[0x31] = 0x0;
-  Registers[0x32] = 0x0;
-  Registers[0x33] = 0x0;
-  Registers[0x34] = 0x0;
-  Registers[0x35] = 0x0;
-  Registers[0x36] = 0x0;
-  Registers[0x37] = 0x0;
-  Registers[0x38] = 0x0;
-  Registers[0x39] = 0x0;
-  Registers[0x3A] = 0x0;
-  Registers[0x3B] = 0x0;
-  Registers[0x3C] = 0x0;
-  Registers[0x3D] = 0x0;
-  Registers[0x3E] = 0x0;
-  Registers[0x3F] = 0x0;
-  Registers[0x40] = 0x0;
-  Registers[0x41] = 0x0;
-  Registers[0x42] = 0x0;
-  Registers[0x43] = 0x0;
-  Registers[0x44] = 0x0;
-  Registers[0x45] = 0x0;
-  Registers[0x46] = 0x0;
-  Registers[0x47] = 0x0;
-  Registers[0x48] = 0x0;
-  Registers[0x49] = 0x0;
-  Registers[0x4A] = 0x0;
-  Registers[0x4B] = 0x0;
-  Registers[0x4C] = 0x0;
-  Registers[0x4D] = 0x0;
-  Registers[0x4E] = 0x0;
-  Registers[0x4F] = 0x0;
-  Registers[0x50] = 0x0;
-  Registers[0x51] = 0x0;
-  Registers[0x52] = 0x0;
-  Registers[0x53] = 0x0;
-  Registers[0x54] = 0x0;
-  Registers[0x55] = 0x0;
-  Registers[0x56] = 0x0;
-  Registers[0x57] = 0x0;
-  Registers[0x58] = 0x0;
-  Registers[0x59] = 0x0;
-  Registers[0x5A] = 0x0;
-  Registers[0x5B] = 0x0;
-  Registers[0x5C] = 0x0;
-  Registers[0x5D] = 0x0;
-  Registers[0x5E] = 0x0;
-  Registers[0x5F] = 0x0;
-  Registers[0x60] = 0x0;
-  Registers[0x61] = 0x0;
-  Registers[0x62] = 0x0;
-  Registers[0x63] = 0x0;
-  Registers[0x64] = 0x0;
-  Registers[0x65] = 0x0;
-  Registers[0x66] = 0x0;
-  Registers[0x67] = 0x0;
-  Registers[0x68] = 0x0;
-  Registers[0x69] = 0x0;
-  Registers[0x6A] = 0x0;
-  Registers[0x6B] = 0x0;
-  Registers[0x6C] = 0x0;
-  Registers[0x6D] = 0x0;
-  Registers[0x6E] = 0x0;
-  Registers[0x6F] = 0x0;
-  Registers[0x70] = 0x0;
-  Registers[0x71] = 0x0;
-  Registers[0x72] = 0x0;
-  Registers[0x73] = 0x0;
-  Registers[0x74] = 0x0;
-  Registers[0x75] = 0x0;
-  Registers[0x76] = 0x0;
-  Registers[0x77] = 0x0;
-  Registers[0x78] = 0x0;
-  Registers[0x79] = 0x0;
-  Registers[0x7A] = 0x0;
-  Registers[0x7B] = 0x0;
-  Registers[0x7C] = 0x0;
-  Registers[0x7D] = 0x0;
-  Registers[0x7E] = 0x0;
-  Registers[0x7F] = 0x0;
-  Registers[0x80] = 0x8D;
-  Registers[0x81] = 0x71;
-  Registers[0x82] = 0x89;
-  Registers[0x83] = 0x6B;
-  Registers[0x84] = 0x9E;
-  Registers[0x85] = 0x44;
-  Registers[0x86] = 0xF5;
-  Registers[0x87] = 0x6;
-  Registers[0x88] = 0x26;
-  Registers[0x89] = 0x6E;
-  Registers[0x8A] = 0x3;
-  Registers[0x8B] = 0x67;
-  Registers[0x8C] = 0x32;
-  Registers[0x8D] = 0x0;
-  Registers[0x8E] = 0xA0;
-  Registers[0x8F] = 0x8E;
-  Registers[0x90] = 0x5A;
-  Registers[0x91] = 0xD6;
-  Registers[0x92] = 0xD0;
-  Registers[0x93] = 0xB;
-  Registers[0x94] = 0xA;
-  Registers[0x95] = 0x1E;
-  Registers[0x96] = 0xDB;
-  Registers[0x97] = 0xFF;
-  Registers[0x98] = 0xF9;
-  Registers[0x99] = 0xFF;
-  Registers[0x9A] = 0xAC;
-  Registers[0x9B] = 0x26;
-  Registers[0x9C] = 0xA;
-  Registers[0x9D] = 0xD8;
-  Registers[0x9E] = 0xBD;
-  Registers[0x9F] = 0x10;
-  Registers[0xA0] = 0x0;
-  Registers[0xA1] = 0x4B;
-  Registers[0xA2] = 0xFA;
-  Registers[0xA3] = 0x0;
-  Registers[0xA4] = 0x0;
-  Registers[0xA5] = 0x0;
-  Registers[0xA6] = 0x0;
-  Registers[0xA7] = 0x0;
-  Registers[0xA8] = 0x0;
-  Registers[0xA9] = 0x0;
-  Registers[0xAA] = 0x0;
-  Registers[0xAB] = 0x0;
-  Registers[0xAC] = 0x33;
-  Registers[0xAD] = 0x0;
-  Registers[0xAE] = 0x0;
-  Registers[0xAF] = 0xC0;
-  Registers[0xB0] = 0x0;
-  Registers[0xB1] = 0x54;
-  Registers[0xB2] = 0x0;
-  Registers[0xB3] = 0x0;
-  Registers[0xB4] = 0x0;
-  Registers[0xB5] = 0x0;
-  Registers[0xB6] = 0x60;
-  Registers[0xB7] = 0x2;
-  Registers[0xB8] = 0x0;
-  Registers[0xB9] = 0x1;
-  Registers[0xBA] = 0xFF;
-  Registers[0xBB] = 0xFF;
-  Registers[0xBC] = 0x1F;
-  Registers[0xBD] = 0x60;
-  Registers[0xBE] = 0x3;
-  Registers[0xBF] = 0x0;
-  Registers[0xC0] = 0x0;
-  Registers[0xC1] = 0x0;
-  Registers[0xC2] = 0x0;
-  Registers[0xC3] = 0xFF;
-  Registers[0xC4] = 0x0;
-  Registers[0xC5] = 0x0;
-  Registers[0xC6] = 0x0;
-  Registers[0xC7] = 0x0;
-  Registers[0xC8] = 0x0;
-  Registers[0xC9] = 0x0;
-  Registers[0xCA] = 0x0;
-  Registers[0xCB] = 0x0;
-  Registers[0xCC] = 0x0;
-  Registers[0xCD] = 0x0;
-  Registers[0xCE] = 0x0;
-  Registers[0xCF] = 0x0;
-  Registers[0xD0] = 0x60;
-  Registers[0xD1] = 0x0;
-  Registers[0xD2] = 0x0;
-  Registers[0xD3] = 0x0;
-  Registers[0xD4] = 0x0;
-  Registers[0xD5] = 0x0;
-  Registers[0xD6] = 0x0;
-  Registers[0xD7] = 0x0;
-  Registers[0xD8] = 0x0;
-  Registers[0xD9] = 0x0;
-  Registers[0xDA] = 0x0;
-  Registers[0xDB] = 0x0;
-  Registers[0xDC] = 0x0;
-  Registers[0xDD] = 0x0;
-  Registers[0xDE] = 0x0;
-  Registers[0xDF] = 0x0;
-  Registers[0xE0] = 0x0;
-  Registers[0xE1] = 0x73;
-  Registers[0xE2] = 0x1;
-  Registers[0xE3] = 0x0;
-  Registers[0xE4] = 0x12;
-  Registers[0xE5] = 0x29;
-  Registers[0xE6] = 0x3;
-  Registers[0xE7] = 0x1E;
-  Registers[0xE8] = 0xCA;
-  Registers[0xE9] = 0x41;
-  Registers[0xEA] = 0xFF;
-  Registers[0xEB] = 0xFF;
-  Registers[0xEC] = 0xFF;
-  Registers[0xED] = 0xFF;
-  Registers[0xEE] = 0xFF;
-  Registers[0xEF] = 0xFF;
-  Registers[0xF0] = 0xFF;
-  Registers[0xF1] = 0x0;
-  Registers[0xF2] = 0x0;
-  Registers[0xF3] = 0x0;
-  Registers[0xF4] = 0x0;
-  Registers[0xF5] = 0x0;
-  Registers[0xF6] = 0x0;
-  Registers[0xF7] = 0x80;
-  Registers[0xF8] = 0x0;
-  Registers[0xF9] = 0x0;
-  Registers[0xFA] = 0x80;
-  Registers[0xFB] = 0x0;
-  Registers[0xFC] = 0x0;
-  Registers[0xFD] = 0x80;
-  Registers[0xFE] = 0x0;
-  Registers[0xFF] = 0x80;
-
-  // Temporary hack to put in some reasonable pressure data
-  // This should be close to 1 atm, but not exact, because the value
-  // is temperature dependent.
-  int32_t adc_P_value = 0x539BA0;
-  Registers[BME280_REGISTER_PRESSUREDATA] = adc_P_value >> 16;
-  Registers[BME280_REGISTER_PRESSUREDATA + 1] = adc_P_value >> 8;
-  Registers[BME280_REGISTER_PRESSUREDATA + 2] = adc_P_value;
+// Load the reset image
+void Bme280::init_registers() {
+  memcpy(registers_, Registers.reset, RegisterSize);
 }
 
 } // namespace bme
@@ -2,48 +2,23 @@
 #define BME_INCLUDED
 
 #include <Arduino.h>
+#include <Wire.h>
+#include <atomic>
+#include "bme_calibration.hpp"
+#include "bme_compensation.hpp"
+#include "isr_stats.hpp"
+#include "noise.hpp"
+#include "recompute_stats.hpp"
+#include "shadow_bank.hpp"
 
-// bme namespace contains functions to emulate a BME280
-// The default i2C "Wire" interface is used for communication
+// bme namespace contains classes to emulate a BME280
+// The setters run in the main loop and publish each new sample of the data
+// registers atomically, see shadow_bank.hpp, so the I2C interrupt handler
+// never reads a mix of old and new bytes.
 namespace bme {
 
-void init();
-void begin();
-
-// Set the raw sensor reading (adc_T) given temperature T in degC
-// This solves the quadratic equation given in Appendix 8.1 in the BME datasheet
-void set_T(const double &T);
-void set_H(double H);
-
-// Many calibration terms are composed of two bytes.
-// The first register is the least significant digit.
-
-// Temperature calibration
-uint16_t dig_T1();
-int16_t dig_T2();
-int16_t dig_T3();
-
-// Humidity calibration
-uint8_t dig_H1();
-int16_t dig_H2();
-uint8_t dig_H3();
-int16_t dig_H4();
-int16_t dig_H5();
-uint8_t dig_H6();
-
-enum class Root { Min, Max };
-double solve_quadratic(const double &a, const double &b, const double &c, Root root);
-
-int32_t adc_T();
-int32_t t_fine();
-
-void on_wire_receive(int numBytes);
-void on_wire_request(void);
-
-static byte Address = 0x0;
-constexpr static int RegisterSize = 256;
-static byte Registers[RegisterSize];
-void init_registers();
+constexpr static byte BME280_ADDRESS = 0x76;
+constexpr static byte BME280_ADDRESS_ALTERNATE = 0x77;
 
 constexpr static byte BME280_REGISTER_DIG_T1 = 0x88;
 constexpr static byte BME280_REGISTER_DIG_T2 = 0x8A;
@@ -75,6 +50,475 @@ constexpr static byte BME280_REGISTER_PRESSUREDATA = 0xF7;
 constexpr static byte BME280_REGISTER_TEMPDATA = 0xFA;
 constexpr static byte BME280_REGISTER_HUMIDDATA = 0xFD;
 
+// Fields of the control and status registers, see section 5.4 of the BME280 datasheet
+constexpr static byte BME280_STATUS_MEASURING = 0x08;
+constexpr static byte BME280_MODE_MASK = 0x03;
+constexpr static byte BME280_MODE_SLEEP = 0x00;
+constexpr static byte BME280_MODE_FORCED = 0x01;
+constexpr static byte BME280_MODE_NORMAL = 0x03;
+
+// Registers, calibration and setpoints of one emulated BME280.
+// This part does not depend on the bus, see Bme280Emulator for the I2C binding.
+//
+// The setters change the environment the sensor measures. As on the real
+// part, the data registers only change when a conversion completes, which
+// update() decides from ctrl_meas, ctrl_hum and config. A controller write
+// to ctrl_meas sets the measuring bit at once, from the interrupt, so a
+// driver polling status never sees a conversion finish instantly.
+class Bme280 {
+public:
+  constexpr static int RegisterSize = 256;
+  // Bytes the RP2040 I2C TX FIFO holds, the most one read request serves
+  constexpr static int ReadChunk = 16;
+
+  // The data registers 0xF7..0xFE are served from a shadow bank rather than
+  // the register array, so a burst read always sees one whole sample.
+  constexpr static int DataSize = BME280_REGISTER_HUMIDDATA + 2 - BME280_REGISTER_PRESSUREDATA;
+
+  explicit Bme280(byte i2c_address);
+
+  Bme280(const Bme280 &) = delete;
+  Bme280 &operator=(const Bme280 &) = delete;
+
+  byte i2c_address() const { return i2c_address_; }
+
+  // Load the reset image and the default calibration, at 22 degC and 50 %RH
+  void init();
+
+  // Set the raw sensor reading (adc_T) given temperature T in degC
+  // The inverse compensation is integer only, see bme_compensation.hpp.
+  // The _milli forms take thousandths of a degC or %RH and avoid floating point entirely.
+  void set_T(const double &T);
+  void set_T_milli(int32_t T_milli);
+  void set_H(double H);
+  void set_H_milli(uint32_t H_milli);
+
+  // Set the raw sensor reading (adc_P) given pressure P in Pa, clamped to the
+  // sensor's 30..110 kPa. Compensated pressure depends on t_fine, so set_T recomputes adc_P from
+  // the last pressure set here.
+  void set_P(const double &P);
+  void set_P_milli(uint32_t P_milli);
+
+  // Set all three in one pass. Conversions latch the staged sample from the
+  // main loop, so a driver never reads a temperature from one state next to
+  // a humidity from another, however the setpoints arrive.
+  void set_state(const double &T, double H, const double &P);
+  void set_state_milli(int32_t T_milli, uint32_t H_milli, uint32_t P_milli);
+
+  // The setters only recompute what their input feeds:
+  //   T -> adc_T -> t_fine -> adc_H, adc_P
+  //   H -> adc_H
+  //   P -> adc_P
+  // A setpoint equal to the last one, or a temperature that gives the same
+  // adc_T, leaves everything downstream of it as it is.
+  struct Recomputes {
+    RecomputeStats adc_T;
+    RecomputeStats adc_H;
+    RecomputeStats adc_P;
+  };
+  const Recomputes &recomputes() const { return recomputes_; }
+
+  // Select the calibration profile the emulator reports and compensates with.
+  // Either form derives the coefficients and caches them for the setters, and
+  // writes the calibration registers. A Bme280Emulator given the profile as a
+  // template argument compensates with it as compile time constants instead.
+  template <const Calibration &Profile> void load_calibration();
+  void load_calibration(const Calibration &calibration);
+
+  // Decode the calibration currently held in the calibration registers
+  Calibration read_calibration() const;
+
+  // Many calibration terms are composed of two bytes.
+  // The first register is the least significant digit.
+
+  // Temperature calibration
+  uint16_t dig_T1() const;
+  int16_t dig_T2() const;
+  int16_t dig_T3() const;
+
+  // Humidity calibration
+  uint8_t dig_H1() const;
+  int16_t dig_H2() const;
+  uint8_t dig_H3() const;
+  int16_t dig_H4() const;
+  int16_t dig_H5() const;
+  uint8_t dig_H6() const;
+
+  int32_t adc_T() const;
+  int32_t t_fine() const;
+
+  // Run the measurement engine up to now_us, a micros() timestamp, from the
+  // main loop. Each call does at most two state changes and one 8 byte latch,
+  // so its cost is bounded whatever the loop latency. Returns true if a
+  // conversion completed and the data registers were latched.
+  bool update(uint32_t now_us);
+
+  // Duration of one conversion, and the standby between conversions in
+  // normal mode, for the current ctrl_meas, ctrl_hum and config values
+  uint32_t measurement_us() const;
+  uint32_t standby_us() const;
+
+  // Run time of update
+  const IsrStats &update_stats() const { return update_stats_; }
+
+  // Measurement noise, off until enabled. Each conversion then adds noise
+  // with the datasheet RMS for its oversampling, before the IIR filter from
+  // config, so a driver sees realistic jitter between slow setpoint changes.
+  // The same seed gives the same sequence of readings.
+  void set_noise(bool enabled);
+  void seed_noise(uint32_t seed);
+
+  // I2C transaction handlers, run from the interrupt of the bus this sensor is on
+  void on_wire_receive(TwoWire &bus, int numBytes);
+  void on_wire_request(TwoWire &bus);
+
+  // Run time of on_wire_request, the I2C read interrupt handler
+  const IsrStats &request_stats() const { return request_stats_; }
+
+  // Reads of the data registers, and the micros() time of the last. The
+  // interrupt sets the time before the count.
+  uint32_t data_reads() const { return data_reads_.load(std::memory_order_acquire); }
+  uint32_t data_read_us() const { return data_read_us_; }
+
+  // Whether a controller has addressed the sensor since init, and the
+  // micros() time it first did. The interrupt sets the time before the flag.
+  bool answered() const { return answered_.load(std::memory_order_acquire); }
+  uint32_t answered_us() const { return answered_us_; }
+
+  // Load the reset image of every register, see bme_registers.hpp
+  void init_registers();
+
+  // Restore the control and status registers, as writing 0xB6 to 0xE0 does.
+  // The data registers read as after power on until the next conversion.
+  void soft_reset();
+
+  byte read_register(byte reg) const { return registers_[reg]; }
+
+protected:
+  // The setters, compensating with k: coefficients_, or FixedCoefficients
+  // whose terms the compiler folds into the search
+  template <typename K> void set_T_milli(const K &k, int32_t T_milli);
+  template <typename K> void set_H_milli(const K &k, uint32_t H_milli);
+  template <typename K> void set_P_milli(const K &k, uint32_t P_milli);
+  template <typename K> void set_state_milli(const K &k, int32_t T_milli, uint32_t H_milli, uint32_t P_milli);
+
+  static int32_t T_to_milli(double T);
+  static uint32_t H_to_milli(double H);
+  static uint32_t P_to_milli(double P);
+
+  const Coefficients &coefficients() const { return coefficients_; }
+
+private:
+  enum class Mode : uint8_t { Sleep, Forced, Normal };
+
+  // Offsets of the measurements in the data registers
+  constexpr static int PressureOffset = BME280_REGISTER_PRESSUREDATA - BME280_REGISTER_PRESSUREDATA;
+  constexpr static int TemperatureOffset = BME280_REGISTER_TEMPDATA - BME280_REGISTER_PRESSUREDATA;
+  constexpr static int HumidityOffset = BME280_REGISTER_HUMIDDATA - BME280_REGISTER_PRESSUREDATA;
+
+  // 20 bit adc values are left aligned in three registers, MSB first.
+  // The four least significant digits are not used.
+  static void put_adc20(byte *data, int32_t adc) {
+    const int32_t value = adc << 4;
+    data[0] = value >> 16;
+    data[1] = value >> 8;
+    data[2] = value;
+  }
+
+  static int32_t get_adc20(const byte *data) {
+    return (int32_t(data[0]) << 12) | (int32_t(data[1]) << 4) | (data[2] >> 4);
+  }
+
+  void load_calibration(const Calibration &calibration, const Coefficients &coefficients);
+  void write_register(byte reg, byte value);
+  void answer();
+  void write_u16(byte reg, uint16_t value);
+  template <typename K> void stage_setpoints(const K &k);
+  template <typename K> bool stage_T(const K &k, int32_t T_milli);
+  template <typename K> void stage_H(const K &k);
+  template <typename K> void stage_P(const K &k);
+  void trigger();
+  void refresh_status();
+  void latch();
+  void set_noise_scales();
+  int32_t measure(int32_t adc, int32_t scale, const uint16_t *ratio, byte setting, int32_t max);
+  int32_t filter(int32_t &state, int32_t adc, byte shift);
+
+  const byte i2c_address_;
+
+  // Register the next read or write starts at
+  byte address_ = 0;
+  byte registers_[RegisterSize];
+
+  // The sample a read of the data registers is served from, until the read
+  // moves past them or the controller writes an address
+  byte data_sample_[DataSize];
+  bool data_burst_ = false;
+
+  // The data registers as of the last completed conversion
+  ShadowBank<DataSize> data_;
+
+  // What the next conversion will read, raw values of the setpoints.
+  // Only the main loop uses it.
+  byte sample_[DataSize];
+
+  // Measurement engine. The interrupt counts ctrl_meas writes in triggers_,
+  // with the time of the last one and the ctrl_hum value it latched. The main
+  // loop owns the rest and publishes which trigger it has acted on, whether a
+  // conversion is running and whether the engine went back to sleep, which is
+  // all the interrupt needs to report status without a lock. Soft resets are
+  // counted the same way, the data bank reset by the main loop.
+  std::atomic<uint32_t> triggers_{0};
+  std::atomic<uint32_t> resets_{0};
+  std::atomic<uint32_t> seen_resets_{0};
+  volatile uint32_t trigger_us_ = 0;
+  volatile byte latched_ctrl_hum_ = 0;
+  std::atomic<uint32_t> seen_triggers_{0};
+  std::atomic<bool> measuring_{false};
+  std::atomic<bool> sleeping_{true};
+  Mode mode_ = Mode::Sleep;
+  byte ctrl_meas_ = 0;
+  byte ctrl_hum_ = 0;
+  uint32_t deadline_us_ = 0;
+
+  // Noise and IIR filter of each conversion, used by the main loop only.
+  // The noise scales are the x1 RMS noise in adc counts, for Noise::gaussian.
+  // The filter states hold adc values with 8 fractional bits, -1 until the
+  // first filtered conversion.
+  Noise noise_;
+  bool noise_enabled_ = false;
+  int32_t noise_T_ = 0;
+  int32_t noise_P_ = 0;
+  int32_t noise_H_ = 0;
+  byte filter_shift_ = 0;
+  int32_t filter_T_ = -1;
+  int32_t filter_P_ = -1;
+
+  // Compensation terms of the calibration in use.
+  // Kept decoded so the update path never touches the calibration registers.
+  Coefficients coefficients_;
+
+  // Requested temperature, humidity and pressure in thousandths of a degC,
+  // %RH and Pa, and t_fine of the staged adc_T. The humidity and pressure
+  // registers depend on t_fine as well, so they are recomputed from their
+  // setpoints whenever adc_T changes.
+  int32_t temperature_setpoint_ = 22000;
+  uint32_t humidity_setpoint_ = 50000;
+  uint32_t pressure_setpoint_ = 101325000;
+  int32_t t_fine_ = 0;
+  Recomputes recomputes_;
+
+  IsrStats request_stats_;
+  IsrStats update_stats_;
+  std::atomic<uint32_t> data_reads_{0};
+  volatile uint32_t data_read_us_ = 0;
+  std::atomic<bool> answered_{false};
+  volatile uint32_t answered_us_ = 0;
+};
+
+// A Bme280 served on the I2C bus Bus, Wire or Wire1, calibrated with Profile.
+// Unless it is the default, which may be replaced at run time, the setters
+// compensate with the profile's coefficients as compile time constants. The
+// Wire callbacks are plain functions, so each bus gets its own trampolines
+// and the instance they forward to. The RP2040 I2C block answers a single
+// target address, so a bus serves one emulated sensor at a time; beginning a
+// second instance on the same bus takes it over.
+template <TwoWire &Bus, const Calibration &Profile = DefaultCalibration> class Bme280Emulator : public Bme280 {
+public:
+  Bme280Emulator(byte i2c_address, int sda, int scl) : Bme280(i2c_address), sda_(sda), scl_(scl) {}
+
+  // Initialize the registers and set up the bus pins and callbacks
+  void init() {
+    Bme280::init();
+    if constexpr (Fixed) {
+      Bme280::load_calibration<Profile>();
+    }
+
+    Bus.setSDA(sda_);
+    Bus.setSCL(scl_);
+
+    Active = this;
+    Bus.onReceive(on_receive);
+    Bus.onRequest(on_request);
+  }
+
+  // Start answering on the bus. The callbacks are set again, as an emulator
+  // with another profile has trampolines of its own.
+  void begin() {
+    Active = this;
+    Bus.onReceive(on_receive);
+    Bus.onRequest(on_request);
+    Bus.begin(i2c_address());
+  }
+
+  void end() {
+    Bus.end();
+    if (Active == this) {
+      Active = nullptr;
+    }
+  }
+
+  void set_T(const double &T) { set_T_milli(T_to_milli(T)); }
+  void set_T_milli(int32_t T_milli) { Bme280::set_T_milli(compensation(), T_milli); }
+  void set_H(double H) { set_H_milli(H_to_milli(H)); }
+  void set_H_milli(uint32_t H_milli) { Bme280::set_H_milli(compensation(), H_milli); }
+  void set_P(const double &P) { set_P_milli(P_to_milli(P)); }
+  void set_P_milli(uint32_t P_milli) { Bme280::set_P_milli(compensation(), P_milli); }
+  void set_state(const double &T, double H, const double &P) {
+    set_state_milli(T_to_milli(T), H_to_milli(H), P_to_milli(P));
+  }
+  void set_state_milli(int32_t T_milli, uint32_t H_milli, uint32_t P_milli) {
+    Bme280::set_state_milli(compensation(), T_milli, H_milli, P_milli);
+  }
+
+  // A profile fixed at compile time cannot be replaced
+  template <const Calibration &Other> void load_calibration() {
+    static_assert(!Fixed || &Other == &Profile, "the profile is fixed at compile time");
+    Bme280::load_calibration<Other>();
+  }
+  void load_calibration(const Calibration &calibration) {
+    static_assert(!Fixed, "the profile is fixed at compile time");
+    Bme280::load_calibration(calibration);
+  }
+
+private:
+  constexpr static bool Fixed = &Profile != &DefaultCalibration;
+
+  // The coefficients the setters compensate with
+  decltype(auto) compensation() const {
+    if constexpr (Fixed) {
+      return FixedCoefficients<Profile>();
+    } else {
+      return coefficients();
+    }
+  }
+
+  static void on_receive(int numBytes) {
+    if (Active) {
+      Active->on_wire_receive(Bus, numBytes);
+    }
+  }
+
+  static void on_request(void) {
+    if (Active) {
+      Active->on_wire_request(Bus);
+    }
+  }
+
+  inline static Bme280 *volatile Active = nullptr;
+
+  const int sda_;
+  const int scl_;
+};
+
+template <const Calibration &Profile> void Bme280::load_calibration() {
+  load_calibration(Profile, FixedCoefficients<Profile>::Value);
+}
+
+// Set adc_T to the value whose compensated temperature is closest to T_milli.
+// This inverts the integer formula in section 4.2.3 of the BME datasheet
+// rather than the floating point one in Appendix 8.1, so drivers read back
+// exactly the nearest representable temperature.
+template <typename K> void Bme280::set_T_milli(const K &k, int32_t T_milli) {
+  // Compensated humidity and pressure depend on t_fine, so they go in the
+  // same sample, unless adc_T has not moved
+  const bool moved = stage_T(k, T_milli);
+  recomputes_.adc_H.record(moved);
+  recomputes_.adc_P.record(moved);
+  if (moved) {
+    stage_H(k);
+    stage_P(k);
+  }
+}
+
+// Stage adc_T and t_fine for T_milli. Returns true if adc_T moved.
+template <typename K> bool Bme280::stage_T(const K &k, int32_t T_milli) {
+  const bool changed = T_milli != temperature_setpoint_;
+  recomputes_.adc_T.record(changed);
+  if (!changed) {
+    return false;
+  }
+  temperature_setpoint_ = T_milli;
+  const int32_t adc = inverse_T(k, T_milli);
+  if (adc == get_adc20(sample_ + TemperatureOffset)) {
+    return false;
+  }
+  put_adc20(sample_ + TemperatureOffset, adc);
+  t_fine_ = compensate_t_fine(k, adc);
+  return true;
+}
+
+// Set adc_H to the value whose compensated humidity, at the current temperature,
+// is closest to H_milli
+template <typename K> void Bme280::set_H_milli(const K &k, uint32_t H_milli) {
+  const bool changed = H_milli != humidity_setpoint_;
+  recomputes_.adc_H.record(changed);
+  if (changed) {
+    humidity_setpoint_ = H_milli;
+    stage_H(k);
+  }
+}
+
+// Pressures outside the sensor's 30..110 kPa range are clamped to it
+template <typename K> void Bme280::set_P_milli(const K &k, uint32_t P_milli) {
+  P_milli = clamp_P_milli(P_milli);
+  const bool changed = P_milli != pressure_setpoint_;
+  recomputes_.adc_P.record(changed);
+  if (changed) {
+    pressure_setpoint_ = P_milli;
+    stage_P(k);
+  }
+}
+
+// Each register is recomputed at most once, where set_T followed by set_H
+// would compute adc_H for the new t_fine and then again for the new humidity
+template <typename K> void Bme280::set_state_milli(const K &k, int32_t T_milli, uint32_t H_milli, uint32_t P_milli) {
+  P_milli = clamp_P_milli(P_milli);
+  const bool moved = stage_T(k, T_milli);
+
+  const bool H_changed = moved || H_milli != humidity_setpoint_;
+  recomputes_.adc_H.record(H_changed);
+  if (H_changed) {
+    humidity_setpoint_ = H_milli;
+    stage_H(k);
+  }
+
+  const bool P_changed = moved || P_milli != pressure_setpoint_;
+  recomputes_.adc_P.record(P_changed);
+  if (P_changed) {
+    pressure_setpoint_ = P_milli;
+    stage_P(k);
+  }
+}
+
+// Set adc_P in the sample to the value whose compensated pressure, at t_fine,
+// is closest to the pressure setpoint. This inverts the 64 bit integer formula
+// in section 4.2.3 of the BME datasheet.
+template <typename K> void Bme280::stage_P(const K &k) {
+  put_adc20(sample_ + PressureOffset, inverse_P(k, t_fine_, pressure_setpoint_));
+}
+
+// Set adc_H to the value whose compensated humidity, at t_fine, is closest to
+// the humidity setpoint
+template <typename K> void Bme280::stage_H(const K &k) {
+  const int32_t adc_H = inverse_H(k, t_fine_, humidity_setpoint_);
+
+  sample_[HumidityOffset] = adc_H >> 8;
+  sample_[HumidityOffset + 1] = adc_H;
+}
+
+// Recompute the whole sample from the setpoints, when the calibration changes
+template <typename K> void Bme280::stage_setpoints(const K &k) {
+  const int32_t adc = inverse_T(k, temperature_setpoint_);
+  put_adc20(sample_ + TemperatureOffset, adc);
+  t_fine_ = compensate_t_fine(k, adc);
+  stage_H(k);
+  stage_P(k);
+  recomputes_.adc_T.record(true);
+  recomputes_.adc_H.record(true);
+  recomputes_.adc_P.record(true);
+}
+
 } // namespace bme
 
 #endif // BME_INCLUDED
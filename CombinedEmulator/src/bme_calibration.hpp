@@ -0,0 +1,90 @@
+#ifndef BME_CALIBRATION_INCLUDED
+#define BME_CALIBRATION_INCLUDED
+
+#include <stdint.h>
+
+namespace bme {
+
+// Factory trimming parameters of a BME280, already decoded from the
+// calibration registers (0x88..0xA1 and 0xE1..0xE7)
+struct Calibration {
+  uint16_t dig_T1;
+  int16_t dig_T2;
+  int16_t dig_T3;
+
+  uint16_t dig_P1;
+  int16_t dig_P2;
+  int16_t dig_P3;
+  int16_t dig_P4;
+  int16_t dig_P5;
+  int16_t dig_P6;
+  int16_t dig_P7;
+  int16_t dig_P8;
+  int16_t dig_P9;
+
+  uint8_t dig_H1;
+  int16_t dig_H2;
+  uint8_t dig_H3;
+  int16_t dig_H4;
+  int16_t dig_H5;
+  int8_t dig_H6;
+};
+
+// Calibration terms of the integer compensation formulas in section 4.2.3 of
+// the BME datasheet, widened and pre-shifted so the compensation needs no
+// sign extension or decoding at run time
+struct Coefficients {
+  int32_t t1;
+  int32_t t1_x2;
+  int32_t t2;
+  int32_t t3;
+
+  int64_t p1;
+  int64_t p2;
+  int64_t p3;
+  int64_t p4_shifted;
+  int64_t p5;
+  int64_t p6;
+  int64_t p7_shifted;
+  int64_t p8;
+  int64_t p9;
+
+  int32_t h1;
+  int32_t h2;
+  int32_t h3;
+  int32_t h4_shifted;
+  int32_t h5;
+  int32_t h6;
+
+  constexpr explicit Coefficients(const Calibration &cal)
+    : t1(cal.dig_T1),
+      t1_x2(int32_t(cal.dig_T1) << 1),
+      t2(cal.dig_T2),
+      t3(cal.dig_T3),
+      p1(cal.dig_P1),
+      p2(cal.dig_P2),
+      p3(cal.dig_P3),
+      p4_shifted(int64_t(cal.dig_P4) * (int64_t(1) << 35)),
+      p5(cal.dig_P5),
+      p6(cal.dig_P6),
+      p7_shifted(int64_t(cal.dig_P7) * 16),
+      p8(cal.dig_P8),
+      p9(cal.dig_P9),
+      h1(cal.dig_H1),
+      h2(cal.dig_H2),
+      h3(cal.dig_H3),
+      h4_shifted(int32_t(cal.dig_H4) * (1 << 20)),
+      h5(cal.dig_H5),
+      h6(cal.dig_H6) {}
+};
+
+// Calibration of the BME280 the register image in init_registers was dumped from
+inline constexpr Calibration DefaultCalibration = {
+  28198, 26371, 50,
+  36512, -10662, 3024, 7690, -37, -7, 9900, -10230, 4285,
+  75, 371, 0, 297, 50, 30
+};
+
+} // namespace bme
+
+#endif // BME_CALIBRATION_INCLUDED
@@ -0,0 +1,339 @@
+#ifndef BME_COMPENSATION_INCLUDED
+#define BME_COMPENSATION_INCLUDED
+
+#include "bme_calibration.hpp"
+
+// Integer only BME280 compensation, and its inverse.
+// The forward functions are bit exact with the 32 bit integer formulas in
+// section 4.2.3 of the BME datasheet, which is what a driver computes from the
+// emulated registers. The inverse functions search adc space with the forward
+// formula, so whatever they return round trips exactly through the driver.
+//
+// Each function takes its calibration terms as k, either Coefficients derived
+// at run time or FixedCoefficients, whose terms are compile time constants
+// the compiler folds into the formulas.
+namespace bme {
+
+// Raw adc values are 20 bit for temperature and pressure, and 16 bit for humidity
+constexpr static int32_t ADC_T_MAX = 0xFFFFF;
+constexpr static int32_t ADC_P_MAX = 0xFFFFF;
+constexpr static int32_t ADC_H_MAX = 0xFFFF;
+
+// Humidity output is Q22.10 %RH, so 1024 is 1 %RH, capped at 100 %RH
+constexpr static uint32_t H_ONE_PERCENT = 1024;
+constexpr static uint32_t H_MAX = 100 * H_ONE_PERCENT;
+constexpr static uint32_t H_MILLI_MAX = 100000;
+
+// The operating range of the sensor, which temperature requests are clamped to
+constexpr static int32_t T_MILLI_MIN = -40000;
+constexpr static int32_t T_MILLI_MAX = 85000;
+
+// The pressure range of the sensor, which pressure requests are clamped to.
+// Far outside it the compensated pressure goes negative.
+constexpr static uint32_t P_MILLI_MIN = 30000000;
+constexpr static uint32_t P_MILLI_MAX = 110000000;
+
+// P_milli within the pressure range of the sensor
+inline uint32_t clamp_P_milli(uint32_t P_milli) {
+  return P_milli < P_MILLI_MIN ? P_MILLI_MIN : (P_milli > P_MILLI_MAX ? P_MILLI_MAX : P_milli);
+}
+
+// The Coefficients of Profile as static constants
+template <const Calibration &Profile> struct FixedCoefficients {
+  constexpr static Coefficients Value{Profile};
+
+  constexpr static int32_t t1 = Value.t1;
+  constexpr static int32_t t1_x2 = Value.t1_x2;
+  constexpr static int32_t t2 = Value.t2;
+  constexpr static int32_t t3 = Value.t3;
+
+  constexpr static int64_t p1 = Value.p1;
+  constexpr static int64_t p2 = Value.p2;
+  constexpr static int64_t p3 = Value.p3;
+  constexpr static int64_t p4_shifted = Value.p4_shifted;
+  constexpr static int64_t p5 = Value.p5;
+  constexpr static int64_t p6 = Value.p6;
+  constexpr static int64_t p7_shifted = Value.p7_shifted;
+  constexpr static int64_t p8 = Value.p8;
+  constexpr static int64_t p9 = Value.p9;
+
+  constexpr static int32_t h1 = Value.h1;
+  constexpr static int32_t h2 = Value.h2;
+  constexpr static int32_t h3 = Value.h3;
+  constexpr static int32_t h4_shifted = Value.h4_shifted;
+  constexpr static int32_t h5 = Value.h5;
+  constexpr static int32_t h6 = Value.h6;
+};
+
+template <typename K> int32_t compensate_t_fine(const K &k, int32_t adc_T);
+
+// Temperature in 0.01 degC, as reported by the datasheet formula
+inline int32_t t_fine_to_centi(int32_t t_fine) {
+  return (t_fine * 5 + 128) >> 8;
+}
+
+// The temperature dependent part of the humidity formula. It only changes with
+// t_fine, so it is computed once per temperature rather than once per adc value.
+struct HumidityTerms {
+  int32_t offset;
+  int32_t scale;
+};
+
+template <typename K> HumidityTerms humidity_terms(const K &k, int32_t t_fine);
+template <typename K> uint32_t compensate_H(const K &k, const HumidityTerms &terms, int32_t adc_H);
+
+// The temperature dependent part of the 64 bit pressure formula
+struct PressureTerms {
+  int64_t offset;
+  int64_t divisor;
+};
+
+template <typename K> PressureTerms pressure_terms(const K &k, int32_t t_fine);
+
+// Pressure in Q24.8 Pa, so 256 is 1 Pa
+template <typename K> uint32_t compensate_P(const K &k, const PressureTerms &terms, int32_t adc_P);
+
+// The inverse functions take requests in thousandths of a degree, %RH or Pa,
+// finer than the output resolution of the formulas, so the nearest output can
+// be chosen without rounding the request first.
+
+// adc_T whose compensated temperature (0.01 degC) is closest to T_milli.
+// Of the adc values that tie on that, the one with t_fine closest to the
+// request is chosen, so the humidity formula sees the closest temperature too.
+template <typename K> int32_t inverse_T(const K &k, int32_t T_milli);
+
+// adc_H whose compensated humidity at t_fine is closest to H_milli
+template <typename K> int32_t inverse_H(const K &k, int32_t t_fine, uint32_t H_milli);
+
+// adc_P whose compensated pressure at t_fine is closest to P_milli
+template <typename K> int32_t inverse_P(const K &k, int32_t t_fine, uint32_t P_milli);
+
+namespace detail {
+
+// Beyond this intermediate value the datasheet formula overflows 32 bits,
+// and the result is clamped to 100 %RH anyway
+constexpr int32_t H_SATURATION = 1 << 30;
+
+inline int32_t clamp(int32_t x, int32_t low, int32_t high) {
+  return x < low ? low : (x > high ? high : x);
+}
+
+template <typename T> T distance(T a, T b) {
+  return a > b ? a - b : b - a;
+}
+
+// The x in [low, high] where the non decreasing f(x) is closest to target.
+// The search gallops outwards from guess to bracket the target, then bisects,
+// so it costs about 2 * log2 of the guess error in evaluations of f, and never
+// more than about 2 * log2(high - low).
+template <typename T, typename F> int32_t nearest(const F &f, T target, int32_t guess, int32_t low, int32_t high) {
+  guess = clamp(guess, low, high);
+
+  // Invariant: f(below) < target <= f(above), where low - 1 and high + 1
+  // stand for minus and plus infinity
+  int32_t below;
+  int32_t above;
+  int32_t step = 1;
+
+  if (f(guess) >= target) {
+    above = guess;
+    for (;;) {
+      const int32_t probe = above - step;
+      if (probe < low) {
+        below = low - 1;
+        break;
+      }
+      if (f(probe) < target) {
+        below = probe;
+        break;
+      }
+      above = probe;
+      step <<= 1;
+    }
+  } else {
+    below = guess;
+    for (;;) {
+      const int32_t probe = below + step;
+      if (probe > high) {
+        above = high + 1;
+        break;
+      }
+      if (f(probe) >= target) {
+        above = probe;
+        break;
+      }
+      below = probe;
+      step <<= 1;
+    }
+  }
+
+  while (above - below > 1) {
+    const int32_t mid = below + ((above - below) >> 1);
+    if (f(mid) < target) {
+      below = mid;
+    } else {
+      above = mid;
+    }
+  }
+
+  if (above > high) {
+    return high;
+  }
+  if (below >= low && distance(f(below), target) < distance(f(above), target)) {
+    return below;
+  }
+  return above;
+}
+
+} // namespace detail
+
+template <typename K> int32_t compensate_t_fine(const K &k, int32_t adc_T) {
+  const int32_t var1 = (((adc_T >> 3) - k.t1_x2) * k.t2) >> 11;
+  const int32_t var2 = (((((adc_T >> 4) - k.t1) * ((adc_T >> 4) - k.t1)) >> 12) * k.t3) >> 14;
+
+  return var1 + var2;
+}
+
+template <typename K> HumidityTerms humidity_terms(const K &k, int32_t t_fine) {
+  const int32_t x1 = t_fine - 76800;
+
+  HumidityTerms terms;
+  terms.offset = k.h4_shifted + k.h5 * x1;
+  terms.scale = (((((x1 * k.h6) >> 10) * (((x1 * k.h3) >> 11) + 32768)) >> 10) + 2097152) * k.h2 + 8192;
+  terms.scale >>= 14;
+  return terms;
+}
+
+template <typename K> uint32_t compensate_H(const K &k, const HumidityTerms &terms, int32_t adc_H) {
+  int32_t v = (((adc_H << 14) - terms.offset + 16384) >> 15) * terms.scale;
+
+  if (v >= detail::H_SATURATION) {
+    return H_MAX;
+  }
+
+  v = v - (((((v >> 15) * (v >> 15)) >> 7) * k.h1) >> 4);
+  v = v < 0 ? 0 : v;
+  v = v > 419430400 ? 419430400 : v;
+  return uint32_t(v >> 12);
+}
+
+template <typename K> int32_t inverse_T(const K &k, int32_t T_milli) {
+  T_milli = detail::clamp(T_milli, T_MILLI_MIN, T_MILLI_MAX);
+
+  // t_fine only depends on adc_T >> 3, so search that space. Comparisons are
+  // scaled by 25 * 1000 so the request, T_milli * 5120 / 1000 in t_fine units,
+  // stays an integer: 25 * t_fine against 128 * T_milli.
+  const auto scaled_t_fine = [&k](int32_t x) { return 25 * compensate_t_fine(k, x << 3); };
+  const int32_t target = 128 * T_milli;
+
+  // var1 is linear in x, so invert it for a first guess, then take one
+  // Newton step to absorb the small quadratic var2 term. A calibration loaded
+  // at run time may have no linear term, then the search starts mid range.
+  const int32_t t_fine = T_milli * 128 / 25;
+  int32_t guess = ADC_T_MAX >> 4;
+  if (k.t2 != 0) {
+    guess = k.t1_x2 + t_fine * 2048 / k.t2;
+    guess += (t_fine - compensate_t_fine(k, guess << 3)) * 2048 / k.t2;
+  }
+
+  int32_t x = detail::nearest(scaled_t_fine, target, guess, 0, ADC_T_MAX >> 3);
+
+  // t_fine steps are much finer than the 0.01 degC output, but the closest
+  // t_fine can sit just across an output boundary from the request. Then its
+  // neighbour on the other side of the request is the closest output.
+  const int32_t output_error = 10 * t_fine_to_centi(compensate_t_fine(k, x << 3)) - T_milli;
+  if (output_error > 5 && x > 0) {
+    --x;
+  } else if (output_error < -5 && x < (ADC_T_MAX >> 3)) {
+    ++x;
+  }
+
+  return x << 3;
+}
+
+template <typename K> int32_t inverse_H(const K &k, int32_t t_fine, uint32_t H_milli) {
+  if (H_milli > H_MILLI_MAX) {
+    H_milli = H_MILLI_MAX;
+  }
+
+  const HumidityTerms terms = humidity_terms(k, t_fine);
+
+  // Compare 1000 * output (Q22.10) against 1024 * H_milli to stay exact
+  const auto scaled_H = [&k, &terms](int32_t adc_H) { return int32_t(1000 * compensate_H(k, terms, adc_H)); };
+  const int32_t target = int32_t(1024 * H_milli);
+
+  // Undo the quadratic term to first order and the linear part exactly for a first guess
+  int32_t guess = ADC_H_MAX >> 1;
+  if (terms.scale > 0) {
+    const int32_t v_target = int32_t(H_milli * H_ONE_PERCENT / 1000) << 12;
+    const int32_t v = v_target + (((((v_target >> 15) * (v_target >> 15)) >> 7) * k.h1) >> 4);
+    guess = (((v / terms.scale) << 15) + terms.offset - 16384) >> 14;
+  }
+
+  return detail::nearest(scaled_H, target, guess, 0, ADC_H_MAX);
+}
+
+template <typename K> PressureTerms pressure_terms(const K &k, int32_t t_fine) {
+  // The datasheet shifts signed 64 bit values left, written here as multiplies
+  int64_t var1 = int64_t(t_fine) - 128000;
+  int64_t var2 = var1 * var1 * k.p6;
+  var2 = var2 + var1 * k.p5 * (int64_t(1) << 17);
+  var2 = var2 + k.p4_shifted;
+  var1 = ((var1 * var1 * k.p3) >> 8) + var1 * k.p2 * (int64_t(1) << 12);
+  var1 = (((int64_t(1) << 47) + var1) * k.p1) >> 33;
+
+  PressureTerms terms;
+  terms.offset = var2;
+  terms.divisor = var1;
+  return terms;
+}
+
+template <typename K> uint32_t compensate_P(const K &k, const PressureTerms &terms, int32_t adc_P) {
+  if (terms.divisor == 0) {
+    return 0; // avoid exception caused by division by zero
+  }
+
+  int64_t p = 1048576 - adc_P;
+  p = ((p * (int64_t(1) << 31)) - terms.offset) * 3125 / terms.divisor;
+  const int64_t var1 = (k.p9 * (p >> 13) * (p >> 13)) >> 25;
+  const int64_t var2 = (k.p8 * p) >> 19;
+  p = ((p + var1 + var2) >> 8) + k.p7_shifted;
+  // Clamped, as the wrapped cast of a negative pressure would break the
+  // monotonic order the inverse searches by
+  return p < 0 ? 0 : uint32_t(p);
+}
+
+template <typename K> int32_t inverse_P(const K &k, int32_t t_fine, uint32_t P_milli) {
+  P_milli = clamp_P_milli(P_milli);
+  const PressureTerms terms = pressure_terms(k, t_fine);
+  if (terms.divisor == 0) {
+    return 0;
+  }
+
+  // Pressure falls as adc_P rises, so search u = ADC_P_MAX - adc_P instead,
+  // comparing 1000 * output (Q24.8) against 256 * P_milli to stay exact
+  const auto scaled_P = [&k, &terms](int32_t u) { return int64_t(1000) * compensate_P(k, terms, ADC_P_MAX - u); };
+  const int64_t target = int64_t(256) * P_milli;
+
+  // Ignoring the small dig_P8 and dig_P9 corrections the output is linear in u,
+  // so a secant through two evaluations near 1 atm gets within about a thousand
+  // counts, and a second secant through that guess within a few
+  const int32_t u0 = ADC_P_MAX >> 1;
+  const int32_t u1 = u0 + 4096;
+  const int64_t p0 = scaled_P(u0);
+  const int64_t p1 = scaled_P(u1);
+  int32_t guess = u0;
+  if (p1 != p0) {
+    guess = detail::clamp(u0 + int32_t((target - p0) * (u1 - u0) / (p1 - p0)), 0, ADC_P_MAX);
+    const int64_t p_guess = scaled_P(guess);
+    if (p_guess != p0) {
+      guess += int32_t((target - p_guess) * (guess - u0) / (p_guess - p0));
+    }
+  }
+
+  return ADC_P_MAX - detail::nearest(scaled_P, target, guess, 0, ADC_P_MAX);
+}
+
+} // namespace bme
+
+#endif // BME_COMPENSATION_INCLUDED
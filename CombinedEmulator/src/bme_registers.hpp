@@ -0,0 +1,97 @@
+#ifndef BME_REGISTERS_INCLUDED
+#define BME_REGISTERS_INCLUDED
+
+#include "bme.hpp"
+
+// Reset image and access rules of the BME280 register file.
+// Everything here is constexpr, so the tables live in flash and booting an
+// emulator is one block copy rather than a store per register.
+namespace bme {
+
+// How a controller may access a register, see section 5.3 of the BME280 datasheet
+enum class Access : uint8_t {
+  // Calibration, chip id and unused registers. Writes are ignored.
+  ReadOnly,
+  // Control registers. A soft reset restores their reset value.
+  ReadWrite,
+  // The reset register, which reads as 0x00
+  WriteOnly,
+  // Status and data registers, which the emulator updates
+  Volatile
+};
+
+// Written to BME280_REGISTER_SOFTRESET to reset the device
+constexpr static byte BME280_SOFTRESET_COMMAND = 0xB6;
+
+// This is a raw dump of data from a real BME280
+// According to the datasheet the first register address is actually 0x88,
+// but the emulator holds all 256 registers, so the dump covers them all.
+constexpr byte RegisterDump[Bme280::RegisterSize] = {
+  /* 0x00 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 0x10 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 0x20 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 0x30 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 0x40 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 0x50 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 0x60 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 0x70 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 0x80 */ 0x8D, 0x71, 0x89, 0x6B, 0x9E, 0x44, 0xF5, 0x06, 0x26, 0x6E, 0x03, 0x67, 0x32, 0x00, 0xA0, 0x8E,
+  /* 0x90 */ 0x5A, 0xD6, 0xD0, 0x0B, 0x0A, 0x1E, 0xDB, 0xFF, 0xF9, 0xFF, 0xAC, 0x26, 0x0A, 0xD8, 0xBD, 0x10,
+  /* 0xA0 */ 0x00, 0x4B, 0xFA, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x33, 0x00, 0x00, 0xC0,
+  /* 0xB0 */ 0x00, 0x54, 0x00, 0x00, 0x00, 0x00, 0x60, 0x02, 0x00, 0x01, 0xFF, 0xFF, 0x1F, 0x60, 0x03, 0x00,
+  /* 0xC0 */ 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 0xD0 */ 0x60, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 0xE0 */ 0x00, 0x73, 0x01, 0x00, 0x12, 0x29, 0x03, 0x1E, 0xCA, 0x41, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  /* 0xF0 */ 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x80, 0x00, 0x00, 0x80, 0x00, 0x80,
+};
+
+// Reset value and access of every register
+struct RegisterMap {
+  byte reset[Bme280::RegisterSize];
+  Access access[Bme280::RegisterSize];
+
+  constexpr explicit RegisterMap(const byte (&image)[Bme280::RegisterSize]) : reset(), access() {
+    for (int reg = 0; reg < Bme280::RegisterSize; ++reg) {
+      reset[reg] = image[reg];
+      access[reg] = Access::ReadOnly;
+    }
+    set(BME280_REGISTER_SOFTRESET, BME280_REGISTER_SOFTRESET, Access::WriteOnly);
+    set(BME280_REGISTER_CONTROLHUMID, BME280_REGISTER_CONTROLHUMID, Access::ReadWrite);
+    set(BME280_REGISTER_STATUS, BME280_REGISTER_STATUS, Access::Volatile);
+    set(BME280_REGISTER_CONTROL, BME280_REGISTER_CONFIG, Access::ReadWrite);
+    set(BME280_REGISTER_PRESSUREDATA, BME280_REGISTER_HUMIDDATA + 1, Access::Volatile);
+  }
+
+  constexpr void set(int first, int last, Access value) {
+    for (int reg = first; reg <= last; ++reg) {
+      access[reg] = value;
+    }
+  }
+
+  // True if every register in first..last has one of the two access values
+  constexpr bool all(int first, int last, Access a, Access b) const {
+    for (int reg = first; reg <= last; ++reg) {
+      if (access[reg] != a && access[reg] != b) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+inline constexpr RegisterMap Registers(RegisterDump);
+
+// Read only registers never change, so a soft reset only has to restore the
+// control and status window, in one block copy from the reset image.
+constexpr int ResetFirst = BME280_REGISTER_CONTROLHUMID;
+constexpr int ResetLast = BME280_REGISTER_CONFIG;
+
+static_assert(Registers.all(0, ResetFirst - 1, Access::ReadOnly, Access::WriteOnly) &&
+                Registers.all(ResetLast + 1, Bme280::RegisterSize - 1, Access::ReadOnly, Access::Volatile),
+              "the soft reset window holds every read write register");
+static_assert(Registers.reset[BME280_REGISTER_CHIPID] == 0x60, "chip id of a BME280");
+static_assert(Registers.reset[BME280_REGISTER_SOFTRESET] == 0x00, "the reset register reads as 0x00");
+
+} // namespace bme
+
+#endif // BME_REGISTERS_INCLUDED
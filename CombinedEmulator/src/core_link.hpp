@@ -0,0 +1,60 @@
+#ifndef CORE_LINK_INCLUDED
+#define CORE_LINK_INCLUDED
+
+#include <stdint.h>
+#include "spsc_queue.hpp"
+
+// Messages between the two RP2040 cores. Core1 runs the sensor emulation,
+// with the I2C interrupts of both buses, so nothing core0 does delays a
+// sensor reply. Core0 runs WiFi, HTTP and serial, turns what the host sends
+// into setpoints and forwards the thermostat outputs to the host.
+
+// Setpoints for every emulated sensor, with the humidity corrections and the
+// temperature adjustment applied on core0. sent_us is the micros() time the
+// command was queued; the timer is shared, so core1 can time its latency.
+// step is the lockstep step the setpoints are for, 0 for none.
+struct SetpointCommand {
+  double sht_T;
+  double sht_H;
+  int32_t bme_T_milli;
+  uint32_t bme_H_milli;
+  uint32_t bme_P_milli;
+  uint32_t sent_us;
+  uint32_t step;
+};
+
+// The thermostat outputs, bit n for input n, after a change, and the time of
+// the change's first edge, gpio_capture.hpp
+struct GpioEvent {
+  uint8_t inputs;
+  uint32_t time_us;
+};
+
+// A measurement the ecobee read from one of the sensors, at micros() time_us
+struct SensorRead {
+  constexpr static uint8_t Sht = 0;
+  constexpr static uint8_t Bme = 1;
+  uint8_t sensor;
+  uint32_t time_us;
+};
+
+using SetpointQueue = SpscQueue<SetpointCommand, 16>;
+using GpioQueue = SpscQueue<GpioEvent, 32>;
+// A lockstep step core1 gave to the sensors, and the debounced outputs then
+struct StepApplied {
+  uint32_t step;
+  uint8_t inputs;
+  uint32_t time_us;
+};
+
+using SensorReadQueue = SpscQueue<SensorRead, 16>;
+using StepQueue = SpscQueue<StepApplied, 4>;
+
+// Apply a command to the sensors, each publishing its registers once
+template <typename Sht, typename Bme>
+void apply_setpoints(const SetpointCommand &command, Sht &sht, Bme &bme) {
+  sht.set_state(command.sht_T, command.sht_H);
+  bme.set_state_milli(command.bme_T_milli, command.bme_H_milli, command.bme_P_milli);
+}
+
+#endif // CORE_LINK_INCLUDED
@@ -0,0 +1,45 @@
+#include "gpio_capture.hpp"
+
+void EdgeCapture::reset(uint8_t inputs) {
+  Sample sample;
+  while (samples_.pop(sample)) {
+  }
+  stable_ = inputs;
+  level_ = inputs;
+  pending_ = false;
+}
+
+void EdgeCapture::poll(uint32_t now_us, GpioQueue &out) {
+  Sample sample;
+  while (samples_.pop(sample)) {
+    // A burst that was already quiet when this edge came settled before it
+    settle(sample.time_us, out);
+    if (!pending_) {
+      if (sample.inputs == stable_) {
+        // An edge too short for the port read to see
+        continue;
+      }
+      pending_ = true;
+      first_edge_us_ = sample.time_us;
+    }
+    last_edge_us_ = sample.time_us;
+    level_ = sample.inputs;
+  }
+  settle(now_us, out);
+}
+
+void EdgeCapture::settle(uint32_t now_us, GpioQueue &out) {
+  // Signed, as an edge may be stamped after the now_us its caller read
+  if (!pending_ || int32_t(now_us - last_edge_us_) < int32_t(debounce_us_)) {
+    return;
+  }
+  pending_ = false;
+  if (level_ == stable_) {
+    ++glitches_;
+    return;
+  }
+  stable_ = level_;
+  if (!out.push(GpioEvent{level_, first_edge_us_})) {
+    ++drops_;
+  }
+}
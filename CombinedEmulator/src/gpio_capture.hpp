@@ -0,0 +1,71 @@
+#ifndef GPIO_CAPTURE_INCLUDED
+#define GPIO_CAPTURE_INCLUDED
+
+#include <stdint.h>
+#include "core_link.hpp"
+#include "spsc_queue.hpp"
+
+// Time stamped capture of the thermostat outputs.
+//
+// An edge interrupt on any output pin reads the whole port once and records
+// it, with micros(), in a ring the interrupt fills and loop1 empties, so the
+// time of a transition is when it happened rather than when a loop got round
+// to reading the pins. poll() then debounces the samples: once the pins have
+// been quiet for the debounce time, a change is reported with the time of its
+// first edge, and a burst of edges that ended where it began is dropped as a
+// glitch.
+class EdgeCapture {
+public:
+  constexpr static uint32_t DefaultDebounceUs = 1000;
+
+  // A port read by the edge interrupt, bit n for input n
+  struct Sample {
+    uint8_t inputs;
+    uint32_t time_us;
+  };
+
+  // The outputs before the first edge
+  void reset(uint8_t inputs);
+
+  // Interrupt side. Counts the sample as dropped if the ring is full.
+  void on_edge(uint8_t inputs, uint32_t time_us) {
+    if (!samples_.push(Sample{inputs, time_us})) {
+      overruns_ = overruns_ + 1;
+    }
+  }
+
+  // Debounce the samples recorded so far, and push each change that has
+  // settled by now_us to out. Changes that do not fit in out are counted as
+  // dropped.
+  void poll(uint32_t now_us, GpioQueue &out);
+
+  void set_debounce_us(uint32_t debounce_us) { debounce_us_ = debounce_us; }
+  uint32_t debounce_us() const { return debounce_us_; }
+
+  // The outputs as last reported
+  uint8_t inputs() const { return stable_; }
+
+  // Samples lost to a full ring, changes lost to a full out, and changes
+  // dropped as glitches
+  uint32_t overruns() const { return overruns_; }
+  uint32_t drops() const { return drops_; }
+  uint32_t glitches() const { return glitches_; }
+
+private:
+  void settle(uint32_t now_us, GpioQueue &out);
+
+  SpscQueue<Sample, 64> samples_;
+  uint32_t debounce_us_ = DefaultDebounceUs;
+  uint8_t stable_ = 0;
+  // The burst of edges since the last settled level: when it began, when it
+  // last moved, and where the pins are now
+  bool pending_ = false;
+  uint32_t first_edge_us_ = 0;
+  uint32_t last_edge_us_ = 0;
+  uint8_t level_ = 0;
+  volatile uint32_t overruns_ = 0;
+  uint32_t drops_ = 0;
+  uint32_t glitches_ = 0;
+};
+
+#endif // GPIO_CAPTURE_INCLUDED
@@ -0,0 +1,302 @@
+#include "history.hpp"
+#include <string.h>
+
+namespace {
+
+constexpr uint8_t NoWindow = 0xFF;
+
+int32_t &field(HistorySample &sample, int index) {
+  return index == 0 ? sample.T_milli : (index == 1 ? sample.H_milli : sample.P_milli);
+}
+
+// Delta of delta ranges of the time stamps, after a prefix of 1 to 4 bits:
+// 0 for none, 10 for 7 bits, 110 for 9, 1110 for 12 and 1111 for 32
+struct TimeRange {
+  uint32_t prefix;
+  int prefix_bits;
+  int bits;
+  int32_t min;
+  int32_t max;
+};
+
+constexpr TimeRange TimeRanges[] = {
+  {0x2, 2, 7, -63, 64},
+  {0x6, 3, 9, -255, 256},
+  {0xE, 4, 12, -2047, 2048},
+};
+
+void put_u16(uint8_t *out, uint16_t value) {
+  out[0] = uint8_t(value);
+  out[1] = uint8_t(value >> 8);
+}
+
+void put_u32(uint8_t *out, uint32_t value) {
+  put_u16(out, uint16_t(value));
+  put_u16(out + 2, uint16_t(value >> 16));
+}
+
+} // namespace
+
+void HistoryLog::append(const HistorySample &sample) {
+  ++samples_;
+  if (next_block_ == oldest_block_) {
+    start_block(sample);
+    return;
+  }
+  HistorySample next = sample;
+  if (int32_t(next.time_ms - last_.time_ms) < 0) {
+    next.time_ms = last_.time_ms;
+  }
+  Block &current = block(next_block_ - 1);
+  if (current.bits + MaxSampleBits > int(BlockBytes * 8) || current.count == UINT16_MAX) {
+    start_block(next);
+    return;
+  }
+
+  const int32_t delta = int32_t(next.time_ms - last_.time_ms);
+  const int32_t delta_of_delta = delta - last_delta_;
+  if (delta_of_delta == 0) {
+    put_bits(0, 1);
+  } else {
+    bool put = false;
+    for (const TimeRange &range : TimeRanges) {
+      if (delta_of_delta >= range.min && delta_of_delta <= range.max) {
+        put_bits(range.prefix, range.prefix_bits);
+        put_bits(uint32_t(delta_of_delta - range.min), range.bits);
+        put = true;
+        break;
+      }
+    }
+    if (!put) {
+      put_bits(0xF, 4);
+      put_bits(uint32_t(delta_of_delta), 32);
+    }
+  }
+
+  for (int i = 0; i < 3; ++i) {
+    put_value(i, field(next, i), field(last_, i));
+  }
+
+  if (next.inputs == last_.inputs) {
+    put_bits(0, 1);
+  } else {
+    put_bits(1, 1);
+    put_bits(next.inputs, 8);
+  }
+
+  current.last_ms = next.time_ms;
+  ++current.count;
+  last_ = next;
+  last_delta_ = delta;
+}
+
+void HistoryLog::start_block(const HistorySample &sample) {
+  if (next_block_ - oldest_block_ == Blocks) {
+    dropped_ += block(oldest_block_).count;
+    ++oldest_block_;
+  }
+  Block &started = block(next_block_++);
+  started.first_ms = sample.time_ms;
+  started.last_ms = sample.time_ms;
+  started.count = 1;
+  started.bits = 0;
+  memset(started.data, 0, sizeof(started.data));
+
+  put_bits(sample.time_ms, 32);
+  put_bits(uint32_t(sample.T_milli), 32);
+  put_bits(uint32_t(sample.H_milli), 32);
+  put_bits(uint32_t(sample.P_milli), 32);
+  put_bits(sample.inputs, 8);
+
+  last_ = sample;
+  last_delta_ = 0;
+  memset(leading_, NoWindow, sizeof(leading_));
+  memset(trailing_, 0, sizeof(trailing_));
+}
+
+// Append the low bits of value, most significant first, to the newest block
+void HistoryLog::put_bits(uint32_t value, int bits) {
+  Block &current = block(next_block_ - 1);
+  while (bits > 0) {
+    const int free = 8 - current.bits % 8;
+    const int take = bits < free ? bits : free;
+    const uint32_t chunk = (value >> (bits - take)) & ((1u << take) - 1);
+    current.data[current.bits / 8] |= uint8_t(chunk << (free - take));
+    current.bits = uint16_t(current.bits + take);
+    bits -= take;
+  }
+}
+
+// A setpoint as its XOR with the last one: 0 if unchanged, 10 and the bits
+// of the last window if they hold it, or 11, the leading zeros in 5 bits, the
+// length less one in 5 bits and the bits of a new window
+void HistoryLog::put_value(int index, int32_t value, int32_t last) {
+  const uint32_t xored = uint32_t(value) ^ uint32_t(last);
+  if (xored == 0) {
+    put_bits(0, 1);
+    return;
+  }
+  const int leading = __builtin_clz(xored);
+  const int trailing = __builtin_ctz(xored);
+  if (leading_[index] != NoWindow && leading >= leading_[index] && trailing >= trailing_[index]) {
+    put_bits(2, 2);
+    put_bits(xored >> trailing_[index], 32 - leading_[index] - trailing_[index]);
+    return;
+  }
+  const int length = 32 - leading - trailing;
+  put_bits(3, 2);
+  put_bits(uint32_t(leading), 5);
+  put_bits(uint32_t(length - 1), 5);
+  put_bits(xored >> trailing, length);
+  leading_[index] = uint8_t(leading);
+  trailing_[index] = uint8_t(trailing);
+}
+
+size_t HistoryLog::bytes() const {
+  size_t total = 0;
+  for (uint32_t id = oldest_block_; id != next_block_; ++id) {
+    total += (block(id).bits + 7) / 8;
+  }
+  return total;
+}
+
+uint32_t HistoryLog::first_time_ms() const {
+  return next_block_ == oldest_block_ ? 0 : block(oldest_block_).first_ms;
+}
+
+bool HistoryLog::overlaps(const Block &held, uint32_t from_ms, uint32_t to_ms) const {
+  return held.last_ms >= from_ms && held.first_ms <= to_ms;
+}
+
+HistoryLog::Export HistoryLog::start_export(uint32_t from_ms, uint32_t to_ms) const {
+  return Export{from_ms, to_ms, oldest_block_, 0, 0, false};
+}
+
+size_t HistoryLog::read(Export &position, uint8_t *out, size_t max) const {
+  size_t written = 0;
+  while (written < max && !position.cut) {
+    if (int32_t(position.block - oldest_block_) < 0) {
+      // Dropped since the export began; one partly sent ends the export, as
+      // the rest of it is gone
+      if (position.offset != 0) {
+        position.cut = true;
+        break;
+      }
+      position.block = oldest_block_;
+    }
+    if (position.block == next_block_) {
+      break;
+    }
+    const Block &held = block(position.block);
+    if (position.offset == 0) {
+      if (!overlaps(held, position.from_ms, position.to_ms)) {
+        ++position.block;
+        continue;
+      }
+      if (max - written < ExportHeaderSize) {
+        break;
+      }
+      position.bits = held.bits;
+      put_u32(out + written, held.first_ms);
+      put_u32(out + written + 4, held.last_ms);
+      put_u16(out + written + 8, held.count);
+      put_u16(out + written + 10, held.bits);
+      written += ExportHeaderSize;
+      position.offset = ExportHeaderSize;
+    }
+    const size_t end = ExportHeaderSize + (position.bits + 7) / 8;
+    const size_t take = end - position.offset < max - written ? end - position.offset : max - written;
+    memcpy(out + written, held.data + position.offset - ExportHeaderSize, take);
+    written += take;
+    position.offset += take;
+    if (position.offset == end) {
+      ++position.block;
+      position.offset = 0;
+    }
+  }
+  return written;
+}
+
+uint32_t HistoryReader::get_bits(int bits) {
+  if (position_ + bits > bits_) {
+    overrun_ = true;
+    return 0;
+  }
+  uint32_t value = 0;
+  while (bits > 0) {
+    const int available = 8 - position_ % 8;
+    const int take = bits < available ? bits : available;
+    const uint32_t chunk = (data_[position_ / 8] >> (available - take)) & ((1u << take) - 1);
+    value = (value << take) | chunk;
+    position_ = uint16_t(position_ + take);
+    bits -= take;
+  }
+  return value;
+}
+
+bool HistoryReader::get_value(int index, int32_t &value) {
+  if (get_bits(1) == 0) {
+    return !overrun_;
+  }
+  if (get_bits(1) == 0) {
+    if (leading_[index] == NoWindow) {
+      return false;
+    }
+    const int length = 32 - leading_[index] - trailing_[index];
+    value = int32_t(uint32_t(value) ^ (get_bits(length) << trailing_[index]));
+    return !overrun_;
+  }
+  const int leading = int(get_bits(5));
+  const int length = int(get_bits(5)) + 1;
+  const int trailing = 32 - leading - length;
+  if (trailing < 0) {
+    return false;
+  }
+  value = int32_t(uint32_t(value) ^ (get_bits(length) << trailing));
+  leading_[index] = uint8_t(leading);
+  trailing_[index] = uint8_t(trailing);
+  return !overrun_;
+}
+
+bool HistoryReader::next(HistorySample &sample) {
+  if (read_ == count_ || overrun_) {
+    return false;
+  }
+  if (read_ == 0) {
+    last_.time_ms = get_bits(32);
+    last_.T_milli = int32_t(get_bits(32));
+    last_.H_milli = int32_t(get_bits(32));
+    last_.P_milli = int32_t(get_bits(32));
+    last_.inputs = uint8_t(get_bits(8));
+    memset(leading_, NoWindow, sizeof(leading_));
+  } else {
+    int32_t delta_of_delta = 0;
+    int ones = 0;
+    while (ones < 4 && get_bits(1) == 1) {
+      ++ones;
+    }
+    if (ones == 4) {
+      delta_of_delta = int32_t(get_bits(32));
+    } else if (ones > 0) {
+      const TimeRange &range = TimeRanges[ones - 1];
+      delta_of_delta = int32_t(get_bits(range.bits)) + range.min;
+    }
+    last_delta_ += delta_of_delta;
+    last_.time_ms += uint32_t(last_delta_);
+    for (int i = 0; i < 3; ++i) {
+      if (!get_value(i, field(last_, i))) {
+        overrun_ = true;
+        return false;
+      }
+    }
+    if (get_bits(1) == 1) {
+      last_.inputs = uint8_t(get_bits(8));
+    }
+  }
+  if (overrun_) {
+    return false;
+  }
+  ++read_;
+  sample = last_;
+  return true;
+}
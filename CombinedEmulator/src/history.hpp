@@ -0,0 +1,148 @@
+#ifndef HISTORY_INCLUDED
+#define HISTORY_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// What the ecobee was shown and what it did about it: the setpoints the host
+// sent, in thousandths of a degC, %RH and Pa, and the thermostat outputs, bit
+// n for input n, from time_ms on.
+struct HistorySample {
+  uint32_t time_ms;
+  int32_t T_milli;
+  int32_t H_milli;
+  int32_t P_milli;
+  uint8_t inputs;
+};
+
+// History of samples, compressed as in Facebook's Gorilla time series store,
+// in a ring of blocks that drops the oldest block when it needs a new one.
+//
+// A block starts with a whole sample. Each later one is its time as a delta
+// of the delta before it, in 1 to 36 bits, then each setpoint as the XOR with
+// its last value, 1 bit if unchanged and otherwise only the bits between the
+// XOR's leading and trailing zeros, then 1 bit for unchanged outputs or 9
+// for new ones. A setpoint that moves a few thousandths, or not at all, at a
+// steady rate costs a handful of bits. Each block decodes on its own, so it
+// can be sent as it is and decoded by the host, Executive/emulator_protocol.py.
+//
+// Times are expected in order, less than 2^31 ms apart; a sample older than
+// the last is logged at the last one's time.
+class HistoryLog {
+public:
+  constexpr static size_t BlockBytes = 1024;
+  constexpr static size_t Blocks = 64;
+  // The most bits one sample takes, time, three setpoints and outputs
+  constexpr static int MaxSampleBits = 36 + 3 * (2 + 5 + 5 + 32) + 9;
+
+  // A block as exported: first and last time, samples and bits, little
+  // endian, then the bits, most significant first, padded to a byte
+  constexpr static size_t ExportHeaderSize = 12;
+
+  void append(const HistorySample &sample);
+
+  // Samples logged, and dropped with the oldest blocks
+  uint32_t samples() const { return samples_; }
+  uint32_t dropped() const { return dropped_; }
+  // Bytes of compressed samples held
+  size_t bytes() const;
+  size_t block_count() const { return size_t(next_block_ - oldest_block_); }
+  uint32_t first_time_ms() const;
+  uint32_t last_time_ms() const { return last_.time_ms; }
+
+  // Call fn(const HistorySample &) for each sample held from from_ms to
+  // to_ms, oldest first
+  template <typename Fn> void for_each(uint32_t from_ms, uint32_t to_ms, Fn &&fn) const;
+
+  // A bulk export in progress, of the blocks that overlap a range of times.
+  // Samples appended meanwhile are exported if they are in a block not yet
+  // reached; blocks dropped meanwhile are skipped.
+  struct Export {
+    uint32_t from_ms;
+    uint32_t to_ms;
+    uint32_t block;
+    size_t offset;
+    // Size of the block being exported when its header was read
+    uint16_t bits;
+    // Set if the block being exported was dropped before it was all read
+    bool cut;
+  };
+
+  Export start_export(uint32_t from_ms, uint32_t to_ms) const;
+
+  // Copy up to max bytes more of an export to out, returning 0 when it is done
+  size_t read(Export &position, uint8_t *out, size_t max) const;
+
+private:
+  struct Block {
+    uint32_t first_ms;
+    uint32_t last_ms;
+    uint16_t count;
+    uint16_t bits;
+    uint8_t data[BlockBytes];
+  };
+
+  const Block &block(uint32_t id) const { return blocks_[id % Blocks]; }
+  Block &block(uint32_t id) { return blocks_[id % Blocks]; }
+  bool overlaps(const Block &block, uint32_t from_ms, uint32_t to_ms) const;
+
+  void start_block(const HistorySample &sample);
+  void put_bits(uint32_t value, int bits);
+  void put_value(int field, int32_t value, int32_t last);
+
+  Block blocks_[Blocks];
+  // Ids of the oldest block held and of the next to be started
+  uint32_t oldest_block_ = 0;
+  uint32_t next_block_ = 0;
+  uint32_t samples_ = 0;
+  uint32_t dropped_ = 0;
+
+  // What the next sample is encoded against, in the newest block
+  HistorySample last_ = {};
+  int32_t last_delta_ = 0;
+  uint8_t leading_[3] = {};
+  uint8_t trailing_[3] = {};
+};
+
+// Decodes the samples of one block, as held or as exported
+class HistoryReader {
+public:
+  HistoryReader(const uint8_t *data, uint16_t bits, uint16_t count)
+      : data_(data), bits_(bits), count_(count) {}
+
+  // The next sample, or false at the end of the block or of valid bits
+  bool next(HistorySample &sample);
+
+private:
+  uint32_t get_bits(int bits);
+  bool get_value(int field, int32_t &value);
+
+  const uint8_t *data_;
+  uint16_t bits_;
+  uint16_t count_;
+  uint16_t read_ = 0;
+  uint16_t position_ = 0;
+  bool overrun_ = false;
+  HistorySample last_ = {};
+  int32_t last_delta_ = 0;
+  uint8_t leading_[3] = {};
+  uint8_t trailing_[3] = {};
+};
+
+template <typename Fn> void HistoryLog::for_each(uint32_t from_ms, uint32_t to_ms, Fn &&fn) const {
+  for (uint32_t id = oldest_block_; id != next_block_; ++id) {
+    const Block &held = block(id);
+    if (!overlaps(held, from_ms, to_ms)) {
+      continue;
+    }
+    HistoryReader reader(held.data, held.bits, held.count);
+    HistorySample sample;
+    while (reader.next(sample)) {
+      if (sample.time_ms >= from_ms && sample.time_ms <= to_ms) {
+        fn(sample);
+      }
+    }
+  }
+}
+
+#endif // HISTORY_INCLUDED
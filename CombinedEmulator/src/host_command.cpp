@@ -0,0 +1,209 @@
+#include "host_command.hpp"
+#include <string.h>
+
+namespace {
+
+int32_t to_milli(double value) {
+  return int32_t(lround(value * 1000));
+}
+
+// A member of an axis object, {"origin": -40, "step": 10, "count": 13}
+void read_axis(HumidityCorrection::Axis &axis, const char *key, double value) {
+  if (strcmp(key, "origin") == 0) {
+    axis.origin = to_milli(value);
+  } else if (strcmp(key, "step") == 0) {
+    axis.step = to_milli(value);
+  } else if (strcmp(key, "count") == 0) {
+    // Out of range counts fail the check in HumidityCorrection::load
+    axis.count = value >= 0 && value <= 255 ? uint8_t(value) : 0;
+  }
+}
+
+} // namespace
+
+void CorrectionGrid::clear() {
+  T = HumidityCorrection::Axis{0, 0, 0};
+  H = HumidityCorrection::Axis{0, 0, 0};
+  count = 0;
+}
+
+void CorrectionGrid::read(const JsonStreamParser &parser, int level) {
+  if (parser.depth() != level + 2 || parser.type() != JsonStreamParser::Type::Number) {
+    return;
+  }
+  const char *member = parser.key(level);
+  const char *key = parser.key(level + 1);
+  const int index = parser.index(level + 1);
+  if (index < 0 && strcmp(member, "T") == 0) {
+    read_axis(T, key, parser.number());
+  } else if (index < 0 && strcmp(member, "H") == 0) {
+    read_axis(H, key, parser.number());
+  } else if (index >= 0 && strcmp(member, "values") == 0) {
+    if (index < MaxValues) {
+      values[index] = to_milli(parser.number());
+    }
+    if (index >= count) {
+      count = index + 1;
+    }
+  }
+}
+
+bool CorrectionGrid::load_into(HumidityCorrection &correction) const {
+  if (count != int(T.count) * H.count || count > MaxValues) {
+    return false;
+  }
+  return correction.load(T, H, values);
+}
+
+void CorrectionGrid::print(Print &out) const {
+  char text[80];
+  const auto print_axis = [&](const char *name, const HumidityCorrection::Axis &axis) {
+    snprintf(text, sizeof(text), "\"%s\": {\"origin\": %.3f, \"step\": %.3f, \"count\": %d}, ", name,
+             axis.origin / 1000.0, axis.step / 1000.0, axis.count);
+    out.print(text);
+  };
+  out.print("{");
+  print_axis("T", T);
+  print_axis("H", H);
+  out.print("\"values\": [");
+  const int kept = count < MaxValues ? count : MaxValues;
+  for (int i = 0; i < kept; ++i) {
+    snprintf(text, sizeof(text), i == 0 ? "%.3f" : ", %.3f", values[i] / 1000.0);
+    out.print(text);
+  }
+  out.print("]}");
+}
+
+bool read_grid(Stream &in, CorrectionGrid &grid) {
+  JsonStreamParser parser;
+  grid.clear();
+  while (in.available() > 0) {
+    const uint8_t events = parser.feed(char(in.read()));
+    if (events & JsonStreamParser::Value) {
+      grid.read(parser, 0);
+    }
+    if (events & JsonStreamParser::Error) {
+      return false;
+    }
+    if (events & JsonStreamParser::MessageEnd) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void HostCommand::clear() {
+  has_T = false;
+  has_H = false;
+  has_P = false;
+  has_debounce = false;
+  has_sim_time = false;
+  has_sim_scale = false;
+  has_step = false;
+  has_trajectory = false;
+  trajectory = TrajectoryControl{0, 0, 0, 0, 0, 0};
+  has_correction = false;
+  correction_sensor[0] = '\0';
+  save_correction = false;
+  correction.clear();
+}
+
+bool HostCommandReader::feed(char c) {
+  if (complete_) {
+    command_.clear();
+    complete_ = false;
+  }
+  const uint8_t events = parser_.feed(c);
+  if (events & JsonStreamParser::Value) {
+    take_value();
+  }
+  if (events & JsonStreamParser::Error) {
+    // What the broken message set is dropped with it
+    command_.clear();
+    return false;
+  }
+  complete_ = (events & JsonStreamParser::MessageEnd) != 0;
+  return complete_;
+}
+
+void HostCommandReader::take_value() {
+  const JsonStreamParser &parser = parser_;
+  const bool number = parser.type() == JsonStreamParser::Type::Number;
+  if (parser.depth() == 1) {
+    if (!number) {
+      return;
+    }
+    if (parser.at("temperature")) {
+      command_.has_T = true;
+      command_.T = parser.number();
+    } else if (parser.at("humidity")) {
+      command_.has_H = true;
+      command_.H = parser.number();
+    } else if (parser.at("pressure")) {
+      command_.has_P = true;
+      command_.P = parser.number();
+    } else if (parser.at("gpio_debounce_us")) {
+      command_.has_debounce = true;
+      command_.debounce_us = parser.number();
+    } else if (parser.at("sim_time")) {
+      command_.has_sim_time = true;
+      command_.sim_time = parser.number();
+    } else if (parser.at("sim_scale")) {
+      command_.has_sim_scale = true;
+      command_.sim_scale = parser.number();
+    } else if (parser.at("step")) {
+      command_.has_step = true;
+      command_.step = parser.number() > 0 ? uint32_t(parser.number()) : 0;
+    }
+    return;
+  }
+
+  if (strcmp(parser.key(0), "trajectory") == 0) {
+    take_trajectory();
+    return;
+  }
+  if (strcmp(parser.key(0), "humidity_correction") != 0) {
+    return;
+  }
+  command_.has_correction = true;
+  if (parser.at("humidity_correction", "sensor")) {
+    if (parser.type() == JsonStreamParser::Type::String) {
+      strncpy(command_.correction_sensor, parser.string(), sizeof(command_.correction_sensor) - 1);
+      command_.correction_sensor[sizeof(command_.correction_sensor) - 1] = '\0';
+    }
+  } else if (parser.at("humidity_correction", "save")) {
+    command_.save_correction = parser.type() == JsonStreamParser::Type::True;
+  } else {
+    command_.correction.read(parser, 1);
+  }
+}
+
+void HostCommandReader::take_trajectory() {
+  const JsonStreamParser &parser = parser_;
+  TrajectoryControl &control = command_.trajectory;
+  command_.has_trajectory = true;
+  if (parser.at("trajectory", "play")) {
+    control.flags |= parser.type() == JsonStreamParser::Type::True ? TrajectoryControl::Play : TrajectoryControl::Pause;
+    return;
+  }
+  if (parser.type() != JsonStreamParser::Type::Number) {
+    return;
+  }
+  const double value = parser.number();
+  if (parser.at("trajectory", "seek")) {
+    control.flags |= TrajectoryControl::Seek;
+    control.seek_s = value > 0 ? uint32_t(value) : 0;
+  } else if (parser.at("trajectory", "scale")) {
+    control.flags |= TrajectoryControl::Scale;
+    control.scale_milli = value > 0 ? uint32_t(lround(value * 1000)) : 0;
+  } else if (parser.at("trajectory", "offset_T")) {
+    control.flags |= TrajectoryControl::Offsets;
+    control.offset_T_milli = to_milli(value);
+  } else if (parser.at("trajectory", "offset_H")) {
+    control.flags |= TrajectoryControl::Offsets;
+    control.offset_H_milli = to_milli(value);
+  } else if (parser.at("trajectory", "offset_P")) {
+    control.flags |= TrajectoryControl::Offsets;
+    control.offset_P_milli = to_milli(value);
+  }
+}
@@ -0,0 +1,108 @@
+#ifndef HOST_COMMAND_INCLUDED
+#define HOST_COMMAND_INCLUDED
+
+#include <Arduino.h>
+#include "humidity_correction.hpp"
+#include "json_stream.hpp"
+#include "trajectory.hpp"
+
+// A humidity correction grid as the host sends it, and as it is kept in
+// flash, in degC and %RH:
+// {"T": {"origin": -40, "step": 10, "count": 13}, "H": {...}, "values": [...]}
+// with T.count rows of H.count corrected humidities
+struct CorrectionGrid {
+  constexpr static int MaxValues = HumidityCorrection::MaxPoints * HumidityCorrection::MaxPoints;
+
+  HumidityCorrection::Axis T;
+  HumidityCorrection::Axis H;
+  // Corrected humidities in thousandths of a %RH, and how many were sent,
+  // counting any past MaxValues that did not fit
+  int32_t values[MaxValues];
+  int count;
+
+  void clear();
+
+  // Take the value the parser just reported, if it belongs to a grid whose
+  // members are at level of the parser's path
+  void read(const JsonStreamParser &parser, int level);
+
+  // Load the grid into correction. Returns false, leaving it unchanged, if the
+  // grid is incomplete or invalid.
+  bool load_into(HumidityCorrection &correction) const;
+
+  // Write the grid as JSON, in the form read takes
+  void print(Print &out) const;
+};
+
+// Read a whole grid from in, as written by CorrectionGrid::print
+bool read_grid(Stream &in, CorrectionGrid &grid);
+
+// One message from the host. What the message does not set is left unset.
+struct HostCommand {
+  bool has_T;
+  bool has_H;
+  bool has_P;
+  double T;
+  double H;
+  double P;
+
+  // Debounce time of the thermostat outputs
+  bool has_debounce;
+  double debounce_us;
+
+  // The host's simulation time in s, and its scale, simulation s per s, to
+  // sync the clock to. Without a scale the last one is kept.
+  bool has_sim_time;
+  double sim_time;
+  bool has_sim_scale;
+  double sim_scale;
+
+  // The lockstep step the message is, lockstep.hpp
+  bool has_step;
+  uint32_t step;
+
+  // {"play": true or false, "seek": s, "scale": trajectory s per s,
+  //  "offset_T": degC, "offset_H": %RH, "offset_P": Pa}, with any of the
+  // members. The offsets not sent are set to 0 along with those sent.
+  bool has_trajectory;
+  TrajectoryControl trajectory;
+
+  // "sensor" is "sht" or "bme" for one sensor, empty for both, and "save"
+  // keeps the grid in flash
+  bool has_correction;
+  char correction_sensor[8];
+  bool save_correction;
+  CorrectionGrid correction;
+
+  void clear();
+};
+
+// Assembles HostCommands from the JSON messages of the serial control channel:
+// {"temperature": 21.5, "humidity": 45, "pressure": 101325, "gpio_debounce_us": 1000,
+//  "sim_time": 86400.5, "sim_scale": 15, "step": 12,
+//  "humidity_correction": {"sensor": "sht", <grid>, "save": true},
+//  "trajectory": {"play": true, "scale": 15}}
+// with any subset of the members. Unknown members are ignored.
+class HostCommandReader {
+public:
+  HostCommandReader() { command_.clear(); }
+
+  // Take one byte. Returns true when it completes a message, which command()
+  // then holds until the next byte.
+  bool feed(char c);
+
+  const HostCommand &command() const { return command_; }
+
+  // Malformed messages dropped so far
+  uint32_t errors() const { return parser_.errors(); }
+
+private:
+  void take_value();
+  void take_trajectory();
+
+  JsonStreamParser parser_;
+  HostCommand command_;
+  bool complete_ = false;
+};
+
+#endif // HOST_COMMAND_INCLUDED
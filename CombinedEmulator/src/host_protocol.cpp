@@ -0,0 +1,367 @@
+#include "host_protocol.hpp"
+
+namespace protocol {
+
+size_t cobs_encode(const uint8_t *in, size_t length, uint8_t *out) {
+  // Each block starts with the distance to the next zero, which it replaces,
+  // or 0xFF for 254 bytes without one
+  size_t code_at = 0;
+  size_t written = 1;
+  uint8_t code = 1;
+  for (size_t i = 0; i < length; ++i) {
+    if (in[i] == 0) {
+      out[code_at] = code;
+      code_at = written++;
+      code = 1;
+      continue;
+    }
+    out[written++] = in[i];
+    if (++code == 0xFF) {
+      out[code_at] = code;
+      code_at = written++;
+      code = 1;
+    }
+  }
+  out[code_at] = code;
+  return written;
+}
+
+size_t cobs_decode(const uint8_t *in, size_t length, uint8_t *out) {
+  size_t read = 0;
+  size_t written = 0;
+  while (read < length) {
+    const uint8_t code = in[read++];
+    if (code == 0 || read + code - 1 > length) {
+      return 0;
+    }
+    for (int i = 1; i < code; ++i) {
+      out[written++] = in[read++];
+    }
+    if (code != 0xFF && read < length) {
+      out[written++] = 0;
+    }
+  }
+  return written;
+}
+
+size_t encode_frame(const Frame &frame, uint8_t *out) {
+  uint8_t raw[MaxFrame];
+  raw[0] = frame.version;
+  raw[1] = frame.type;
+  put_u16(raw + 2, frame.sequence);
+  for (int i = 0; i < frame.length; ++i) {
+    raw[HeaderSize + i] = frame.payload[i];
+  }
+  const size_t length = HeaderSize + frame.length;
+  put_u16(raw + length, crc16(raw, length));
+
+  out[0] = 0;
+  const size_t encoded = cobs_encode(raw, length + CrcSize, out + 1);
+  out[encoded + 1] = 0;
+  return encoded + 2;
+}
+
+void HelloPayload::put(Frame &frame) const {
+  frame.payload[0] = version;
+  put_u16(frame.payload + 1, capabilities);
+  frame.length = Size;
+}
+
+bool HelloPayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  version = frame.payload[0];
+  capabilities = get_u16(frame.payload + 1);
+  return true;
+}
+
+void StatePayload::put(Frame &frame) const {
+  frame.payload[0] = fields;
+  put_u32(frame.payload + 1, uint32_t(T_milli));
+  put_u32(frame.payload + 5, uint32_t(H_milli));
+  put_u32(frame.payload + 9, uint32_t(P_milli));
+  put_u32(frame.payload + 13, host_ms);
+  frame.length = Size;
+}
+
+bool StatePayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  fields = frame.payload[0];
+  T_milli = int32_t(get_u32(frame.payload + 1));
+  H_milli = int32_t(get_u32(frame.payload + 5));
+  P_milli = int32_t(get_u32(frame.payload + 9));
+  host_ms = get_u32(frame.payload + 13);
+  return true;
+}
+
+void OutputsPayload::put(Frame &frame) const {
+  frame.payload[0] = inputs;
+  put_u32(frame.payload + 1, time_us);
+  frame.length = Size;
+}
+
+bool OutputsPayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  inputs = frame.payload[0];
+  time_us = get_u32(frame.payload + 1);
+  return true;
+}
+
+void OutputEventsPayload::put(Frame &frame) const {
+  frame.payload[0] = count;
+  for (int i = 0; i < count; ++i) {
+    uint8_t *event = frame.payload + 1 + i * EventSize;
+    event[0] = events[i].inputs;
+    put_u32(event + 1, events[i].time_us);
+  }
+  frame.length = uint8_t(1 + count * EventSize);
+}
+
+bool OutputEventsPayload::get(const Frame &frame) {
+  if (frame.length < 1 || frame.payload[0] > MaxEvents || frame.length < 1 + frame.payload[0] * EventSize) {
+    return false;
+  }
+  count = frame.payload[0];
+  for (int i = 0; i < count; ++i) {
+    const uint8_t *event = frame.payload + 1 + i * EventSize;
+    events[i].inputs = event[0];
+    events[i].time_us = get_u32(event + 1);
+  }
+  return true;
+}
+
+void SimEventsPayload::put(Frame &frame) const {
+  frame.payload[0] = count;
+  for (int i = 0; i < count; ++i) {
+    uint8_t *event = frame.payload + 1 + i * EventSize;
+    event[0] = events[i].value;
+    put_u64(event + 1, events[i].sim_us);
+  }
+  frame.length = uint8_t(1 + count * EventSize);
+}
+
+bool SimEventsPayload::get(const Frame &frame) {
+  if (frame.length < 1 || frame.payload[0] > MaxEvents || frame.length < 1 + frame.payload[0] * EventSize) {
+    return false;
+  }
+  count = frame.payload[0];
+  for (int i = 0; i < count; ++i) {
+    const uint8_t *event = frame.payload + 1 + i * EventSize;
+    events[i].value = event[0];
+    events[i].sim_us = get_u64(event + 1);
+  }
+  return true;
+}
+
+void HistoryRequestPayload::put(Frame &frame) const {
+  put_u32(frame.payload, from_ms);
+  put_u32(frame.payload + 4, to_ms);
+  frame.length = Size;
+}
+
+bool HistoryRequestPayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  from_ms = get_u32(frame.payload);
+  to_ms = get_u32(frame.payload + 4);
+  return true;
+}
+
+void HistoryEndPayload::put(Frame &frame) const {
+  frame.payload[0] = cut ? 1 : 0;
+  frame.length = Size;
+}
+
+bool HistoryEndPayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  cut = frame.payload[0] != 0;
+  return true;
+}
+
+void TrajectoryBeginPayload::put(Frame &frame) const {
+  frame.payload[0] = fields;
+  frame.length = Size;
+}
+
+bool TrajectoryBeginPayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  fields = frame.payload[0];
+  return true;
+}
+
+void TrajectoryEndPayload::put(Frame &frame) const {
+  put_u32(frame.payload, points);
+  frame.length = Size;
+}
+
+bool TrajectoryEndPayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  points = get_u32(frame.payload);
+  return true;
+}
+
+void TrajectoryCommandPayload::put(Frame &frame) const {
+  frame.payload[0] = control.flags;
+  put_u32(frame.payload + 1, control.seek_s);
+  put_u32(frame.payload + 5, control.scale_milli);
+  put_u32(frame.payload + 9, uint32_t(control.offset_T_milli));
+  put_u32(frame.payload + 13, uint32_t(control.offset_H_milli));
+  put_u32(frame.payload + 17, uint32_t(control.offset_P_milli));
+  frame.length = Size;
+}
+
+bool TrajectoryCommandPayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  control.flags = frame.payload[0];
+  control.seek_s = get_u32(frame.payload + 1);
+  control.scale_milli = get_u32(frame.payload + 5);
+  control.offset_T_milli = int32_t(get_u32(frame.payload + 9));
+  control.offset_H_milli = int32_t(get_u32(frame.payload + 13));
+  control.offset_P_milli = int32_t(get_u32(frame.payload + 17));
+  return true;
+}
+
+void TrajectoryStatusPayload::put(Frame &frame) const {
+  frame.payload[0] = state;
+  frame.payload[1] = error;
+  put_u32(frame.payload + 2, points);
+  put_u32(frame.payload + 6, received);
+  put_u32(frame.payload + 10, position_s);
+  put_u32(frame.payload + 14, scale_milli);
+  frame.length = Size;
+}
+
+bool TrajectoryStatusPayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  state = frame.payload[0];
+  error = frame.payload[1];
+  points = get_u32(frame.payload + 2);
+  received = get_u32(frame.payload + 6);
+  position_s = get_u32(frame.payload + 10);
+  scale_milli = get_u32(frame.payload + 14);
+  return true;
+}
+
+void ClockSyncPayload::put(Frame &frame) const {
+  put_u64(frame.payload, sim_us);
+  put_u32(frame.payload + 8, scale_milli);
+  frame.length = Size;
+}
+
+bool ClockSyncPayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  sim_us = get_u64(frame.payload);
+  scale_milli = get_u32(frame.payload + 8);
+  return true;
+}
+
+void StepPayload::put(Frame &frame) const {
+  put_u32(frame.payload, step);
+  frame.payload[4] = fields;
+  put_u32(frame.payload + 5, uint32_t(T_milli));
+  put_u32(frame.payload + 9, uint32_t(H_milli));
+  put_u32(frame.payload + 13, uint32_t(P_milli));
+  put_u64(frame.payload + 17, sim_us);
+  frame.length = Size;
+}
+
+bool StepPayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  step = get_u32(frame.payload);
+  fields = frame.payload[4];
+  T_milli = int32_t(get_u32(frame.payload + 5));
+  H_milli = int32_t(get_u32(frame.payload + 9));
+  P_milli = int32_t(get_u32(frame.payload + 13));
+  sim_us = get_u64(frame.payload + 17);
+  return true;
+}
+
+void StepAckPayload::put(Frame &frame) const {
+  put_u32(frame.payload, ack.step);
+  put_u32(frame.payload + 4, uint32_t(ack.T_milli));
+  put_u32(frame.payload + 8, uint32_t(ack.H_milli));
+  put_u32(frame.payload + 12, uint32_t(ack.P_milli));
+  frame.payload[16] = ack.inputs;
+  put_u32(frame.payload + 17, ack.time_us);
+  frame.length = Size;
+}
+
+bool StepAckPayload::get(const Frame &frame) {
+  if (frame.length < Size) {
+    return false;
+  }
+  ack.step = get_u32(frame.payload);
+  ack.T_milli = int32_t(get_u32(frame.payload + 4));
+  ack.H_milli = int32_t(get_u32(frame.payload + 8));
+  ack.P_milli = int32_t(get_u32(frame.payload + 12));
+  ack.inputs = frame.payload[16];
+  ack.time_us = get_u32(frame.payload + 17);
+  return true;
+}
+
+FrameReader::Result FrameReader::feed(uint8_t byte) {
+  if (!in_frame_) {
+    if (byte != 0) {
+      return Result::Text;
+    }
+    in_frame_ = true;
+    length_ = 0;
+    return Result::None;
+  }
+  if (byte != 0) {
+    // A frame too long for any message is kept counting, and dropped at its end
+    if (length_ < MaxEncoded) {
+      buffer_[length_] = byte;
+    }
+    ++length_;
+    return Result::None;
+  }
+  if (length_ == 0) {
+    // The delimiter after a lost one, or between two frames sent back to back
+    return Result::None;
+  }
+  in_frame_ = false;
+  return end_frame();
+}
+
+FrameReader::Result FrameReader::end_frame() {
+  // Later versions may add to a payload; what this one knows of it is read
+  // and the rest ignored
+  const size_t length = length_ <= MaxEncoded ? cobs_decode(buffer_, length_, buffer_) : 0;
+  if (length < size_t(HeaderSize + CrcSize) ||
+      crc16(buffer_, length - CrcSize) != get_u16(buffer_ + length - CrcSize)) {
+    ++invalid_frames_;
+    return Result::Invalid;
+  }
+  frame_.version = buffer_[0];
+  frame_.type = buffer_[1];
+  frame_.sequence = get_u16(buffer_ + 2);
+  const size_t payload = length - HeaderSize - CrcSize;
+  frame_.length = uint8_t(payload < size_t(MaxPayload) ? payload : MaxPayload);
+  for (int i = 0; i < frame_.length; ++i) {
+    frame_.payload[i] = buffer_[HeaderSize + i];
+  }
+  return Result::Frame;
+}
+
+} // namespace protocol
@@ -0,0 +1,353 @@
+#ifndef HOST_PROTOCOL_INCLUDED
+#define HOST_PROTOCOL_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lockstep.hpp"
+#include "trajectory.hpp"
+
+// Binary protocol of the serial link to the host, Executive/emulator_protocol.py
+// on the other end.
+//
+// Each frame is version, type, a 16 bit sequence number, a typed payload and
+// a CRC-16 of all of them, COBS encoded so it holds no zero byte, and sent
+// between two zero delimiters. JSON text never holds a zero byte either, so
+// frames and JSON messages can share the link: the link starts in JSON, and
+// the host switches to frames by sending a Hello the emulator acknowledges.
+// A host that never sends one keeps the JSON messages. Multi-byte fields are
+// little endian.
+namespace protocol {
+
+constexpr uint8_t Version = 1;
+
+enum MessageType : uint8_t {
+  // Host to emulator: highest version, capabilities wanted
+  Hello = 0x01,
+  // Emulator to host: version spoken, capabilities granted
+  HelloAck = 0x02,
+  // Host to emulator: a StatePayload
+  SetState = 0x10,
+  // Emulator to host: an OutputsPayload
+  Outputs = 0x20,
+  // Emulator to host: an OutputEventsPayload
+  OutputEvents = 0x21,
+  // Emulator to host, once the clock is synced: a SimEventsPayload of output
+  // changes, each value the inputs, in place of OutputEvents
+  SimOutputEvents = 0x22,
+  // Emulator to host, once the clock is synced: a SimEventsPayload of sensor
+  // reads, each value a SensorRead sensor, core_link.hpp
+  SensorReads = 0x23,
+  // Host to emulator: a HistoryRequestPayload
+  HistoryRequest = 0x30,
+  // Emulator to host: the next bytes of the exported history, HistoryLog in
+  // history.hpp, in as many frames as it takes
+  HistoryData = 0x31,
+  // Emulator to host: a HistoryEndPayload after the last HistoryData
+  HistoryEnd = 0x32,
+  // Host to emulator: a trajectory upload, a TrajectoryBeginPayload, then
+  // frames of whole TrajectoryPoints, each answered with a status before the
+  // next is sent, then a TrajectoryEndPayload
+  TrajectoryBegin = 0x40,
+  TrajectoryPoints = 0x41,
+  TrajectoryEnd = 0x42,
+  // Host to emulator: a TrajectoryCommandPayload
+  TrajectoryCommand = 0x43,
+  // Emulator to host: a TrajectoryStatusPayload, after each of the above
+  TrajectoryStatus = 0x44,
+  // Host to emulator: a ClockSyncPayload
+  ClockSync = 0x50,
+  // Host to emulator: a StepPayload, in lockstep, lockstep.hpp
+  Step = 0x60,
+  // Emulator to host: a StepAckPayload, once the step is applied
+  StepAck = 0x61,
+};
+
+// Capabilities negotiated by Hello
+constexpr uint16_t CapSetState = 0x0001;
+constexpr uint16_t CapOutputs = 0x0002;
+constexpr uint16_t CapOutputEvents = 0x0004;
+constexpr uint16_t CapHistory = 0x0008;
+constexpr uint16_t CapTrajectory = 0x0010;
+constexpr uint16_t CapSimTime = 0x0020;
+constexpr uint16_t CapLockstep = 0x0040;
+constexpr uint16_t Capabilities =
+    CapSetState | CapOutputs | CapOutputEvents | CapHistory | CapTrajectory | CapSimTime | CapLockstep;
+
+constexpr int HeaderSize = 4;
+constexpr int CrcSize = 2;
+constexpr int MaxPayload = 64;
+constexpr int MaxFrame = HeaderSize + MaxPayload + CrcSize;
+// COBS adds a byte per 254, and one to start, plus the two delimiters
+constexpr int MaxEncoded = MaxFrame + MaxFrame / 254 + 1 + 2;
+
+// CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF, no reflection
+// or final XOR. The table is generated at compile time, as for the SHT CRC-8.
+struct Crc16Table {
+  uint16_t entries[256];
+
+  constexpr Crc16Table() : entries() {
+    for (int value = 0; value < 256; ++value) {
+      uint16_t crc = uint16_t(value << 8);
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc & 0x8000) ? uint16_t(crc << 1) ^ 0x1021 : uint16_t(crc << 1);
+      }
+      entries[value] = crc;
+    }
+  }
+};
+
+inline constexpr Crc16Table Crc16Lookup;
+
+constexpr uint16_t crc16(const uint8_t *data, size_t length) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; ++i) {
+    crc = uint16_t(crc << 8) ^ Crc16Lookup.entries[(crc >> 8) ^ data[i]];
+  }
+  return crc;
+}
+
+// The check value of the algorithm
+constexpr uint8_t Crc16TestData[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+static_assert(crc16(Crc16TestData, 9) == 0x29B1, "CRC-16/CCITT-FALSE check value");
+
+// COBS encode length bytes of in, returning the encoded length. out must hold
+// length + length / 254 + 1 bytes.
+size_t cobs_encode(const uint8_t *in, size_t length, uint8_t *out);
+
+// Decode a COBS block without its delimiter into out, which may be in.
+// Returns the decoded length, or 0 if the block is malformed.
+size_t cobs_decode(const uint8_t *in, size_t length, uint8_t *out);
+
+inline void put_u16(uint8_t *out, uint16_t value) {
+  out[0] = uint8_t(value);
+  out[1] = uint8_t(value >> 8);
+}
+
+inline void put_u32(uint8_t *out, uint32_t value) {
+  put_u16(out, uint16_t(value));
+  put_u16(out + 2, uint16_t(value >> 16));
+}
+
+inline void put_u64(uint8_t *out, uint64_t value) {
+  put_u32(out, uint32_t(value));
+  put_u32(out + 4, uint32_t(value >> 32));
+}
+
+inline uint16_t get_u16(const uint8_t *in) {
+  return uint16_t(in[0] | (in[1] << 8));
+}
+
+inline uint32_t get_u32(const uint8_t *in) {
+  return get_u16(in) | (uint32_t(get_u16(in + 2)) << 16);
+}
+
+inline uint64_t get_u64(const uint8_t *in) {
+  return get_u32(in) | (uint64_t(get_u32(in + 4)) << 32);
+}
+
+struct Frame {
+  uint8_t version;
+  uint8_t type;
+  uint16_t sequence;
+  uint8_t length;
+  uint8_t payload[MaxPayload];
+};
+
+// The wire bytes of frame, delimiters included, into out, which must hold
+// MaxEncoded bytes. Returns their number.
+size_t encode_frame(const Frame &frame, uint8_t *out);
+
+// Typed payloads, with their encoded sizes
+struct HelloPayload {
+  constexpr static uint8_t Size = 3;
+  uint8_t version;
+  uint16_t capabilities;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// Setpoints in thousandths of a degC, %RH and Pa, of the fields flagged, and
+// the host's time in ms when it sent them
+struct StatePayload {
+  constexpr static uint8_t Size = 17;
+  constexpr static uint8_t HasT = 1;
+  constexpr static uint8_t HasH = 2;
+  constexpr static uint8_t HasP = 4;
+  uint8_t fields;
+  int32_t T_milli;
+  int32_t H_milli;
+  int32_t P_milli;
+  uint32_t host_ms;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// The thermostat outputs, bit n for input n, and the emulator's micros() when
+// they were sampled
+struct OutputsPayload {
+  constexpr static uint8_t Size = 5;
+  uint8_t inputs;
+  uint32_t time_us;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// Changes of the thermostat outputs, each with the emulator's micros() at its
+// first edge, oldest first
+struct OutputEventsPayload {
+  constexpr static int EventSize = 5;
+  constexpr static int MaxEvents = (MaxPayload - 1) / EventSize;
+  uint8_t count;
+  OutputsPayload events[MaxEvents];
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// Events stamped with the simulation time, sim_clock.hpp, oldest first
+struct SimEventsPayload {
+  constexpr static int EventSize = 9;
+  constexpr static int MaxEvents = (MaxPayload - 1) / EventSize;
+  struct Event {
+    uint8_t value;
+    uint64_t sim_us;
+  };
+  uint8_t count;
+  Event events[MaxEvents];
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// The history from from_ms to to_ms, in the emulator's millis()
+struct HistoryRequestPayload {
+  constexpr static uint8_t Size = 8;
+  uint32_t from_ms;
+  uint32_t to_ms;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// Whether the export was cut short by the oldest history being dropped
+struct HistoryEndPayload {
+  constexpr static uint8_t Size = 1;
+  bool cut;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// The fields the trajectory drives, TrajectoryPoint::HasT and so on
+struct TrajectoryBeginPayload {
+  constexpr static uint8_t Size = 1;
+  uint8_t fields;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// The number of points sent, to check none was lost
+struct TrajectoryEndPayload {
+  constexpr static uint8_t Size = 4;
+  uint32_t points;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+constexpr int TrajectoryPointsPerFrame = MaxPayload / TrajectoryPoint::Size;
+
+struct TrajectoryCommandPayload {
+  constexpr static uint8_t Size = 21;
+  TrajectoryControl control;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// Playback as it stands, with the points of the trajectory loaded and of an
+// upload in progress
+struct TrajectoryStatusPayload {
+  constexpr static uint8_t Size = 18;
+  enum Error : uint8_t { None, Storage, LostPoints, BadFrame, NoUpload };
+  uint8_t state;
+  uint8_t error;
+  uint32_t points;
+  uint32_t received;
+  uint32_t position_s;
+  uint32_t scale_milli;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// The host's simulation time in us when it sent this, and its scale, in
+// simulation ms per 1000 ms of real time, 0 while it is held
+struct ClockSyncPayload {
+  constexpr static uint8_t Size = 12;
+  uint64_t sim_us;
+  uint32_t scale_milli;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// A lockstep step: its number, the setpoints of the fields flagged as in a
+// StatePayload, and with HasSimTime the simulation time of the step, which
+// the clock is held at until the next
+struct StepPayload {
+  constexpr static uint8_t Size = 25;
+  constexpr static uint8_t HasSimTime = 8;
+  uint32_t step;
+  uint8_t fields;
+  int32_t T_milli;
+  int32_t H_milli;
+  int32_t P_milli;
+  uint64_t sim_us;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// The acknowledgement of a step
+struct StepAckPayload {
+  constexpr static uint8_t Size = 21;
+  ::StepAck ack;
+
+  void put(Frame &frame) const;
+  bool get(const Frame &frame);
+};
+
+// Splits the bytes from the link into JSON text and frames. A zero byte
+// starts a frame and the next one ends it; a zero right after a zero starts
+// the frame again, so a reader that lost a delimiter is back in step by the
+// next frame.
+class FrameReader {
+public:
+  enum class Result : uint8_t { Text, None, Frame, Invalid };
+
+  // Take one byte. Text means the byte is for the JSON parser, Frame that it
+  // completed a valid frame, Invalid that it completed a frame that failed to
+  // decode or its CRC.
+  Result feed(uint8_t byte);
+
+  const Frame &frame() const { return frame_; }
+  uint32_t invalid_frames() const { return invalid_frames_; }
+
+private:
+  Result end_frame();
+
+  bool in_frame_ = false;
+  int length_ = 0;
+  uint8_t buffer_[MaxEncoded];
+  Frame frame_ = {};
+  uint32_t invalid_frames_ = 0;
+};
+
+} // namespace protocol
+
+#endif // HOST_PROTOCOL_INCLUDED
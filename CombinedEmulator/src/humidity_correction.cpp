@@ -0,0 +1,62 @@
+#include "humidity_correction.hpp"
+
+namespace {
+
+// Linear interpolation from a to b by fraction, a Q24 value that may be
+// outside 0..1 when extrapolating, rounded to nearest
+int32_t lerp(int32_t a, int32_t b, int32_t fraction) {
+  return a + int32_t((int64_t(b - a) * fraction + (1 << 23)) >> 24);
+}
+
+} // namespace
+
+HumidityCorrection::HumidityCorrection() {
+  // Two points per axis with corrected equal to input is the identity
+  const Axis T = {0, 100000, 2};
+  const Axis H = {0, 100000, 2};
+  const int32_t identity[] = {0, 100000, 0, 100000};
+  load(T, H, identity);
+}
+
+bool HumidityCorrection::load(const Axis &T, const Axis &H, const int32_t *values) {
+  const auto valid = [](const Axis &axis) {
+    return axis.count >= 2 && axis.count <= MaxPoints && axis.step > 1;
+  };
+  if (!valid(T) || !valid(H)) {
+    return false;
+  }
+
+  T_ = T;
+  H_ = H;
+  T_inverse_ = ((int64_t(1) << 40) + T.step / 2) / T.step;
+  H_inverse_ = ((int64_t(1) << 40) + H.step / 2) / H.step;
+  for (int t = 0; t < T.count; ++t) {
+    for (int h = 0; h < H.count; ++h) {
+      values_[t][h] = values[t * H.count + h];
+    }
+  }
+  return true;
+}
+
+HumidityCorrection::Position HumidityCorrection::locate(const Axis &axis, int64_t inverse, int32_t value) {
+  // Q24 cells from the origin. A Q24 fraction keeps the interpolation exact
+  // to the thousandth for cells up to 100 %RH wide, and the rounded
+  // reciprocal is within one part in 2^20 of the step.
+  const int64_t cells = (int64_t(value - axis.origin) * inverse + (1 << 15)) >> 16;
+  int index = int(cells >> 24);
+  if (index < 0) {
+    index = 0;
+  } else if (index > axis.count - 2) {
+    index = axis.count - 2;
+  }
+  return Position{index, int32_t(cells - (int64_t(index) << 24))};
+}
+
+int32_t HumidityCorrection::apply(int32_t T_milli, int32_t H_milli) const {
+  const Position t = locate(T_, T_inverse_, T_milli);
+  const Position h = locate(H_, H_inverse_, H_milli);
+  const int32_t *low = values_[t.index];
+  const int32_t *high = values_[t.index + 1];
+  return lerp(lerp(low[h.index], low[h.index + 1], h.fraction), lerp(high[h.index], high[h.index + 1], h.fraction),
+              t.fraction);
+}
@@ -0,0 +1,88 @@
+#ifndef HUMIDITY_CORRECTION_INCLUDED
+#define HUMIDITY_CORRECTION_INCLUDED
+
+#include <stdint.h>
+
+// Correction from the humidity the host asks for to the humidity an emulated
+// sensor reports, as a function of temperature and humidity. The ecobee
+// applies its own correction to each sensor, so the emulator pre-distorts the
+// setpoint by the inverse of it.
+//
+// The correction is a grid of corrected humidities over evenly spaced
+// temperatures and humidities, interpolated bilinearly in fixed point. A
+// lookup is a constant number of integer operations, with no division, and a
+// bilinear fit of the form a H + b T + c H T + d is reproduced exactly.
+// Outside the grid the edge cells are extrapolated linearly.
+class HumidityCorrection {
+public:
+  constexpr static int MaxPoints = 16;
+
+  // Evenly spaced grid points, in thousandths of a degC or %RH
+  struct Axis {
+    int32_t origin;
+    int32_t step;
+    uint8_t count;
+  };
+
+  // The identity correction
+  HumidityCorrection();
+
+  // Load a grid of T.count x H.count corrected humidities in thousandths of a
+  // %RH, one row per temperature. Leaves the correction unchanged and returns
+  // false if an axis has fewer than 2 or more than MaxPoints points or a step
+  // under 0.002.
+  bool load(const Axis &T, const Axis &H, const int32_t *values);
+
+  // Corrected humidity for temperature T_milli and humidity H_milli
+  int32_t apply(int32_t T_milli, int32_t H_milli) const;
+
+  const Axis &T_axis() const { return T_; }
+  const Axis &H_axis() const { return H_; }
+  int32_t value(int t, int h) const { return values_[t][h]; }
+
+private:
+  // Position on an axis, as a cell and a Q24 fraction of it
+  struct Position {
+    int index;
+    int32_t fraction;
+  };
+
+  static Position locate(const Axis &axis, int64_t inverse, int32_t value);
+
+  Axis T_;
+  Axis H_;
+  // 2^40 / step of each axis, so locating a value needs no division
+  int64_t T_inverse_;
+  int64_t H_inverse_;
+  int32_t values_[MaxPoints][MaxPoints];
+};
+
+// The correction the emulator has used for both sensors, a fit of the
+// ecobee's readings against a reference, evaluated on a grid at compile time.
+// Being bilinear in T and H, the grid reproduces it exactly.
+struct HumidityFitGrid {
+  constexpr static double A = 0.740036139896326;
+  constexpr static double B = -0.0017671331702309168;
+  constexpr static double C = 0.0005783465707743796;
+  constexpr static double D = 0.05096062356332354;
+
+  constexpr static HumidityCorrection::Axis T = {-40000, 10000, 13};
+  constexpr static HumidityCorrection::Axis H = {0, 10000, 11};
+
+  int32_t values[T.count * H.count];
+
+  constexpr HumidityFitGrid() : values() {
+    for (int t = 0; t < T.count; ++t) {
+      for (int h = 0; h < H.count; ++h) {
+        const double T_degC = (T.origin + t * T.step) / 1000.0;
+        const double H_percent = (H.origin + h * H.step) / 1000.0;
+        const double corrected = A * H_percent + B * T_degC + C * H_percent * T_degC + D;
+        values[t * H.count + h] = int32_t(corrected * 1000.0 + (corrected < 0 ? -0.5 : 0.5));
+      }
+    }
+  }
+};
+
+inline constexpr HumidityFitGrid HumidityFit;
+
+#endif // HUMIDITY_CORRECTION_INCLUDED
@@ -0,0 +1,43 @@
+#ifndef ISR_STATS_INCLUDED
+#define ISR_STATS_INCLUDED
+
+#include <Arduino.h>
+
+// Run time of an interrupt handler in microseconds.
+// The handler records into it, and the main loop reads it for reporting. The
+// reader may see fields from different invocations, which is fine for a report.
+struct IsrStats {
+  volatile uint32_t count = 0;
+  volatile uint32_t total_us = 0;
+  volatile uint32_t max_us = 0;
+
+  void record(uint32_t elapsed_us) {
+    count = count + 1;
+    total_us = total_us + elapsed_us;
+    if (elapsed_us > max_us) {
+      max_us = elapsed_us;
+    }
+  }
+
+  void reset() {
+    count = 0;
+    total_us = 0;
+    max_us = 0;
+  }
+};
+
+// Records the time from construction to the end of the enclosing scope
+class IsrTimer {
+public:
+  explicit IsrTimer(IsrStats &stats) : stats_(stats), start_(micros()) {}
+  ~IsrTimer() { stats_.record(micros() - start_); }
+
+  IsrTimer(const IsrTimer &) = delete;
+  IsrTimer &operator=(const IsrTimer &) = delete;
+
+private:
+  IsrStats &stats_;
+  const uint32_t start_;
+};
+
+#endif // ISR_STATS_INCLUDED
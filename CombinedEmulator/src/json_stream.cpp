@@ -0,0 +1,273 @@
+#include "json_stream.hpp"
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool is_number_char(char c) {
+  return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+} // namespace
+
+void JsonStreamParser::reset() {
+  state_ = State::Idle;
+  depth_ = 0;
+  key_length_ = 0;
+  token_length_ = 0;
+  token_[0] = '\0';
+  value_depth_ = 0;
+  value_index_ = -1;
+  type_ = Type::Null;
+  number_ = 0;
+}
+
+bool JsonStreamParser::at(const char *key0) const {
+  return value_depth_ == 1 && strcmp(keys_[0], key0) == 0;
+}
+
+bool JsonStreamParser::at(const char *key0, const char *key1) const {
+  return value_depth_ == 2 && object_[1] && strcmp(keys_[0], key0) == 0 && strcmp(keys_[1], key1) == 0;
+}
+
+bool JsonStreamParser::append(char c) {
+  if (token_length_ == TokenSize - 1) {
+    return false;
+  }
+  token_[token_length_++] = c;
+  return true;
+}
+
+uint8_t JsonStreamParser::feed(char c) {
+  switch (state_) {
+  case State::Idle:
+    if (is_space(c)) {
+      return 0;
+    }
+    return c == '{' ? open(true) : fail(c);
+
+  case State::KeyStart:
+    if (is_space(c)) {
+      return 0;
+    }
+    if (c == '"') {
+      key_length_ = 0;
+      state_ = State::Key;
+      return 0;
+    }
+    return c == '}' ? after_value(c) : fail(c);
+
+  case State::Key:
+    if (c == '"') {
+      keys_[depth_ - 1][key_length_] = '\0';
+      state_ = State::Colon;
+    } else if (c == '\\') {
+      state_ = State::KeyEscape;
+    } else if (key_length_ < KeySize - 1) {
+      // A longer key is cut short, and then matches none the reader knows
+      keys_[depth_ - 1][key_length_++] = c;
+    }
+    return 0;
+
+  case State::KeyEscape:
+    if (key_length_ < KeySize - 1) {
+      keys_[depth_ - 1][key_length_++] = c;
+    }
+    state_ = State::Key;
+    return 0;
+
+  case State::Colon:
+    if (is_space(c)) {
+      return 0;
+    }
+    if (c != ':') {
+      return fail(c);
+    }
+    state_ = State::ValueStart;
+    return 0;
+
+  case State::ValueStart:
+    if (is_space(c)) {
+      return 0;
+    }
+    return start_value(c);
+
+  case State::String:
+    if (c == '"') {
+      return end_scalar(Type::String);
+    }
+    if (c == '\\') {
+      state_ = State::StringEscape;
+    } else {
+      // A longer string is cut short
+      append(c);
+    }
+    return 0;
+
+  case State::StringEscape:
+    append(c == 'n' ? '\n' : (c == 't' ? '\t' : c));
+    state_ = State::String;
+    return 0;
+
+  case State::Number:
+    if (is_number_char(c)) {
+      return append(c) ? 0 : fail(c);
+    } else {
+      token_[token_length_] = '\0';
+      char *end;
+      number_ = strtod(token_, &end);
+      if (end != token_ + token_length_) {
+        return fail(c);
+      }
+      const uint8_t value = end_scalar(Type::Number);
+      return value | after_value(c);
+    }
+
+  case State::Literal:
+    if (c >= 'a' && c <= 'z') {
+      return append(c) ? 0 : fail(c);
+    } else {
+      token_[token_length_] = '\0';
+      Type type;
+      if (strcmp(token_, "true") == 0) {
+        type = Type::True;
+      } else if (strcmp(token_, "false") == 0) {
+        type = Type::False;
+      } else if (strcmp(token_, "null") == 0) {
+        type = Type::Null;
+      } else {
+        return fail(c);
+      }
+      const uint8_t value = end_scalar(type);
+      return value | after_value(c);
+    }
+
+  case State::AfterValue:
+    return after_value(c);
+
+  case State::Skip:
+  case State::SkipString:
+  case State::SkipEscape:
+    return skip(c);
+  }
+  return 0;
+}
+
+uint8_t JsonStreamParser::start_value(char c) {
+  token_length_ = 0;
+  if (c == '"') {
+    state_ = State::String;
+    return 0;
+  }
+  if (c == '{' || c == '[') {
+    return open(c == '{');
+  }
+  if (c == ']' && !object_[depth_ - 1] && indices_[depth_ - 1] == 0) {
+    // An empty array
+    return after_value(c);
+  }
+  if (c == '-' || (c >= '0' && c <= '9')) {
+    state_ = State::Number;
+  } else if (c >= 'a' && c <= 'z') {
+    state_ = State::Literal;
+  } else {
+    return fail(c);
+  }
+  append(c);
+  return 0;
+}
+
+uint8_t JsonStreamParser::end_scalar(Type type) {
+  token_[token_length_] = '\0';
+  value_depth_ = depth_;
+  value_index_ = indices_[depth_ - 1];
+  type_ = type;
+  state_ = State::AfterValue;
+  return Value;
+}
+
+uint8_t JsonStreamParser::after_value(char c) {
+  if (is_space(c)) {
+    return 0;
+  }
+  const bool object = object_[depth_ - 1];
+  if (c == ',') {
+    if (object) {
+      state_ = State::KeyStart;
+    } else {
+      ++indices_[depth_ - 1];
+      state_ = State::ValueStart;
+    }
+    return 0;
+  }
+  if ((c == '}' && object) || (c == ']' && !object)) {
+    --depth_;
+    if (depth_ == 0) {
+      state_ = State::Idle;
+      return MessageEnd;
+    }
+    state_ = State::AfterValue;
+    return 0;
+  }
+  return fail(c);
+}
+
+uint8_t JsonStreamParser::open(bool object) {
+  if (depth_ == MaxDepth) {
+    // Skipped along with the containers it is in
+    return fail(object ? '{' : '[');
+  }
+  object_[depth_] = object;
+  keys_[depth_][0] = '\0';
+  indices_[depth_] = object ? -1 : 0;
+  ++depth_;
+  state_ = object ? State::KeyStart : State::ValueStart;
+  return 0;
+}
+
+// Drop the message, and skip the rest of it from this byte on
+uint8_t JsonStreamParser::fail(char c) {
+  ++errors_;
+  state_ = State::Skip;
+  skip(c);
+  return Error;
+}
+
+// A byte of a dropped message. Its brackets are counted, outside strings,
+// until they close; a newline ends it whatever is still open. A '{' only
+// starts the next message once nothing is.
+uint8_t JsonStreamParser::skip(char c) {
+  if (c == '\n') {
+    depth_ = 0;
+    state_ = State::Idle;
+    return 0;
+  }
+  switch (state_) {
+  case State::SkipString:
+    if (c == '\\') {
+      state_ = State::SkipEscape;
+    } else if (c == '"') {
+      state_ = State::Skip;
+    }
+    return 0;
+  case State::SkipEscape:
+    state_ = State::SkipString;
+    return 0;
+  default:
+    break;
+  }
+  if (c == '"') {
+    state_ = State::SkipString;
+  } else if (c == '{' && depth_ == 0) {
+    return open(true);
+  } else if (c == '{' || c == '[') {
+    ++depth_;
+  } else if ((c == '}' || c == ']') && depth_ > 0 && --depth_ == 0) {
+    state_ = State::Idle;
+  }
+  return 0;
+}
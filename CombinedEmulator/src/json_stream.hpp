@@ -0,0 +1,101 @@
+#ifndef JSON_STREAM_INCLUDED
+#define JSON_STREAM_INCLUDED
+
+#include <stdint.h>
+
+// Incremental JSON parser for the serial control channel.
+//
+// Bytes go in one at a time, as they arrive, and the parser never waits for
+// more or allocates: its whole state is the fixed buffers below. Each scalar
+// value is reported with its path, the member key or array index at every
+// level, and the end of each top level object is reported, so any number of
+// messages can be taken from whatever the serial buffer holds.
+//
+// Messages are top level objects, back to back, with or without whitespace or
+// newlines between them. After malformed input the parser skips the rest of
+// the message, up to where its brackets close or the next newline, and carries
+// on. A '{' inside the dropped message never starts a new one.
+class JsonStreamParser {
+public:
+  constexpr static int MaxDepth = 4;
+  constexpr static int KeySize = 24;
+  constexpr static int TokenSize = 32;
+
+  // What a byte completed, as flags, since one byte can end a value and the
+  // objects around it
+  constexpr static uint8_t Value = 1;
+  constexpr static uint8_t MessageEnd = 2;
+  constexpr static uint8_t Error = 4;
+
+  enum class Type : uint8_t { Number, String, True, False, Null };
+
+  JsonStreamParser() { reset(); }
+
+  // Drop any partial message
+  void reset();
+
+  uint8_t feed(char c);
+
+  // The value just reported, at depth levels of containers below the message.
+  // A member of the message is at depth 1. The byte that ends a number or a
+  // literal may also close containers or move on to the next element, so the
+  // path of the value is kept apart from where the parser has got to.
+  int depth() const { return value_depth_; }
+  // Key of the member at level, or "" for an array element
+  const char *key(int level) const { return keys_[level]; }
+  // Index of the array element at level, or -1 for an object member
+  int index(int level) const { return level == value_depth_ - 1 ? value_index_ : indices_[level]; }
+  bool at(const char *key0) const;
+  bool at(const char *key0, const char *key1) const;
+
+  Type type() const { return type_; }
+  double number() const { return number_; }
+  // String values longer than TokenSize - 1 are cut short
+  const char *string() const { return token_; }
+
+  // Malformed messages dropped so far
+  uint32_t errors() const { return errors_; }
+
+private:
+  enum class State : uint8_t {
+    Idle,
+    KeyStart,
+    Key,
+    KeyEscape,
+    Colon,
+    ValueStart,
+    String,
+    StringEscape,
+    Number,
+    Literal,
+    AfterValue,
+    Skip,
+    SkipString,
+    SkipEscape
+  };
+
+  uint8_t start_value(char c);
+  uint8_t end_scalar(Type type);
+  uint8_t after_value(char c);
+  uint8_t open(bool object);
+  uint8_t fail(char c);
+  uint8_t skip(char c);
+  bool append(char c);
+
+  State state_;
+  // Open containers, also while a malformed message is skipped
+  int depth_;
+  bool object_[MaxDepth + 1];
+  char keys_[MaxDepth + 1][KeySize];
+  int indices_[MaxDepth + 1];
+  int key_length_;
+  char token_[TokenSize];
+  int token_length_;
+  int value_depth_;
+  int value_index_;
+  Type type_;
+  double number_;
+  uint32_t errors_ = 0;
+};
+
+#endif // JSON_STREAM_INCLUDED
@@ -0,0 +1,34 @@
+#include "lockstep.hpp"
+
+Lockstep::Action Lockstep::receive(uint32_t step, int32_t T_milli, int32_t H_milli, int32_t P_milli) {
+  if (step == 0) {
+    return Action::Ignore;
+  }
+  if (started_ && step == ack_.step) {
+    ++resent_;
+    return pending_ ? Action::Apply : Action::Resend;
+  }
+  if (started_ && step != 1 && int32_t(step - ack_.step) < 0) {
+    ++stale_;
+    return Action::Ignore;
+  }
+  started_ = true;
+  pending_ = true;
+  ack_ = StepAck{step, T_milli, H_milli, P_milli, 0, 0};
+  ++steps_;
+  return Action::Apply;
+}
+
+bool Lockstep::applied(uint32_t step, uint8_t inputs, uint32_t time_us) {
+  if (!pending_ || step != ack_.step) {
+    return false;
+  }
+  ack_.inputs = inputs;
+  ack_.time_us = time_us;
+  pending_ = false;
+  return true;
+}
+
+void Lockstep::reset() {
+  *this = Lockstep();
+}
@@ -0,0 +1,59 @@
+#ifndef LOCKSTEP_INCLUDED
+#define LOCKSTEP_INCLUDED
+
+#include <stdint.h>
+
+// Lockstep co-simulation. The host sends each step's setpoints with a step
+// number and waits for the acknowledgement before it advances the
+// simulation: the setpoints as core1 gave them to the sensors, and the
+// thermostat outputs as they stood when it did. The host needs no timer, and
+// runs as fast as the round trip goes.
+//
+// Each step is acknowledged once it is applied. The last step sent again, its
+// acknowledgement lost, gets the acknowledgement again; one sent again before
+// core1 has applied it is applied again, in case its setpoints were dropped,
+// and an older one is ignored. Step 1 starts a new run, and step 0 is not a
+// step.
+
+// What a step's acknowledgement holds, in thousandths of a degC, %RH and Pa,
+// bit n of inputs for input n, and time_us the micros() the outputs were
+// read at
+struct StepAck {
+  uint32_t step;
+  int32_t T_milli;
+  int32_t H_milli;
+  int32_t P_milli;
+  uint8_t inputs;
+  uint32_t time_us;
+};
+
+class Lockstep {
+public:
+  enum class Action : uint8_t { Apply, Resend, Ignore };
+
+  // A step from the host with the setpoints it sets. Apply means hand them to
+  // core1; Resend, send ack() again.
+  Action receive(uint32_t step, int32_t T_milli, int32_t H_milli, int32_t P_milli);
+
+  // Core1 gave step's setpoints to the sensors, with the outputs at inputs
+  // then. Returns true, with ack() ready to send, if it is the step awaited.
+  bool applied(uint32_t step, uint8_t inputs, uint32_t time_us);
+
+  void reset();
+
+  const StepAck &ack() const { return ack_; }
+  bool pending() const { return pending_; }
+  uint32_t steps() const { return steps_; }
+  uint32_t resent() const { return resent_; }
+  uint32_t stale() const { return stale_; }
+
+private:
+  bool started_ = false;
+  bool pending_ = false;
+  StepAck ack_ = {};
+  uint32_t steps_ = 0;
+  uint32_t resent_ = 0;
+  uint32_t stale_ = 0;
+};
+
+#endif // LOCKSTEP_INCLUDED
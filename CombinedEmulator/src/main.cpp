@@ -1,39 +1,306 @@
 #include "bme.hpp"
+#include "core_link.hpp"
+#include "gpio_capture.hpp"
+#include "host_command.hpp"
+#include "history.hpp"
+#include "host_protocol.hpp"
+#include "humidity_correction.hpp"
+#include "lockstep.hpp"
 #include "sht.hpp"
+#include "sim_clock.hpp"
+#include "trajectory.hpp"
 #include <Arduino.h>
+#include <LittleFS.h>
 #include <WiFi.h>
 #include <WebServer.h>
-#include <ArduinoJson.h>
 
 // This is a combined BME and SHT emulator
 // This used both Wire and Wire1 interfaces available on the Pico
+//
+// Core1 owns the sensors: it begins both buses, so their I2C interrupts run
+// there, and setup1/loop1 are the only code that touches sensor state.
+// Core0 runs WiFi, HTTP and serial, and talks to core1 through the queues in
+// core_link.hpp.
+
+// Each bus serves one emulated sensor. Either may be swapped for the other
+// kind, or moved to an alternate address, e.g. a second BME280 at 0x77 on Wire1.
+// The SHT4x may also be swapped for an SHT3x, sht::Sht3xEmulator in sht3x.hpp.
+bme::Bme280Emulator<Wire> bme280(bme::BME280_ADDRESS, 16, 17);
+sht::Sht4xEmulator<Wire1> sht4x(sht::SHT4x_DEFAULT_ADDR, 18, 19);
 
 WebServer server(80);
 constexpr char ssid[] = EMBEDDED_SSID; //  your network SSID
 constexpr char pass[] = EMBEDDED_PASS; //  your network password
 double T_store;
 double H_store;
+double P_store;
+int32_t T_store_milli;
 
-void set_T(const double &T) {
-  T_store = T;
-  double T_adjusted = (T_store + 4.3766) / 0.9861;
+// Humidity correction of each sensor, as a function of the temperature and
+// humidity the host sends. Both start from the fit in humidity_correction.hpp,
+// and either can be replaced from serial or from a file in flash.
+HumidityCorrection sht_humidity;
+HumidityCorrection bme_humidity;
+constexpr char sht_humidity_file[] = "/sht_humidity.json";
+constexpr char bme_humidity_file[] = "/bme_humidity.json";
+
+// What the host sends, true temperature in degC, humidity in %RH and
+// pressure in Pa
+struct State {
+  double T;
+  double H;
+  double P;
+};
+
+// Core0 to core1 setpoints, and core1 to core0 thermostat outputs
+SetpointQueue setpoint_queue;
+GpioQueue gpio_queue;
+
+// The thermostat outputs on GPIO 0 to 2, captured by edge interrupts on
+// core1, and their debounce time, which the host may change
+constexpr uint8_t OutputPinCount = 3;
+constexpr uint32_t OutputPinMask = (1u << OutputPinCount) - 1;
+EdgeCapture output_capture;
+volatile uint32_t output_debounce_us = EdgeCapture::DefaultDebounceUs;
+
+// The ecobee's reads of the sensors, timed by core1
+SensorReadQueue sensor_read_queue;
+uint32_t sensor_reads = 0;
+
+// The host's simulation time, once it syncs it, which output changes and
+// sensor reads are reported in
+SimClock sim_clock;
+
+// Lockstep steps, acknowledged once core1 has applied them
+StepQueue step_queue;
+Lockstep lockstep;
+
+// The last step core1 applied while step_queue was full, only on core1. It
+// is offered again on every run until core0 takes it, so each step is
+// acknowledged. A later step supersedes it, as the host only waits on that.
+StepApplied pending_step;
+bool step_pending = false;
+
+// Hand core0 the pending step if there is room
+void offer_step() {
+  if (step_pending && step_queue.push(pending_step)) {
+    step_pending = false;
+  }
+}
+
+// Setpoints core0 could not queue because core1 had fallen behind
+volatile uint32_t setpoint_drops = 0;
+
+// Time from queueing a setpoint to its registers being published, recorded by
+// core1, and the longest gap between two runs of loop1
+IsrStats setpoint_latency;
+IsrStats sensor_loop_stats;
+
+// micros() at the start of setup1, written before the buses begin. The time
+// to the BME280 first answering the controller is reported once from loop().
+volatile uint32_t sensors_start_us = 0;
+static bool answered_reported_ = false;
+
+// Binary frames taken from the host, and the host's time stamp on the last
+// setpoints it sent in one
+uint32_t host_frames = 0;
+uint32_t host_time_ms = 0;
+
+// The serial control channel, parsed as the bytes arrive. A partial message
+// waits in the reader for the rest, and every message completed by the bytes
+// available is applied in this loop. Binary frames, host_protocol.hpp, are
+// split out of the same bytes, and JSON stays in use until the host asks for
+// frames.
+HostCommandReader serial_reader;
+protocol::FrameReader frame_reader;
+
+// Capabilities the host was granted by its Hello, none for a JSON host, and
+// the sequence number of the next frame sent
+uint16_t host_capabilities = 0;
+uint16_t host_sequence = 0;
+
+// What the ecobee was shown and what it did, logged on core0 whenever the
+// setpoints or the outputs change, about 64 KB. A serial export of it runs a
+// few frames per loop until it is done.
+HistoryLog history;
+uint8_t history_inputs = 0;
+bool history_exporting = false;
+HistoryLog::Export history_export;
+
+// A setpoint trajectory in flash, played on core0 every TrajectoryTickMs once
+// the host starts it. An upload writes the file as the points arrive.
+constexpr char trajectory_file[] = "/trajectory.bin";
+constexpr uint32_t TrajectoryTickMs = 200;
+
+// Points read from the trajectory file as playback reaches them: a header of
+// "TRJ1" and the fields played, then TrajectoryPoint::Size bytes a point
+class FileTrajectory : public TrajectorySource {
+public:
+  constexpr static size_t HeaderSize = 8;
+
+  bool open(uint8_t &fields) {
+    file_ = LittleFS.open(trajectory_file, "r");
+    uint8_t header[HeaderSize];
+    if (!file_ || file_.read(header, HeaderSize) != HeaderSize || memcmp(header, "TRJ1", 4) != 0) {
+      close();
+      return false;
+    }
+    fields = header[4];
+    size_ = (file_.size() - HeaderSize) / TrajectoryPoint::Size;
+    return true;
+  }
+
+  void close() {
+    if (file_) {
+      file_.close();
+    }
+    size_ = 0;
+  }
+
+  uint32_t size() const override { return size_; }
+
+  bool read(uint32_t index, TrajectoryPoint &point) override {
+    uint8_t bytes[TrajectoryPoint::Size];
+    if (index >= size_ || !file_.seek(HeaderSize + index * TrajectoryPoint::Size) ||
+        file_.read(bytes, sizeof(bytes)) != sizeof(bytes)) {
+      return false;
+    }
+    point.get(bytes);
+    return true;
+  }
+
+private:
+  File file_;
+  uint32_t size_ = 0;
+};
 
-  sht::set_T(T_adjusted);
-  bme::set_T(T_adjusted);
+FileTrajectory trajectory_source;
+TrajectoryPlayer trajectory;
+File trajectory_upload;
+uint32_t trajectory_received = 0;
+
+void log_history(uint32_t time_ms) {
+  history.append(HistorySample{time_ms, T_store_milli, int32_t(lround(H_store * 1000)),
+                               int32_t(lround(P_store * 1000)), history_inputs});
+}
+
+// Compute the setpoints of every sensor for state, and hand them to core1 in
+// one command, so each sensor publishes its registers once and the ecobee
+// never reads a new temperature next to an old humidity. The humidity
+// corrections depend on temperature, so they are reapplied whenever either
+// changes; each sensor skips the setpoints that did not move. Setpoints of a
+// lockstep step carry its number, so core1 reports when it applied them.
+void set_state(const State &state, uint32_t step = 0) {
+  T_store = state.T;
+  H_store = state.H;
+  P_store = state.P;
+  T_store_milli = lround(T_store * 1000);
+  const double T_adjusted = (T_store + 4.3766) / 0.9861;
+  const int32_t H_milli = lround(H_store * 1000);
+
+  const int32_t sht_H = sht_humidity.apply(T_store_milli, H_milli);
+  const int32_t bme_H = bme_humidity.apply(T_store_milli, H_milli);
+
+  const SetpointCommand command = {T_adjusted,
+                                   sht_H / 1000.0,
+                                   int32_t(lround(T_adjusted * 1000)),
+                                   uint32_t(bme_H < 0 ? 0 : bme_H),
+                                   P_store > 0 ? uint32_t(lround(P_store * 1000)) : 0,
+                                   uint32_t(micros()),
+                                   step};
+  if (!setpoint_queue.push(command)) {
+    setpoint_drops = setpoint_drops + 1;
+  }
+  log_history(millis());
+}
+
+void set_T(const double &T) {
+  set_state(State{T, H_store, P_store});
 }
 
 void set_H(const double &H) {
-  H_store = H;
+  set_state(State{T_store, H, P_store});
+}
+
+bool load_humidity_file(HumidityCorrection &correction, const char *path) {
+  File file = LittleFS.open(path, "r");
+  if (!file) {
+    return false;
+  }
+  static CorrectionGrid grid;
+  const bool loaded = read_grid(file, grid) && grid.load_into(correction);
+  file.close();
+  return loaded;
+}
+
+bool save_humidity_file(const CorrectionGrid &grid, const char *path) {
+  File file = LittleFS.open(path, "w");
+  if (!file) {
+    return false;
+  }
+  grid.print(file);
+  file.close();
+  return true;
+}
+
+// {"humidity_correction": {"sensor": "sht" or "bme", <grid>, "save": true}}
+// replaces the grid of one sensor, or both without "sensor", and with "save"
+// keeps it in flash for the next boot
+void handle_humidity_correction(const HostCommand &command) {
+  const bool sht = strcmp(command.correction_sensor, "bme") != 0;
+  const bool bme = strcmp(command.correction_sensor, "sht") != 0;
+  bool loaded = true;
+  if (sht) {
+    loaded = command.correction.load_into(sht_humidity) && loaded;
+  }
+  if (bme) {
+    loaded = command.correction.load_into(bme_humidity) && loaded;
+  }
+  if (!loaded) {
+    Serial.println("Invalid humidity correction grid");
+    return;
+  }
+  if (command.save_correction) {
+    if ((sht && !save_humidity_file(command.correction, sht_humidity_file)) ||
+        (bme && !save_humidity_file(command.correction, bme_humidity_file))) {
+      Serial.println("Could not save the humidity correction grid");
+    }
+  }
+  // Apply the new correction to the current setpoint
+  set_H(H_store);
+}
 
-  constexpr double a = 0.740036139896326;
-  constexpr double b = -0.0017671331702309168;
-  constexpr double c = 0.0005783465707743796;
-  constexpr double d = 0.05096062356332354;
+bool load_trajectory() {
+  trajectory.unload();
+  trajectory_source.close();
+  uint8_t fields;
+  if (!trajectory_source.open(fields)) {
+    return false;
+  }
+  trajectory.load(trajectory_source, fields, millis());
+  return true;
+}
 
-  double H_adjusted = a * H_store + b * T_store + c * H_store * T_store + d;
+// The setpoints in fields, in milli units, the others as the host left them.
+// Frames and trajectories flag their fields the same way.
+static_assert(TrajectoryPoint::HasT == protocol::StatePayload::HasT &&
+                TrajectoryPoint::HasH == protocol::StatePayload::HasH &&
+                TrajectoryPoint::HasP == protocol::StatePayload::HasP,
+              "trajectory and frame fields differ");
+State state_from_milli(uint8_t fields, int32_t T_milli, int32_t H_milli, int32_t P_milli) {
+  return State{fields & protocol::StatePayload::HasT ? T_milli / 1000.0 : T_store,
+               fields & protocol::StatePayload::HasH ? H_milli / 1000.0 : H_store,
+               fields & protocol::StatePayload::HasP ? P_milli / 1000.0 : P_store};
+}
+
+// The setpoints the trajectory drives, the others as the host left them
+void apply_trajectory(const TrajectoryPoint &point) {
+  set_state(state_from_milli(trajectory.fields(), point.T_milli, point.H_milli, point.P_milli));
+}
 
-  sht::set_H(H_adjusted);
-  bme::set_H(H_adjusted);
+// Only the BME280 measures pressure
+void set_P(const double &P) {
+  set_state(State{T_store, H_store, P});
 }
 
 // TODO: Reduce code duplication in endpoints
@@ -75,29 +342,161 @@ void http_humidity_endpoint() {
   }
 }
 
+void http_pressure_endpoint() {
+  const auto method = server.method();
+  if (method == HTTP_GET) {
+    server.send(200, "text/plain", String(P_store));
+  } else if (method == HTTP_PUT) {
+    if (server.hasArg("value")) {
+      const auto value = server.arg("value");
+      const double new_p = value.toDouble();
+      set_P(new_p);
+      server.send(200); 
+    } else {
+      server.send(400, "text/plain", "Bad request");
+    }
+  } else {
+    server.send(405, "text/plain", "Method not allowed");
+  }
+}
+
+// All three setpoints at once. PUT with any of temperature, humidity and
+// pressure as arguments sets those together; GET returns the current state.
+void http_state_endpoint() {
+  const auto method = server.method();
+  if (method == HTTP_GET) {
+    char body[96];
+    snprintf(body, sizeof(body), "{\"temperature\": %.3f, \"humidity\": %.3f, \"pressure\": %.3f}", T_store,
+             H_store, P_store);
+    server.send(200, "application/json", body);
+  } else if (method == HTTP_PUT) {
+    State state = {T_store, H_store, P_store};
+    bool any = false;
+    if (server.hasArg("temperature")) {
+      state.T = server.arg("temperature").toDouble();
+      any = true;
+    }
+    if (server.hasArg("humidity")) {
+      state.H = server.arg("humidity").toDouble();
+      any = true;
+    }
+    if (server.hasArg("pressure")) {
+      state.P = server.arg("pressure").toDouble();
+      any = true;
+    }
+    if (any) {
+      set_state(state);
+      server.send(200);
+    } else {
+      server.send(400, "text/plain", "Bad request");
+    }
+  } else {
+    server.send(405, "text/plain", "Method not allowed");
+  }
+}
+
+// Interrupt handler timing, to watch I2C latency on the bench rig, the
+// register recomputes done and avoided as [done, avoided], and the latency of
+// setpoints through core1. Core1 writes these as core0 reads them, so fields
+// may come from different updates, which is fine for a report.
+void http_stats_endpoint() {
+  const IsrStats &bme_request = bme280.request_stats();
+  const IsrStats &bme_update = bme280.update_stats();
+  const bme::Bme280::Recomputes &bme_recomputes = bme280.recomputes();
+  const RecomputeStats &sht_recomputes = sht4x.frame_recomputes();
+  char body[1536];
+  snprintf(body, sizeof(body),
+           "{\"bme_request\": {\"count\": %lu, \"total_us\": %lu, \"max_us\": %lu}, "
+           "\"bme_update\": {\"count\": %lu, \"total_us\": %lu, \"max_us\": %lu}, "
+           "\"sht_busy_reads\": %lu, "
+           "\"recomputes\": {\"adc_T\": [%lu, %lu], \"adc_H\": [%lu, %lu], \"adc_P\": [%lu, %lu], "
+           "\"sht_frames\": [%lu, %lu]}, "
+           "\"setpoint_latency\": {\"count\": %lu, \"total_us\": %lu, \"max_us\": %lu}, "
+           "\"setpoint_drops\": %lu, "
+           "\"sensor_loop\": {\"count\": %lu, \"max_us\": %lu}, "
+           "\"host_link\": {\"frames\": %lu, \"invalid_frames\": %lu, \"json_errors\": %lu, "
+           "\"capabilities\": %u, \"host_time_ms\": %lu}, "
+           "\"outputs\": {\"debounce_us\": %lu, \"overruns\": %lu, \"drops\": %lu, \"glitches\": %lu}, "
+           "\"history\": {\"samples\": %lu, \"dropped\": %lu, \"bytes\": %lu, \"blocks\": %lu, "
+           "\"first_ms\": %lu, \"last_ms\": %lu}, "
+           "\"trajectory\": {\"state\": %u, \"points\": %lu, \"position_s\": %lu, \"scale\": %.3f, "
+           "\"reads\": %lu}, "
+           "\"sim_clock\": {\"synced\": %d, \"sim_s\": %.3f, \"scale\": %.3f, \"drift_ppm\": %.1f, "
+           "\"offset_us\": %ld, \"syncs\": %lu, \"steps\": %lu, \"sensor_reads\": %lu}, "
+           "\"lockstep\": {\"steps\": %lu, \"resent\": %lu, \"stale\": %lu, \"last\": %lu, \"pending\": %d}}",
+           (unsigned long)bme_request.count, (unsigned long)bme_request.total_us,
+           (unsigned long)bme_request.max_us, (unsigned long)bme_update.count,
+           (unsigned long)bme_update.total_us, (unsigned long)bme_update.max_us,
+           (unsigned long)sht4x.busy_reads(), (unsigned long)bme_recomputes.adc_T.done,
+           (unsigned long)bme_recomputes.adc_T.avoided, (unsigned long)bme_recomputes.adc_H.done,
+           (unsigned long)bme_recomputes.adc_H.avoided, (unsigned long)bme_recomputes.adc_P.done,
+           (unsigned long)bme_recomputes.adc_P.avoided, (unsigned long)sht_recomputes.done,
+           (unsigned long)sht_recomputes.avoided, (unsigned long)setpoint_latency.count,
+           (unsigned long)setpoint_latency.total_us, (unsigned long)setpoint_latency.max_us,
+           (unsigned long)setpoint_drops, (unsigned long)sensor_loop_stats.count,
+           (unsigned long)sensor_loop_stats.max_us, (unsigned long)host_frames,
+           (unsigned long)frame_reader.invalid_frames(), (unsigned long)serial_reader.errors(),
+           unsigned(host_capabilities), (unsigned long)host_time_ms, (unsigned long)output_debounce_us,
+           (unsigned long)output_capture.overruns(), (unsigned long)output_capture.drops(),
+           (unsigned long)output_capture.glitches(), (unsigned long)history.samples(),
+           (unsigned long)history.dropped(), (unsigned long)history.bytes(), (unsigned long)history.block_count(),
+           (unsigned long)history.first_time_ms(), (unsigned long)history.last_time_ms(),
+           unsigned(trajectory.state()), (unsigned long)trajectory.points(),
+           (unsigned long)(trajectory.position_ms() / 1000), trajectory.scale_milli() / 1000.0,
+           (unsigned long)trajectory.reads(), sim_clock.synced() ? 1 : 0,
+           sim_clock.to_sim_us(micros()) / 1e6, sim_clock.scale_milli() / 1000.0, sim_clock.drift_ppm(),
+           long(sim_clock.offset_us()), (unsigned long)sim_clock.syncs(), (unsigned long)sim_clock.steps(),
+           (unsigned long)sensor_reads, (unsigned long)lockstep.steps(), (unsigned long)lockstep.resent(),
+           (unsigned long)lockstep.stale(), (unsigned long)lockstep.ack().step, lockstep.pending() ? 1 : 0);
+  server.send(200, "application/json", body);
+}
+
+// The history from the from to the to argument, in ms since boot, both
+// optional, as the compressed blocks that hold it, in one response. Each
+// block is the header of HistoryLog::ExportHeaderSize and its bits;
+// Executive/emulator_protocol.py decodes them.
+void http_history_endpoint() {
+  if (server.method() != HTTP_GET) {
+    server.send(405, "text/plain", "Method not allowed");
+    return;
+  }
+  const uint32_t from = server.hasArg("from") ? uint32_t(server.arg("from").toInt()) : 0;
+  const uint32_t to = server.hasArg("to") ? uint32_t(server.arg("to").toInt()) : UINT32_MAX;
+  HistoryLog::Export position = history.start_export(from, to);
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/octet-stream", "");
+  uint8_t chunk[512];
+  size_t length;
+  while ((length = history.read(position, chunk, sizeof(chunk))) > 0) {
+    server.sendContent(reinterpret_cast<const char *>(chunk), length);
+  }
+  server.sendContent("");
+}
+
 void http_not_found_endpoint(){
   server.send(404, "text/plain", "Not found");
 }
 
 void setup() {
-  pinMode(0, INPUT_PULLDOWN);
-  pinMode(1, INPUT_PULLDOWN);
-  pinMode(2, INPUT_PULLDOWN);
-
   Serial.begin(9600);
 
   Serial1.setTX(12);  // Set TX pin to GPIO 12 
   Serial1.setRX(13);  // Set RX pin to GPIO 13 
   Serial1.begin(115200);
 
-  sht::init();
-  bme::init();
-
-  set_T(22.0);
-  set_H(50.0);
+  // The fit the emulator was tuned with, unless a grid was saved to flash.
+  // Writing flash pauses core1, and with it the sensors, until it is done.
+  sht_humidity.load(HumidityFitGrid::T, HumidityFitGrid::H, HumidityFit.values);
+  bme_humidity.load(HumidityFitGrid::T, HumidityFitGrid::H, HumidityFit.values);
+  if (LittleFS.begin()) {
+    load_humidity_file(sht_humidity, sht_humidity_file);
+    load_humidity_file(bme_humidity, bme_humidity_file);
+    // Paused until the host plays it
+    load_trajectory();
+  }
 
-  sht::begin();
-  bme::begin();
+  // Core1 answers at its power on setpoints until this arrives
+  set_state(State{22.0, 50.0, 101325.0});
 
   auto status = WL_DISCONNECTED;
   // Uncomment this line to connect to wifi
@@ -114,74 +513,538 @@ void setup() {
 
   server.on("/api/temperature", http_temperature_endpoint);
   server.on("/api/humidity", http_humidity_endpoint);
+  server.on("/api/pressure", http_pressure_endpoint);
+  server.on("/api/state", http_state_endpoint);
+  server.on("/api/stats", http_stats_endpoint);
+  server.on("/api/history", http_history_endpoint);
   server.onNotFound(http_not_found_endpoint);
   server.begin();
   Serial.println("HTTP server started");
 }
 
+// Any edge on an output pin reads the port once, so an edge on another pin
+// at the same time is seen with it
+void output_edge() {
+  output_capture.on_edge(uint8_t(gpio_get_all() & OutputPinMask), micros());
+}
+
+// Core1 runs the sensors from here, concurrently with setup on core0
+void setup1() {
+  for (uint8_t pin = 0; pin < OutputPinCount; ++pin) {
+    pinMode(pin, INPUT_PULLDOWN);
+  }
+  // Interrupts attached here run on core1, with the capture they feed
+  output_capture.reset(uint8_t(gpio_get_all() & OutputPinMask));
+  for (uint8_t pin = 0; pin < OutputPinCount; ++pin) {
+    attachInterrupt(digitalPinToInterrupt(pin), output_edge, CHANGE);
+  }
+
+  // Time from here to the controller first addressing the sensors
+  sensors_start_us = micros();
+
+  sht4x.init();
+  bme280.init();
+
+  // The host sends true values, the sensors add their own measurement noise
+  sht4x.set_noise(true);
+  bme280.set_noise(true);
+  sht4x.set_timing(true);
+
+  // The I2C interrupts are enabled on the core that begins the bus
+  sht4x.begin();
+  bme280.begin();
+
+  // Reported here once, since begin runs again whenever a bus is taken over
+  Serial.print("SHT emulator started with I2C address 0x");
+  Serial.print(sht4x.i2c_address(), HEX);
+  Serial.print(", ");
+  Serial.print(sizeof(sht4x), DEC);
+  Serial.println(" bytes of RAM");
+  Serial.print("BME emulator started with I2C address 0x");
+  Serial.print(bme280.i2c_address(), HEX);
+  Serial.print(", ");
+  Serial.print(sizeof(bme280), DEC);
+  Serial.println(" bytes of RAM");
+}
+
 static unsigned long last_refresh_ = 0;
 static const unsigned long refresh_interval_ = 3000;
-static char buffer_[40];
+static char buffer_[320];
 static char io0_;
 static char io1_;
 static char io2_;
 
-void handle_serial_input(HardwareSerial &serial) {
-  if (serial.available() > 0) {
-    JsonDocument doc;
-    auto error = deserializeJson(doc, serial);
+// Serial bytes parsed per loop, so a burst from the host cannot hold up
+// the HTTP server for longer than this takes
+constexpr int SerialBytesPerLoop = 512;
+
+void send_frame(HardwareSerial &serial, protocol::Frame &frame) {
+  uint8_t wire[protocol::MaxEncoded];
+  frame.version = protocol::Version;
+  frame.sequence = host_sequence++;
+  serial.write(wire, protocol::encode_frame(frame, wire));
+}
+
+// Print a JSON list to a host without binary frames: the head already in
+// buffer_, then count rows, each written by row(i, out, size, separator) as
+// snprintf would, and the closing "]}". Rows that do not fit are left out
+// whole, so the line stays valid JSON.
+template <typename Row>
+void send_json_list(HardwareSerial &serial, int length, int count, Row row) {
+  constexpr int End = sizeof(buffer_) - sizeof("]}");
+  length = length < 0 ? 0 : length > End ? End : length;
+  for (int i = 0; i < count; ++i) {
+    const int written = row(i, buffer_ + length, size_t(End - length), i == 0 ? "" : ", ");
+    if (written < 0 || length + written >= End) {
+      break;
+    }
+    length += written;
+  }
+  memcpy(buffer_ + length, "]}", sizeof("]}"));
+  serial.println(buffer_);
+}
+
+// The acknowledgement of the last lockstep step, as a frame to a host that
+// asked for lockstep and as JSON to one that speaks it
+void send_step_ack(HardwareSerial &serial) {
+  const StepAck &ack = lockstep.ack();
+  if (host_capabilities & protocol::CapLockstep) {
+    protocol::Frame frame;
+    frame.type = protocol::StepAck;
+    protocol::StepAckPayload{ack}.put(frame);
+    send_frame(serial, frame);
+  } else {
+    snprintf(buffer_, sizeof(buffer_),
+             "{\"step\": %lu, \"temperature\": %.3f, \"humidity\": %.3f, \"pressure\": %.3f, \"inputs\": %u, "
+             "\"time_us\": %lu}",
+             (unsigned long)ack.step, ack.T_milli / 1000.0, ack.H_milli / 1000.0, ack.P_milli / 1000.0,
+             unsigned(ack.inputs), (unsigned long)ack.time_us);
+    serial.println(buffer_);
+  }
+}
+
+// A lockstep step. Its setpoints go to core1 with its number, and the loop
+// acknowledges it once core1 has applied them; the last step sent again is
+// acknowledged again. Returns true if the step was applied.
+bool handle_step(HardwareSerial &serial, uint32_t step, const State &state) {
+  switch (lockstep.receive(step, int32_t(lround(state.T * 1000)), int32_t(lround(state.H * 1000)),
+                           int32_t(lround(state.P * 1000)))) {
+  case Lockstep::Action::Apply:
+    set_state(state, step);
+    return true;
+  case Lockstep::Action::Resend:
+    send_step_ack(serial);
+    return false;
+  default:
+    return false;
+  }
+}
+
+void apply_host_command(HardwareSerial &serial, const HostCommand &command) {
+  // Whatever the message sets is applied together
+  const State state = {command.has_T ? command.T : T_store, command.has_H ? command.H : H_store,
+                       command.has_P ? command.P : P_store};
+  if (command.has_step) {
+    handle_step(serial, command.step, state);
+  } else if (command.has_T || command.has_H || command.has_P) {
+    set_state(state);
+  }
+  if (command.has_debounce) {
+    output_debounce_us = command.debounce_us > 0 ? uint32_t(command.debounce_us) : 0;
+  }
+  if (command.has_trajectory) {
+    trajectory.control(command.trajectory, millis());
+  }
+  if (command.has_sim_time) {
+    const double scale = command.has_sim_scale ? command.sim_scale : sim_clock.scale_milli() / 1000.0;
+    sim_clock.sync(command.sim_time > 0 ? uint64_t(llround(command.sim_time * 1e6)) : 0,
+                   scale > 0 ? uint32_t(lround(scale * 1000)) : 0, micros());
+  }
+  if (command.has_correction) {
+    handle_humidity_correction(command);
+  }
+}
 
-    if ( error ) {
-      Serial.print(F("deserializeJson() failed: "));
-      Serial.println(error.f_str());
+void send_trajectory_status(HardwareSerial &serial, uint8_t error) {
+  protocol::TrajectoryStatusPayload status = {uint8_t(trajectory.state()), error, trajectory.points(),
+                                              trajectory_received, uint32_t(trajectory.position_ms() / 1000),
+                                              trajectory.scale_milli()};
+  protocol::Frame frame;
+  frame.type = protocol::TrajectoryStatus;
+  status.put(frame);
+  send_frame(serial, frame);
+}
+
+// Trajectory uploads and playback commands, each answered with the status.
+// Writing flash pauses core1, and with it the sensors, so an upload belongs
+// before a run rather than during one.
+void handle_trajectory_frame(HardwareSerial &serial, const protocol::Frame &frame) {
+  using Status = protocol::TrajectoryStatusPayload;
+  uint8_t error = Status::None;
+  switch (frame.type) {
+  case protocol::TrajectoryBegin: {
+    protocol::TrajectoryBeginPayload begin;
+    trajectory.unload();
+    trajectory_source.close();
+    if (trajectory_upload) {
+      trajectory_upload.close();
+    }
+    trajectory_received = 0;
+    if (!begin.get(frame)) {
+      error = Status::BadFrame;
+      break;
+    }
+    trajectory_upload = LittleFS.open(trajectory_file, "w");
+    const uint8_t header[FileTrajectory::HeaderSize] = {'T', 'R', 'J', '1', begin.fields};
+    if (!trajectory_upload || trajectory_upload.write(header, sizeof(header)) != sizeof(header)) {
+      error = Status::Storage;
+    }
+    break;
+  }
+  case protocol::TrajectoryPoints:
+    if (!trajectory_upload) {
+      error = Status::NoUpload;
+    } else if (frame.length % TrajectoryPoint::Size != 0) {
+      error = Status::BadFrame;
+    } else if (trajectory_upload.write(frame.payload, frame.length) != frame.length) {
+      error = Status::Storage;
     } else {
-      const auto temperature = doc["temperature"];
-      if (temperature.is<double>()) {
-        set_T(temperature.as<double>());
+      trajectory_received += frame.length / TrajectoryPoint::Size;
+    }
+    break;
+  case protocol::TrajectoryEnd: {
+    protocol::TrajectoryEndPayload end;
+    if (!trajectory_upload) {
+      error = Status::NoUpload;
+      break;
+    }
+    trajectory_upload.close();
+    if (!end.get(frame) || end.points != trajectory_received) {
+      error = Status::LostPoints;
+    } else if (!load_trajectory()) {
+      error = Status::Storage;
+    }
+    break;
+  }
+  case protocol::TrajectoryCommand: {
+    protocol::TrajectoryCommandPayload command;
+    if (command.get(frame)) {
+      trajectory.control(command.control, millis());
+    } else {
+      error = Status::BadFrame;
+    }
+    break;
+  }
+  default:
+    return;
+  }
+  send_trajectory_status(serial, error);
+}
+
+// A Hello is answered with the version and capabilities both ends have, and
+// from then on the outputs go out as frames. Setpoints are taken in either
+// encoding.
+void handle_frame(HardwareSerial &serial, const protocol::Frame &frame) {
+  ++host_frames;
+  if (frame.type == protocol::Hello) {
+    protocol::HelloPayload hello;
+    if (!hello.get(frame) || hello.version == 0) {
+      return;
+    }
+    protocol::HelloPayload ack = {hello.version < protocol::Version ? hello.version : protocol::Version,
+                                  uint16_t(hello.capabilities & protocol::Capabilities)};
+    host_capabilities = ack.capabilities;
+    // A new host starts its own run
+    lockstep.reset();
+    protocol::Frame reply;
+    reply.type = protocol::HelloAck;
+    ack.put(reply);
+    send_frame(serial, reply);
+    return;
+  }
+  if (frame.version != protocol::Version) {
+    return;
+  }
+  protocol::HistoryRequestPayload request;
+  if (frame.type == protocol::HistoryRequest && request.get(frame)) {
+    // A new request replaces one in progress, which the host gave up on
+    history_export = history.start_export(request.from_ms, request.to_ms);
+    history_exporting = true;
+    return;
+  }
+  protocol::StepPayload step;
+  if (frame.type == protocol::Step && step.get(frame)) {
+    const State state = state_from_milli(step.fields, step.T_milli, step.H_milli, step.P_milli);
+    // The clock holds at the step's time until the next
+    if (handle_step(serial, step.step, state) && (step.fields & step.HasSimTime)) {
+      sim_clock.sync(step.sim_us, 0, micros());
+    }
+    return;
+  }
+  protocol::ClockSyncPayload sync;
+  if (frame.type == protocol::ClockSync && sync.get(frame)) {
+    sim_clock.sync(sync.sim_us, sync.scale_milli, micros());
+    return;
+  }
+  if (frame.type >= protocol::TrajectoryBegin && frame.type <= protocol::TrajectoryCommand) {
+    handle_trajectory_frame(serial, frame);
+    return;
+  }
+  protocol::StatePayload state;
+  if (frame.type == protocol::SetState && state.get(frame)) {
+    host_time_ms = state.host_ms;
+    if (state.fields & (state.HasT | state.HasH | state.HasP)) {
+      set_state(state_from_milli(state.fields, state.T_milli, state.H_milli, state.P_milli));
+    }
+  }
+}
+
+void handle_serial_input(HardwareSerial &serial) {
+  const uint32_t errors = serial_reader.errors();
+  const uint32_t invalid_frames = frame_reader.invalid_frames();
+  for (int i = 0; i < SerialBytesPerLoop && serial.available() > 0; ++i) {
+    const uint8_t byte = uint8_t(serial.read());
+    switch (frame_reader.feed(byte)) {
+    case protocol::FrameReader::Result::Text:
+      if (serial_reader.feed(char(byte))) {
+        apply_host_command(serial, serial_reader.command());
       }
-      const auto humidity = doc["humidity"];
-      if (humidity.is<double>()) {
-        set_H(humidity.as<double>());
+      break;
+    case protocol::FrameReader::Result::Frame:
+      handle_frame(serial, frame_reader.frame());
+      break;
+    default:
+      break;
+    }
+  }
+  if (serial_reader.errors() != errors || frame_reader.invalid_frames() != invalid_frames) {
+    Serial.println(F("Dropped a malformed message"));
+  }
+}
+
+// Send a batch of output changes, oldest first, each with the time of its
+// first edge, in simulation time once the host has synced the clock. A host
+// that did not ask for batches gets the outputs after the last change.
+void send_output_events(HardwareSerial &serial, const GpioEvent *events, int count) {
+  if ((host_capabilities & protocol::CapSimTime) && sim_clock.synced()) {
+    protocol::SimEventsPayload payload;
+    payload.count = uint8_t(count);
+    for (int i = 0; i < count; ++i) {
+      payload.events[i] = {events[i].inputs, sim_clock.to_sim_us(events[i].time_us)};
+    }
+    protocol::Frame frame;
+    frame.type = protocol::SimOutputEvents;
+    payload.put(frame);
+    send_frame(serial, frame);
+  } else if (host_capabilities & protocol::CapOutputEvents) {
+    protocol::OutputEventsPayload payload;
+    payload.count = uint8_t(count);
+    for (int i = 0; i < count; ++i) {
+      payload.events[i] = protocol::OutputsPayload{events[i].inputs, events[i].time_us};
+    }
+    protocol::Frame frame;
+    frame.type = protocol::OutputEvents;
+    payload.put(frame);
+    send_frame(serial, frame);
+  } else if (host_capabilities & protocol::CapOutputs) {
+    protocol::Frame frame;
+    frame.type = protocol::Outputs;
+    protocol::OutputsPayload{events[count - 1].inputs, events[count - 1].time_us}.put(frame);
+    send_frame(serial, frame);
+  } else {
+    const int head = snprintf(buffer_, sizeof(buffer_),
+                              "{\"input0\": %d, \"input1\": %d, \"input2\": %d, \"events\": [", io0_, io1_, io2_);
+    send_json_list(serial, head, count, [&](int i, char *out, size_t size, const char *separator) {
+      if (sim_clock.synced()) {
+        return snprintf(out, size, "%s[%u, %lu, %.6f]", separator, unsigned(events[i].inputs),
+                        (unsigned long)events[i].time_us, sim_clock.to_sim_us(events[i].time_us) / 1e6);
       }
+      return snprintf(out, size, "%s[%u, %lu]", separator, unsigned(events[i].inputs),
+                      (unsigned long)events[i].time_us);
+    });
+  }
+}
+
+// Send a batch of sensor reads in simulation time, to a host that asked for
+// it or speaks JSON
+void send_sensor_reads(HardwareSerial &serial, const SensorRead *reads, int count) {
+  if (host_capabilities & protocol::CapSimTime) {
+    protocol::SimEventsPayload payload;
+    payload.count = uint8_t(count);
+    for (int i = 0; i < count; ++i) {
+      payload.events[i] = {reads[i].sensor, sim_clock.to_sim_us(reads[i].time_us)};
+    }
+    protocol::Frame frame;
+    frame.type = protocol::SensorReads;
+    payload.put(frame);
+    send_frame(serial, frame);
+  } else if (host_capabilities == 0) {
+    const int head = snprintf(buffer_, sizeof(buffer_), "{\"reads\": [");
+    send_json_list(serial, head, count, [&](int i, char *out, size_t size, const char *separator) {
+      return snprintf(out, size, "%s[%u, %.6f]", separator, unsigned(reads[i].sensor),
+                      sim_clock.to_sim_us(reads[i].time_us) / 1e6);
+    });
+  }
+}
+
+// Send the next frames of a serial history export, within the per loop
+// budget, and the end of it once it is done
+void send_history(HardwareSerial &serial) {
+  for (int sent = 0; sent < SerialBytesPerLoop; sent += protocol::MaxPayload) {
+    protocol::Frame frame;
+    const size_t length = history.read(history_export, frame.payload, protocol::MaxPayload);
+    if (length == 0) {
+      protocol::HistoryEndPayload end = {history_export.cut};
+      frame.type = protocol::HistoryEnd;
+      end.put(frame);
+      send_frame(serial, frame);
+      history_exporting = false;
+      return;
     }
+    frame.type = protocol::HistoryData;
+    frame.length = uint8_t(length);
+    send_frame(serial, frame);
   }
 }
 
 void loop() {
+  // The interrupt sets the time of the first transaction before answered()
+  if (!answered_reported_ && bme280.answered()) {
+    answered_reported_ = true;
+    Serial.print("BME280 answering after ");
+    Serial.print(bme280.answered_us() - sensors_start_us);
+    Serial.println(" us");
+  }
+
+  // A lockstep step is acknowledged as soon as core1 has applied it
+  StepApplied applied;
+  while (step_queue.pop(applied)) {
+    if (lockstep.applied(applied.step, applied.inputs, applied.time_us)) {
+      send_step_ack(Serial1);
+    }
+  }
+
   server.handleClient();
 
-  auto input0 = digitalRead(0);
-  auto input1 = digitalRead(1);
-  auto input2 = digitalRead(2);
+  // The changes core1 captured since the last loop go to the client in
+  // batches, smaller once they carry simulation time, and a timeout resends
+  // the outputs as they are
+  GpioEvent events[protocol::OutputEventsPayload::MaxEvents];
+  const size_t batch =
+      sim_clock.synced() ? protocol::SimEventsPayload::MaxEvents : protocol::OutputEventsPayload::MaxEvents;
+  int count;
+  while ((count = int(gpio_queue.pop_batch(events, batch))) > 0) {
+    const uint8_t inputs = events[count - 1].inputs;
+    io0_ = inputs & 1;
+    io1_ = (inputs >> 1) & 1;
+    io2_ = (inputs >> 2) & 1;
+    send_output_events(Serial1, events, count);
+    last_refresh_ = millis();
 
-  // This is the condition to flag for sending new input values to the client
-  bool stale_inputs{false};
+    // Log each change at its own time, from micros() on core1
+    const uint32_t now_ms = millis();
+    const uint32_t now_us = micros();
+    for (int i = 0; i < count; ++i) {
+      history_inputs = events[i].inputs;
+      log_history(now_ms - (now_us - events[i].time_us) / 1000);
+    }
+  }
 
-  // A timeout will trigger stale_inputs
-  if ( millis() - last_refresh_ >= refresh_interval_ ) {
-    stale_inputs = true;
+  SensorRead reads[protocol::SimEventsPayload::MaxEvents];
+  while ((count = int(sensor_read_queue.pop_batch(reads, protocol::SimEventsPayload::MaxEvents))) > 0) {
+    sensor_reads += count;
+    if (sim_clock.synced()) {
+      send_sensor_reads(Serial1, reads, count);
+    }
   }
 
-  // If any of the cached values change, that will also trigger stale_inputs
-  if ( input0 != io0_ ||
-       input1 != io1_ ||
-       input2 != io2_
-  ) {
-    stale_inputs = true;
+  if (history_exporting) {
+    send_history(Serial1);
   }
 
-  if ( stale_inputs ) {
-    io0_ = input0;
-    io1_ = input1;
-    io2_ = input2;
+  // The trajectory, at a fixed tick whatever the host is doing. Its position
+  // follows millis(), so a late tick is caught up rather than lost.
+  static uint32_t last_trajectory_tick = 0;
+  if (millis() - last_trajectory_tick >= TrajectoryTickMs) {
+    last_trajectory_tick = millis();
+    TrajectoryPoint point;
+    if (trajectory.tick(last_trajectory_tick, point)) {
+      apply_trajectory(point);
+    }
+  }
 
-    sprintf(buffer_, "{\"input0\": %d, \"input1\": %d, \"input2\": %d}",input0, input1, input2);
+  if ( millis() - last_refresh_ >= refresh_interval_ ) {
+    if (host_capabilities & protocol::CapOutputs) {
+      protocol::Frame frame;
+      frame.type = protocol::Outputs;
+      protocol::OutputsPayload{uint8_t(io0_ | (io1_ << 1) | (io2_ << 2)), uint32_t(micros())}.put(frame);
+      send_frame(Serial1, frame);
+    } else {
+      sprintf(buffer_, "{\"input0\": %d, \"input1\": %d, \"input2\": %d}", io0_, io1_, io2_);
 
-    Serial1.println(buffer_);
+      Serial1.println(buffer_);
+    }
 
     last_refresh_ = millis();
-    stale_inputs = false;
   }
 
   handle_serial_input(Serial1);
 }
+
+// Sensor emulation, alone on core1 with the I2C interrupts
+void loop1() {
+  static uint32_t last_run_us = micros();
+
+  const uint32_t now = micros();
+  sensor_loop_stats.record(now - last_run_us);
+  last_run_us = now;
+
+  // Complete any BME280 conversion that is due before anything slower runs
+  bme280.update(now);
+
+  offer_step();
+  SetpointCommand command;
+  while (setpoint_queue.pop(command)) {
+    apply_setpoints(command, sht4x, bme280);
+    setpoint_latency.record(uint32_t(micros()) - command.sent_us);
+    if (command.step != 0) {
+      offer_step();
+      pending_step = StepApplied{command.step, output_capture.inputs(), uint32_t(micros())};
+      step_pending = true;
+      offer_step();
+    }
+  }
+
+  // Run the SHT4x heater model, and redraw its noise once a measurement has
+  // taken the last frames
+  sht4x.update(micros());
+
+  // Debounce the output edges captured since the last run, and hand core0
+  // the changes that have settled
+  output_capture.set_debounce_us(output_debounce_us);
+  output_capture.poll(micros(), gpio_queue);
+
+  // Hand core0 the time of each new sensor read. The time is read between
+  // two reads of the count, so it is the counted read's even if the
+  // interrupt runs in between.
+  static uint32_t seen_sht_reads = 0;
+  static uint32_t seen_bme_reads = 0;
+  uint32_t reads;
+  uint32_t read_us;
+  do {
+    reads = sht4x.measurements();
+    read_us = sht4x.measurement_read_us();
+  } while (reads != sht4x.measurements());
+  if (reads != seen_sht_reads) {
+    seen_sht_reads = reads;
+    sensor_read_queue.push(SensorRead{SensorRead::Sht, read_us});
+  }
+  do {
+    reads = bme280.data_reads();
+    read_us = bme280.data_read_us();
+  } while (reads != bme280.data_reads());
+  if (reads != seen_bme_reads) {
+    seen_bme_reads = reads;
+    sensor_read_queue.push(SensorRead{SensorRead::Bme, read_us});
+  }
+}
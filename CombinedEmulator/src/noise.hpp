@@ -0,0 +1,42 @@
+#ifndef NOISE_INCLUDED
+#define NOISE_INCLUDED
+
+#include <stdint.h>
+
+// Deterministic measurement noise for the emulated sensors.
+// A xorshift32 generator, so a seed reproduces the same sequence of readings,
+// and an approximately normal sample from the sum of the four bytes of one
+// draw, which needs no floating point or table on the RP2040.
+class Noise {
+public:
+  explicit Noise(uint32_t seed = 1) { this->seed(seed); }
+
+  // xorshift32 never leaves the all zero state, so 0 is mapped to 1
+  void seed(uint32_t seed) { state_ = seed ? seed : 1; }
+
+  uint32_t next() {
+    uint32_t x = state_;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state_ = x;
+    return x;
+  }
+
+  // Scale for gaussian() giving a standard deviation of sigma.
+  // The sum of four uniform signed bytes has a standard deviation of 147.8.
+  constexpr static int32_t scale(double sigma) { return int32_t(sigma * 65536.0 / 147.8 + 0.5); }
+
+  // A zero mean sample with the standard deviation scale was made for,
+  // rounded toward minus infinity. Its range is about +-3.5 sigma.
+  int32_t gaussian(int32_t scale) {
+    const uint32_t x = next();
+    const int32_t sum = int8_t(x) + int8_t(x >> 8) + int8_t(x >> 16) + int8_t(x >> 24) + 2;
+    return (sum * scale) >> 16;
+  }
+
+private:
+  uint32_t state_;
+};
+
+#endif // NOISE_INCLUDED
@@ -0,0 +1,22 @@
+#ifndef RECOMPUTE_STATS_INCLUDED
+#define RECOMPUTE_STATS_INCLUDED
+
+#include <stdint.h>
+
+// Recomputes of a value derived from the setpoints, in the main loop.
+// A setter that finds the inputs of the value unchanged, to the resolution of
+// the register they feed, skips the work and counts it as avoided.
+struct RecomputeStats {
+  uint32_t done = 0;
+  uint32_t avoided = 0;
+
+  void record(bool recomputed) {
+    if (recomputed) {
+      ++done;
+    } else {
+      ++avoided;
+    }
+  }
+};
+
+#endif // RECOMPUTE_STATS_INCLUDED
@@ -0,0 +1,86 @@
+#ifndef SHADOW_BANK_INCLUDED
+#define SHADOW_BANK_INCLUDED
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Double buffered data registers, like the shadowing real sensors use so a
+// burst read never mixes bytes from two conversions.
+//
+// One writer, the main loop, builds a whole new sample in the back buffer and
+// publishes it with a single store of the sequence number. Readers, the I2C
+// interrupt handlers, copy the front buffer and check the sequence did not
+// move while they copied. Neither side disables interrupts or takes a lock.
+//
+// The writer only ever writes the buffer readers are not pointed at, and it
+// only starts writing the other one after publishing again. So a reader
+// interrupted by no more than one publish, which is always the case for an
+// interrupt handler on the writer's own core, never has to retry.
+template <size_t N> class ShadowBank {
+public:
+  constexpr static size_t Size = N;
+
+  // Set both buffers, before any reader runs
+  void reset(const uint8_t *data) {
+    memcpy(buffers_[0], data, N);
+    memcpy(buffers_[1], data, N);
+    sequence_.store(0, std::memory_order_release);
+  }
+
+  // Writer side
+
+  // The back buffer, starting from a copy of the current sample
+  uint8_t *stage() {
+    const uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+    uint8_t *back = buffers_[(sequence + 1) & 1];
+
+    // Readers that loaded the previous sequence may still be copying the back
+    // buffer. The fence keeps that publish ahead of these writes, so such a
+    // reader always sees the sequence moved and retries.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    memcpy(back, buffers_[sequence & 1], N);
+    return back;
+  }
+
+  // Make the staged buffer the current sample
+  void publish() {
+    const uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_release);
+  }
+
+  // The current sample. Only the writer may read it in place.
+  const uint8_t *front() const {
+    return buffers_[sequence_.load(std::memory_order_relaxed) & 1];
+  }
+
+  // Reader side
+
+  // Copy a consistent current sample into out, and return its sequence number
+  uint32_t read(uint8_t *out) const {
+    return read(out, 0, N);
+  }
+
+  // The same for length bytes of the sample from offset
+  uint32_t read(uint8_t *out, size_t offset, size_t length) const {
+    for (;;) {
+      const uint32_t sequence = sequence_.load(std::memory_order_acquire);
+      memcpy(out, buffers_[sequence & 1] + offset, length);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence_.load(std::memory_order_relaxed) == sequence) {
+        return sequence;
+      }
+    }
+  }
+
+  uint32_t sequence() const {
+    return sequence_.load(std::memory_order_acquire);
+  }
+
+private:
+  uint8_t buffers_[2][N] = {};
+  std::atomic<uint32_t> sequence_{0};
+};
+
+#endif // SHADOW_BANK_INCLUDED
@@ -1,147 +1,343 @@
 #include "sht.hpp"
-#include "Wire.h"
+#include "sht_commands.hpp"
 
 namespace sht {
 
-void init() {
+namespace {
+
+// Ticks per degC and per %RH, from the conversion in section 4.6 of the datasheet
+constexpr double TicksPerDegree = 65535.0 / 175.0;
+constexpr double TicksPerPercent = 65535.0 / 125.0;
+
+// Repeatability of each precision, from table 1 of the SHT4x datasheet, as
+// Noise scales in ticks. The datasheet states it as 3 sigma.
+struct Repeatability {
+  int32_t T;
+  int32_t H;
+};
+
+constexpr Repeatability HighRepeatability = {Noise::scale(0.04 / 3 * TicksPerDegree),
+                                             Noise::scale(0.08 / 3 * TicksPerPercent)};
+constexpr Repeatability MediumRepeatability = {Noise::scale(0.07 / 3 * TicksPerDegree),
+                                               Noise::scale(0.15 / 3 * TicksPerPercent)};
+constexpr Repeatability LowRepeatability = {Noise::scale(0.10 / 3 * TicksPerDegree),
+                                            Noise::scale(0.25 / 3 * TicksPerPercent)};
+
+constexpr Repeatability PrecisionRepeatability[Sht4x::Precisions] = {HighRepeatability, MediumRepeatability,
+                                                                     LowRepeatability};
+
+// Each command, and for the measurement commands, from table 4 of the SHT4x
+// datasheet, the longest it takes, the frame it replies with and the heater
+// power while it runs. The heater commands measure at high precision once the
+// heater is off.
+enum class Action : uint8_t { None, Measure, ReadSerial, SoftReset };
+
+struct Command {
+  uint16_t command;
+  Action action;
+  uint32_t duration_us;
+  byte frame;
+  uint16_t heater_mW;
+  uint32_t heater_us;
+};
+
+constexpr Command Commands[] = {
+  {SHT4x_NOHEAT_HIGHPRECISION, Action::Measure, 8300, 0, 0, 0},
+  {SHT4x_NOHEAT_MEDPRECISION, Action::Measure, 4500, 1, 0, 0},
+  {SHT4x_NOHEAT_LOWPRECISION, Action::Measure, 1600, 2, 0, 0},
+  {SHT4x_HIGHHEAT_1S, Action::Measure, 1100000, Sht4x::HeaterFrame, 200, 1000000},
+  {SHT4x_HIGHHEAT_100MS, Action::Measure, 110000, Sht4x::HeaterFrame, 200, 100000},
+  {SHT4x_MEDHEAT_1S, Action::Measure, 1100000, Sht4x::HeaterFrame, 110, 1000000},
+  {SHT4x_MEDHEAT_100MS, Action::Measure, 110000, Sht4x::HeaterFrame, 110, 100000},
+  {SHT4x_LOWHEAT_1S, Action::Measure, 1100000, Sht4x::HeaterFrame, 20, 1000000},
+  {SHT4x_LOWHEAT_100MS, Action::Measure, 110000, Sht4x::HeaterFrame, 20, 100000},
+  {SHT4x_READSERIAL, Action::ReadSerial, 0, 0, 0, 0},
+  {SHT4x_SOFTRESET, Action::SoftReset, 0, 0, 0, 0},
+};
+
+constexpr CommandTable<Command, 4, 0x347> CommandLookup(Commands);
+static_assert(!CommandLookup.collision, "SHT4x commands must hash to distinct slots");
+
+const Command *find_command(int16_t command) {
+  return CommandLookup.find(uint16_t(command));
+}
+
+// First order thermal model of the die, for a bare part in still air. The
+// heater settles ThermalResistance K/W above ambient with time constant
+// ThermalTimeConstantUs; a 1 s pulse at 200 mW reports about 30 K of rise.
+// Below ThermalResolution K the rise is dropped, and while the die cools the
+// frames are rebuilt every ThermalStepUs.
+constexpr double ThermalResistance = 250.0;
+constexpr double ThermalTimeConstantUs = 1000000.0;
+constexpr double ThermalResolution = 0.01;
+constexpr uint32_t ThermalStepUs = 10000;
+
+// Water vapour saturation pressure ratio between T and T + excess, with the
+// Magnus formula. Heating the air at the sensor lowers its relative humidity
+// by this factor.
+double saturation_ratio(double T, double excess) {
+  const double heated = T + excess;
+  return exp(17.62 * T / (243.12 + T) - 17.62 * heated / (243.12 + heated));
+}
+
+// These are the functions provided by the datasheet, held to the range of
+// the ticks, since a corrected humidity may fall outside it
+uint16_t T_ticks(double T) {
+  return to_ticks((T + 45) * (pow(2, 16) - 1) / 175);
+}
+
+uint16_t H_ticks(double H) {
+  return to_ticks((H + 6) * (pow(2, 16) - 1) / 125);
+}
+
+} // namespace
+
+Sht4x::Sht4x(byte i2c_address, uint32_t serial_number)
+  : i2c_address_(i2c_address), serial_number_(serial_number), noise_(serial_number) {}
+
+void Sht4x::init() {
   init_serial_number();
 
-  set_T(22.0);
-  set_H(50.0);
+  T_ticks_ = T_ticks(22.0);
+  H_ticks_ = H_ticks(50.0);
+  publish_frames();
+}
 
-  Wire1.setSDA(18);
-  Wire1.setSCL(19);
+// Publish new frames only if the ticks changed
+void Sht4x::set_ticks(uint16_t T, uint16_t H) {
+  const bool changed = T != T_ticks_ || H != H_ticks_;
+  frame_recomputes_.record(changed);
+  if (changed) {
+    T_ticks_ = T;
+    H_ticks_ = H;
+    publish_frames();
+  }
+}
 
-  Wire1.onReceive(on_wire_receive);
-  Wire1.onRequest(on_wire_request);
+// Set the raw temperature ticks given temperature T in degC
+void Sht4x::set_T(const double &T) {
+  set_ticks(T_ticks(T), H_ticks_);
 }
 
-void begin() {
-  Wire1.begin(SHT4x_DEFAULT_ADDR); // This is the I2C address of a BME280
-  Serial.println("SHT emulator started with I2C address 0x44 on Wire1");
+double Sht4x::get_T(void) const {
+  return T_ticks_ * 175 / (pow(2, 16) - 1) - 45;
 }
 
-// Set the raw sensor reading (adc_T) given temperature T in degC
-// This solves the quadratic equation given in Appendix 8.1 in the BME datasheet
-void set_T(const double &T) {
-  // This is the function provided by the datasheet
-  TemperatureRegister = (T + 45) * (pow(2, 16) - 1) / 175;
+void Sht4x::set_H(const double &H) {
+  set_ticks(T_ticks_, H_ticks(H));
 }
 
-double get_T(void) {
-  return TemperatureRegister * 175 / (pow(2, 16) - 1) - 45;
+double Sht4x::get_H(void) const {
+  return H_ticks_ * 125 / (pow(2, 16) - 1) - 6;
 }
 
-void set_H(const double &H) {
-  HumidityRegister = (H + 6) * (pow(2, 16) - 1) / 125;
+void Sht4x::set_state(const double &T, const double &H) {
+  set_ticks(T_ticks(T), H_ticks(H));
 }
 
-bool is_measure_command(int16_t command) {
-  return (command == SHT4x_NOHEAT_HIGHPRECISION) ||
-         (command == SHT4x_NOHEAT_MEDPRECISION) ||
-         (command == SHT4x_NOHEAT_LOWPRECISION) ||
-         (command == SHT4x_HIGHHEAT_1S) ||
-         (command == SHT4x_HIGHHEAT_100MS) ||
-         (command == SHT4x_MEDHEAT_1S) ||
-         (command == SHT4x_MEDHEAT_100MS) ||
-         (command == SHT4x_LOWHEAT_1S) ||
-         (command == SHT4x_LOWHEAT_100MS);
-
-}
-
-uint8_t crc8(const uint8_t *data, int len) {
-  /*
-   *
-   * CRC-8 formula from page 14 of SHT spec pdf
-   *
-   * Test data 0xBE, 0xEF should yield 0x92
-   *
-   * Initialization data 0xFF
-   * Polynomial 0x31 (x8 + x5 +x4 +1)
-   * Final XOR 0x00
-   */
-
-  const uint8_t POLYNOMIAL(0x31);
-  uint8_t crc(0xFF);
-
-  for (int j = len; j; --j) {
-    crc ^= *data++;
-
-    for (int i = 8; i; --i) {
-      crc = (crc & 0x80) ? (crc << 1) ^ POLYNOMIAL : (crc << 1);
+// The ticks the sensor reads with the die excess K above the setpoint
+Sht4x::Ticks Sht4x::heated_ticks(double excess) const {
+  if (excess == 0) {
+    return Ticks{T_ticks_, H_ticks_};
+  }
+  const double T = get_T();
+  const double H = get_H() * saturation_ratio(T, excess);
+  return Ticks{to_ticks(T_ticks_ + excess * TicksPerDegree), to_ticks((H + 6) * TicksPerPercent)};
+}
+
+// Build the reply of every frame, with fresh noise if it is on, so the
+// interrupt only copies bytes
+void Sht4x::publish_frames() {
+  const Ticks now = heated_ticks(excess_);
+  const Ticks pulse = heated_ticks(pulse_excess_);
+  byte *frames = frames_.stage();
+  for (int f = 0; f < Frames; ++f) {
+    byte *frame = frames + f * FrameSize;
+    const Repeatability &repeatability = PrecisionRepeatability[f == HeaterFrame ? 0 : f];
+    uint16_t T = f == HeaterFrame ? pulse.T : now.T;
+    uint16_t H = f == HeaterFrame ? pulse.H : now.H;
+    if (noise_enabled_) {
+      T = add_noise(T, noise_.gaussian(repeatability.T));
+      H = add_noise(H, noise_.gaussian(repeatability.H));
+    }
+    put_frame(frame, T, H);
+  }
+  frames_.publish();
+}
+
+// Rise of the die over the setpoint at now_us, cooling from the last pulse
+double Sht4x::excess_at(uint32_t now_us) const {
+  const int32_t since_pulse = int32_t(now_us - pulse_end_us_);
+  if (pulse_excess_ == 0 || since_pulse <= 0) {
+    return pulse_excess_;
+  }
+  const double excess = pulse_excess_ * exp(-since_pulse / ThermalTimeConstantUs);
+  return excess < ThermalResolution ? 0 : excess;
+}
+
+// Heat the die for the pulse of command, which started at start_us
+void Sht4x::run_heater(byte command, uint32_t start_us) {
+  const Command *entry = find_command(command);
+  if (!entry || entry->heater_mW == 0) {
+    return;
+  }
+  const double start = excess_at(start_us);
+  const double settled = entry->heater_mW / 1000.0 * ThermalResistance;
+  pulse_excess_ = settled + (start - settled) * exp(-(entry->heater_us / ThermalTimeConstantUs));
+  pulse_end_us_ = start_us + entry->heater_us;
+}
+
+bool Sht4x::update(uint32_t now_us) {
+  bool publish = false;
+
+  // A heater command needs its frame before the read interrupt can answer it
+  const uint32_t commands = commands_.load(std::memory_order_acquire);
+  if (commands != seen_commands_) {
+    seen_commands_ = commands;
+    if (frame_ == HeaterFrame) {
+      run_heater(measure_command_, command_us_);
+      publish = true;
+    }
+  }
+
+  // While the die cools, follow it in steps
+  if (pulse_excess_ != 0 && (publish || now_us - thermal_us_ >= ThermalStepUs)) {
+    const double excess = excess_at(now_us);
+    if (excess == 0) {
+      pulse_excess_ = 0;
     }
+    publish = publish || excess != excess_;
+    excess_ = excess;
+    thermal_us_ = now_us;
+  }
+
+  const uint32_t measurements = measurements_.load(std::memory_order_relaxed);
+  if (noise_enabled_ && measurements != seen_measurements_) {
+    publish = true;
   }
-  return crc;
+  seen_measurements_ = measurements;
+
+  if (!publish) {
+    return false;
+  }
+  publish_frames();
+  heated_.store(commands, std::memory_order_release);
+  return true;
+}
+
+uint32_t Sht4x::measurement_us(int16_t command) {
+  const Command *entry = find_command(command);
+  return entry ? entry->duration_us : 0;
 }
 
-void eval_command(int16_t command) {
+bool is_measure_command(int16_t command) {
+  const Command *entry = find_command(command);
+  return entry && entry->action == Action::Measure;
+}
+
+void Sht4x::eval_command(int16_t command) {
   // Some commands setup an expected read request, which require no action. (until the read request)
   // Other commands are a command to write data, and they should be handled here.
   // Update: Actually for SHT4x (unlike SHT3x), there are no write commands, beyond reset
-  if (command == SHT4x_SOFTRESET) {
+  const Command *entry = find_command(command);
+  if (!entry) {
+    return;
+  }
+  if (entry->action == Action::SoftReset) {
     Serial.println("SOFTRESET Issued");
+  } else if (entry->action == Action::Measure) {
+    // The part ignores commands until a measurement is finished
+    const uint32_t now = micros();
+    if (now - command_us_ < busy_us_) {
+      return;
+    }
+    measure_command_ = command;
+    frame_ = entry->frame;
+    command_us_ = now;
+    busy_us_ = timing_enabled_ ? entry->duration_us : 0;
+    latched_ = false;
+    const uint32_t index = commands_.load(std::memory_order_relaxed) + 1;
+    command_index_ = index;
+    commands_.store(index, std::memory_order_release);
   }
 }
 
-void on_wire_receive(int num_bytes) {
+void Sht4x::set_noise(bool enabled) {
+  noise_enabled_ = enabled;
+  publish_frames();
+}
+
+void Sht4x::seed_noise(uint32_t seed) {
+  noise_.seed(seed);
+}
+
+void Sht4x::set_timing(bool enabled) {
+  timing_enabled_ = enabled;
+}
+
+void Sht4x::on_wire_receive(TwoWire &bus, int num_bytes) {
   //Serial.println("Begin on_wire_receive");
 
   if (num_bytes == 1) {
     int index = 0;
 
-    while (Wire1.available()) {
+    while (bus.available()) {
       if (index > 0) {
         Serial.println("Unexpected data received from controller");
         break;
       }
-      Command = Wire1.read();
+      command_ = bus.read();
       index++; 
     }
 
     // Second byte in the command is the last significant digit
-    eval_command(Command);
+    eval_command(command_);
 
     //Serial.print("Received command ");
-    //Serial.println(Command, HEX);
+    //Serial.println(command_, HEX);
   } else {
     Serial.print("One byte was expected, but received ");
     Serial.print(num_bytes, 0);
     Serial.println(" bytes from controller");
-    Command = 0x0;
+    command_ = 0x0;
   }
 
   //Serial.println("End on_wire_receive");
 }
 
-void on_wire_request(void) {
+void Sht4x::on_wire_request(TwoWire &bus) {
   //Serial.println("Begin on_wire_request");
   //Serial.print("Current Command: ");
-  //Serial.println(Command, HEX);
-
-  if (is_measure_command(Command)) {
-    byte data[6];
-    data[0] = TemperatureRegister >> 8;
-    data[1] = TemperatureRegister;
-    data[2] = crc8(data, 2);
-    data[3] = HumidityRegister >> 8;
-    data[4] = HumidityRegister;
-    data[5] = crc8(data + 3, 2);
-    Wire1.write(data, 6);
-  } else if(Command == SHT4x_READSERIAL) {
-    Wire1.write(SerialNumber, 6);
+  //Serial.println(command_, HEX);
+
+  if (is_measure_command(command_)) {
+    // The part NACKs its address until the measurement is finished. The
+    // RP2040 target always ACKs its address and stretches the clock until it
+    // has a byte to send, so the nearest it can do is an all ones frame, which
+    // is what the controller reads from an idle bus and fails the CRC check.
+    // A heater frame is also busy until the main loop has published it.
+    if (!latched_) {
+      if (micros() - command_us_ < busy_us_ ||
+          (frame_ == HeaterFrame && heated_.load(std::memory_order_acquire) != command_index_)) {
+        busy_reads_ = busy_reads_ + 1;
+        bus.write(BusyFrame, FrameSize);
+        return;
+      }
+      frames_.read(measurement_frame_, frame_ * FrameSize, FrameSize);
+      latched_ = true;
+      measurement_read_us_ = micros();
+      measurements_.store(measurements_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    bus.write(measurement_frame_, FrameSize);
+  } else if(command_ == SHT4x_READSERIAL) {
+    bus.write(serial_frame_, FrameSize);
   }
 
   //Serial.println("End on_wire_request");
 }
 
-void init_serial_number() {
-  SerialNumber[0] = 0x0E;
-  SerialNumber[1] = 0xFE;
-  SerialNumber[2] = crc8(SerialNumber, 2);
-  SerialNumber[3] = 0x7F;
-  SerialNumber[4] = 0xBF;
-  SerialNumber[5] = crc8(SerialNumber + 3, 2);
+void Sht4x::init_serial_number() {
+  put_frame(serial_frame_, serial_number_ >> 16, serial_number_);
 }
 
-
 } // namespace sht
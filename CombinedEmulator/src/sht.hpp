@@ -2,14 +2,22 @@
 #define SHT_INCLUDED
 
 #include <Arduino.h>
+#include <Wire.h>
+#include <atomic>
+#include "noise.hpp"
+#include "recompute_stats.hpp"
+#include "shadow_bank.hpp"
+#include "sht_frame.hpp"
 
+// sht namespace contains classes to emulate a SHT4x
+// The setters run in the main loop and publish the whole reply frame,
+// temperature, CRC, humidity, CRC, see shadow_bank.hpp, so the I2C interrupt
+// handlers only copy bytes and never read a mix of old and new values.
 namespace sht {
 
-static int16_t Command;
-static int16_t TemperatureRegister;
-static int16_t HumidityRegister;
-
 constexpr static byte SHT4x_DEFAULT_ADDR = 0x44;
+constexpr static byte SHT4x_ADDR_B = 0x45;
+constexpr static byte SHT4x_ADDR_C = 0x46;
 constexpr static byte SHT4x_NOHEAT_HIGHPRECISION = 0xFD;
 constexpr static byte SHT4x_NOHEAT_MEDPRECISION = 0xF6;
 constexpr static byte SHT4x_NOHEAT_LOWPRECISION = 0xE0;
@@ -21,25 +29,205 @@ constexpr static byte SHT4x_LOWHEAT_1S = 0x1E;
 constexpr static byte SHT4x_LOWHEAT_100MS = 0x15;
 constexpr static byte SHT4x_READSERIAL = 0x89;
 constexpr static byte SHT4x_SOFTRESET = 0x94;
-static byte SerialNumber[6];
-
-void init();
-void begin();
 
-// Set the raw sensor reading (adc_T) given temperature T in degC
-// This solves the quadratic equation given in Appendix 8.1 in the BME datasheet
-void set_T(const double &T);
-double get_T(void);
-void set_H(const double &H);
+// The serial number the emulator reported before it supported several instances
+constexpr static uint32_t SHT4x_DEFAULT_SERIAL = 0x0EFE7FBF;
 
 bool is_measure_command(int16_t command);
-void eval_command(int16_t command);
-uint8_t crc8(const uint8_t *data, int len);
 
-void on_wire_receive(int num_bytes);
-void on_wire_request(void);
+// Command state and measurement of one emulated SHT4x.
+// This part does not depend on the bus, see Sht4xEmulator for the I2C binding.
+//
+// A measurement command is timed from the receive interrupt. With timing
+// enabled, reads before the measurement duration of the command has passed
+// are answered busy, and the reply is taken from the published frames on the
+// first read after it. The heater commands also heat the die, which update()
+// models from the main loop; the reply of a heater command, and of every
+// measurement while the die cools, reports the heated temperature.
+class Sht4x {
+public:
+  explicit Sht4x(byte i2c_address, uint32_t serial_number = SHT4x_DEFAULT_SERIAL);
+
+  Sht4x(const Sht4x &) = delete;
+  Sht4x &operator=(const Sht4x &) = delete;
+
+  byte i2c_address() const { return i2c_address_; }
+
+  // Load the serial number, at 22 degC and 50 %RH
+  void init();
+
+  // Set the raw temperature ticks given temperature T in degC
+  // This inverts the conversion in section 4.6 of the SHT4x datasheet
+  void set_T(const double &T);
+  double get_T(void) const;
+  void set_H(const double &H);
+  double get_H(void) const;
+
+  // Set both in one publish, so no read returns the new temperature with the
+  // old humidity
+  void set_state(const double &T, const double &H);
+
+  void eval_command(int16_t command);
+
+  // Repeatability noise, off until enabled. The reply of each precision then
+  // carries noise with the datasheet repeatability for it. The same seed
+  // gives the same sequence of readings.
+  void set_noise(bool enabled);
+  void seed_noise(uint32_t seed);
+
+  // Measurement duration of each command, off until enabled, in which case
+  // every reply is ready at once. See measurement_us.
+  void set_timing(bool enabled);
+
+  // Run the heater thermal model up to now_us, a micros() timestamp, and draw
+  // fresh noise once a measurement has used the last frames, from the main
+  // loop. Returns true if new frames were published.
+  bool update(uint32_t now_us);
+
+  // Temperature rise of the die over the setpoint, in K, as of the last update
+  double heater_excess() const { return excess_; }
+
+  // Reads answered busy because the measurement was not finished
+  uint32_t busy_reads() const { return busy_reads_; }
+
+  // Measurements read, and the micros() time the last was first read. The
+  // interrupt sets the time before the count.
+  uint32_t measurements() const { return measurements_.load(std::memory_order_acquire); }
+  uint32_t measurement_read_us() const { return measurement_read_us_; }
+
+  // Frames published by set_T and set_H, and those skipped because the
+  // setpoint gave the same ticks
+  const RecomputeStats &frame_recomputes() const { return frame_recomputes_; }
+
+  // I2C transaction handlers, run from the interrupt of the bus this sensor is on
+  void on_wire_receive(TwoWire &bus, int num_bytes);
+  void on_wire_request(TwoWire &bus);
+
+  void init_serial_number();
+
+  // Reply frames, one per precision, high, medium and low, and one for the
+  // heater command being run
+  constexpr static int Precisions = 3;
+  constexpr static int HeaterFrame = Precisions;
+  constexpr static int Frames = Precisions + 1;
+
+  // Longest time a measurement command takes, from table 4 of the datasheet,
+  // 0 for other commands
+  static uint32_t measurement_us(int16_t command);
+
+private:
+  struct Ticks {
+    uint16_t T;
+    uint16_t H;
+  };
+
+  void set_ticks(uint16_t T, uint16_t H);
+  void publish_frames();
+  Ticks heated_ticks(double excess) const;
+  double excess_at(uint32_t now_us) const;
+  void run_heater(byte command, uint32_t start_us);
+
+  const byte i2c_address_;
+  const uint32_t serial_number_;
+
+  int16_t command_ = 0;
+  byte serial_frame_[FrameSize] = {};
+
+  // Raw temperature and humidity ticks of the setpoints, main loop only
+  uint16_t T_ticks_ = 0;
+  uint16_t H_ticks_ = 0;
+  RecomputeStats frame_recomputes_;
+
+  // The reply to a measurement command for each frame, ready to send
+  ShadowBank<FrameSize * Frames> frames_;
+
+  // The measurement command being run, written by the receive interrupt.
+  // commands_ counts the accepted commands so the main loop can find heater
+  // pulses, and heated_ is the count as of the last heater frame it
+  // published. The read interrupt takes the reply into measurement_frame_ on
+  // the first read once the command is done, and counts it in measurements_
+  // so the main loop knows when to redraw the noise.
+  volatile bool timing_enabled_ = false;
+  volatile byte measure_command_ = 0;
+  volatile byte frame_ = 0;
+  volatile uint32_t command_us_ = 0;
+  volatile uint32_t busy_us_ = 0;
+  volatile bool latched_ = false;
+  std::atomic<uint32_t> commands_{0};
+  std::atomic<uint32_t> heated_{0};
+  volatile uint32_t command_index_ = 0;
+  byte measurement_frame_[FrameSize] = {};
+  std::atomic<uint32_t> measurements_{0};
+  volatile uint32_t measurement_read_us_ = 0;
+  volatile uint32_t busy_reads_ = 0;
+  uint32_t seen_commands_ = 0;
+  uint32_t seen_measurements_ = 0;
+
+  // Heater thermal model, main loop only. The die is pulse_excess_ K above
+  // the setpoint at the end of the last heater pulse and cools from there;
+  // excess_ is the rise the frames were last built with, at thermal_us_.
+  double pulse_excess_ = 0;
+  uint32_t pulse_end_us_ = 0;
+  double excess_ = 0;
+  uint32_t thermal_us_ = 0;
+
+  Noise noise_;
+  bool noise_enabled_ = false;
+};
+
+// A Sht4x served on the I2C bus Bus, Wire or Wire1.
+// The Wire callbacks are plain functions, so each bus gets its own trampolines
+// and the instance they forward to. The RP2040 I2C block answers a single
+// target address, so a bus serves one emulated sensor at a time; beginning a
+// second instance on the same bus takes it over.
+template <TwoWire &Bus> class Sht4xEmulator : public Sht4x {
+public:
+  Sht4xEmulator(byte i2c_address, int sda, int scl, uint32_t serial_number = SHT4x_DEFAULT_SERIAL)
+    : Sht4x(i2c_address, serial_number), sda_(sda), scl_(scl) {}
+
+  // Initialize the sensor and set up the bus pins and callbacks
+  void init() {
+    Sht4x::init();
+
+    Bus.setSDA(sda_);
+    Bus.setSCL(scl_);
+
+    Active = this;
+    Bus.onReceive(on_receive);
+    Bus.onRequest(on_request);
+  }
+
+  // Start answering on the bus
+  void begin() {
+    Active = this;
+    Bus.begin(i2c_address());
+  }
+
+  void end() {
+    Bus.end();
+    if (Active == this) {
+      Active = nullptr;
+    }
+  }
+
+private:
+  static void on_receive(int num_bytes) {
+    if (Active) {
+      Active->on_wire_receive(Bus, num_bytes);
+    }
+  }
+
+  static void on_request(void) {
+    if (Active) {
+      Active->on_wire_request(Bus);
+    }
+  }
+
+  inline static Sht4x *volatile Active = nullptr;
 
-void init_serial_number();
+  const int sda_;
+  const int scl_;
+};
 
 } // namespace sht
 
@@ -0,0 +1,331 @@
+#include "sht3x.hpp"
+#include "sht_commands.hpp"
+
+namespace sht {
+
+namespace {
+
+// Ticks per degC and per %RH, from the conversion in section 4.13 of the datasheet
+constexpr double TicksPerDegree = 65535.0 / 175.0;
+constexpr double TicksPerPercent = 65535.0 / 100.0;
+
+// Repeatability of each precision, from tables 1 and 2 of the SHT3x
+// datasheet, as Noise scales in ticks. The datasheet states it as 3 sigma.
+struct Repeatability {
+  int32_t T;
+  int32_t H;
+};
+
+constexpr Repeatability PrecisionRepeatability[Sht3x::Precisions] = {
+  {Noise::scale(0.04 / 3 * TicksPerDegree), Noise::scale(0.08 / 3 * TicksPerPercent)},
+  {Noise::scale(0.08 / 3 * TicksPerDegree), Noise::scale(0.15 / 3 * TicksPerPercent)},
+  {Noise::scale(0.15 / 3 * TicksPerDegree), Noise::scale(0.21 / 3 * TicksPerPercent)},
+};
+
+// Each command, with for the measurement commands the longest a measurement
+// takes, from table 4 of the datasheet, the frame it replies with and, for
+// periodic acquisition, its period
+enum class Action : uint8_t {
+  SingleShot,
+  Periodic,
+  Fetch,
+  Break,
+  SoftReset,
+  HeaterEnable,
+  HeaterDisable,
+  ReadStatus,
+  ClearStatus,
+  ReadSerial
+};
+
+struct Command {
+  uint16_t command;
+  Action action;
+  uint32_t duration_us;
+  byte frame;
+  bool stretch;
+  uint32_t period_us;
+};
+
+constexpr uint32_t HighUs = 15000;
+constexpr uint32_t MediumUs = 6000;
+constexpr uint32_t LowUs = 4000;
+
+constexpr Command Commands[] = {
+  {SHT3x_SINGLE_STRETCH_HIGH, Action::SingleShot, HighUs, 0, true, 0},
+  {SHT3x_SINGLE_STRETCH_MEDIUM, Action::SingleShot, MediumUs, 1, true, 0},
+  {SHT3x_SINGLE_STRETCH_LOW, Action::SingleShot, LowUs, 2, true, 0},
+  {SHT3x_SINGLE_HIGH, Action::SingleShot, HighUs, 0, false, 0},
+  {SHT3x_SINGLE_MEDIUM, Action::SingleShot, MediumUs, 1, false, 0},
+  {SHT3x_SINGLE_LOW, Action::SingleShot, LowUs, 2, false, 0},
+  {SHT3x_PERIODIC_05_HIGH, Action::Periodic, HighUs, 0, false, 2000000},
+  {SHT3x_PERIODIC_05_MEDIUM, Action::Periodic, MediumUs, 1, false, 2000000},
+  {SHT3x_PERIODIC_05_LOW, Action::Periodic, LowUs, 2, false, 2000000},
+  {SHT3x_PERIODIC_1_HIGH, Action::Periodic, HighUs, 0, false, 1000000},
+  {SHT3x_PERIODIC_1_MEDIUM, Action::Periodic, MediumUs, 1, false, 1000000},
+  {SHT3x_PERIODIC_1_LOW, Action::Periodic, LowUs, 2, false, 1000000},
+  {SHT3x_PERIODIC_2_HIGH, Action::Periodic, HighUs, 0, false, 500000},
+  {SHT3x_PERIODIC_2_MEDIUM, Action::Periodic, MediumUs, 1, false, 500000},
+  {SHT3x_PERIODIC_2_LOW, Action::Periodic, LowUs, 2, false, 500000},
+  {SHT3x_PERIODIC_4_HIGH, Action::Periodic, HighUs, 0, false, 250000},
+  {SHT3x_PERIODIC_4_MEDIUM, Action::Periodic, MediumUs, 1, false, 250000},
+  {SHT3x_PERIODIC_4_LOW, Action::Periodic, LowUs, 2, false, 250000},
+  {SHT3x_PERIODIC_10_HIGH, Action::Periodic, HighUs, 0, false, 100000},
+  {SHT3x_PERIODIC_10_MEDIUM, Action::Periodic, MediumUs, 1, false, 100000},
+  {SHT3x_PERIODIC_10_LOW, Action::Periodic, LowUs, 2, false, 100000},
+  // ART acquires at 4 Hz
+  {SHT3x_ART, Action::Periodic, HighUs, 0, false, 250000},
+  {SHT3x_FETCH_DATA, Action::Fetch, 0, 0, false, 0},
+  {SHT3x_BREAK, Action::Break, 0, 0, false, 0},
+  {SHT3x_SOFTRESET, Action::SoftReset, 0, 0, false, 0},
+  {SHT3x_HEATER_ENABLE, Action::HeaterEnable, 0, 0, false, 0},
+  {SHT3x_HEATER_DISABLE, Action::HeaterDisable, 0, 0, false, 0},
+  {SHT3x_READ_STATUS, Action::ReadStatus, 0, 0, false, 0},
+  {SHT3x_CLEAR_STATUS, Action::ClearStatus, 0, 0, false, 0},
+  {SHT3x_READ_SERIAL, Action::ReadSerial, 0, 0, false, 0},
+};
+
+constexpr CommandTable<Command, 6, 0x1F7D> CommandLookup(Commands);
+static_assert(!CommandLookup.collision, "SHT3x commands must hash to distinct slots");
+
+// The status bits clear status resets
+constexpr uint16_t ClearableStatus =
+  SHT3x_STATUS_ALERT_PENDING | SHT3x_STATUS_RH_ALERT | SHT3x_STATUS_T_ALERT | SHT3x_STATUS_RESET;
+
+} // namespace
+
+Sht3x::Sht3x(byte i2c_address, uint32_t serial_number)
+  : i2c_address_(i2c_address), serial_number_(serial_number), noise_(serial_number) {}
+
+void Sht3x::init() {
+  put_frame(serial_frame_, serial_number_ >> 16, serial_number_);
+  soft_reset();
+
+  T_ticks_ = to_ticks((22.0 + 45) * TicksPerDegree);
+  H_ticks_ = to_ticks(50.0 * TicksPerPercent);
+  publish_frames();
+}
+
+// Publish new frames only if the ticks changed
+void Sht3x::set_ticks(uint16_t T, uint16_t H) {
+  const bool changed = T != T_ticks_ || H != H_ticks_;
+  frame_recomputes_.record(changed);
+  if (changed) {
+    T_ticks_ = T;
+    H_ticks_ = H;
+    publish_frames();
+  }
+}
+
+void Sht3x::set_T(const double &T) {
+  set_ticks(to_ticks((T + 45) * TicksPerDegree), H_ticks_);
+}
+
+double Sht3x::get_T(void) const {
+  return T_ticks_ / TicksPerDegree - 45;
+}
+
+void Sht3x::set_H(const double &H) {
+  set_ticks(T_ticks_, to_ticks(H * TicksPerPercent));
+}
+
+double Sht3x::get_H(void) const {
+  return H_ticks_ / TicksPerPercent;
+}
+
+void Sht3x::set_state(const double &T, const double &H) {
+  set_ticks(to_ticks((T + 45) * TicksPerDegree), to_ticks(H * TicksPerPercent));
+}
+
+// Build the reply of every repeatability, with fresh noise if it is on, so
+// the interrupt only copies bytes
+void Sht3x::publish_frames() {
+  byte *frames = frames_.stage();
+  for (int p = 0; p < Precisions; ++p) {
+    uint16_t T = T_ticks_;
+    uint16_t H = H_ticks_;
+    if (noise_enabled_) {
+      T = add_noise(T, noise_.gaussian(PrecisionRepeatability[p].T));
+      H = add_noise(H, noise_.gaussian(PrecisionRepeatability[p].H));
+    }
+    put_frame(frames + p * FrameSize, T, H);
+  }
+  frames_.publish();
+}
+
+bool Sht3x::update() {
+  const uint32_t measurements = measurements_.load(std::memory_order_relaxed);
+  if (!noise_enabled_ || measurements == seen_measurements_) {
+    return false;
+  }
+  seen_measurements_ = measurements;
+  publish_frames();
+  return true;
+}
+
+void Sht3x::set_noise(bool enabled) {
+  noise_enabled_ = enabled;
+  publish_frames();
+}
+
+void Sht3x::seed_noise(uint32_t seed) {
+  noise_.seed(seed);
+}
+
+void Sht3x::set_timing(bool enabled) {
+  timing_enabled_ = enabled;
+}
+
+uint32_t Sht3x::measurement_us(uint16_t command) {
+  const Command *entry = CommandLookup.find(command);
+  return entry ? entry->duration_us : 0;
+}
+
+uint32_t Sht3x::period_us(uint16_t command) {
+  const Command *entry = CommandLookup.find(command);
+  return entry ? entry->period_us : 0;
+}
+
+// Stop any acquisition and restore the power on status, as the soft reset
+// command and power on do
+void Sht3x::soft_reset() {
+  reply_ = Reply::None;
+  periodic_ = false;
+  busy_us_ = 0;
+  status_ = SHT3x_STATUS_POWER_ON;
+}
+
+void Sht3x::eval_command(uint16_t command) {
+  const uint32_t now = micros();
+  const Command *entry = CommandLookup.find(command);
+
+  // The part ignores commands while a single shot runs, and in periodic mode
+  // takes only the commands that do not start a measurement
+  const bool busy = now - command_us_ < busy_us_;
+  if (!entry || busy ||
+      (periodic_ && (entry->action == Action::SingleShot || entry->action == Action::Periodic ||
+                     entry->action == Action::ReadSerial))) {
+    status_ = status_ | SHT3x_STATUS_COMMAND_FAILED;
+    return;
+  }
+  status_ = status_ & ~SHT3x_STATUS_COMMAND_FAILED;
+
+  switch (entry->action) {
+  case Action::SingleShot:
+    frame_ = entry->frame;
+    command_us_ = now;
+    busy_us_ = timing_enabled_ && !entry->stretch ? entry->duration_us : 0;
+    latched_ = false;
+    reply_ = Reply::Measurement;
+    break;
+  case Action::Periodic:
+    frame_ = entry->frame;
+    command_us_ = now;
+    busy_us_ = 0;
+    duration_us_ = entry->duration_us;
+    period_us_ = entry->period_us;
+    fetched_ = 0;
+    periodic_ = true;
+    reply_ = Reply::None;
+    break;
+  case Action::Fetch:
+    reply_ = Reply::Fetch;
+    break;
+  case Action::Break:
+    periodic_ = false;
+    reply_ = Reply::None;
+    break;
+  case Action::SoftReset:
+    soft_reset();
+    break;
+  case Action::HeaterEnable:
+    status_ = status_ | SHT3x_STATUS_HEATER;
+    break;
+  case Action::HeaterDisable:
+    status_ = status_ & ~SHT3x_STATUS_HEATER;
+    break;
+  case Action::ReadStatus:
+    status_frame_[0] = status_ >> 8;
+    status_frame_[1] = status_;
+    status_frame_[2] = crc8(status_frame_, 2);
+    reply_ = Reply::Status;
+    break;
+  case Action::ClearStatus:
+    status_ = status_ & ~ClearableStatus;
+    break;
+  case Action::ReadSerial:
+    reply_ = Reply::Serial;
+    break;
+  }
+}
+
+void Sht3x::on_wire_receive(TwoWire &bus, int num_bytes) {
+  if (num_bytes == 2) {
+    const uint16_t msb = bus.read();
+    const uint16_t lsb = bus.read();
+    eval_command((msb << 8) | lsb);
+  } else {
+    // Commands with data, the alert limits, are not emulated
+    while (bus.available()) {
+      bus.read();
+    }
+    status_ = status_ | SHT3x_STATUS_COMMAND_FAILED;
+    reply_ = Reply::None;
+  }
+}
+
+// The part NACKs a read with no data ready, see BusyFrame
+void Sht3x::answer_busy(TwoWire &bus) {
+  busy_reads_ = busy_reads_ + 1;
+  bus.write(BusyFrame, FrameSize);
+}
+
+void Sht3x::on_wire_request(TwoWire &bus) {
+  switch (reply_) {
+  case Reply::Measurement:
+    if (!latched_) {
+      if (micros() - command_us_ < busy_us_) {
+        answer_busy(bus);
+        return;
+      }
+      frames_.read(measurement_frame_, frame_ * FrameSize, FrameSize);
+      latched_ = true;
+      measurements_.store(measurements_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    bus.write(measurement_frame_, FrameSize);
+    break;
+  case Reply::Fetch: {
+    // Each measurement can be fetched once, the first when its duration has
+    // passed and one more every period after that
+    // passed and one more every period after that. Outside periodic mode
+    // there is none, and no period to count them by.
+    if (!periodic_) {
+      answer_busy(bus);
+      return;
+    }
+    const uint32_t duration_us = timing_enabled_ ? duration_us_ : 0;
+    const uint32_t elapsed = micros() - command_us_;
+    const uint32_t completed = elapsed >= duration_us ? (elapsed - duration_us) / period_us_ + 1 : 0;
+    if (completed == fetched_) {
+      answer_busy(bus);
+      return;
+    }
+    fetched_ = completed;
+    frames_.read(measurement_frame_, frame_ * FrameSize, FrameSize);
+    measurements_.store(measurements_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    bus.write(measurement_frame_, FrameSize);
+    break;
+  }
+  case Reply::Status:
+    bus.write(status_frame_, sizeof(status_frame_));
+    break;
+  case Reply::Serial:
+    bus.write(serial_frame_, FrameSize);
+    break;
+  case Reply::None:
+    answer_busy(bus);
+    break;
+  }
+}
+
+} // namespace sht
@@ -0,0 +1,238 @@
+#ifndef SHT3X_INCLUDED
+#define SHT3X_INCLUDED
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <atomic>
+#include "noise.hpp"
+#include "recompute_stats.hpp"
+#include "shadow_bank.hpp"
+#include "sht_frame.hpp"
+
+// SHT3x personality of the sht namespace. The same approach as the SHT4x:
+// the setters publish the reply frames from the main loop and the I2C
+// interrupt handlers only copy bytes. Commands are 16 bits, MSB first.
+namespace sht {
+
+constexpr static byte SHT3x_DEFAULT_ADDR = 0x44;
+constexpr static byte SHT3x_ADDR_B = 0x45;
+
+// Single shot measurement, with and without clock stretching
+constexpr static uint16_t SHT3x_SINGLE_STRETCH_HIGH = 0x2C06;
+constexpr static uint16_t SHT3x_SINGLE_STRETCH_MEDIUM = 0x2C0D;
+constexpr static uint16_t SHT3x_SINGLE_STRETCH_LOW = 0x2C10;
+constexpr static uint16_t SHT3x_SINGLE_HIGH = 0x2400;
+constexpr static uint16_t SHT3x_SINGLE_MEDIUM = 0x240B;
+constexpr static uint16_t SHT3x_SINGLE_LOW = 0x2416;
+
+// Periodic acquisition, at 0.5, 1, 2, 4 and 10 measurements per second
+constexpr static uint16_t SHT3x_PERIODIC_05_HIGH = 0x2032;
+constexpr static uint16_t SHT3x_PERIODIC_05_MEDIUM = 0x2024;
+constexpr static uint16_t SHT3x_PERIODIC_05_LOW = 0x202F;
+constexpr static uint16_t SHT3x_PERIODIC_1_HIGH = 0x2130;
+constexpr static uint16_t SHT3x_PERIODIC_1_MEDIUM = 0x2126;
+constexpr static uint16_t SHT3x_PERIODIC_1_LOW = 0x212D;
+constexpr static uint16_t SHT3x_PERIODIC_2_HIGH = 0x2236;
+constexpr static uint16_t SHT3x_PERIODIC_2_MEDIUM = 0x2220;
+constexpr static uint16_t SHT3x_PERIODIC_2_LOW = 0x222B;
+constexpr static uint16_t SHT3x_PERIODIC_4_HIGH = 0x2334;
+constexpr static uint16_t SHT3x_PERIODIC_4_MEDIUM = 0x2322;
+constexpr static uint16_t SHT3x_PERIODIC_4_LOW = 0x2329;
+constexpr static uint16_t SHT3x_PERIODIC_10_HIGH = 0x2737;
+constexpr static uint16_t SHT3x_PERIODIC_10_MEDIUM = 0x2721;
+constexpr static uint16_t SHT3x_PERIODIC_10_LOW = 0x272A;
+
+constexpr static uint16_t SHT3x_FETCH_DATA = 0xE000;
+constexpr static uint16_t SHT3x_ART = 0x2B32;
+constexpr static uint16_t SHT3x_BREAK = 0x3093;
+constexpr static uint16_t SHT3x_SOFTRESET = 0x30A2;
+constexpr static uint16_t SHT3x_HEATER_ENABLE = 0x306D;
+constexpr static uint16_t SHT3x_HEATER_DISABLE = 0x3066;
+constexpr static uint16_t SHT3x_READ_STATUS = 0xF32D;
+constexpr static uint16_t SHT3x_CLEAR_STATUS = 0x3041;
+constexpr static uint16_t SHT3x_READ_SERIAL = 0x3780;
+
+// Status register bits, see table 17 of the SHT3x datasheet
+constexpr static uint16_t SHT3x_STATUS_ALERT_PENDING = 0x8000;
+constexpr static uint16_t SHT3x_STATUS_HEATER = 0x2000;
+constexpr static uint16_t SHT3x_STATUS_RH_ALERT = 0x0800;
+constexpr static uint16_t SHT3x_STATUS_T_ALERT = 0x0400;
+constexpr static uint16_t SHT3x_STATUS_RESET = 0x0010;
+constexpr static uint16_t SHT3x_STATUS_COMMAND_FAILED = 0x0002;
+constexpr static uint16_t SHT3x_STATUS_WRITE_CRC_FAILED = 0x0001;
+
+// The status after power on or a reset
+constexpr static uint16_t SHT3x_STATUS_POWER_ON = SHT3x_STATUS_ALERT_PENDING | SHT3x_STATUS_RESET;
+
+constexpr static uint32_t SHT3x_DEFAULT_SERIAL = 0x0EFE7FBF;
+
+// Command state and measurement of one emulated SHT3x.
+// This part does not depend on the bus, see Sht3xEmulator for the I2C binding.
+//
+// A single shot measurement is timed as on the SHT4x, see Sht4x. Periodic
+// acquisition and ART run from the time of their command: a Fetch Data read
+// returns the latest measurement once, and is answered busy until the next
+// one is done. The part holds SCL low during a clock stretching measurement,
+// which the RP2040 handler cannot do for milliseconds without stalling its
+// core, so those replies are ready at once.
+class Sht3x {
+public:
+  explicit Sht3x(byte i2c_address, uint32_t serial_number = SHT3x_DEFAULT_SERIAL);
+
+  Sht3x(const Sht3x &) = delete;
+  Sht3x &operator=(const Sht3x &) = delete;
+
+  byte i2c_address() const { return i2c_address_; }
+
+  // Load the serial number and the power on status, at 22 degC and 50 %RH
+  void init();
+
+  // Set the raw temperature and humidity ticks given T in degC and H in %RH
+  // This inverts the conversion in section 4.13 of the SHT3x datasheet
+  void set_T(const double &T);
+  double get_T(void) const;
+  void set_H(const double &H);
+  double get_H(void) const;
+
+  // Set both in one publish, so no read returns the new temperature with the
+  // old humidity
+  void set_state(const double &T, const double &H);
+
+  void eval_command(uint16_t command);
+
+  // Repeatability noise, off until enabled, as on the SHT4x
+  void set_noise(bool enabled);
+  void seed_noise(uint32_t seed);
+
+  // Measurement duration of each command, off until enabled, in which case
+  // single shot replies are ready at once
+  void set_timing(bool enabled);
+
+  // Draw fresh noise once a measurement has used the last frames, from the
+  // main loop. Returns true if new frames were published.
+  bool update();
+
+  uint16_t status() const { return status_; }
+
+  // Reads answered busy because no measurement was ready
+  uint32_t busy_reads() const { return busy_reads_; }
+
+  // Frames published by set_T and set_H, and those skipped because the
+  // setpoint gave the same ticks
+  const RecomputeStats &frame_recomputes() const { return frame_recomputes_; }
+
+  // I2C transaction handlers, run from the interrupt of the bus this sensor is on
+  void on_wire_receive(TwoWire &bus, int num_bytes);
+  void on_wire_request(TwoWire &bus);
+
+  // Reply frames, one per repeatability, high, medium and low
+  constexpr static int Precisions = 3;
+
+  // Longest time a measurement command takes, from table 4 of the datasheet,
+  // 0 for other commands, and the period of a periodic acquisition command
+  static uint32_t measurement_us(uint16_t command);
+  static uint32_t period_us(uint16_t command);
+
+private:
+  enum class Reply : uint8_t { None, Measurement, Fetch, Status, Serial };
+
+  void set_ticks(uint16_t T, uint16_t H);
+  void publish_frames();
+  void soft_reset();
+  void answer_busy(TwoWire &bus);
+
+  const byte i2c_address_;
+  const uint32_t serial_number_;
+
+  byte serial_frame_[FrameSize] = {};
+
+  // Raw temperature and humidity ticks of the setpoints, main loop only
+  uint16_t T_ticks_ = 0;
+  uint16_t H_ticks_ = 0;
+  RecomputeStats frame_recomputes_;
+
+  // The reply to a measurement for each repeatability, ready to send
+  ShadowBank<FrameSize * Precisions> frames_;
+
+  // Command state, owned by the interrupt handlers. A single shot runs from
+  // command_us_ for busy_us_; periodic acquisition from command_us_ every
+  // period_us_, each measurement taking duration_us_, with fetched_ the
+  // number of measurements read so far.
+  volatile Reply reply_ = Reply::None;
+  volatile uint16_t status_ = SHT3x_STATUS_POWER_ON;
+  volatile bool timing_enabled_ = false;
+  volatile bool periodic_ = false;
+  volatile byte frame_ = 0;
+  volatile uint32_t command_us_ = 0;
+  volatile uint32_t busy_us_ = 0;
+  volatile uint32_t duration_us_ = 0;
+  volatile uint32_t period_us_ = 0;
+  volatile uint32_t fetched_ = 0;
+  volatile bool latched_ = false;
+  byte measurement_frame_[FrameSize] = {};
+  byte status_frame_[3] = {};
+  std::atomic<uint32_t> measurements_{0};
+  volatile uint32_t busy_reads_ = 0;
+  uint32_t seen_measurements_ = 0;
+
+  Noise noise_;
+  bool noise_enabled_ = false;
+};
+
+// A Sht3x served on the I2C bus Bus, Wire or Wire1.
+// The Wire callbacks are plain functions, so each bus gets its own trampolines
+// and the instance they forward to. The RP2040 I2C block answers a single
+// target address, so a bus serves one emulated sensor at a time; beginning a
+// second instance on the same bus takes it over.
+template <TwoWire &Bus> class Sht3xEmulator : public Sht3x {
+public:
+  Sht3xEmulator(byte i2c_address, int sda, int scl, uint32_t serial_number = SHT3x_DEFAULT_SERIAL)
+    : Sht3x(i2c_address, serial_number), sda_(sda), scl_(scl) {}
+
+  // Initialize the sensor and set up the bus pins and callbacks
+  void init() {
+    Sht3x::init();
+
+    Bus.setSDA(sda_);
+    Bus.setSCL(scl_);
+
+    Active = this;
+    Bus.onReceive(on_receive);
+    Bus.onRequest(on_request);
+  }
+
+  // Start answering on the bus
+  void begin() {
+    Active = this;
+    Bus.begin(i2c_address());
+  }
+
+  void end() {
+    Bus.end();
+    if (Active == this) {
+      Active = nullptr;
+    }
+  }
+
+private:
+  static void on_receive(int num_bytes) {
+    if (Active) {
+      Active->on_wire_receive(Bus, num_bytes);
+    }
+  }
+
+  static void on_request(void) {
+    if (Active) {
+      Active->on_wire_request(Bus);
+    }
+  }
+
+  inline static Sht3x *volatile Active = nullptr;
+
+  const int sda_;
+  const int scl_;
+};
+
+} // namespace sht
+
+#endif // SHT3X_INCLUDED
@@ -0,0 +1,45 @@
+#ifndef SHT_COMMANDS_INCLUDED
+#define SHT_COMMANDS_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sht {
+
+// Command dispatch table of a sensor family, built at compile time.
+// Each entry lands in its own slot of a 2^Bits table, by a multiplicative
+// hash of the command, so the receive interrupt finds a command with one
+// multiply, one shift and one compare whatever the size of the command set.
+// Entry is a literal type with a uint16_t command member.
+//
+// The table records whether two commands share a slot. Check collision with
+// a static_assert where the table is defined; when adding a command breaks
+// it, search for another odd Multiplier.
+template <typename Entry, int Bits, uint16_t Multiplier> struct CommandTable {
+  constexpr static int Slots = 1 << Bits;
+
+  Entry entries[Slots] = {};
+  bool used[Slots] = {};
+  bool collision = false;
+
+  template <size_t N> constexpr CommandTable(const Entry (&commands)[N]) {
+    for (size_t i = 0; i < N; ++i) {
+      const int s = slot(commands[i].command);
+      collision = collision || used[s];
+      entries[s] = commands[i];
+      used[s] = true;
+    }
+  }
+
+  constexpr static int slot(uint16_t command) { return uint16_t(command * Multiplier) >> (16 - Bits); }
+
+  // The entry of command, or nullptr for a command the family does not have
+  constexpr const Entry *find(uint16_t command) const {
+    const int s = slot(command);
+    return used[s] && entries[s].command == command ? &entries[s] : nullptr;
+  }
+};
+
+} // namespace sht
+
+#endif // SHT_COMMANDS_INCLUDED
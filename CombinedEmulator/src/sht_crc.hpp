@@ -0,0 +1,47 @@
+#ifndef SHT_CRC_INCLUDED
+#define SHT_CRC_INCLUDED
+
+#include <stdint.h>
+
+namespace sht {
+
+// CRC-8 formula from page 14 of SHT spec pdf
+//
+// Initialization data 0xFF
+// Polynomial 0x31 (x8 + x5 +x4 +1)
+// Final XOR 0x00
+//
+// The table holds the CRC of every byte value, generated at compile time, so
+// each data byte costs one lookup rather than eight shifts.
+struct Crc8Table {
+  uint8_t entries[256];
+
+  constexpr Crc8Table() : entries() {
+    constexpr uint8_t Polynomial = 0x31;
+    for (int value = 0; value < 256; ++value) {
+      uint8_t crc = value;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc & 0x80) ? uint8_t(crc << 1) ^ Polynomial : uint8_t(crc << 1);
+      }
+      entries[value] = crc;
+    }
+  }
+};
+
+inline constexpr Crc8Table Crc8Lookup;
+
+constexpr uint8_t crc8(const uint8_t *data, int len) {
+  uint8_t crc = 0xFF;
+  for (int i = 0; i < len; ++i) {
+    crc = Crc8Lookup.entries[crc ^ data[i]];
+  }
+  return crc;
+}
+
+// Test data 0xBE, 0xEF should yield 0x92
+constexpr uint8_t Crc8TestData[] = {0xBE, 0xEF};
+static_assert(crc8(Crc8TestData, 2) == 0x92, "CRC-8 datasheet example");
+
+} // namespace sht
+
+#endif // SHT_CRC_INCLUDED
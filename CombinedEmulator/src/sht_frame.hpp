@@ -0,0 +1,44 @@
+#ifndef SHT_FRAME_INCLUDED
+#define SHT_FRAME_INCLUDED
+
+#include <Arduino.h>
+#include "sht_crc.hpp"
+
+// Reply frames shared by the SHT3x and SHT4x, two 16 bit words MSB first,
+// each followed by its CRC-8
+namespace sht {
+
+constexpr int FrameSize = 6;
+
+inline void put_ticks(byte *data, uint16_t ticks) {
+  data[0] = ticks >> 8;
+  data[1] = ticks;
+}
+
+inline void put_frame(byte *frame, uint16_t first, uint16_t second) {
+  put_ticks(frame, first);
+  frame[2] = crc8(frame, 2);
+  put_ticks(frame + 3, second);
+  frame[5] = crc8(frame + 3, 2);
+}
+
+// A converted reading in ticks, held to the 16 bit range, NaN as 0
+inline uint16_t to_ticks(double ticks) {
+  return ticks > 0 ? (ticks < 0xFFFF ? uint16_t(ticks) : 0xFFFF) : 0;
+}
+
+inline uint16_t add_noise(uint16_t ticks, int32_t noise) {
+  const int32_t value = int32_t(ticks) + noise;
+  return value < 0 ? 0 : (value > 0xFFFF ? 0xFFFF : value);
+}
+
+// Reply of a read while the sensor is busy. The RP2040 target always ACKs
+// its address and stretches the clock until it has a byte to send, so it
+// cannot NACK as the parts do; the nearest is an all ones frame, which is
+// what a controller reads from an idle bus, and which fails the CRC check.
+constexpr byte BusyFrame[FrameSize] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+static_assert(crc8(BusyFrame, 2) != 0xFF, "a busy reply must fail the CRC");
+
+} // namespace sht
+
+#endif // SHT_FRAME_INCLUDED
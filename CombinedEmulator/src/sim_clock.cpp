@@ -0,0 +1,72 @@
+#include "sim_clock.hpp"
+
+namespace {
+
+constexpr double FixedOne = 4294967296.0;
+
+// us of device time at rate, 32.32 fixed point, in two products that each
+// fit 64 bits
+uint64_t scaled(uint32_t elapsed_us, uint64_t rate) {
+  return uint64_t(elapsed_us) * (rate >> 32) + ((uint64_t(elapsed_us) * (rate & 0xFFFFFFFFu)) >> 32);
+}
+
+uint64_t magnitude(int64_t value) {
+  return value < 0 ? uint64_t(-value) : uint64_t(value);
+}
+
+} // namespace
+
+void SimClock::reset() {
+  *this = SimClock();
+}
+
+uint64_t SimClock::to_sim_us(uint32_t time_us) const {
+  if (!synced_) {
+    return 0;
+  }
+  const int32_t elapsed = int32_t(time_us - anchor_us_);
+  if (elapsed < 0) {
+    // Captured before the sync was taken, so at the rate without its slew
+    const uint64_t back = scaled(uint32_t(-int64_t(elapsed)), rate_);
+    return back < anchor_sim_us_ ? anchor_sim_us_ - back : 0;
+  }
+  const uint32_t slewed = uint32_t(elapsed) < SlewUs ? uint32_t(elapsed) : SlewUs;
+  return anchor_sim_us_ + scaled(slewed, slew_rate_) + scaled(uint32_t(elapsed) - slewed, rate_);
+}
+
+void SimClock::sync(uint64_t sim_us, uint32_t scale_milli, uint32_t now_us) {
+  ++syncs_;
+  const uint64_t predicted = to_sim_us(now_us);
+  const int64_t offset = synced_ ? int64_t(sim_us - predicted) : 0;
+  const bool step = !synced_ || scale_milli != scale_milli_ || scale_milli == 0 ||
+                    magnitude(offset) > uint64_t(StepUs) * scale_milli / RealTime;
+  offset_us_ = offset;
+
+  if (!step) {
+    baseline_dev_us_ += now_us - last_sync_us_;
+    if (baseline_dev_us_ >= MinBaselineUs) {
+      const double host_us = double(int64_t(sim_us - baseline_sim_us_)) * RealTime / scale_milli;
+      const double ratio = host_us / double(baseline_dev_us_);
+      const double limit = MaxDriftPpm * 1e-6;
+      ratio_ = ratio < 1 - limit ? 1 - limit : ratio > 1 + limit ? 1 + limit : ratio;
+    }
+  }
+  last_sync_us_ = now_us;
+  scale_milli_ = scale_milli;
+  rate_ = uint64_t(double(scale_milli) / RealTime * ratio_ * FixedOne);
+  anchor_us_ = now_us;
+
+  if (step) {
+    ++steps_;
+    anchor_sim_us_ = sim_us;
+    baseline_sim_us_ = sim_us;
+    baseline_dev_us_ = 0;
+    slew_rate_ = rate_;
+  } else {
+    // Half the offset over SlewUs, never slower than half the rate
+    anchor_sim_us_ = predicted;
+    const double slew = double(rate_) + double(offset) / 2 / SlewUs * FixedOne;
+    slew_rate_ = slew < double(rate_ / 2) ? rate_ / 2 : uint64_t(slew);
+  }
+  synced_ = true;
+}
@@ -0,0 +1,74 @@
+#ifndef SIM_CLOCK_INCLUDED
+#define SIM_CLOCK_INCLUDED
+
+#include <stdint.h>
+
+// The host's simulation time, kept on the device from the host's clock syncs
+// so each output edge and sensor read can be stamped with the simulation time
+// it happened at, to the device's micros() rather than to the step.
+//
+// A sync gives the simulation time when the host sent it and the scale, in
+// simulation ms per 1000 ms of real time. Between syncs the clock runs at the
+// scale, corrected by how fast the device's crystal runs against the host's
+// clock, measured over the whole time since the last step. What it is off by
+// at a sync is slewed out, half of it over SlewUs, so it never jumps and
+// never runs backwards, and the jitter of the host's latency averages out.
+// An offset of more than StepUs of real time, a new scale or a held clock is
+// taken as it is instead.
+//
+// Stamps lag by the host's one way latency, which the host may add to the
+// time it sends. Device times must be within 2^31 us of the last sync, so
+// the host must sync at least every half hour.
+class SimClock {
+public:
+  constexpr static uint32_t RealTime = 1000;
+  constexpr static uint32_t StepUs = 100000;
+  constexpr static uint32_t SlewUs = 1000000;
+  // Drift measured over less than this is not trusted yet
+  constexpr static uint32_t MinBaselineUs = 10000000;
+  // The most the device's clock is taken to be off by, in parts per million
+  constexpr static int32_t MaxDriftPpm = 1000;
+
+  // The host's simulation time sim_us, at scale_milli, as of micros() now_us
+  void sync(uint64_t sim_us, uint32_t scale_milli, uint32_t now_us);
+  void reset();
+
+  bool synced() const { return synced_; }
+
+  // The simulation time at micros() time_us, 0 until the first sync
+  uint64_t to_sim_us(uint32_t time_us) const;
+
+  uint32_t scale_milli() const { return scale_milli_; }
+  // How much faster the device's clock runs than the host's
+  double drift_ppm() const { return (1.0 / ratio_ - 1.0) * 1e6; }
+  // What the host's time was ahead of the clock by at the last sync, in
+  // simulation us
+  int64_t offset_us() const { return offset_us_; }
+  uint32_t syncs() const { return syncs_; }
+  uint32_t steps() const { return steps_; }
+
+private:
+  bool synced_ = false;
+  uint32_t scale_milli_ = RealTime;
+  // Host us per device us
+  double ratio_ = 1.0;
+
+  // Simulation us per device us, in 32.32 fixed point, while the offset is
+  // slewed and after it
+  uint64_t slew_rate_ = 0;
+  uint64_t rate_ = 0;
+  uint32_t anchor_us_ = 0;
+  uint64_t anchor_sim_us_ = 0;
+
+  // Device time since the last step, and the simulation time the host gave
+  // then, to measure the drift over
+  uint32_t last_sync_us_ = 0;
+  uint64_t baseline_dev_us_ = 0;
+  uint64_t baseline_sim_us_ = 0;
+
+  int64_t offset_us_ = 0;
+  uint32_t syncs_ = 0;
+  uint32_t steps_ = 0;
+};
+
+#endif // SIM_CLOCK_INCLUDED
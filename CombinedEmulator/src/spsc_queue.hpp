@@ -0,0 +1,69 @@
+#ifndef SPSC_QUEUE_INCLUDED
+#define SPSC_QUEUE_INCLUDED
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed size queue from one producer to one consumer, for passing messages
+// between the two RP2040 cores.
+//
+// Each index is written by one side only, the tail by the producer and the
+// head by the consumer, so both ends are a plain load and store with no
+// lock, no read-modify-write and no interrupt masking. The Cortex-M0+ has no
+// exclusive access instructions, so this is also the only kind of atomic it
+// does without a spinlock. A message is copied in before the tail that
+// publishes it is stored, and copied out before the head that frees its slot.
+template <typename T, size_t N> class SpscQueue {
+public:
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscQueue size must be a power of 2");
+
+  constexpr static size_t Capacity = N;
+
+  // Producer side. Returns false, leaving the queue as it is, when full.
+  bool push(const T &message) {
+    const uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    slots_[tail & (N - 1)] = message;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false when empty.
+  bool pop(T &message) {
+    const uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    message = slots_[head & (N - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Pops up to max messages in one pass, freeing their slots
+  // together, and returns how many.
+  size_t pop_batch(T *messages, size_t max) {
+    const uint32_t head = head_.load(std::memory_order_relaxed);
+    const uint32_t waiting = tail_.load(std::memory_order_acquire) - head;
+    const size_t count = waiting < max ? waiting : max;
+    for (size_t i = 0; i < count; ++i) {
+      messages[i] = slots_[(head + i) & (N - 1)];
+    }
+    head_.store(head + uint32_t(count), std::memory_order_release);
+    return count;
+  }
+
+  // Messages waiting, as seen from either side
+  size_t size() const {
+    return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+  }
+
+private:
+  T slots_[N];
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+};
+
+#endif // SPSC_QUEUE_INCLUDED
@@ -0,0 +1,189 @@
+#include "trajectory.hpp"
+
+namespace {
+
+void put_u32(uint8_t *out, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    out[i] = uint8_t(value >> (8 * i));
+  }
+}
+
+uint32_t get_u32(const uint8_t *in) {
+  return in[0] | (uint32_t(in[1]) << 8) | (uint32_t(in[2]) << 16) | (uint32_t(in[3]) << 24);
+}
+
+uint64_t point_ms(const TrajectoryPoint &point) {
+  return uint64_t(point.time_s) * 1000;
+}
+
+// Segments stepped through one at a time before a seek by bisection
+constexpr int MaxSteps = 4;
+
+} // namespace
+
+void TrajectoryPoint::put(uint8_t *out) const {
+  put_u32(out, time_s);
+  put_u32(out + 4, uint32_t(T_milli));
+  put_u32(out + 8, uint32_t(H_milli));
+  put_u32(out + 12, uint32_t(P_milli));
+}
+
+void TrajectoryPoint::get(const uint8_t *in) {
+  time_s = get_u32(in);
+  T_milli = int32_t(get_u32(in + 4));
+  H_milli = int32_t(get_u32(in + 8));
+  P_milli = int32_t(get_u32(in + 12));
+}
+
+void TrajectoryPlayer::load(TrajectorySource &source, uint8_t fields, uint32_t now_ms) {
+  source_ = &source;
+  fields_ = fields;
+  state_ = source.size() > 0 ? State::Paused : State::Empty;
+  position_ms_ = 0;
+  remainder_ = 0;
+  last_ms_ = now_ms;
+  segment_valid_ = false;
+  has_last_ = false;
+}
+
+void TrajectoryPlayer::unload() {
+  source_ = nullptr;
+  state_ = State::Empty;
+  segment_valid_ = false;
+  has_last_ = false;
+}
+
+void TrajectoryPlayer::control(const TrajectoryControl &control, uint32_t now_ms) {
+  // Time up to now runs at the scale it had
+  advance(now_ms);
+  if (control.flags & TrajectoryControl::Scale) {
+    scale_milli_ = control.scale_milli;
+  }
+  if (control.flags & TrajectoryControl::Offsets) {
+    offsets_[0] = control.offset_T_milli;
+    offsets_[1] = control.offset_H_milli;
+    offsets_[2] = control.offset_P_milli;
+  }
+  if (state_ == State::Empty) {
+    return;
+  }
+  if (control.flags & TrajectoryControl::Seek) {
+    position_ms_ = uint64_t(control.seek_s) * 1000;
+    remainder_ = 0;
+    if (state_ == State::Finished) {
+      state_ = State::Paused;
+    }
+  }
+  if (control.flags & TrajectoryControl::Pause) {
+    state_ = State::Paused;
+  }
+  if (control.flags & TrajectoryControl::Play && state_ != State::Finished) {
+    state_ = State::Playing;
+  }
+}
+
+void TrajectoryPlayer::advance(uint32_t now_ms) {
+  const uint32_t elapsed = now_ms - last_ms_;
+  last_ms_ = now_ms;
+  if (state_ != State::Playing) {
+    return;
+  }
+  const uint64_t scaled = uint64_t(elapsed) * scale_milli_ + remainder_;
+  position_ms_ += scaled / 1000;
+  remainder_ = uint32_t(scaled % 1000);
+}
+
+bool TrajectoryPlayer::read(uint32_t index, TrajectoryPoint &point) {
+  ++reads_;
+  return source_->read(index, point);
+}
+
+// Bring from_ and to_ round the position: the segment it is in, the first
+// before the trajectory starts, or the last after it ends
+bool TrajectoryPlayer::locate() {
+  const uint32_t size = source_->size();
+  if (size < 2) {
+    segment_ = 0;
+    segment_valid_ = size == 1 && read(0, from_);
+    to_ = from_;
+    return segment_valid_;
+  }
+  const uint32_t last_segment = size - 2;
+  if (segment_valid_ && position_ms_ >= point_ms(from_)) {
+    for (int step = 0; step < MaxSteps; ++step) {
+      if (position_ms_ < point_ms(to_) || segment_ == last_segment) {
+        return true;
+      }
+      from_ = to_;
+      ++segment_;
+      if (!read(segment_ + 1, to_)) {
+        segment_valid_ = false;
+        return false;
+      }
+    }
+    if (position_ms_ < point_ms(to_)) {
+      return true;
+    }
+  } else if (segment_valid_ && segment_ == 0) {
+    // Before the start
+    return true;
+  }
+
+  // The last segment starting at or before the position
+  uint32_t low = 0;
+  uint32_t high = last_segment;
+  TrajectoryPoint point;
+  while (low < high) {
+    const uint32_t middle = low + (high - low + 1) / 2;
+    if (!read(middle, point)) {
+      segment_valid_ = false;
+      return false;
+    }
+    if (point_ms(point) <= position_ms_) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  segment_ = low;
+  segment_valid_ = read(segment_, from_) && read(segment_ + 1, to_);
+  return segment_valid_;
+}
+
+int32_t TrajectoryPlayer::interpolate(int32_t from, int32_t to) const {
+  const uint64_t start = point_ms(from_);
+  const uint64_t end = point_ms(to_);
+  if (position_ms_ <= start) {
+    return from;
+  }
+  if (position_ms_ >= end) {
+    return to;
+  }
+  return int32_t(from + (int64_t(to) - from) * int64_t(position_ms_ - start) / int64_t(end - start));
+}
+
+bool TrajectoryPlayer::tick(uint32_t now_ms, TrajectoryPoint &setpoints) {
+  if (state_ == State::Empty) {
+    return false;
+  }
+  advance(now_ms);
+  if (!locate()) {
+    return false;
+  }
+  if (state_ == State::Playing && segment_ + 2 >= source_->size() && position_ms_ >= point_ms(to_)) {
+    state_ = State::Finished;
+    position_ms_ = point_ms(to_);
+  }
+
+  TrajectoryPoint point;
+  point.time_s = uint32_t(position_ms_ / 1000);
+  point.T_milli = interpolate(from_.T_milli, to_.T_milli) + offsets_[0];
+  point.H_milli = interpolate(from_.H_milli, to_.H_milli) + offsets_[1];
+  point.P_milli = interpolate(from_.P_milli, to_.P_milli) + offsets_[2];
+  const bool changed = !has_last_ || point.T_milli != last_.T_milli || point.H_milli != last_.H_milli ||
+                       point.P_milli != last_.P_milli;
+  has_last_ = true;
+  last_ = point;
+  setpoints = point;
+  return changed;
+}
@@ -0,0 +1,114 @@
+#ifndef TRAJECTORY_INCLUDED
+#define TRAJECTORY_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A setpoint trajectory the emulator plays by itself, so the sensors follow a
+// schedule smoothly however late the host is. The host uploads the points,
+// and then only sends corrections and play, pause, seek and scale commands.
+
+// One point, at time_s into the trajectory, in thousandths of a degC, %RH
+// and Pa. Stored and sent as Size bytes, little endian.
+struct TrajectoryPoint {
+  constexpr static size_t Size = 16;
+  constexpr static uint8_t HasT = 1;
+  constexpr static uint8_t HasH = 2;
+  constexpr static uint8_t HasP = 4;
+
+  uint32_t time_s;
+  int32_t T_milli;
+  int32_t H_milli;
+  int32_t P_milli;
+
+  void put(uint8_t *out) const;
+  void get(const uint8_t *in);
+};
+
+// Where the points come from: a file in flash on the device, read a point at a
+// time as playback reaches it, or memory on the host. Times must not
+// decrease.
+class TrajectorySource {
+public:
+  virtual ~TrajectorySource() = default;
+
+  virtual uint32_t size() const = 0;
+  virtual bool read(uint32_t index, TrajectoryPoint &point) = 0;
+};
+
+// What the host asks of playback, each part applied if its flag is set
+struct TrajectoryControl {
+  constexpr static uint8_t Play = 1;
+  constexpr static uint8_t Pause = 2;
+  constexpr static uint8_t Seek = 4;
+  constexpr static uint8_t Scale = 8;
+  constexpr static uint8_t Offsets = 16;
+
+  uint8_t flags;
+  uint32_t seek_s;
+  // Trajectory ms per 1000 ms of real time
+  uint32_t scale_milli;
+  // Corrections added to the trajectory, in thousandths of a degC, %RH, Pa
+  int32_t offset_T_milli;
+  int32_t offset_H_milli;
+  int32_t offset_P_milli;
+};
+
+// Plays a trajectory, interpolating linearly between its points. Its
+// position advances by the real time between ticks times the scale, with
+// the remainder carried, so the tick's jitter never accumulates. Before the
+// first point playback holds the first, and at the last it holds the last
+// and stops.
+class TrajectoryPlayer {
+public:
+  enum class State : uint8_t { Empty, Paused, Playing, Finished };
+
+  constexpr static uint32_t RealTime = 1000;
+
+  // Load source, of which the fields flagged are played, paused at its
+  // start. The source must outlive playback.
+  void load(TrajectorySource &source, uint8_t fields, uint32_t now_ms);
+  void unload();
+
+  void control(const TrajectoryControl &control, uint32_t now_ms);
+
+  // Advance to now_ms and interpolate. Returns true, with the setpoints,
+  // when they differ from those last returned.
+  bool tick(uint32_t now_ms, TrajectoryPoint &setpoints);
+
+  State state() const { return state_; }
+  uint8_t fields() const { return fields_; }
+  uint32_t points() const { return source_ ? source_->size() : 0; }
+  uint64_t position_ms() const { return position_ms_; }
+  uint32_t scale_milli() const { return scale_milli_; }
+  // Source reads, to see how rarely playback goes to flash
+  uint32_t reads() const { return reads_; }
+
+private:
+  void advance(uint32_t now_ms);
+  bool read(uint32_t index, TrajectoryPoint &point);
+  bool locate();
+  int32_t interpolate(int32_t from, int32_t to) const;
+
+  TrajectorySource *source_ = nullptr;
+  uint8_t fields_ = 0;
+  State state_ = State::Empty;
+  uint64_t position_ms_ = 0;
+  // Trajectory time not yet a whole ms, in thousandths of one
+  uint32_t remainder_ = 0;
+  uint32_t last_ms_ = 0;
+  uint32_t scale_milli_ = RealTime;
+  int32_t offsets_[3] = {};
+
+  // The points either side of the position, from_ at segment_
+  uint32_t segment_ = 0;
+  bool segment_valid_ = false;
+  TrajectoryPoint from_ = {};
+  TrajectoryPoint to_ = {};
+
+  bool has_last_ = false;
+  TrajectoryPoint last_ = {};
+  uint32_t reads_ = 0;
+};
+
+#endif // TRAJECTORY_INCLUDED
@@ -0,0 +1,438 @@
+"""
+Binary frames of the serial link to the emulator, the counterpart of
+CombinedEmulator/src/host_protocol.hpp.
+
+Each frame is version, type, a 16 bit sequence number, a payload and a
+CRC-16/CCITT-FALSE of all of them, little endian, COBS encoded and sent
+between two zero bytes. JSON lines share the link, since they never hold a
+zero byte. The emulator speaks JSON until it acknowledges a Hello.
+
+Run this file to compare the encode and decode rates of both encodings.
+"""
+
+import json
+import struct
+import time
+
+VERSION = 1
+
+HELLO = 0x01
+HELLO_ACK = 0x02
+SET_STATE = 0x10
+OUTPUTS = 0x20
+OUTPUT_EVENTS = 0x21
+SIM_OUTPUT_EVENTS = 0x22
+SENSOR_READS = 0x23
+HISTORY_REQUEST = 0x30
+HISTORY_DATA = 0x31
+HISTORY_END = 0x32
+TRAJECTORY_BEGIN = 0x40
+TRAJECTORY_POINTS = 0x41
+TRAJECTORY_END = 0x42
+TRAJECTORY_COMMAND = 0x43
+TRAJECTORY_STATUS = 0x44
+CLOCK_SYNC = 0x50
+STEP = 0x60
+STEP_ACK = 0x61
+
+CAP_SET_STATE = 0x0001
+CAP_OUTPUTS = 0x0002
+CAP_OUTPUT_EVENTS = 0x0004
+CAP_HISTORY = 0x0008
+CAP_TRAJECTORY = 0x0010
+CAP_SIM_TIME = 0x0020
+CAP_LOCKSTEP = 0x0040
+CAPABILITIES = (CAP_SET_STATE | CAP_OUTPUTS | CAP_OUTPUT_EVENTS | CAP_HISTORY | CAP_TRAJECTORY | CAP_SIM_TIME |
+                CAP_LOCKSTEP)
+
+HAS_T = 1
+HAS_H = 2
+HAS_P = 4
+# Of a STEP only, the simulation time is set
+HAS_SIM_TIME = 8
+
+# Trajectory playback commands, applied if set
+PLAY = 1
+PAUSE = 2
+SEEK = 4
+SCALE = 8
+OFFSETS = 16
+
+# Trajectory playback states and upload errors, as in the status
+TRAJECTORY_STATES = ('empty', 'paused', 'playing', 'finished')
+TRAJECTORY_ERRORS = (None, 'storage', 'lost points', 'bad frame', 'no upload')
+TRAJECTORY_POINTS_PER_FRAME = 4
+
+# The sensors of SENSOR_READS, by their number
+SENSORS = ('sht', 'bme')
+
+_HEADER = struct.Struct('<BBH')
+_CRC = struct.Struct('<H')
+_HELLO = struct.Struct('<BH')
+_STATE = struct.Struct('<BiiiI')
+_OUTPUTS = struct.Struct('<BI')
+_HISTORY_REQUEST = struct.Struct('<II')
+_HISTORY_BLOCK = struct.Struct('<IIHH')
+_TRAJECTORY_POINT = struct.Struct('<Iiii')
+_TRAJECTORY_END = struct.Struct('<I')
+_TRAJECTORY_COMMAND = struct.Struct('<BIIiii')
+_TRAJECTORY_STATUS = struct.Struct('<BBIIII')
+_CLOCK_SYNC = struct.Struct('<QI')
+_SIM_EVENT = struct.Struct('<BQ')
+_STEP = struct.Struct('<IBiiiQ')
+_STEP_ACK = struct.Struct('<IiiiBI')
+
+
+def _crc16_table():
+    table = []
+    for value in range(256):
+        crc = value << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+        table.append(crc & 0xFFFF)
+    return table
+
+
+_CRC16_TABLE = _crc16_table()
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc = ((crc << 8) & 0xFFFF) ^ _CRC16_TABLE[(crc >> 8) ^ byte]
+    return crc
+
+
+assert crc16(b'123456789') == 0x29B1
+
+
+def cobs_encode(data):
+    out = bytearray()
+    block = bytearray()
+    for byte in data:
+        if byte == 0:
+            out.append(len(block) + 1)
+            out += block
+            block.clear()
+        else:
+            block.append(byte)
+            if len(block) == 254:
+                out.append(255)
+                out += block
+                block.clear()
+    out.append(len(block) + 1)
+    out += block
+    return bytes(out)
+
+
+def cobs_decode(data):
+    """Decode a COBS block without its delimiters, None if it is malformed"""
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            return None
+        out += data[i + 1:i + code]
+        i += code
+        if code != 255 and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def encode_frame(frame_type, sequence, payload=b''):
+    raw = _HEADER.pack(VERSION, frame_type, sequence & 0xFFFF) + payload
+    return b'\x00' + cobs_encode(raw + _CRC.pack(crc16(raw))) + b'\x00'
+
+
+def decode_frame(block):
+    """(version, type, sequence, payload) of a block between delimiters, None if it is invalid"""
+    raw = cobs_decode(block)
+    if raw is None or len(raw) < _HEADER.size + _CRC.size:
+        return None
+    body, (crc,) = raw[:-_CRC.size], _CRC.unpack(raw[-_CRC.size:])
+    if crc16(body) != crc:
+        return None
+    version, frame_type, sequence = _HEADER.unpack(body[:_HEADER.size])
+    return version, frame_type, sequence, body[_HEADER.size:]
+
+
+def hello(sequence, capabilities=CAPABILITIES):
+    return encode_frame(HELLO, sequence, _HELLO.pack(VERSION, capabilities))
+
+
+def set_state(sequence, temperature=None, humidity=None, pressure=None, host_ms=None):
+    """Setpoints in degC, %RH and Pa; those left as None are kept"""
+    fields = ((HAS_T if temperature is not None else 0) | (HAS_H if humidity is not None else 0) |
+              (HAS_P if pressure is not None else 0))
+    if host_ms is None:
+        host_ms = int(time.monotonic() * 1000)
+    payload = _STATE.pack(fields, round((temperature or 0) * 1000), round((humidity or 0) * 1000),
+                          round((pressure or 0) * 1000), host_ms & 0xFFFFFFFF)
+    return encode_frame(SET_STATE, sequence, payload)
+
+
+def read_hello_ack(payload):
+    """(version, capabilities) the emulator granted"""
+    return _HELLO.unpack(payload[:_HELLO.size])
+
+
+def read_outputs(payload):
+    """(inputs bitmask, emulator time in us when they were sampled)"""
+    return _OUTPUTS.unpack(payload[:_OUTPUTS.size])
+
+
+def read_output_events(payload):
+    """[(inputs bitmask, emulator time in us of the change's first edge)], oldest first"""
+    count = payload[0]
+    return [_OUTPUTS.unpack_from(payload, 1 + i * _OUTPUTS.size) for i in range(count)]
+
+
+def clock_sync(sequence, sim_time, scale):
+    """
+    Sync the emulator's simulation clock to sim_time, in s, running at scale
+    simulation s per s, 0 while the simulation is held. Send the time the
+    emulator will take it at, adding the link's latency.
+    """
+    return encode_frame(CLOCK_SYNC, sequence, _CLOCK_SYNC.pack(max(0, round(sim_time * 1e6)),
+                                                               max(0, round(scale * 1000))))
+
+
+def read_sim_events(payload):
+    """
+    [(value, simulation time in s)], oldest first, of SIM_OUTPUT_EVENTS, each
+    value the inputs bitmask, or of SENSOR_READS, each value the sensor
+    """
+    count = payload[0]
+    return [(value, sim_us / 1e6) for value, sim_us in
+            (_SIM_EVENT.unpack_from(payload, 1 + i * _SIM_EVENT.size) for i in range(count))]
+
+
+def step(sequence, number, temperature=None, humidity=None, pressure=None, sim_time=None):
+    """
+    Lockstep step number, from 1, with its setpoints as in set_state and the
+    simulation time in s the emulator's clock holds at until the next
+    """
+    fields = ((HAS_T if temperature is not None else 0) | (HAS_H if humidity is not None else 0) |
+              (HAS_P if pressure is not None else 0) | (HAS_SIM_TIME if sim_time is not None else 0))
+    payload = _STEP.pack(number, fields, round((temperature or 0) * 1000), round((humidity or 0) * 1000),
+                         round((pressure or 0) * 1000), max(0, round((sim_time or 0) * 1e6)))
+    return encode_frame(STEP, sequence, payload)
+
+
+def read_step_ack(payload):
+    """
+    (step, temperature, humidity, pressure, inputs, time_us) of STEP_ACK: the
+    setpoints applied, the inputs bitmask when they were and the emulator's
+    micros() then
+    """
+    number, T, H, P, inputs, time_us = _STEP_ACK.unpack(payload[:_STEP_ACK.size])
+    return number, T / 1000, H / 1000, P / 1000, inputs, time_us
+
+
+def history_request(sequence, from_ms=0, to_ms=0xFFFFFFFF):
+    """Ask for the history between two times in the emulator's millis()"""
+    return encode_frame(HISTORY_REQUEST, sequence, _HISTORY_REQUEST.pack(from_ms, to_ms))
+
+
+def read_history_end(payload):
+    """True if the export was cut short by the emulator dropping old history"""
+    return payload[0] != 0
+
+
+def trajectory_begin(sequence, fields):
+    """Start a trajectory upload of the fields flagged, HAS_T and so on"""
+    return encode_frame(TRAJECTORY_BEGIN, sequence, bytes([fields]))
+
+
+def trajectory_points(sequence, points):
+    """
+    Up to TRAJECTORY_POINTS_PER_FRAME points, as (time_s, temperature,
+    humidity, pressure) in s, degC, %RH and Pa, times not decreasing
+    """
+    payload = b''.join(_TRAJECTORY_POINT.pack(int(time_s), round(T * 1000), round(H * 1000), round(P * 1000))
+                       for time_s, T, H, P in points)
+    return encode_frame(TRAJECTORY_POINTS, sequence, payload)
+
+
+def trajectory_end(sequence, count):
+    """End an upload of count points"""
+    return encode_frame(TRAJECTORY_END, sequence, _TRAJECTORY_END.pack(count))
+
+
+def trajectory_command(sequence, play=None, seek=None, scale=None, offsets=None):
+    """
+    Play (True) or pause (False) the trajectory, seek to seek s into it, run it
+    at scale times real time, and add offsets, (degC, %RH, Pa), to it. Those
+    left as None are kept.
+    """
+    flags = ((0 if play is None else PLAY if play else PAUSE) | (0 if seek is None else SEEK) |
+             (0 if scale is None else SCALE) | (0 if offsets is None else OFFSETS))
+    T, H, P = offsets or (0, 0, 0)
+    payload = _TRAJECTORY_COMMAND.pack(flags, int(seek or 0), round((scale or 0) * 1000), round(T * 1000),
+                                       round(H * 1000), round(P * 1000))
+    return encode_frame(TRAJECTORY_COMMAND, sequence, payload)
+
+
+def read_trajectory_status(payload):
+    """(state, error, points loaded, points received, position s, scale) of a TrajectoryStatus"""
+    state, error, points, received, position_s, scale_milli = _TRAJECTORY_STATUS.unpack(
+        payload[:_TRAJECTORY_STATUS.size])
+    return (TRAJECTORY_STATES[state] if state < len(TRAJECTORY_STATES) else state,
+            TRAJECTORY_ERRORS[error] if error < len(TRAJECTORY_ERRORS) else error,
+            points, received, position_s, scale_milli / 1000)
+
+
+class _BitReader:
+    def __init__(self, data, bits):
+        self.value = int.from_bytes(data, 'big')
+        self.length = len(data) * 8
+        self.bits = bits
+        self.position = 0
+
+    def get(self, bits):
+        if self.position + bits > self.bits:
+            raise ValueError('history block overrun')
+        self.position += bits
+        return (self.value >> (self.length - self.position)) & ((1 << bits) - 1)
+
+
+def _signed(value):
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+# Delta of delta ranges of the history time stamps, after 1 to 3 one bits:
+# (bits, offset)
+_TIME_RANGES = ((7, -63), (9, -255), (12, -2047))
+
+
+def _decode_block(data, bits, count):
+    reader = _BitReader(data, bits)
+    time_ms = reader.get(32)
+    values = [_signed(reader.get(32)) for _ in range(3)]
+    inputs = reader.get(8)
+    windows = [None, None, None]
+    delta = 0
+    samples = [(time_ms, *values, inputs)]
+    for _ in range(count - 1):
+        ones = 0
+        while ones < 4 and reader.get(1):
+            ones += 1
+        if ones == 4:
+            delta += _signed(reader.get(32))
+        elif ones:
+            width, offset = _TIME_RANGES[ones - 1]
+            delta += reader.get(width) + offset
+        time_ms = (time_ms + delta) & 0xFFFFFFFF
+        for i in range(3):
+            if not reader.get(1):
+                continue
+            if not reader.get(1):
+                leading, trailing = windows[i]
+            else:
+                leading = reader.get(5)
+                trailing = 32 - leading - (reader.get(5) + 1)
+                windows[i] = (leading, trailing)
+            xored = reader.get(32 - leading - trailing) << trailing
+            values[i] = _signed((values[i] & 0xFFFFFFFF) ^ xored)
+        if reader.get(1):
+            inputs = reader.get(8)
+        samples.append((time_ms, *values, inputs))
+    return samples
+
+
+def decode_history(data, from_ms=0, to_ms=0xFFFFFFFF):
+    """
+    Samples of an exported history, HistoryLog in history.hpp, as
+    (time_ms, temperature, humidity, pressure, inputs), the setpoints in
+    thousandths of a degC, %RH and Pa, keeping those from from_ms to to_ms.
+    A block cut short ends the list.
+    """
+    samples = []
+    at = 0
+    while at + _HISTORY_BLOCK.size <= len(data):
+        first_ms, last_ms, count, bits = _HISTORY_BLOCK.unpack_from(data, at)
+        at += _HISTORY_BLOCK.size
+        block = data[at:at + (bits + 7) // 8]
+        at += len(block)
+        try:
+            decoded = _decode_block(block, bits, count)
+        except ValueError:
+            break
+        samples += [sample for sample in decoded if from_ms <= sample[0] <= to_ms]
+    return samples
+
+
+class LinkReader:
+    """
+    Splits the bytes from the emulator into JSON lines and frames. feed returns
+    a list of ('json', dict) and ('frame', (version, type, sequence, payload)).
+    Lines that are not JSON, and invalid frames, are counted and dropped.
+    """
+
+    def __init__(self):
+        self.in_frame = False
+        self.block = bytearray()
+        self.line = bytearray()
+        self.invalid_frames = 0
+        self.invalid_lines = 0
+
+    def feed(self, data):
+        messages = []
+        for byte in data:
+            if not self.in_frame:
+                if byte == 0:
+                    self.in_frame = True
+                    self.block.clear()
+                elif byte == ord('\n'):
+                    self._end_line(messages)
+                else:
+                    self.line.append(byte)
+            elif byte != 0:
+                self.block.append(byte)
+            elif self.block:
+                self.in_frame = False
+                frame = decode_frame(bytes(self.block))
+                if frame is None:
+                    self.invalid_frames += 1
+                else:
+                    messages.append(('frame', frame))
+        return messages
+
+    def _end_line(self, messages):
+        text = self.line.decode('utf-8', errors='replace').strip()
+        self.line.clear()
+        if not text:
+            return
+        try:
+            messages.append(('json', json.loads(text)))
+        except ValueError:
+            self.invalid_lines += 1
+
+
+def _benchmark(count=20000):
+    state = {"temperature": 21.375, "humidity": 45.5}
+
+    start = time.perf_counter()
+    for i in range(count):
+        encoded = set_state(i, state["temperature"], state["humidity"], host_ms=i)
+    reader = LinkReader()
+    for _ in range(count):
+        reader.feed(encoded)
+    binary = time.perf_counter() - start
+
+    start = time.perf_counter()
+    for _ in range(count):
+        line = (json.dumps(state) + '\n').encode('utf-8')
+    reader = LinkReader()
+    for _ in range(count):
+        reader.feed(line)
+    text = time.perf_counter() - start
+
+    for name, seconds, size in (('binary SetState', binary, len(encoded)), ('JSON setpoints', text, len(line))):
+        print(f"{name:20} {count / seconds:10.0f} frames/s, {size} bytes, "
+              f"{size * 10 / 115200 * 1e6:.0f} us on the wire at 115200 baud")
+
+
+if __name__ == '__main__':
+    _benchmark()
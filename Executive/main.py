@@ -4,6 +4,8 @@ import time
 import serial
 import threading
 import time
+import emulator_protocol as protocol
+from collections import deque
 from datetime import datetime, timedelta
 
 boptest_host = '10.1.1.158'
@@ -19,6 +21,31 @@ cooling_status = 0
 ADVANCE_INTERVAL = STEP_SIZE / TIME_SCALER
 serial_port = '/dev/tty.usbserial-0001'
 baudrate = 115200
+# Time from writing a message to the emulator to it being read, added to the
+# simulation time sent with a clock sync
+LINK_LATENCY = 0.003
+# Advance BOPTEST as soon as the emulator acknowledges each step's setpoints
+# rather than every ADVANCE_INTERVAL. The emulator's simulation clock holds
+# at each step's time, and a step not acknowledged within LOCKSTEP_TIMEOUT is
+# sent again, up to LOCKSTEP_ATTEMPTS times.
+LOCKSTEP = False
+LOCKSTEP_TIMEOUT = 0.5
+LOCKSTEP_ATTEMPTS = 4
+# Adjust the time scale, starting at TIME_SCALER, to the loop's measured
+# latencies, see TimeScaler. Each step's timing goes to timing_csv.
+ADAPTIVE_SCALE = True
+MIN_SCALE = 1.0
+MAX_SCALE = 60.0
+# The emulator's response, the serial round trip and the thermostat's
+# reaction, is kept within this fraction of a step in simulation time
+LATENCY_FRACTION = 0.25
+timing_csv = 'step_timing.csv'
+
+# A zone temperature trajectory to upload, a CSV of time_s,temperature in s
+# from the start and degC, or None to send every step's temperature. With
+# one the emulator plays it at the time scale and only the difference from
+# BOPTEST is sent.
+trajectory_csv = None
 
 # The epoch from the BOPTEST / Modelica / Spawn point of view
 epoch_datetime = datetime(year=2024, month=1, day=1, hour=0, minute=0, second=0)
@@ -48,29 +75,252 @@ def kelvin_to_fahrenheit(kelvin):
 
 
 class SerialIO:
+    """
+    The link to the emulator. It offers binary frames with a Hello, and keeps
+    to JSON lines if the emulator does not acknowledge within HELLO_TIMEOUT.
+    """
+
+    HELLO_TIMEOUT = 1.0
+    # Steps whose send time is kept for their round trip
+    STEPS_IN_FLIGHT = 64
+
     def __init__(self, port, baudrate):
-        self.ser = serial.Serial(serial_port, baudrate)
+        self.ser = serial.Serial(serial_port, baudrate, timeout=0.05)
+        self.reader = protocol.LinkReader()
+        # Held by the reader thread while it takes each message, and by the
+        # main loop while it uses the lists the reader fills
+        self.lock = threading.Lock()
+        self.sequence = 0
+        self.capabilities = 0
+        # Output changes as (inputs, emulator us at the first edge), oldest first
+        self.output_events = []
+        # Once the clock is synced, output changes as (inputs, simulation s at
+        # the first edge) and sensor reads as (sensor, simulation s)
+        self.sim_output_events = []
+        self.sensor_reads = []
+        self.history = bytearray()
+        self.history_cut = False
+        self.history_done = threading.Event()
+        self.trajectory_status = None
+        self.trajectory_answered = threading.Event()
+        self.acknowledged = threading.Event()
+        # The last lockstep step sent, and its acknowledgement once it came
+        self.step_number = 0
+        self.step_ack = None
+        self.step_acknowledged = threading.Event()
+        # When each step not yet acknowledged was last sent, and the longest
+        # round trip of the steps acknowledged since it was last taken
+        self.step_sent = {}
+        self.step_round_trip = None
+        # When the last setpoints were sent, and the thermostat's reaction
+        # times, from them to each output change that came within a step
+        self.inputs = None
+        self.setpoint_sent = None
+        self.reaction_window = STEP_SIZE / TIME_SCALER
+        self.reactions = []
         self.running = True
         self.thread = threading.Thread(target=self.readln)
         self.thread.start()
+        self.negotiate()
+
+    def negotiate(self):
+        self.ser.write(protocol.hello(self.next_sequence()))
+        if not self.acknowledged.wait(self.HELLO_TIMEOUT):
+            print("Emulator did not answer the Hello, using JSON")
+
+    def next_sequence(self):
+        sequence = self.sequence
+        self.sequence = (self.sequence + 1) & 0xFFFF
+        return sequence
+
+    def set_outputs(self, inputs):
+        global fan_status, heating_status, cooling_status
+        if self.inputs is not None and inputs != self.inputs and self.setpoint_sent is not None:
+            reaction = time.time() - self.setpoint_sent
+            if reaction < self.reaction_window:
+                self.reactions.append(reaction)
+        self.inputs = inputs
+        fan_status = inputs & 1
+        heating_status = (inputs >> 1) & 1
+        cooling_status = (inputs >> 2) & 1
 
     def readln(self):
         global fan_status, heating_status, cooling_status
         while self.running:
-            if self.ser.in_waiting > 0:  # Check if data is available
-                data = self.ser.readline().decode('utf-8').rstrip()  # Read a line
-                #print(f"Received from thermostat: {data}")  # Process the data (e.g., print it)
-                try:
-                    json_data = json.loads(data)
-                    if "input0" in json_data:
-                        fan_status = json_data["input0"]
-                    if "input1" in json_data:
-                        heating_status = json_data["input1"]
-                    if "input2" in json_data:
-                        cooling_status = json_data["input2"]
-                except Exception as e:
-                    pass
-
+            data = self.ser.read(self.ser.in_waiting or 1)
+            for kind, message in self.reader.feed(data):
+                with self.lock:
+                    if kind == 'frame':
+                        version, frame_type, sequence, payload = message
+                        if frame_type == protocol.HELLO_ACK:
+                            version, self.capabilities = protocol.read_hello_ack(payload)
+                            self.acknowledged.set()
+                        elif frame_type == protocol.OUTPUTS:
+                            inputs, device_us = protocol.read_outputs(payload)
+                            self.set_outputs(inputs)
+                        elif frame_type == protocol.HISTORY_DATA:
+                            self.history += payload
+                        elif frame_type == protocol.HISTORY_END:
+                            self.history_cut = protocol.read_history_end(payload)
+                            self.history_done.set()
+                        elif frame_type == protocol.TRAJECTORY_STATUS:
+                            self.trajectory_status = protocol.read_trajectory_status(payload)
+                            self.trajectory_answered.set()
+                        elif frame_type == protocol.STEP_ACK:
+                            self.take_step_ack(protocol.read_step_ack(payload))
+                        elif frame_type == protocol.SIM_OUTPUT_EVENTS:
+                            events = protocol.read_sim_events(payload)
+                            self.sim_output_events.extend(events)
+                            if events:
+                                self.set_outputs(events[-1][0])
+                        elif frame_type == protocol.SENSOR_READS:
+                            self.sensor_reads.extend(protocol.read_sim_events(payload))
+                        elif frame_type == protocol.OUTPUT_EVENTS:
+                            events = protocol.read_output_events(payload)
+                            self.output_events.extend(events)
+                            if events:
+                                self.set_outputs(events[-1][0])
+                    elif isinstance(message, dict):
+                        if "step" in message:
+                            self.take_step_ack((message["step"], message["temperature"], message["humidity"],
+                                                message["pressure"], message["inputs"], message["time_us"]))
+                            continue
+                        for event in message.get("events", []):
+                            if len(event) == 3:
+                                self.sim_output_events.append((event[0], event[2]))
+                        for sensor, sim_time in message.get("reads", []):
+                            self.sensor_reads.append((protocol.SENSORS[sensor], sim_time))
+                        if "input0" in message:
+                            fan_status = message["input0"]
+                        if "input1" in message:
+                            heating_status = message["input1"]
+                        if "input2" in message:
+                            cooling_status = message["input2"]
+                        if "input0" in message or "input1" in message or "input2" in message:
+                            self.set_outputs(fan_status | heating_status << 1 | cooling_status << 2)
+
+    def take_step_ack(self, ack):
+        # Any step's round trip counts, so a link slower than the step
+        # interval still reports how slow it is. Steps sent before it will
+        # not be acknowledged now.
+        sent = self.step_sent.pop(ack[0], None)
+        if sent is not None:
+            round_trip = time.time() - sent
+            self.step_round_trip = max(round_trip, self.step_round_trip or 0)
+            for number in [number for number in self.step_sent if number < ack[0]]:
+                del self.step_sent[number]
+        if ack[0] == self.step_number:
+            self.set_outputs(ack[4])
+            self.step_ack = ack
+            self.step_acknowledged.set()
+
+    def take_round_trip(self):
+        """The longest round trip of the steps acknowledged since, or None"""
+        with self.lock:
+            round_trip, self.step_round_trip = self.step_round_trip, None
+        return round_trip
+
+    def step(self, temperature, sim_time=None, wait=True):
+        """
+        Send the next lockstep step and wait for the emulator to apply it.
+        Returns its acknowledgement, (step, temperature, humidity, pressure,
+        inputs, emulator us), or None if none came after LOCKSTEP_ATTEMPTS.
+        With no sim_time the simulation clock keeps running. Without wait the
+        step is sent once and None returned, its round trip left for
+        take_round_trip.
+        """
+        with self.lock:
+            self.step_number += 1
+            number = self.step_number
+        self.step_acknowledged.clear()
+        message = {"step": number, "temperature": temperature}
+        if sim_time is not None:
+            message.update({"sim_time": sim_time, "sim_scale": 0})
+        for attempt in range(LOCKSTEP_ATTEMPTS):
+            # Sent again, the same step is only acknowledged again
+            with self.lock:
+                self.setpoint_sent = time.time()
+                self.step_sent[number] = self.setpoint_sent
+                # Steps long unacknowledged never will be
+                for old in [old for old in self.step_sent if old <= number - self.STEPS_IN_FLIGHT]:
+                    del self.step_sent[old]
+            if self.capabilities & protocol.CAP_LOCKSTEP:
+                self.ser.write(protocol.step(self.next_sequence(), number, temperature=temperature,
+                                             sim_time=sim_time))
+            else:
+                self.ser.write((json.dumps(message) + "\n").encode('utf-8'))
+            if not wait:
+                return None
+            if self.step_acknowledged.wait(LOCKSTEP_TIMEOUT):
+                return self.step_ack
+        print(f"Emulator did not acknowledge step {number}")
+        return None
+
+    def set_temperature(self, temperature):
+        with self.lock:
+            self.setpoint_sent = time.time()
+        if self.capabilities & protocol.CAP_SET_STATE:
+            self.ser.write(protocol.set_state(self.next_sequence(), temperature=temperature))
+        else:
+            self.ser.write((json.dumps({"temperature": temperature}) + "\n").encode('utf-8'))
+
+    def sync_clock(self, sim_time, scale):
+        """Sync the emulator's simulation clock, sim_time in s as of now"""
+        sim_time += LINK_LATENCY * scale
+        if self.capabilities & protocol.CAP_SIM_TIME:
+            self.ser.write(protocol.clock_sync(self.next_sequence(), sim_time, scale))
+        else:
+            self.ser.write((json.dumps({"sim_time": sim_time, "sim_scale": scale}) + "\n").encode('utf-8'))
+
+    def fetch_history(self, from_ms=0, to_ms=0xFFFFFFFF, timeout=30.0):
+        """The emulator's history, decoded, or None if it has none to send"""
+        if not self.capabilities & protocol.CAP_HISTORY:
+            return None
+        with self.lock:
+            self.history = bytearray()
+        self.history_done.clear()
+        self.ser.write(protocol.history_request(self.next_sequence(), from_ms, to_ms))
+        if not self.history_done.wait(timeout):
+            print("Emulator history export timed out")
+        with self.lock:
+            history = bytes(self.history)
+        return protocol.decode_history(history, from_ms, to_ms)
+
+    def trajectory_request(self, frame, timeout=1.0):
+        """Send a trajectory frame and wait for the status it is answered with"""
+        self.trajectory_answered.clear()
+        self.ser.write(frame)
+        if not self.trajectory_answered.wait(timeout):
+            return None
+        return self.trajectory_status
+
+    def upload_trajectory(self, points, fields=protocol.HAS_T):
+        """
+        Upload points, (time_s, temperature, humidity, pressure), a frame at a
+        time, each answered before the next goes. Returns True if the emulator
+        loaded them all. The emulator writes them to flash, which holds up its
+        sensors, so upload before a run rather than during one.
+        """
+        if not self.capabilities & protocol.CAP_TRAJECTORY:
+            return False
+        frames = [protocol.trajectory_begin(self.next_sequence(), fields)]
+        for i in range(0, len(points), protocol.TRAJECTORY_POINTS_PER_FRAME):
+            frames.append(protocol.trajectory_points(self.next_sequence(),
+                                                     points[i:i + protocol.TRAJECTORY_POINTS_PER_FRAME]))
+        frames.append(protocol.trajectory_end(self.next_sequence(), len(points)))
+        for frame in frames:
+            status = self.trajectory_request(frame)
+            if status is None or status[1] is not None:
+                print(f"Trajectory upload failed: {status[1] if status else 'no answer'}")
+                return False
+        return self.trajectory_status[2] == len(points)
+
+    def control_trajectory(self, play=None, seek=None, scale=None, offsets=None):
+        """Play, pause, seek, scale or correct the trajectory, see protocol.trajectory_command"""
+        if offsets is not None:
+            with self.lock:
+                self.setpoint_sent = time.time()
+        self.ser.write(protocol.trajectory_command(self.next_sequence(), play, seek, scale, offsets))
 
     def write(self, data):
         self.ser.write(data)
@@ -80,10 +330,105 @@ class SerialIO:
         self.thread.join()  # Wait for the thread to finish
         self.ser.close()
 
+class TimeScaler:
+    """
+    The time scale, from the loop's latencies in real s as measured each
+    step. A step's work, BOPTEST's /advance and the serial round trip, must
+    fit in its real interval with HEADROOM to spare; and the emulator's
+    response, the round trip and the thermostat's reaction, must stay within
+    LATENCY_FRACTION of a step in simulation time. The worst of the last
+    WINDOW steps is taken, the scale dropping to the bound at once and rising
+    by at most RISE a step, so one slow /advance does not set it swinging.
+    """
+
+    WINDOW = 20
+    HEADROOM = 0.8
+    RISE = 1.1
+
+    def __init__(self, scale):
+        self.scale = scale
+        self.advance = deque(maxlen=self.WINDOW)
+        self.round_trip = deque(maxlen=self.WINDOW)
+        self.reaction = deque(maxlen=self.WINDOW)
+
+    def record(self, advance, round_trip, reactions):
+        """A step's /advance and round trip, None if not measured, and reaction times"""
+        self.advance.append(advance)
+        if round_trip is not None:
+            self.round_trip.append(round_trip)
+        self.reaction.extend(reactions)
+
+    def bound(self):
+        """The highest scale the latencies allow"""
+        round_trip = max(self.round_trip, default=2 * LINK_LATENCY)
+        work = max(self.advance, default=0) + round_trip
+        response = round_trip + max(self.reaction, default=0)
+        bound = MAX_SCALE
+        if work > 0:
+            bound = min(bound, STEP_SIZE * self.HEADROOM / work)
+        if response > 0:
+            bound = min(bound, STEP_SIZE * LATENCY_FRACTION / response)
+        return max(MIN_SCALE, bound)
+
+    def update(self):
+        """The scale for the next step"""
+        self.scale = min(self.bound(), self.scale * self.RISE)
+        return self.scale
+
+def runtime(events, inputs, bit, start, end):
+    """
+    Seconds output bit was on from start to end, in simulation time, given
+    the inputs at start and the (inputs, simulation s) changes, oldest first
+    """
+    on_since = start if inputs & bit else None
+    total = 0.0
+    for event_inputs, sim_time in events:
+        if sim_time >= end:
+            break
+        at = max(sim_time, start)
+        if event_inputs & bit and on_since is None:
+            on_since = at
+        elif not event_inputs & bit and on_since is not None:
+            total += at - on_since
+            on_since = None
+    if on_since is not None:
+        total += end - on_since
+    return total
+
+def read_trajectory(path):
+    """(time_s, temperature, humidity, pressure) points of a trajectory CSV"""
+    points = []
+    with open(path) as trajectory_file:
+        for line in trajectory_file:
+            fields = line.strip().split(',')
+            try:
+                points.append((float(fields[0]), float(fields[1]), 0.0, 0.0))
+            except (IndexError, ValueError):
+                continue
+    return points
+
+def trajectory_at(points, time_s):
+    """The trajectory's temperature at time_s, as the emulator interpolates it"""
+    if time_s <= points[0][0]:
+        return points[0][1]
+    for (t0, T0, _, _), (t1, T1, _, _) in zip(points, points[1:]):
+        if time_s < t1:
+            return T0 + (T1 - T0) * (time_s - t0) / (t1 - t0)
+    return points[-1][1]
+
 print('Starting')
 
 serialio = SerialIO(serial_port, baudrate)
 
+trajectory = None
+# In lockstep every step's temperature is sent with the step
+if trajectory_csv and not LOCKSTEP:
+    trajectory = read_trajectory(trajectory_csv)
+    if trajectory and serialio.upload_trajectory(trajectory):
+        print(f"Uploaded a trajectory of {len(trajectory)} points")
+    else:
+        trajectory = None
+
 response = requests.post(
     url=f"http://{boptest_host}/testcases/{testcase_id}/select",
 )
@@ -95,6 +440,7 @@ testid = response.json()['testid']
 
 print(f"testid is {testid}")
 
+timing_file = None
 try:
     response = requests.put(
         url=f"http://{boptest_host}/initialize/{testid}",
@@ -119,15 +465,48 @@ try:
 
     t = time.time()
     dt = start_datetime
+    scaler = TimeScaler(TIME_SCALER)
+    time_scale = TIME_SCALER
+    # The emulator stamps the outputs and sensor reads in simulation time
+    serialio.sync_clock(start_seconds, 0 if LOCKSTEP else time_scale)
+    step_inputs = 0
+    if trajectory:
+        serialio.control_trajectory(play=True, seek=0, scale=time_scale)
+    if timing_csv:
+        timing_file = open(timing_csv, 'w')
+        timing_file.write("sim_time,scale,interval_ms,advance_ms,serial_ms,reaction_ms,work_ms\n")
 
     while response.status_code == 200:
-        if time.time() - t >= ADVANCE_INTERVAL:
-            t = t + ADVANCE_INTERVAL
+        interval = STEP_SIZE / time_scale
+        if LOCKSTEP or time.time() - t >= interval:
+            t = t + interval
+            step_start = time.time()
 
             dt = dt + timedelta(seconds=STEP_SIZE)
             pretty_dt = dt.strftime("%A, %B %d, %Y %H:%M:%S")
             print(pretty_dt)
 
+            # In step with the emulator's clock, and each output's run time
+            # in the step just ended, from the edges as the emulator stamped
+            # them rather than as of the step
+            step_end = (dt - epoch_datetime).total_seconds()
+            if not LOCKSTEP:
+                serialio.sync_clock(step_end + (time.time() - t) * time_scale, time_scale)
+            with serialio.lock:
+                events = serialio.sim_output_events
+                heating_s = runtime(events, step_inputs, 2, step_end - STEP_SIZE, step_end)
+                cooling_s = runtime(events, step_inputs, 4, step_end - STEP_SIZE, step_end)
+                ended = [event for event in events if event[1] < step_end]
+                if ended:
+                    step_inputs = ended[-1][0]
+                del events[:len(ended)]
+                reads = serialio.sensor_reads
+                read = len([sensor_read for sensor_read in reads if sensor_read[1] < step_end])
+                del reads[:read]
+            if serialio.capabilities & protocol.CAP_SIM_TIME or ended or read:
+                print(f"Heating ran {heating_s:.1f} s, cooling {cooling_s:.1f} s of the last step, "
+                      f"{read} sensor reads")
+
             json_data = json.dumps({
                     "overwrite_FurnaceStatus_u": f"{heating_status}",
                     "overwrite_FurnaceStatus_activate": f"{ON}",
@@ -135,6 +514,7 @@ try:
                     "overwrite_ACstatus_activate": f"{ON}"
                 })
 
+            advance_start = time.time()
             response = requests.post(
                 url=f"http://{boptest_host}/advance/{testid}",
                 headers={
@@ -142,10 +522,30 @@ try:
                 },
                 data = json_data
             )
+            advance_s = time.time() - advance_start
 
             zone_temp = response.json()['payload']['read_TRoomTemp_y']
-            payload = {"temperature": zone_temp - 273.15}
-            serialio.write(json.dumps(payload).encode('utf-8'))
+            round_trip_s = None
+            if trajectory:
+                # The emulator is already playing the trajectory; correct it
+                # by what BOPTEST says
+                elapsed_s = (dt - start_datetime).total_seconds()
+                offset = zone_temp - 273.15 - trajectory_at(trajectory, elapsed_s)
+                serialio.control_trajectory(offsets=(offset, 0, 0))
+            elif LOCKSTEP:
+                # The outputs for the next advance are those the emulator
+                # acknowledges the step with
+                sent = time.time()
+                if serialio.step(zone_temp - 273.15, step_end) is None:
+                    break
+                round_trip_s = time.time() - sent
+            elif serialio.capabilities & protocol.CAP_LOCKSTEP:
+                # Sent as a step, with the clock running, for the round trip
+                # the acknowledgement gives, but not waited on
+                round_trip_s = serialio.take_round_trip()
+                serialio.step(zone_temp - 273.15, wait=False)
+            else:
+                serialio.set_temperature(zone_temp - 273.15)
             
             print(f"Zone Temperature: {'{:.2f}'.format(kelvin_to_fahrenheit(zone_temp))}")
 
@@ -153,15 +553,53 @@ try:
             #print(f"Outside Temperature: {'{:.2f}'.format(kelvin_to_fahrenheit(oa_temp))}")
 
             print(f"Heating: {on_off_str(heating_status)}, Cooling: {on_off_str(cooling_status)}, Fan: {on_off_str(fan_status)}")
+
+            # Where the step's time went, and the scale for the next
+            with serialio.lock:
+                reactions = serialio.reactions
+                serialio.reactions = []
+            work_s = time.time() - step_start
+            scaler.record(advance_s, round_trip_s, reactions)
+            serial_ms = f"{round_trip_s * 1000:.1f}" if round_trip_s is not None else ""
+            reaction_ms = f"{max(reactions) * 1000:.0f}" if reactions else ""
+            print(f"Step of {interval * 1000:.0f} ms at x{time_scale:.1f}: /advance {advance_s * 1000:.0f} ms, "
+                  f"serial {serial_ms or '-'} ms, reaction {reaction_ms or '-'} ms, work {work_s * 1000:.0f} ms")
+            if timing_file:
+                timing_file.write(f"{step_end},{time_scale:.2f},{interval * 1000:.0f},{advance_s * 1000:.1f},"
+                                  f"{serial_ms},{reaction_ms},{work_s * 1000:.1f}\n")
+            if ADAPTIVE_SCALE and not LOCKSTEP:
+                scale = scaler.update()
+                if abs(scale - time_scale) >= 0.05 * time_scale:
+                    # Keep the simulation time now as it was, at the new rate
+                    now = time.time()
+                    t = now - (now - t) * time_scale / scale
+                    time_scale = scale
+                    serialio.reaction_window = STEP_SIZE / time_scale
+                    serialio.sync_clock(step_end + (now - t) * time_scale, time_scale)
+                    if trajectory:
+                        serialio.control_trajectory(scale=time_scale)
+                    print(f"Time scale now x{time_scale:.1f}")
             print("")
 
 except KeyboardInterrupt:
     print('Stopping')
 
 finally:
+    if timing_file:
+        timing_file.close()
     response = requests.put(
         url=f"http://{boptest_host}/stop/{testid}",
     )
+    # What the emulator showed the ecobee and how it answered, as the device
+    # recorded it
+    history = serialio.fetch_history()
+    if history:
+        with open('emulator_history.csv', 'w') as history_file:
+            history_file.write("time_ms,temperature,humidity,pressure,fan,heating,cooling\n")
+            for time_ms, T, H, P, inputs in history:
+                history_file.write(f"{time_ms},{T / 1000:.3f},{H / 1000:.3f},{P / 1000:.3f},"
+                                   f"{inputs & 1},{(inputs >> 1) & 1},{(inputs >> 2) & 1}\n")
+        print(f"Saved {len(history)} emulator history samples")
     serialio.stop()
     print('Stopped')
 